@@ -1,8 +1,10 @@
+import importlib
 import os
 import subprocess
 import sys
 from pathlib import Path
 
+import torch
 from torch.utils import cpp_extension
 
 DEFAULT_TORCH_EXTENSION_PATH = os.path.join(
@@ -12,10 +14,85 @@ DEFAULT_TORCH_EXTENSION_PATH = os.path.join(
     "oslo",
 )
 
+# Architectures of the prebuilt extensions, bare versions get SASS only and
+# "+PTX" also embeds PTX that newer devices JIT compile.
+DEFAULT_CUDA_ARCH_LIST = "7.0;8.0;8.6;9.0+PTX"
+
+
+def parse_cuda_arch_list(arch_list):
+    """Returns (arch, ptx) pairs such as (80, False) of 'arch_list'."""
+    archs = []
+    for arch in arch_list.replace(",", ";").replace(" ", ";").split(";"):
+        if len(arch) == 0:
+            continue
+        ptx = arch.endswith("+PTX")
+        archs.append((int(arch.replace("+PTX", "").replace(".", "")), ptx))
+    return archs
+
+
+# first CUDA release whose nvcc targets the architecture
+MIN_CUDA_VERSION_OF_ARCH = {
+    80: (11, 0),
+    86: (11, 1),
+    87: (11, 4),
+    89: (11, 8),
+    90: (11, 8),
+}
+
+
+def get_cuda_version():
+    """Returns (major, minor) of nvcc, or of the CUDA torch was built with."""
+    try:
+        output = subprocess.check_output(
+            [os.path.join(cpp_extension.CUDA_HOME, "bin", "nvcc"), "-V"],
+            universal_newlines=True,
+        ).split()
+        version = output[output.index("release") + 1].rstrip(",")
+    except Exception:
+        version = torch.version.cuda
+    if version is None:
+        return None
+    major, minor = version.split(".")[:2]
+    return int(major), int(minor)
+
+
+def supported_cuda_arch_list(arch_list, cuda_version):
+    """
+    Returns 'arch_list' without the architectures 'cuda_version' cannot
+    compile. When the architecture carrying PTX is dropped, the newest one
+    left carries it instead, so that newer devices can still JIT compile it.
+    """
+    if cuda_version is None:
+        return arch_list
+    archs = parse_cuda_arch_list(arch_list)
+    supported = [
+        (arch, ptx)
+        for arch, ptx in archs
+        if MIN_CUDA_VERSION_OF_ARCH.get(arch, (0, 0)) <= cuda_version
+    ]
+    if len(supported) == 0:
+        raise ValueError(
+            f"CUDA {cuda_version[0]}.{cuda_version[1]} compiles none of "
+            f"the architectures {arch_list!r}."
+        )
+    if any(ptx for _, ptx in archs) and not any(ptx for _, ptx in supported):
+        newest = max(arch for arch, _ in supported)
+        supported = [(arch, ptx or arch == newest) for arch, ptx in supported]
+    return ";".join(
+        f"{arch // 10}.{arch % 10}{'+PTX' if ptx else ''}" for arch, ptx in supported
+    )
+
 
 class Binder(object):
     def __init__(self):
-        self.compat = self.get_compatibility_version()
+        self._compat = None
+
+    @property
+    def compat(self):
+        # only detected when compiling, a prebuilt module never needs it
+        if self._compat is None:
+            self._compat = self.get_compatibility_version()
+        return self._compat
 
     def base_package(self):
         raise NotImplementedError
@@ -73,12 +150,89 @@ class Binder(object):
             return 0
 
     def get_compatibility_version(self):
+        if torch.cuda.is_available():
+            major, minor = torch.cuda.get_device_capability()
+            return f"{major}{minor}"
         try:
             return self._search_compatibility_version()
         except Exception:
             return self._constant_compatibility_version()
 
+    def prebuilt_name(self):
+        return f"oslo.pytorch._C._{self.name()}"
+
+    def prebuilt_matches(self, config):
+        """
+        Whether the prebuilt module described by 'config' runs here. It must be
+        built against this torch and CUDA, and hold SASS of the major version
+        of the device and an older or equal minor, or PTX of an older
+        architecture.
+        """
+        if config.TORCH_VERSION != torch.__version__:
+            return False
+        if not any(source.endswith(".cu") for source in self.sources()):
+            return True
+        if config.CUDA_VERSION != torch.version.cuda:
+            return False
+        if not torch.cuda.is_available():
+            return True
+
+        major, minor = torch.cuda.get_device_capability()
+        device_arch = major * 10 + minor
+        # SASS of sm_XY runs on every sm_XZ with Z >= Y
+        return any(
+            (arch // 10 == major and arch <= device_arch)
+            or (ptx and arch <= device_arch)
+            for arch, ptx in parse_cuda_arch_list(config.CUDA_ARCH_LIST)
+        )
+
+    def load_prebuilt(self):
+        """
+        Returns the module prebuilt by ``OSLO_BUILD_EXTENSIONS=1 pip install``,
+        or None when there is none matching this environment.
+        """
+        if os.environ.get("OSLO_FORCE_JIT", "0") == "1":
+            return None
+        try:
+            from oslo.pytorch._C import _build_config
+        except ImportError:
+            return None
+        if not self.prebuilt_matches(_build_config):
+            return None
+        try:
+            return importlib.import_module(self.prebuilt_name())
+        except ImportError:
+            return None
+
+    def extension(self, base_path, arch_list=DEFAULT_CUDA_ARCH_LIST):
+        """
+        Returns the setuptools extension prebuilding the sources under
+        'base_path' for every architecture of 'arch_list'.
+        """
+        sources = [os.path.join(base_path, path) for path in self.sources()]
+        include_dirs = [os.path.join(base_path, path) for path in self.includes()]
+        if not any(source.endswith(".cu") for source in sources):
+            return cpp_extension.CppExtension(
+                name=self.prebuilt_name(),
+                sources=sources,
+                include_dirs=include_dirs,
+                extra_compile_args={"cxx": self.cxx_args()},
+            )
+        return cpp_extension.CUDAExtension(
+            name=self.prebuilt_name(),
+            sources=sources,
+            include_dirs=include_dirs,
+            extra_compile_args={
+                "cxx": self.cxx_args(),
+                "nvcc": self.nvcc_args(arch_list=arch_list),
+            },
+        )
+
     def bind(self):
+        op_module = self.load_prebuilt()
+        if op_module is not None:
+            return op_module
+
         try:
             import ninja
             import pybind11
@@ -129,7 +283,7 @@ class Binder(object):
                 "-Wno-deprecated-declarations",
             ]
 
-    def nvcc_args(self, maxrregcount: int = None):
+    def nvcc_args(self, maxrregcount: int = None, arch_list: str = None):
         nvcc_flags = [
             "-O3",
             "--use_fast_math",
@@ -140,10 +294,20 @@ class Binder(object):
             "--expt-extended-lambda",
         ]
 
-        additional_flags = [
-            "-gencode",
-            f"arch=compute_{self.compat},code=sm_{self.compat}",
-        ]
+        if arch_list is None:
+            additional_flags = [
+                "-gencode",
+                f"arch=compute_{self.compat},code=sm_{self.compat}",
+            ]
+        else:
+            additional_flags = []
+            for arch, ptx in parse_cuda_arch_list(arch_list):
+                additional_flags += ["-gencode", f"arch=compute_{arch},code=sm_{arch}"]
+                if ptx:
+                    additional_flags += [
+                        "-gencode",
+                        f"arch=compute_{arch},code=compute_{arch}",
+                    ]
 
         if maxrregcount:
             additional_flags.append(f"-maxrregcount={maxrregcount}")
@@ -177,4 +341,39 @@ class CUDABinder(OSLOBinder):
         return "cuda"
 
     def sources(self):
-        return ["FusedLayerNorm.cu", "FusedNoRepeatNGram.cu", "CUDABinder.cpp"]
+        return [
+            "FusedLayerNorm.cu",
+            "FusedNoRepeatNGram.cu",
+            "FusedLogitsProcessor.cu",
+            "FusedBiasGeLU.cu",
+            "FusedScaleMaskSoftmax.cu",
+            "FusedCrossEntropy.cu",
+            "FusedGradientFlatten.cu",
+            "OpTelemetry.cpp",
+            "CUDABinder.cpp",
+        ]
+
+    @staticmethod
+    def feature_flags():
+        flags = []
+        if hasattr(torch, "float8_e4m3fn"):
+            flags.append("-DOSLO_ENABLE_FLOAT8")
+        return flags
+
+    @staticmethod
+    def cxx_args():
+        return OSLOBinder.cxx_args() + CUDABinder.feature_flags()
+
+    def nvcc_args(self, maxrregcount: int = None, arch_list: str = None):
+        return super().nvcc_args(maxrregcount, arch_list) + self.feature_flags()
+
+
+class CheckpointBinder(OSLOBinder):
+    def name(self):
+        return "checkpoint"
+
+    def sources(self):
+        return [
+            "FusedCheckpointPartition.cu",
+            "CheckpointBinder.cpp",
+        ]
@@ -1,3 +1,4 @@
+#include "OpTelemetry.h"
 #include <cassert>
 #include <cuda_fp16.h>
 #include <torch/extension.h>
@@ -9,6 +10,20 @@ torch::Tensor ngram_repeat_block_cuda_forward(torch::Tensor tokens,
                                               int step, int beam_size,
                                               int no_repeat_ngram_size);
 
+torch::Tensor ngram_repeat_block_ragged_cuda_forward(
+    torch::Tensor tokens, torch::Tensor lprobs, torch::Tensor seq_starts,
+    torch::Tensor seq_lens, int max_seqlen, int no_repeat_ngram_size);
+
+torch::Tensor logits_process_cuda_forward(
+    torch::Tensor tokens, torch::Tensor scores, int step,
+    int no_repeat_ngram_size, float repetition_penalty, float presence_penalty,
+    float temperature, int top_k, int min_length, int eos_token_id);
+
+torch::Tensor ngram_repeat_block_index_cuda_forward(
+    torch::Tensor tokens, torch::Tensor lprobs, torch::Tensor keys,
+    torch::Tensor positions, int step, int num_indexed,
+    int no_repeat_ngram_size);
+
 #define CHECK_CUDA(x)                                                          \
   TORCH_CHECK(x.type().is_cuda(), #x " must be a CUDA tensor")
 #define CHECK_CONTIGUOUS(x)                                                    \
@@ -30,10 +45,116 @@ torch::Tensor ngram_repeat_block_forward(torch::Tensor tokens,
   assert(beam_size > 0);
   assert(no_repeat_ngram_size > 0);
 
+  OP_TELEMETRY_SCOPE("ngram_repeat_block_forward", lprobs.scalar_type(),
+                     lprobs.size(0), lprobs.size(-1));
   return ngram_repeat_block_cuda_forward(tokens, lprobs, bsz, step, beam_size,
                                          no_repeat_ngram_size);
 }
 
+// Keys and positions are the per-sample ngram index, updated in place.
+torch::Tensor ngram_repeat_block_index_forward(
+    torch::Tensor tokens, torch::Tensor lprobs, torch::Tensor keys,
+    torch::Tensor positions, int step, int num_indexed,
+    int no_repeat_ngram_size) {
+  CHECK_INPUT(tokens);
+  CHECK_INPUT(lprobs);
+  CHECK_INPUT(keys);
+  CHECK_INPUT(positions);
+  TORCH_CHECK(keys.scalar_type() == at::ScalarType::Long,
+              "keys must be an int64 tensor");
+  TORCH_CHECK(positions.scalar_type() == at::ScalarType::Int,
+              "positions must be an int32 tensor");
+  TORCH_CHECK(keys.sizes().equals(positions.sizes()),
+              "keys and positions must have the same shape");
+  TORCH_CHECK(keys.size(0) == tokens.size(0) &&
+                  lprobs.size(0) == tokens.size(0),
+              "keys, lprobs and tokens must have the same number of rows");
+  const int64_t capacity = keys.size(1);
+  TORCH_CHECK(capacity > 0 && (capacity & (capacity - 1)) == 0,
+              "capacity of the ngram index must be a power of two");
+  TORCH_CHECK(step - no_repeat_ngram_size + 2 < capacity,
+              "ngram index is full");
+  assert(step >= 0);
+  assert(num_indexed >= 0);
+  assert(no_repeat_ngram_size > 0);
+
+  OP_TELEMETRY_SCOPE("ngram_repeat_block_index_forward", lprobs.scalar_type(),
+                     lprobs.size(0), lprobs.size(-1));
+  return ngram_repeat_block_index_cuda_forward(
+      tokens, lprobs, keys, positions, step, num_indexed,
+      no_repeat_ngram_size);
+}
+
+// Tokens are the flat histories of a ragged batch, row i of lprobs is
+// blocked with the seq_lens[i] tokens starting at seq_starts[i]. The ranges
+// are not checked on the host, they have to lie within tokens.
+torch::Tensor ngram_repeat_block_ragged_forward(torch::Tensor tokens,
+                                                torch::Tensor lprobs,
+                                                torch::Tensor seq_starts,
+                                                torch::Tensor seq_lens,
+                                                int max_seqlen,
+                                                int no_repeat_ngram_size) {
+  CHECK_INPUT(tokens);
+  CHECK_INPUT(lprobs);
+  CHECK_INPUT(seq_starts);
+  CHECK_INPUT(seq_lens);
+  TORCH_CHECK(seq_starts.scalar_type() == at::ScalarType::Int &&
+                  seq_lens.scalar_type() == at::ScalarType::Int,
+              "seq_starts and seq_lens must be int32 tensors");
+  TORCH_CHECK(seq_starts.numel() == lprobs.size(0) &&
+                  seq_lens.numel() == lprobs.size(0),
+              "seq_starts and seq_lens must have one entry per row of lprobs");
+  assert(max_seqlen >= 0);
+  assert(no_repeat_ngram_size > 0);
+
+  OP_TELEMETRY_SCOPE("ngram_repeat_block_ragged_forward", lprobs.scalar_type(),
+                     lprobs.size(0), lprobs.size(-1));
+  return ngram_repeat_block_ragged_cuda_forward(
+      tokens, lprobs, seq_starts, seq_lens, max_seqlen, no_repeat_ngram_size);
+}
+
+// Scores are processed in place, a processor is disabled by its neutral
+// value (ngram size 0, penalties 1 and 0, temperature 1, top_k 0).
+torch::Tensor logits_process_forward(torch::Tensor tokens,
+                                     torch::Tensor scores, int step,
+                                     int no_repeat_ngram_size,
+                                     double repetition_penalty,
+                                     double presence_penalty,
+                                     double temperature, int top_k,
+                                     int min_length, int eos_token_id) {
+  CHECK_INPUT(tokens);
+  CHECK_INPUT(scores);
+  TORCH_CHECK(tokens.scalar_type() == at::ScalarType::Long,
+              "tokens must be an int64 tensor");
+  TORCH_CHECK(scores.dim() == 2 && tokens.dim() == 2 &&
+                  scores.size(0) == tokens.size(0),
+              "tokens and scores must have the same number of rows");
+  TORCH_CHECK(step >= 0 && step < tokens.size(1),
+              "step is out of the range of tokens");
+  TORCH_CHECK(no_repeat_ngram_size >= 0,
+              "no_repeat_ngram_size must be non-negative");
+  TORCH_CHECK(repetition_penalty > 0, "repetition_penalty must be positive");
+  TORCH_CHECK(temperature > 0, "temperature must be positive");
+  TORCH_CHECK(top_k >= 0, "top_k must be non-negative");
+  TORCH_CHECK(eos_token_id < scores.size(1),
+              "eos_token_id is out of the range of the vocab");
+  if (no_repeat_ngram_size > 0 || repetition_penalty != 1.0 ||
+      presence_penalty != 0.0) {
+    // the tokens of the history index the per-row bitmaps of the vocab
+    auto history = tokens.narrow(1, 0, step + 1);
+    auto range = torch::stack({history.min(), history.max()}).cpu();
+    auto bounds = range.accessor<int64_t, 1>();
+    TORCH_CHECK(bounds[0] >= 0 && bounds[1] < scores.size(1),
+                "tokens must be in the range of the vocab");
+  }
+
+  OP_TELEMETRY_SCOPE("logits_process_forward", scores.scalar_type(),
+                     scores.size(0), scores.size(1));
+  return logits_process_cuda_forward(
+      tokens, scores, step, no_repeat_ngram_size, repetition_penalty,
+      presence_penalty, temperature, top_k, min_length, eos_token_id);
+}
+
 #include "compat.h"
 #include <cassert>
 #include <torch/extension.h>
@@ -174,6 +295,7 @@ std::vector<at::Tensor> layer_norm(at::Tensor input,
                                       ? at::ScalarType::Float
                                       : input.scalar_type()));
   at::Tensor invvar = at::empty_like(mean);
+  OP_TELEMETRY_SCOPE("layer_norm_forward", input.scalar_type(), n1, n2);
   cuda_layer_norm(&output, &mean, &invvar, &input, n1, n2, normalized_shape,
                   NULL, NULL, epsilon);
   return {output, mean, invvar};
@@ -199,6 +321,7 @@ std::vector<at::Tensor> layer_norm_affine(at::Tensor input,
                                : input.scalar_type();
   at::Tensor mean = at::empty({n1}, input.options().dtype(stats_dtype));
   at::Tensor invvar = at::empty_like(mean);
+  OP_TELEMETRY_SCOPE("layer_norm_forward_affine", input.scalar_type(), n1, n2);
   cuda_layer_norm(&output, &mean, &invvar, &input, n1, n2, normalized_shape,
                   &gamma, &beta, epsilon);
   return {output, mean, invvar};
@@ -225,6 +348,8 @@ layer_norm_affine_mixed_dtypes(at::Tensor input,
                                       ? at::ScalarType::Float
                                       : input.scalar_type()));
   at::Tensor invvar = at::empty_like(mean);
+  OP_TELEMETRY_SCOPE("layer_norm_forward_affine_mixed_dtypes",
+                     input.scalar_type(), n1, n2);
   cuda_layer_norm(&output, &mean, &invvar, &input, n1, n2, normalized_shape,
                   &gamma, &beta, epsilon);
   return {output, mean, invvar};
@@ -257,6 +382,7 @@ at::Tensor layer_norm_gradient(at::Tensor dout, at::Tensor mean,
   int n1, n2;
   check_args(input, normalized_shape, n1, n2);
   at::Tensor grad_input = at::empty_like(input);
+  OP_TELEMETRY_SCOPE("layer_norm_backward", input.scalar_type(), n1, n2);
   cuda_layer_norm_gradient(&dout, &mean, &invvar, &input, n1, n2,
                            normalized_shape, NULL, NULL, epsilon, &grad_input,
                            NULL, NULL);
@@ -283,6 +409,7 @@ layer_norm_gradient_affine(at::Tensor dout, at::Tensor mean, at::Tensor invvar,
   at::Tensor grad_input = at::empty_like(input);
   at::Tensor grad_gamma = at::empty_like(gamma);
   at::Tensor grad_beta = at::empty_like(beta);
+  OP_TELEMETRY_SCOPE("layer_norm_backward_affine", input.scalar_type(), n1, n2);
   cuda_layer_norm_gradient(&dout, &mean, &invvar, &input, n1, n2,
                            normalized_shape, &gamma, &beta, epsilon,
                            &grad_input, &grad_gamma, &grad_beta);
@@ -323,6 +450,7 @@ std::vector<at::Tensor> rms_norm(at::Tensor input,
                                               at::ScalarType::BFloat16
                                       ? at::ScalarType::Float
                                       : input.scalar_type()));
+  OP_TELEMETRY_SCOPE("rms_norm_forward", input.scalar_type(), n1, n2);
   cuda_rms_norm(&output, &invvar, &input, n1, n2, normalized_shape, NULL,
                 epsilon);
   return {output, invvar};
@@ -345,6 +473,7 @@ std::vector<at::Tensor> rms_norm_affine(at::Tensor input,
                                ? at::ScalarType::Float
                                : input.scalar_type();
   at::Tensor invvar = at::empty({n1}, input.options().dtype(stats_dtype));
+  OP_TELEMETRY_SCOPE("rms_norm_forward_affine", input.scalar_type(), n1, n2);
   cuda_rms_norm(&output, &invvar, &input, n1, n2, normalized_shape, &gamma,
                 epsilon);
   return {output, invvar};
@@ -370,6 +499,8 @@ rms_norm_affine_mixed_dtypes(at::Tensor input,
                                       ? at::ScalarType::Float
                                       : input.scalar_type()));
 
+  OP_TELEMETRY_SCOPE("rms_norm_forward_affine_mixed_dtypes",
+                     input.scalar_type(), n1, n2);
   cuda_rms_norm(&output, &invvar, &input, n1, n2, normalized_shape, &gamma,
                 epsilon);
   return {output, invvar};
@@ -399,6 +530,7 @@ at::Tensor rms_norm_gradient(at::Tensor dout, at::Tensor invvar,
   int n1, n2;
   check_args(input, normalized_shape, n1, n2);
   at::Tensor grad_input = at::empty_like(input);
+  OP_TELEMETRY_SCOPE("rms_norm_backward", input.scalar_type(), n1, n2);
   cuda_rms_norm_gradient(&dout, &invvar, &input, n1, n2, normalized_shape, NULL,
                          epsilon, &grad_input, NULL);
   return grad_input;
@@ -420,11 +552,989 @@ rms_norm_gradient_affine(at::Tensor dout, at::Tensor invvar, at::Tensor input,
   check_args(input, normalized_shape, gamma, n1, n2);
   at::Tensor grad_input = at::empty_like(input);
   at::Tensor grad_gamma = at::empty_like(gamma);
+  OP_TELEMETRY_SCOPE("rms_norm_backward_affine", input.scalar_type(), n1, n2);
   cuda_rms_norm_gradient(&dout, &invvar, &input, n1, n2, normalized_shape,
                          &gamma, epsilon, &grad_input, &grad_gamma);
   return {grad_input, grad_gamma};
 }
 
+void cuda_layer_norm_residual(at::Tensor *output, at::Tensor *sum,
+                              at::Tensor *mask, at::Tensor *mean,
+                              at::Tensor *invvar, at::Tensor *input,
+                              at::Tensor *residual, at::Tensor *bias, int n1,
+                              int n2,
+#ifdef VERSION_GE_1_1
+                              at::IntArrayRef normalized_shape,
+#else
+                              at::IntList normalized_shape,
+#endif
+                              at::Tensor *gamma, at::Tensor *beta,
+                              double epsilon, double p, int64_t seed);
+
+void cuda_rms_norm_residual(at::Tensor *output, at::Tensor *sum,
+                            at::Tensor *mask, at::Tensor *invvar,
+                            at::Tensor *input, at::Tensor *residual,
+                            at::Tensor *bias, int n1, int n2,
+#ifdef VERSION_GE_1_1
+                            at::IntArrayRef normalized_shape,
+#else
+                            at::IntList normalized_shape,
+#endif
+                            at::Tensor *gamma, double epsilon, double p,
+                            int64_t seed);
+
+void cuda_residual_dropout_gradient(at::Tensor *grad_sum, at::Tensor *dsum,
+                                    at::Tensor *mask, int n1, int n2,
+                                    double p, at::Tensor *grad_input);
+
+void check_residual_args(at::Tensor input, at::Tensor residual,
+#ifdef VERSION_GE_1_1
+                         at::IntArrayRef normalized_shape,
+#else
+                         at::IntList normalized_shape,
+#endif
+                         at::Tensor bias, double p) {
+  TORCH_CHECK(residual.sizes().equals(input.sizes()),
+              "residual must have the same shape as input");
+  TORCH_CHECK(residual.scalar_type() == input.scalar_type() &&
+                  bias.scalar_type() == input.scalar_type(),
+              "residual and bias must have the same dtype as input");
+  TORCH_CHECK(bias.sizes().equals(normalized_shape));
+  TORCH_CHECK(p >= 0.0 && p <= 1.0,
+              "dropout probability has to be between 0 and 1, but got ", p);
+}
+
+// An empty mask means dropout is disabled (p == 0).
+at::Tensor empty_dropout_mask(at::Tensor input, double p) {
+  return p > 0.0 ? at::empty_like(input,
+                                  input.options().dtype(at::ScalarType::Byte))
+                 : at::empty({0}, input.options().dtype(at::ScalarType::Byte));
+}
+
+// output = LayerNorm(residual + dropout(input + bias))
+std::vector<at::Tensor>
+layer_norm_residual_affine(at::Tensor input, at::Tensor residual,
+                           at::Tensor bias,
+#ifdef VERSION_GE_1_1
+                           at::IntArrayRef normalized_shape,
+#else
+                           at::IntList normalized_shape,
+#endif
+                           at::Tensor gamma, at::Tensor beta, double epsilon,
+                           double p, int64_t seed) {
+  CHECK_INPUT(input);
+  CHECK_INPUT(residual);
+  CHECK_INPUT(bias);
+  CHECK_INPUT(gamma);
+  CHECK_INPUT(beta);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, beta, n1, n2);
+  check_residual_args(input, residual, normalized_shape, bias, p);
+  at::Tensor output = at::empty_like(input);
+  at::Tensor sum = at::empty_like(input);
+  at::Tensor mask = empty_dropout_mask(input, p);
+  const auto stats_dtype = (input.scalar_type() == at::ScalarType::Half ||
+                            input.scalar_type() == at::ScalarType::BFloat16)
+                               ? at::ScalarType::Float
+                               : input.scalar_type();
+  at::Tensor mean = at::empty({n1}, input.options().dtype(stats_dtype));
+  at::Tensor invvar = at::empty_like(mean);
+  OP_TELEMETRY_SCOPE("layer_norm_residual_forward_affine", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_residual(&output, &sum, mask.numel() > 0 ? &mask : NULL,
+                           &mean, &invvar, &input, &residual, &bias, n1, n2,
+                           normalized_shape, &gamma, &beta, epsilon, p, seed);
+  return {output, sum, mean, invvar, mask};
+}
+
+std::vector<at::Tensor> layer_norm_residual_gradient_affine(
+    at::Tensor dout, at::Tensor dsum, at::Tensor mean, at::Tensor invvar,
+    at::Tensor sum, at::Tensor mask,
+#ifdef VERSION_GE_1_1
+    at::IntArrayRef normalized_shape,
+#else
+    at::IntList normalized_shape,
+#endif
+    at::Tensor gamma, at::Tensor beta, double epsilon, double p) {
+  CHECK_INPUT(dout);
+  CHECK_INPUT(dsum);
+  CHECK_INPUT(mean);
+  CHECK_INPUT(invvar);
+  CHECK_INPUT(sum);
+  CHECK_INPUT(mask);
+  CHECK_INPUT(gamma);
+  CHECK_INPUT(beta);
+  int n1, n2;
+  check_args(sum, normalized_shape, gamma, beta, n1, n2);
+  at::Tensor grad_sum = at::empty_like(sum);
+  at::Tensor grad_input = at::empty_like(sum);
+  at::Tensor grad_gamma = at::empty_like(gamma);
+  at::Tensor grad_beta = at::empty_like(beta);
+  OP_TELEMETRY_SCOPE("layer_norm_residual_backward_affine", sum.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_gradient(&dout, &mean, &invvar, &sum, n1, n2,
+                           normalized_shape, &gamma, &beta, epsilon, &grad_sum,
+                           &grad_gamma, &grad_beta);
+  cuda_residual_dropout_gradient(&grad_sum, &dsum,
+                                 mask.numel() > 0 ? &mask : NULL, n1, n2, p,
+                                 &grad_input);
+  at::Tensor grad_bias =
+      grad_input.view({n1, n2}).sum(0).view(normalized_shape);
+  return {grad_input, grad_sum, grad_bias, grad_gamma, grad_beta};
+}
+
+// output = RMSNorm(residual + dropout(input + bias))
+std::vector<at::Tensor>
+rms_norm_residual_affine(at::Tensor input, at::Tensor residual, at::Tensor bias,
+#ifdef VERSION_GE_1_1
+                         at::IntArrayRef normalized_shape,
+#else
+                         at::IntList normalized_shape,
+#endif
+                         at::Tensor gamma, double epsilon, double p,
+                         int64_t seed) {
+  CHECK_INPUT(input);
+  CHECK_INPUT(residual);
+  CHECK_INPUT(bias);
+  CHECK_INPUT(gamma);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, n1, n2);
+  check_residual_args(input, residual, normalized_shape, bias, p);
+  at::Tensor output = at::empty_like(input);
+  at::Tensor sum = at::empty_like(input);
+  at::Tensor mask = empty_dropout_mask(input, p);
+  const auto stats_dtype = (input.scalar_type() == at::ScalarType::Half ||
+                            input.scalar_type() == at::ScalarType::BFloat16)
+                               ? at::ScalarType::Float
+                               : input.scalar_type();
+  at::Tensor invvar = at::empty({n1}, input.options().dtype(stats_dtype));
+  OP_TELEMETRY_SCOPE("rms_norm_residual_forward_affine", input.scalar_type(),
+                     n1, n2);
+  cuda_rms_norm_residual(&output, &sum, mask.numel() > 0 ? &mask : NULL,
+                         &invvar, &input, &residual, &bias, n1, n2,
+                         normalized_shape, &gamma, epsilon, p, seed);
+  return {output, sum, invvar, mask};
+}
+
+std::vector<at::Tensor> rms_norm_residual_gradient_affine(
+    at::Tensor dout, at::Tensor dsum, at::Tensor invvar, at::Tensor sum,
+    at::Tensor mask,
+#ifdef VERSION_GE_1_1
+    at::IntArrayRef normalized_shape,
+#else
+    at::IntList normalized_shape,
+#endif
+    at::Tensor gamma, double epsilon, double p) {
+  CHECK_INPUT(dout);
+  CHECK_INPUT(dsum);
+  CHECK_INPUT(invvar);
+  CHECK_INPUT(sum);
+  CHECK_INPUT(mask);
+  CHECK_INPUT(gamma);
+  int n1, n2;
+  check_args(sum, normalized_shape, gamma, n1, n2);
+  at::Tensor grad_sum = at::empty_like(sum);
+  at::Tensor grad_input = at::empty_like(sum);
+  at::Tensor grad_gamma = at::empty_like(gamma);
+  OP_TELEMETRY_SCOPE("rms_norm_residual_backward_affine", sum.scalar_type(), n1,
+                     n2);
+  cuda_rms_norm_gradient(&dout, &invvar, &sum, n1, n2, normalized_shape,
+                         &gamma, epsilon, &grad_sum, &grad_gamma);
+  cuda_residual_dropout_gradient(&grad_sum, &dsum,
+                                 mask.numel() > 0 ? &mask : NULL, n1, n2, p,
+                                 &grad_input);
+  at::Tensor grad_bias =
+      grad_input.view({n1, n2}).sum(0).view(normalized_shape);
+  return {grad_input, grad_sum, grad_bias, grad_gamma};
+}
+
+void cuda_layer_norm_partial_stats(at::Tensor *stats, at::Tensor *input,
+                                   int n1, int n2, bool rms_only);
+
+void cuda_layer_norm_sharded(at::Tensor *output, at::Tensor *mean,
+                             at::Tensor *invvar, at::Tensor *input,
+                             at::Tensor *stats, int world_size, int n1, int n2,
+                             at::Tensor *gamma, at::Tensor *beta,
+                             double epsilon, bool rms_only);
+
+void cuda_layer_norm_grad_input_partial_sums(at::Tensor *sums,
+                                             at::Tensor *dout,
+                                             at::Tensor *mean,
+                                             at::Tensor *invvar,
+                                             at::Tensor *input, int n1, int n2,
+                                             at::Tensor *gamma, bool rms_only);
+
+void cuda_layer_norm_sharded_gradient(
+    at::Tensor *dout, at::Tensor *sums, at::Tensor *mean, at::Tensor *invvar,
+    at::Tensor *input, int n1, int n2, int n2_global, at::Tensor *gamma,
+    double epsilon, at::Tensor *grad_input, at::Tensor *grad_gamma,
+    at::Tensor *grad_beta, bool rms_only);
+
+// The sharded ops normalize a row whose last dimension is split over a
+// tensor parallel group. normalized_shape is the shape of the local shard.
+// Only the per-row statistics are exchanged between shards:
+//   1) *_partial_stats returns the local (count, mean, M2) as [n1, 3]
+//   2) the caller all-gathers them into [world_size, n1, 3]
+//   3) *_sharded_forward_affine merges them and normalizes the local shard
+// The backward exchanges (sum_loss1, sum_loss2) the same way, except that
+// they are plain sums and can be all-reduced.
+at::Tensor partial_stats(at::Tensor input,
+#ifdef VERSION_GE_1_1
+                         at::IntArrayRef normalized_shape,
+#else
+                         at::IntList normalized_shape,
+#endif
+                         bool rms_only) {
+  CHECK_INPUT(input);
+  int n1, n2;
+  check_args(input, normalized_shape, n1, n2);
+  const auto stats_dtype = (input.scalar_type() == at::ScalarType::Half ||
+                            input.scalar_type() == at::ScalarType::BFloat16)
+                               ? at::ScalarType::Float
+                               : input.scalar_type();
+  at::Tensor stats = at::empty({n1, 3}, input.options().dtype(stats_dtype));
+  OP_TELEMETRY_SCOPE(
+      rms_only ? "rms_norm_partial_stats" : "layer_norm_partial_stats",
+      input.scalar_type(), n1, n2);
+  cuda_layer_norm_partial_stats(&stats, &input, n1, n2, rms_only);
+  return stats;
+}
+
+at::Tensor layer_norm_partial_stats(at::Tensor input,
+#ifdef VERSION_GE_1_1
+                                    at::IntArrayRef normalized_shape
+#else
+                                    at::IntList normalized_shape
+#endif
+) {
+  return partial_stats(input, normalized_shape, false);
+}
+
+at::Tensor rms_norm_partial_stats(at::Tensor input,
+#ifdef VERSION_GE_1_1
+                                  at::IntArrayRef normalized_shape
+#else
+                                  at::IntList normalized_shape
+#endif
+) {
+  return partial_stats(input, normalized_shape, true);
+}
+
+void check_sharded_stats(at::Tensor stats, int n1) {
+  CHECK_INPUT(stats);
+  TORCH_CHECK(stats.dim() == 3 && stats.size(1) == n1 && stats.size(2) == 3,
+              "expected gathered stats of shape [world_size, ", n1,
+              ", 3], but got ", stats.sizes());
+}
+
+std::vector<at::Tensor>
+layer_norm_sharded_affine(at::Tensor input, at::Tensor stats,
+#ifdef VERSION_GE_1_1
+                          at::IntArrayRef normalized_shape,
+#else
+                          at::IntList normalized_shape,
+#endif
+                          at::Tensor gamma, at::Tensor beta, double epsilon) {
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  CHECK_INPUT(beta);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, beta, n1, n2);
+  check_sharded_stats(stats, n1);
+  at::Tensor output = at::empty_like(input);
+  at::Tensor mean = at::empty({n1}, stats.options());
+  at::Tensor invvar = at::empty_like(mean);
+  OP_TELEMETRY_SCOPE("layer_norm_sharded_forward_affine", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_sharded(&output, &mean, &invvar, &input, &stats,
+                          stats.size(0), n1, n2, &gamma, &beta, epsilon, false);
+  return {output, mean, invvar};
+}
+
+std::vector<at::Tensor>
+rms_norm_sharded_affine(at::Tensor input, at::Tensor stats,
+#ifdef VERSION_GE_1_1
+                        at::IntArrayRef normalized_shape,
+#else
+                        at::IntList normalized_shape,
+#endif
+                        at::Tensor gamma, double epsilon) {
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, n1, n2);
+  check_sharded_stats(stats, n1);
+  at::Tensor output = at::empty_like(input);
+  at::Tensor invvar = at::empty({n1}, stats.options());
+  OP_TELEMETRY_SCOPE("rms_norm_sharded_forward_affine", input.scalar_type(), n1,
+                     n2);
+  cuda_layer_norm_sharded(&output, NULL, &invvar, &input, &stats,
+                          stats.size(0), n1, n2, &gamma, NULL, epsilon, true);
+  return {output, invvar};
+}
+
+at::Tensor layer_norm_grad_input_partial_sums(at::Tensor dout, at::Tensor mean,
+                                              at::Tensor invvar,
+                                              at::Tensor input,
+#ifdef VERSION_GE_1_1
+                                              at::IntArrayRef normalized_shape,
+#else
+                                              at::IntList normalized_shape,
+#endif
+                                              at::Tensor gamma) {
+  CHECK_INPUT(dout);
+  CHECK_INPUT(mean);
+  CHECK_INPUT(invvar);
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, n1, n2);
+  at::Tensor sums = at::empty({n1, 2}, invvar.options());
+  OP_TELEMETRY_SCOPE("layer_norm_grad_input_partial_sums", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_grad_input_partial_sums(&sums, &dout, &mean, &invvar, &input,
+                                          n1, n2, &gamma, false);
+  return sums;
+}
+
+at::Tensor rms_norm_grad_input_partial_sums(at::Tensor dout, at::Tensor invvar,
+                                            at::Tensor input,
+#ifdef VERSION_GE_1_1
+                                            at::IntArrayRef normalized_shape,
+#else
+                                            at::IntList normalized_shape,
+#endif
+                                            at::Tensor gamma) {
+  CHECK_INPUT(dout);
+  CHECK_INPUT(invvar);
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, n1, n2);
+  at::Tensor sums = at::empty({n1, 2}, invvar.options());
+  OP_TELEMETRY_SCOPE("rms_norm_grad_input_partial_sums", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_grad_input_partial_sums(&sums, &dout, NULL, &invvar, &input,
+                                          n1, n2, &gamma, true);
+  return sums;
+}
+
+std::vector<at::Tensor> layer_norm_sharded_gradient_affine(
+    at::Tensor dout, at::Tensor sums, at::Tensor mean, at::Tensor invvar,
+    at::Tensor input,
+#ifdef VERSION_GE_1_1
+    at::IntArrayRef normalized_shape,
+#else
+    at::IntList normalized_shape,
+#endif
+    int64_t global_size, at::Tensor gamma, at::Tensor beta, double epsilon) {
+  CHECK_INPUT(dout);
+  CHECK_INPUT(sums);
+  CHECK_INPUT(mean);
+  CHECK_INPUT(invvar);
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  CHECK_INPUT(beta);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, beta, n1, n2);
+  TORCH_CHECK(global_size >= n2, "global_size must cover the local shard");
+  at::Tensor grad_input = at::empty_like(input);
+  at::Tensor grad_gamma = at::empty_like(gamma);
+  at::Tensor grad_beta = at::empty_like(beta);
+  OP_TELEMETRY_SCOPE("layer_norm_sharded_backward_affine", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_sharded_gradient(&dout, &sums, &mean, &invvar, &input, n1,
+                                   n2, global_size, &gamma, epsilon,
+                                   &grad_input, &grad_gamma, &grad_beta, false);
+  return {grad_input, grad_gamma, grad_beta};
+}
+
+std::vector<at::Tensor> rms_norm_sharded_gradient_affine(
+    at::Tensor dout, at::Tensor sums, at::Tensor invvar, at::Tensor input,
+#ifdef VERSION_GE_1_1
+    at::IntArrayRef normalized_shape,
+#else
+    at::IntList normalized_shape,
+#endif
+    int64_t global_size, at::Tensor gamma, double epsilon) {
+  CHECK_INPUT(dout);
+  CHECK_INPUT(sums);
+  CHECK_INPUT(invvar);
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, n1, n2);
+  TORCH_CHECK(global_size >= n2, "global_size must cover the local shard");
+  at::Tensor grad_input = at::empty_like(input);
+  at::Tensor grad_gamma = at::empty_like(gamma);
+  OP_TELEMETRY_SCOPE("rms_norm_sharded_backward_affine", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_sharded_gradient(&dout, &sums, NULL, &invvar, &input, n1, n2,
+                                   global_size, &gamma, epsilon, &grad_input,
+                                   &grad_gamma, NULL, true);
+  return {grad_input, grad_gamma};
+}
+
+void cuda_layer_norm_quantized(at::Tensor *output, at::Tensor *mean,
+                               at::Tensor *invvar, at::Tensor *row_scale,
+                               at::Tensor *tensor_scale, at::Tensor *input,
+                               int n1, int n2,
+#ifdef VERSION_GE_1_1
+                               at::IntArrayRef normalized_shape,
+#else
+                               at::IntList normalized_shape,
+#endif
+                               at::Tensor *gamma, at::Tensor *beta,
+                               double epsilon, bool rms_only);
+
+at::ScalarType quantized_dtype(const std::string &format) {
+  if (format == "int8") {
+    return at::ScalarType::Char;
+  }
+#ifdef OSLO_ENABLE_FLOAT8
+  if (format == "e4m3") {
+    return at::ScalarType::Float8_e4m3fn;
+  }
+  if (format == "e5m2") {
+    return at::ScalarType::Float8_e5m2;
+  }
+#endif
+  std::stringstream ss;
+  ss << "Unsupported quantized output format: " << format;
+  throw std::runtime_error(ss.str());
+}
+
+// The quantized ops write y / scale in a 1-byte format instead of y.
+// A one-element float `scale` selects per-tensor scaling. An empty `scale`
+// selects per-row scaling, and the [n1] float scales are returned.
+at::Tensor quantized_scale(at::Tensor input, at::Tensor scale, int n1) {
+  if (scale.numel() > 0) {
+    CHECK_INPUT(scale);
+    TORCH_CHECK(scale.numel() == 1 &&
+                    scale.scalar_type() == at::ScalarType::Float,
+                "per-tensor scale must be a single float");
+    return scale;
+  }
+  return at::empty({n1}, input.options().dtype(at::ScalarType::Float));
+}
+
+std::vector<at::Tensor>
+layer_norm_affine_quantized(at::Tensor input,
+#ifdef VERSION_GE_1_1
+                            at::IntArrayRef normalized_shape,
+#else
+                            at::IntList normalized_shape,
+#endif
+                            at::Tensor gamma, at::Tensor beta, double epsilon,
+                            std::string format, at::Tensor scale) {
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  CHECK_INPUT(beta);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, beta, n1, n2);
+  at::Tensor output =
+      at::empty_like(input, input.options().dtype(quantized_dtype(format)));
+  const auto stats_dtype = (input.scalar_type() == at::ScalarType::Half ||
+                            input.scalar_type() == at::ScalarType::BFloat16)
+                               ? at::ScalarType::Float
+                               : input.scalar_type();
+  at::Tensor mean = at::empty({n1}, input.options().dtype(stats_dtype));
+  at::Tensor invvar = at::empty_like(mean);
+  const bool per_row = scale.numel() == 0;
+  at::Tensor out_scale = quantized_scale(input, scale, n1);
+  OP_TELEMETRY_SCOPE("layer_norm_forward_affine_quantized", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_quantized(&output, &mean, &invvar,
+                            per_row ? &out_scale : NULL,
+                            per_row ? NULL : &out_scale, &input, n1, n2,
+                            normalized_shape, &gamma, &beta, epsilon, false);
+  return {output, mean, invvar, out_scale};
+}
+
+std::vector<at::Tensor>
+rms_norm_affine_quantized(at::Tensor input,
+#ifdef VERSION_GE_1_1
+                          at::IntArrayRef normalized_shape,
+#else
+                          at::IntList normalized_shape,
+#endif
+                          at::Tensor gamma, double epsilon, std::string format,
+                          at::Tensor scale) {
+  CHECK_INPUT(input);
+  CHECK_INPUT(gamma);
+  int n1, n2;
+  check_args(input, normalized_shape, gamma, n1, n2);
+  at::Tensor output =
+      at::empty_like(input, input.options().dtype(quantized_dtype(format)));
+  const auto stats_dtype = (input.scalar_type() == at::ScalarType::Half ||
+                            input.scalar_type() == at::ScalarType::BFloat16)
+                               ? at::ScalarType::Float
+                               : input.scalar_type();
+  at::Tensor invvar = at::empty({n1}, input.options().dtype(stats_dtype));
+  const bool per_row = scale.numel() == 0;
+  at::Tensor out_scale = quantized_scale(input, scale, n1);
+  OP_TELEMETRY_SCOPE("rms_norm_forward_affine_quantized", input.scalar_type(),
+                     n1, n2);
+  cuda_layer_norm_quantized(&output, NULL, &invvar,
+                            per_row ? &out_scale : NULL,
+                            per_row ? NULL : &out_scale, &input, n1, n2,
+                            normalized_shape, &gamma, NULL, epsilon, true);
+  return {output, invvar, out_scale};
+}
+
+void cuda_multi_layer_norm(std::vector<at::Tensor> &outputs,
+                           std::vector<at::Tensor> &means,
+                           std::vector<at::Tensor> &invvars,
+                           const std::vector<at::Tensor> &inputs,
+                           const std::vector<int> &n1s,
+                           const std::vector<int> &n2s,
+                           const std::vector<at::Tensor> &gammas,
+                           const std::vector<at::Tensor> &betas,
+                           double epsilon, bool rms_only);
+
+void cuda_multi_layer_norm_gradient(
+    std::vector<at::Tensor> &grad_inputs, std::vector<at::Tensor> &grad_gammas,
+    std::vector<at::Tensor> &grad_betas, const std::vector<at::Tensor> &douts,
+    const std::vector<at::Tensor> &means,
+    const std::vector<at::Tensor> &invvars,
+    const std::vector<at::Tensor> &inputs, const std::vector<int> &n1s,
+    const std::vector<int> &n2s, const std::vector<at::Tensor> &gammas,
+    double epsilon, bool rms_only);
+
+// The multi-tensor ops normalize a list of tensors with their own
+// normalized_shape in as few launches as possible. All tensors must share
+// one dtype, and gammas/betas are either empty or given for every tensor.
+void check_multi_args(
+    const std::vector<at::Tensor> &inputs,
+    const std::vector<std::vector<int64_t>> &normalized_shapes,
+    const std::vector<at::Tensor> &gammas, const std::vector<at::Tensor> &betas,
+    std::vector<int> &n1s, std::vector<int> &n2s) {
+  TORCH_CHECK(!inputs.empty(), "expected at least one input");
+  TORCH_CHECK(normalized_shapes.size() == inputs.size(),
+              "expected one normalized_shape per input");
+  TORCH_CHECK(gammas.empty() || gammas.size() == inputs.size(),
+              "expected no gamma or one gamma per input");
+  TORCH_CHECK(betas.empty() || betas.size() == inputs.size(),
+              "expected no beta or one beta per input");
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    CHECK_INPUT(inputs[i]);
+    TORCH_CHECK(inputs[i].scalar_type() == inputs[0].scalar_type(),
+                "all inputs must have the same dtype");
+    int n1, n2;
+    check_args(inputs[i], normalized_shapes[i], n1, n2);
+    if (!gammas.empty()) {
+      CHECK_INPUT(gammas[i]);
+      TORCH_CHECK(gammas[i].scalar_type() == inputs[0].scalar_type(),
+                  "gamma must have the same dtype as input");
+      check_args(normalized_shapes[i], gammas[i]);
+    }
+    if (!betas.empty()) {
+      CHECK_INPUT(betas[i]);
+      TORCH_CHECK(betas[i].scalar_type() == inputs[0].scalar_type(),
+                  "beta must have the same dtype as input");
+      check_args(normalized_shapes[i], betas[i]);
+    }
+    n1s.push_back(n1);
+    n2s.push_back(n2);
+  }
+}
+
+std::vector<at::Tensor> empty_stats(const std::vector<at::Tensor> &inputs,
+                                    const std::vector<int> &n1s) {
+  const auto stats_dtype =
+      (inputs[0].scalar_type() == at::ScalarType::Half ||
+       inputs[0].scalar_type() == at::ScalarType::BFloat16)
+          ? at::ScalarType::Float
+          : inputs[0].scalar_type();
+  std::vector<at::Tensor> stats;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    stats.push_back(
+        at::empty({n1s[i]}, inputs[i].options().dtype(stats_dtype)));
+  }
+  return stats;
+}
+
+std::vector<at::Tensor> empty_like_all(const std::vector<at::Tensor> &tensors) {
+  std::vector<at::Tensor> outputs;
+  for (const auto &tensor : tensors) {
+    outputs.push_back(at::empty_like(tensor));
+  }
+  return outputs;
+}
+
+// The telemetry of the multi tensor ops is keyed by the number of tensors
+// and their total number of rows.
+int64_t total_rows(const std::vector<int> &n1s) {
+  int64_t rows = 0;
+  for (const int n1 : n1s) {
+    rows += n1;
+  }
+  return rows;
+}
+
+std::vector<std::vector<at::Tensor>>
+multi_layer_norm(std::vector<at::Tensor> inputs,
+                 std::vector<std::vector<int64_t>> normalized_shapes,
+                 std::vector<at::Tensor> gammas, std::vector<at::Tensor> betas,
+                 double epsilon) {
+  TORCH_CHECK(gammas.size() == betas.size(),
+              "gammas and betas must be given together");
+  std::vector<int> n1s, n2s;
+  check_multi_args(inputs, normalized_shapes, gammas, betas, n1s, n2s);
+  std::vector<at::Tensor> outputs = empty_like_all(inputs);
+  std::vector<at::Tensor> means = empty_stats(inputs, n1s);
+  std::vector<at::Tensor> invvars = empty_stats(inputs, n1s);
+  OP_TELEMETRY_SCOPE("multi_layer_norm_forward", inputs[0].scalar_type(),
+                     inputs.size(), total_rows(n1s));
+  cuda_multi_layer_norm(outputs, means, invvars, inputs, n1s, n2s, gammas,
+                        betas, epsilon, false);
+  return {outputs, means, invvars};
+}
+
+std::vector<std::vector<at::Tensor>>
+multi_layer_norm_gradient(std::vector<at::Tensor> douts,
+                          std::vector<at::Tensor> means,
+                          std::vector<at::Tensor> invvars,
+                          std::vector<at::Tensor> inputs,
+                          std::vector<std::vector<int64_t>> normalized_shapes,
+                          std::vector<at::Tensor> gammas,
+                          std::vector<at::Tensor> betas, double epsilon) {
+  TORCH_CHECK(gammas.size() == betas.size(),
+              "gammas and betas must be given together");
+  std::vector<int> n1s, n2s;
+  check_multi_args(inputs, normalized_shapes, gammas, betas, n1s, n2s);
+  TORCH_CHECK(douts.size() == inputs.size() && means.size() == inputs.size() &&
+                  invvars.size() == inputs.size(),
+              "expected one dout, mean and invvar per input");
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    CHECK_INPUT(douts[i]);
+    CHECK_INPUT(means[i]);
+    CHECK_INPUT(invvars[i]);
+  }
+  std::vector<at::Tensor> grad_inputs = empty_like_all(inputs);
+  std::vector<at::Tensor> grad_gammas = empty_like_all(gammas);
+  std::vector<at::Tensor> grad_betas = empty_like_all(betas);
+  OP_TELEMETRY_SCOPE("multi_layer_norm_backward", inputs[0].scalar_type(),
+                     inputs.size(), total_rows(n1s));
+  cuda_multi_layer_norm_gradient(grad_inputs, grad_gammas, grad_betas, douts,
+                                 means, invvars, inputs, n1s, n2s, gammas,
+                                 epsilon, false);
+  return {grad_inputs, grad_gammas, grad_betas};
+}
+
+std::vector<std::vector<at::Tensor>>
+multi_rms_norm(std::vector<at::Tensor> inputs,
+               std::vector<std::vector<int64_t>> normalized_shapes,
+               std::vector<at::Tensor> gammas, double epsilon) {
+  std::vector<int> n1s, n2s;
+  check_multi_args(inputs, normalized_shapes, gammas, {}, n1s, n2s);
+  std::vector<at::Tensor> outputs = empty_like_all(inputs);
+  std::vector<at::Tensor> means;
+  std::vector<at::Tensor> invvars = empty_stats(inputs, n1s);
+  OP_TELEMETRY_SCOPE("multi_rms_norm_forward", inputs[0].scalar_type(),
+                     inputs.size(), total_rows(n1s));
+  cuda_multi_layer_norm(outputs, means, invvars, inputs, n1s, n2s, gammas, {},
+                        epsilon, true);
+  return {outputs, invvars};
+}
+
+std::vector<std::vector<at::Tensor>>
+multi_rms_norm_gradient(std::vector<at::Tensor> douts,
+                        std::vector<at::Tensor> invvars,
+                        std::vector<at::Tensor> inputs,
+                        std::vector<std::vector<int64_t>> normalized_shapes,
+                        std::vector<at::Tensor> gammas, double epsilon) {
+  std::vector<int> n1s, n2s;
+  check_multi_args(inputs, normalized_shapes, gammas, {}, n1s, n2s);
+  TORCH_CHECK(douts.size() == inputs.size() && invvars.size() == inputs.size(),
+              "expected one dout and invvar per input");
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    CHECK_INPUT(douts[i]);
+    CHECK_INPUT(invvars[i]);
+  }
+  std::vector<at::Tensor> grad_inputs = empty_like_all(inputs);
+  std::vector<at::Tensor> grad_gammas = empty_like_all(gammas);
+  std::vector<at::Tensor> grad_betas;
+  OP_TELEMETRY_SCOPE("multi_rms_norm_backward", inputs[0].scalar_type(),
+                     inputs.size(), total_rows(n1s));
+  cuda_multi_layer_norm_gradient(grad_inputs, grad_gammas, grad_betas, douts,
+                                 {}, invvars, inputs, n1s, n2s, gammas,
+                                 epsilon, true);
+  return {grad_inputs, grad_gammas};
+}
+
+void cuda_bias_gelu(at::Tensor *output, at::Tensor *derivative,
+                    at::Tensor *input, at::Tensor *bias, int n2,
+                    bool approximate);
+
+void cuda_bias_gelu_gradient(at::Tensor *grad_input, at::Tensor *grad_output,
+                             at::Tensor *input, at::Tensor *bias,
+                             at::Tensor *derivative, int n2,
+                             bool approximate);
+
+// An empty bias means there is no bias, else it is added to the last dim.
+void check_bias_gelu_args(at::Tensor input, at::Tensor bias, int &n2) {
+  CHECK_INPUT(input);
+  TORCH_CHECK(input.dim() > 0 && input.numel() > 0,
+              "input of the fused bias GeLU must not be empty");
+  n2 = input.size(-1);
+  if (bias.numel() > 0) {
+    CHECK_INPUT(bias);
+    TORCH_CHECK(bias.numel() == n2,
+                "bias must have as many elements as the last dim of input, "
+                "but got ",
+                bias.numel(), " and ", n2);
+    TORCH_CHECK(bias.scalar_type() == input.scalar_type(),
+                "bias must have the dtype of input");
+  }
+}
+
+// output = gelu(input + bias), the tanh approximation if 'approximate' else
+// the exact erf form. The derivative is returned too if 'save_derivative',
+// else the backward recomputes it from input and bias.
+std::vector<at::Tensor> fused_bias_gelu_forward(at::Tensor input,
+                                                at::Tensor bias,
+                                                bool approximate,
+                                                bool save_derivative) {
+  int n2;
+  check_bias_gelu_args(input, bias, n2);
+  at::Tensor output = at::empty_like(input);
+  at::Tensor derivative =
+      save_derivative ? at::empty_like(input) : at::empty({0}, input.options());
+  OP_TELEMETRY_SCOPE("fused_bias_gelu_forward", input.scalar_type(),
+                     input.numel() / n2, n2);
+  cuda_bias_gelu(&output, save_derivative ? &derivative : NULL, &input,
+                 bias.numel() > 0 ? &bias : NULL, n2, approximate);
+  return {output, derivative};
+}
+
+// The gradient of the input, the one of the bias is its sum over the rows.
+at::Tensor fused_bias_gelu_backward(at::Tensor grad_output, at::Tensor input,
+                                    at::Tensor bias, at::Tensor derivative,
+                                    bool approximate) {
+  int n2;
+  CHECK_INPUT(grad_output);
+  check_bias_gelu_args(input, bias, n2);
+  TORCH_CHECK(grad_output.sizes().equals(input.sizes()),
+              "grad_output must have the shape of input");
+  if (derivative.numel() > 0) {
+    CHECK_INPUT(derivative);
+    TORCH_CHECK(derivative.sizes().equals(input.sizes()),
+                "derivative must have the shape of input");
+  }
+  at::Tensor grad_input = at::empty_like(grad_output);
+  OP_TELEMETRY_SCOPE("fused_bias_gelu_backward", input.scalar_type(),
+                     input.numel() / n2, n2);
+  cuda_bias_gelu_gradient(&grad_input, &grad_output, &input,
+                          bias.numel() > 0 ? &bias : NULL,
+                          derivative.numel() > 0 ? &derivative : NULL, n2,
+                          approximate);
+  return grad_input;
+}
+
+void cuda_scaled_masked_softmax(at::Tensor *output, at::Tensor *input,
+                                at::Tensor *mask, float scale);
+
+void cuda_scaled_upper_triang_masked_softmax(at::Tensor *output,
+                                             at::Tensor *input, float scale);
+
+void cuda_scaled_softmax_gradient(at::Tensor *grad_input,
+                                  at::Tensor *grad_output, at::Tensor *output,
+                                  float scale);
+
+// softmax(scale * input) over the last dim of the [b, h, sq, sk] scores. An
+// empty mask means there is no mask, else it is a [1 or b, 1, 1 or sq, sk]
+// bool or byte mask whose true positions are excluded.
+at::Tensor scaled_masked_softmax_forward(at::Tensor input, at::Tensor mask,
+                                         double scale) {
+  CHECK_INPUT(input);
+  TORCH_CHECK(input.dim() == 4, "input must be [b, h, sq, sk] scores");
+  if (mask.numel() > 0) {
+    CHECK_INPUT(mask);
+    TORCH_CHECK(mask.scalar_type() == at::ScalarType::Bool ||
+                    mask.scalar_type() == at::ScalarType::Byte,
+                "mask must be a bool or byte tensor");
+    TORCH_CHECK(mask.dim() == 4 && mask.size(1) == 1 &&
+                    (mask.size(0) == 1 || mask.size(0) == input.size(0)) &&
+                    (mask.size(2) == 1 || mask.size(2) == input.size(2)) &&
+                    mask.size(3) == input.size(3),
+                "mask must be broadcastable to the scores from "
+                "[1 or b, 1, 1 or sq, sk], but got ",
+                mask.sizes(), " for ", input.sizes());
+  }
+  at::Tensor output = at::empty_like(input);
+  if (input.numel() > 0) {
+    OP_TELEMETRY_SCOPE("scaled_masked_softmax_forward", input.scalar_type(),
+                       input.numel() / input.size(3), input.size(3));
+    cuda_scaled_masked_softmax(&output, &input,
+                               mask.numel() > 0 ? &mask : NULL, (float)scale);
+  }
+  return output;
+}
+
+// softmax(scale * input) over the last dim of the [b * h, sq, sk] scores,
+// with the query i attending the keys up to sk - sq + i.
+at::Tensor scaled_upper_triang_masked_softmax_forward(at::Tensor input,
+                                                      double scale) {
+  CHECK_INPUT(input);
+  TORCH_CHECK(input.dim() == 3, "input must be [b * h, sq, sk] scores");
+  TORCH_CHECK(input.size(1) <= input.size(2),
+              "causal scores need at least as many keys as queries");
+  at::Tensor output = at::empty_like(input);
+  if (input.numel() > 0) {
+    OP_TELEMETRY_SCOPE("scaled_upper_triang_masked_softmax_forward",
+                       input.scalar_type(), input.numel() / input.size(2),
+                       input.size(2));
+    cuda_scaled_upper_triang_masked_softmax(&output, &input, (float)scale);
+  }
+  return output;
+}
+
+// The backward of both softmaxes, from the output of their forward.
+at::Tensor scaled_softmax_backward(at::Tensor grad_output,
+                                   at::Tensor softmax_results, double scale) {
+  CHECK_INPUT(grad_output);
+  CHECK_INPUT(softmax_results);
+  TORCH_CHECK(grad_output.sizes().equals(softmax_results.sizes()),
+              "grad_output must have the shape of the softmax results");
+  at::Tensor grad_input = at::empty_like(grad_output);
+  if (grad_output.numel() > 0) {
+    OP_TELEMETRY_SCOPE("scaled_softmax_backward", grad_output.scalar_type(),
+                       grad_output.numel() / grad_output.size(-1),
+                       grad_output.size(-1));
+    cuda_scaled_softmax_gradient(&grad_input, &grad_output, &softmax_results,
+                                 (float)scale);
+  }
+  return grad_input;
+}
+
+void cuda_vocab_parallel_cross_entropy(at::Tensor *stats, at::Tensor *logits,
+                                       at::Tensor *targets,
+                                       int64_t vocab_start, int n1, int n2);
+
+void cuda_vocab_parallel_cross_entropy_gradient(
+    at::Tensor *grad, at::Tensor *logits, at::Tensor *grad_loss,
+    at::Tensor *max, at::Tensor *sum, at::Tensor *targets,
+    int64_t vocab_start, int n1, int n2, int64_t ignore_index);
+
+void check_cross_entropy_args(at::Tensor logits, at::Tensor targets, int &n1,
+                              int &n2) {
+  CHECK_INPUT(logits);
+  CHECK_INPUT(targets);
+  TORCH_CHECK(logits.dim() == 2, "logits must be [tokens, local vocab]");
+  TORCH_CHECK(targets.scalar_type() == at::ScalarType::Long,
+              "targets must be a long tensor");
+  TORCH_CHECK(targets.dim() == 1 && targets.size(0) == logits.size(0),
+              "targets must have a target per row of logits");
+  n1 = logits.size(0);
+  n2 = logits.size(1);
+}
+
+// The [tokens, 3] float32 local max, local sum of exp(logits - max) and
+// target logit of every row of the vocabulary shard 'logits', whose first
+// column is the token 'vocab_start'. The target logit is 0 on the shards
+// not holding the target.
+at::Tensor vocab_parallel_cross_entropy_forward(at::Tensor logits,
+                                                at::Tensor targets,
+                                                int64_t vocab_start) {
+  int n1, n2;
+  check_cross_entropy_args(logits, targets, n1, n2);
+  at::Tensor stats =
+      at::empty({n1, 3}, logits.options().dtype(at::ScalarType::Float));
+  if (n1 > 0 && n2 > 0) {
+    OP_TELEMETRY_SCOPE("vocab_parallel_cross_entropy_forward",
+                       logits.scalar_type(), n1, n2);
+    cuda_vocab_parallel_cross_entropy(&stats, &logits, &targets, vocab_start,
+                                      n1, n2);
+  }
+  return stats;
+}
+
+// The gradient of the logits from 'max' and 'sum', reduced over the whole
+// vocabulary, and the float32 gradient of the loss of every row. It is
+// written into 'logits' when 'inplace', which then must not be used again.
+at::Tensor vocab_parallel_cross_entropy_backward(
+    at::Tensor grad_loss, at::Tensor logits, at::Tensor max, at::Tensor sum,
+    at::Tensor targets, int64_t vocab_start, int64_t ignore_index,
+    bool inplace) {
+  int n1, n2;
+  check_cross_entropy_args(logits, targets, n1, n2);
+  CHECK_INPUT(grad_loss);
+  CHECK_INPUT(max);
+  CHECK_INPUT(sum);
+  for (auto &tensor : {grad_loss, max, sum}) {
+    TORCH_CHECK(tensor.scalar_type() == at::ScalarType::Float &&
+                    tensor.numel() == n1,
+                "grad_loss, max and sum must be float tensors of a value per "
+                "row of logits");
+  }
+  at::Tensor grad = inplace ? logits : at::empty_like(logits);
+  if (n1 > 0 && n2 > 0) {
+    OP_TELEMETRY_SCOPE("vocab_parallel_cross_entropy_backward",
+                       logits.scalar_type(), n1, n2);
+    cuda_vocab_parallel_cross_entropy_gradient(&grad, &logits, &grad_loss,
+                                               &max, &sum, &targets,
+                                               vocab_start, n1, n2,
+                                               ignore_index);
+  }
+  return grad;
+}
+
+void cuda_flatten_unscale(at::Tensor *arena,
+                          const std::vector<at::Tensor> &grads,
+                          const std::vector<int64_t> &offsets,
+                          at::Tensor *found_inf, at::Tensor *inv_scale,
+                          float factor);
+
+// Copies every gradient into the arena from its offset, multiplied by
+// 'factor' and by the float32 'inv_scale' if not empty. found_inf is set to 1
+// if a copied value is not finite, unless it is empty. A gradient may already
+// be the view of its slice of the arena.
+void flatten_unscale(std::vector<at::Tensor> grads,
+                     std::vector<int64_t> offsets, at::Tensor arena,
+                     at::Tensor found_inf, at::Tensor inv_scale,
+                     double factor) {
+  CHECK_INPUT(arena);
+  TORCH_CHECK(grads.size() == offsets.size(),
+              "expected one offset per gradient");
+  int64_t numel = 0;
+  for (size_t i = 0; i < grads.size(); ++i) {
+    CHECK_INPUT(grads[i]);
+    TORCH_CHECK(grads[i].scalar_type() == arena.scalar_type(),
+                "gradients must have the dtype of the arena");
+    TORCH_CHECK(offsets[i] >= 0 &&
+                    offsets[i] + grads[i].numel() <= arena.numel(),
+                "gradient ", i, " does not fit in the arena");
+    numel += grads[i].numel();
+  }
+  for (auto &tensor : {found_inf, inv_scale}) {
+    if (tensor.numel() > 0) {
+      CHECK_INPUT(tensor);
+      TORCH_CHECK(tensor.scalar_type() == at::ScalarType::Float &&
+                      tensor.numel() == 1,
+                  "found_inf and inv_scale must be float tensors of one "
+                  "element");
+    }
+  }
+  if (numel > 0) {
+    OP_TELEMETRY_SCOPE("flatten_unscale", arena.scalar_type(), grads.size(),
+                       numel);
+    cuda_flatten_unscale(&arena, grads, offsets,
+                         found_inf.numel() > 0 ? &found_inf : NULL,
+                         inv_scale.numel() > 0 ? &inv_scale : NULL,
+                         (float)factor);
+  }
+}
+
+void layer_norm_prepare_capture(int64_t bytes);
+
+// Allocates the static workspaces of the ops on the current device ahead of
+// a CUDA graph capture, during which they can not be allocated.
+void prepare_cuda_graph_capture(int64_t workspace_bytes) {
+  TORCH_CHECK(workspace_bytes >= 0, "workspace_bytes must be non-negative");
+  layer_norm_prepare_capture(workspace_bytes);
+}
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("layer_norm_forward_affine", &layer_norm_affine,
         "LayerNorm forward (CUDA)");
@@ -445,6 +1555,85 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("rms_norm_forward_affine_mixed_dtypes", &rms_norm_affine_mixed_dtypes,
         "RMSNorm forward with mixed dtypes (CUDA) compatible with Megatron's "
         "implementation");
+  m.def("layer_norm_residual_forward_affine", &layer_norm_residual_affine,
+        "Residual + bias + dropout + LayerNorm forward (CUDA)");
+  m.def("layer_norm_residual_backward_affine",
+        &layer_norm_residual_gradient_affine,
+        "Residual + bias + dropout + LayerNorm backward (CUDA)");
+  m.def("rms_norm_residual_forward_affine", &rms_norm_residual_affine,
+        "Residual + bias + dropout + RMSNorm forward (CUDA)");
+  m.def("rms_norm_residual_backward_affine", &rms_norm_residual_gradient_affine,
+        "Residual + bias + dropout + RMSNorm backward (CUDA)");
+  m.def("layer_norm_partial_stats", &layer_norm_partial_stats,
+        "Tensor parallel LayerNorm local statistics (CUDA)");
+  m.def("layer_norm_sharded_forward_affine", &layer_norm_sharded_affine,
+        "Tensor parallel LayerNorm forward (CUDA)");
+  m.def("layer_norm_grad_input_partial_sums",
+        &layer_norm_grad_input_partial_sums,
+        "Tensor parallel LayerNorm local backward sums (CUDA)");
+  m.def("layer_norm_sharded_backward_affine",
+        &layer_norm_sharded_gradient_affine,
+        "Tensor parallel LayerNorm backward (CUDA)");
+  m.def("rms_norm_partial_stats", &rms_norm_partial_stats,
+        "Tensor parallel RMSNorm local statistics (CUDA)");
+  m.def("rms_norm_sharded_forward_affine", &rms_norm_sharded_affine,
+        "Tensor parallel RMSNorm forward (CUDA)");
+  m.def("rms_norm_grad_input_partial_sums", &rms_norm_grad_input_partial_sums,
+        "Tensor parallel RMSNorm local backward sums (CUDA)");
+  m.def("rms_norm_sharded_backward_affine", &rms_norm_sharded_gradient_affine,
+        "Tensor parallel RMSNorm backward (CUDA)");
+  m.def("layer_norm_forward_affine_quantized", &layer_norm_affine_quantized,
+        "LayerNorm forward with int8/fp8 output (CUDA)");
+  m.def("rms_norm_forward_affine_quantized", &rms_norm_affine_quantized,
+        "RMSNorm forward with int8/fp8 output (CUDA)");
+  m.def("multi_layer_norm_forward", &multi_layer_norm,
+        "Multi-tensor LayerNorm forward (CUDA)");
+  m.def("multi_layer_norm_backward", &multi_layer_norm_gradient,
+        "Multi-tensor LayerNorm backward (CUDA)");
+  m.def("multi_rms_norm_forward", &multi_rms_norm,
+        "Multi-tensor RMSNorm forward (CUDA)");
+  m.def("multi_rms_norm_backward", &multi_rms_norm_gradient,
+        "Multi-tensor RMSNorm backward (CUDA)");
   m.def("ngram_repeat_block_forward", &ngram_repeat_block_forward,
         "No Repeat Ngram Block forward (CUDA)");
+  m.def("ngram_repeat_block_index_forward",
+        &ngram_repeat_block_index_forward,
+        "No Repeat Ngram Block forward with an incremental index (CUDA)");
+  m.def("ngram_repeat_block_ragged_forward",
+        &ngram_repeat_block_ragged_forward,
+        "No Repeat Ngram Block forward for ragged batches (CUDA)");
+  m.def("logits_process_forward", &logits_process_forward,
+        "Fused logits processors forward (CUDA)");
+  m.def("fused_bias_gelu_forward", &fused_bias_gelu_forward,
+        "Fused bias GeLU forward (CUDA)");
+  m.def("fused_bias_gelu_backward", &fused_bias_gelu_backward,
+        "Fused bias GeLU backward (CUDA)");
+  m.def("scaled_masked_softmax_forward", &scaled_masked_softmax_forward,
+        "Scaled masked softmax forward (CUDA)");
+  m.def("scaled_masked_softmax_backward", &scaled_softmax_backward,
+        "Scaled masked softmax backward (CUDA)");
+  m.def("scaled_upper_triang_masked_softmax_forward",
+        &scaled_upper_triang_masked_softmax_forward,
+        "Scaled upper triangular masked softmax forward (CUDA)");
+  m.def("scaled_upper_triang_masked_softmax_backward",
+        &scaled_softmax_backward,
+        "Scaled upper triangular masked softmax backward (CUDA)");
+  m.def("vocab_parallel_cross_entropy_forward",
+        &vocab_parallel_cross_entropy_forward,
+        "Vocabulary parallel cross entropy local statistics (CUDA)");
+  m.def("vocab_parallel_cross_entropy_backward",
+        &vocab_parallel_cross_entropy_backward,
+        "Vocabulary parallel cross entropy backward (CUDA)");
+  m.def("flatten_unscale", &flatten_unscale,
+        "Flatten, unscale and check the overflow of gradients (CUDA)");
+  m.def("prepare_cuda_graph_capture", &prepare_cuda_graph_capture,
+        py::arg("workspace_bytes") = 0,
+        "Allocate the workspaces used while capturing CUDA graphs (CUDA)");
+  m.def("set_op_telemetry", &op_telemetry_set_enabled, py::arg("nvtx") = false,
+        py::arg("timing") = false,
+        "Switch the NVTX ranges and the CUDA event timings of the ops");
+  m.def("op_telemetry_stats", &op_telemetry_stats,
+        "Calls and timings of the ops by name, shape and dtype");
+  m.def("reset_op_telemetry", &op_telemetry_reset,
+        "Clear the calls and timings of the ops");
 }
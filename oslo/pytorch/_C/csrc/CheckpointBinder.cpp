@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <c10/cuda/CUDAGuard.h>
+#include <torch/extension.h>
+#include <torch/torch.h>
+#include <vector>
+
+#include "CheckpointPartition.h"
+#include "compat.h"
+
+namespace {
+// Partitions start at aligned offsets of the packed buffer so that they are
+// copied with vectorized accesses.
+constexpr int64_t kPartitionAlignment = 16;
+
+int64_t alignUp(int64_t bytes) {
+  return (bytes + kPartitionAlignment - 1) / kPartitionAlignment *
+         kPartitionAlignment;
+}
+
+int64_t partitionBytes(const torch::Tensor &tensor, int world_size) {
+  TORCH_CHECK(tensor.numel() % world_size == 0,
+              "Doesn't handle if partition activation if item is not "
+              "divisible by mp size.");
+  return tensor.numel() / world_size * tensor.element_size();
+}
+
+int64_t partitionNumel(const torch::Tensor &tensor, int world_size) {
+  return partitionBytes(tensor, world_size) / tensor.element_size();
+}
+
+// Bytes of the codes of a quantized partition, its scales follow them.
+int64_t codesBytes(int64_t numel, int bits) {
+  return alignUp((numel * bits + 7) / 8);
+}
+
+int64_t scalesBytes(int64_t numel) {
+  const int64_t blocks = (numel + kQuantBlockSize - 1) / kQuantBlockSize;
+  return alignUp(blocks * (int64_t)sizeof(float));
+}
+
+// Offsets of the partition of every tensor in the packed buffer, followed by
+// the size of the buffer. Partitions are stored as is with 0 bits, else as
+// 'bits' bit codes followed by their scales. The layout only depends on the
+// shapes, it is the same on every rank.
+std::vector<int64_t> packedOffsets(const std::vector<torch::Tensor> &tensors,
+                                   int world_size, int bits = 0) {
+  std::vector<int64_t> offsets;
+  offsets.reserve(tensors.size() + 1);
+  int64_t offset = 0;
+  for (auto &tensor : tensors) {
+    offsets.push_back(offset);
+    if (bits == 0) {
+      offset += alignUp(partitionBytes(tensor, world_size));
+    } else {
+      const int64_t numel = partitionNumel(tensor, world_size);
+      offset += codesBytes(numel, bits) + scalesBytes(numel);
+    }
+  }
+  offsets.push_back(offset);
+  return offsets;
+}
+
+int64_t activationType(const torch::Tensor &tensor) {
+  switch (tensor.scalar_type()) {
+  case at::ScalarType::Half:
+    return ACTIVATION_HALF;
+  case at::ScalarType::BFloat16:
+    return ACTIVATION_BFLOAT16;
+  default:
+    TORCH_CHECK(tensor.scalar_type() == at::ScalarType::Float,
+                "only float, half and bfloat16 activations can be quantized");
+    return ACTIVATION_FLOAT;
+  }
+}
+
+char *bytePtr(const torch::Tensor &tensor) {
+  return reinterpret_cast<char *>(tensor.data_ptr());
+}
+
+void checkBits(int bits) {
+  TORCH_CHECK(bits == 4 || bits == 8,
+              "activations are quantized to 4 or 8 bits");
+}
+} // namespace
+
+// Pack the 'rank'-th of 'world_size' partitions of every tensor into one
+// flat uint8 buffer, in a single launch. With a world size of 1 the tensors
+// are packed whole.
+torch::Tensor partition_pack_forward(std::vector<torch::Tensor> tensors,
+                                     int world_size, int rank) {
+  TORCH_CHECK(world_size > 0 && rank >= 0 && rank < world_size,
+              "rank must lie within the world size");
+  TORCH_CHECK(!tensors.empty(), "there are no activations to pack");
+  const auto device = tensors[0].device();
+  for (auto &tensor : tensors) {
+    CHECK_CUDA(tensor);
+    TORCH_CHECK(tensor.device() == device,
+                "activations must be on the same device");
+    tensor = tensor.contiguous();
+  }
+  const at::cuda::CUDAGuard device_guard(device);
+
+  const auto offsets = packedOffsets(tensors, world_size);
+  auto packed = torch::empty(
+      {offsets.back()}, torch::dtype(torch::kUInt8).device(device));
+
+  auto segments = torch::empty({(int64_t)tensors.size(), 3}, torch::kLong);
+  auto rows = segments.accessor<int64_t, 2>();
+  int64_t max_bytes = 0;
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    const int64_t bytes = partitionBytes(tensors[i], world_size);
+    rows[i][0] = (int64_t)(bytePtr(tensors[i]) + bytes * rank);
+    rows[i][1] = (int64_t)(bytePtr(packed) + offsets[i]);
+    rows[i][2] = bytes;
+    max_bytes = std::max(max_bytes, bytes);
+  }
+  checkpoint_copy_segments_cuda(segments, max_bytes, device);
+  return packed;
+}
+
+// Scatter 'gathered', the packed buffers of 'world_size' ranks one after the
+// other, into 'outputs', the contiguous full size tensors that were packed.
+void gather_unpack_forward(torch::Tensor gathered,
+                           std::vector<torch::Tensor> outputs,
+                           int world_size) {
+  CHECK_INPUT(gathered);
+  TORCH_CHECK(world_size > 0, "world size must be positive");
+  TORCH_CHECK(!outputs.empty(), "there are no activations to unpack");
+  for (auto &output : outputs) {
+    CHECK_INPUT(output);
+    TORCH_CHECK(output.device() == gathered.device(),
+                "activations must be on the device of the gathered buffer");
+  }
+  const at::cuda::CUDAGuard device_guard(gathered.device());
+
+  const auto offsets = packedOffsets(outputs, world_size);
+  const int64_t packed_bytes = offsets.back();
+  TORCH_CHECK(gathered.nbytes() == packed_bytes * world_size,
+              "gathered buffer does not match the packed activations");
+
+  auto segments =
+      torch::empty({(int64_t)outputs.size() * world_size, 3}, torch::kLong);
+  auto rows = segments.accessor<int64_t, 2>();
+  int64_t max_bytes = 0;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    const int64_t bytes = partitionBytes(outputs[i], world_size);
+    for (int rank = 0; rank < world_size; ++rank) {
+      const int64_t row = (int64_t)i * world_size + rank;
+      rows[row][0] = (int64_t)(bytePtr(gathered) + packed_bytes * rank +
+                               offsets[i]);
+      rows[row][1] = (int64_t)(bytePtr(outputs[i]) + bytes * rank);
+      rows[row][2] = bytes;
+    }
+    max_bytes = std::max(max_bytes, bytes);
+  }
+  checkpoint_copy_segments_cuda(segments, max_bytes, gathered.device());
+}
+
+// Like partition_pack_forward, but every partition is quantized to 'bits'
+// bit codes with one absmax scale per block of kQuantBlockSize elements.
+torch::Tensor partition_pack_quantized_forward(
+    std::vector<torch::Tensor> tensors, int world_size, int rank, int bits) {
+  TORCH_CHECK(world_size > 0 && rank >= 0 && rank < world_size,
+              "rank must lie within the world size");
+  TORCH_CHECK(!tensors.empty(), "there are no activations to pack");
+  checkBits(bits);
+  const auto device = tensors[0].device();
+  for (auto &tensor : tensors) {
+    CHECK_CUDA(tensor);
+    TORCH_CHECK(tensor.device() == device,
+                "activations must be on the same device");
+    tensor = tensor.contiguous();
+  }
+  const at::cuda::CUDAGuard device_guard(device);
+
+  const auto offsets = packedOffsets(tensors, world_size, bits);
+  auto packed = torch::empty(
+      {offsets.back()}, torch::dtype(torch::kUInt8).device(device));
+
+  auto segments = torch::empty({(int64_t)tensors.size(), 5}, torch::kLong);
+  auto rows = segments.accessor<int64_t, 2>();
+  int64_t max_numel = 0;
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    const int64_t numel = partitionNumel(tensors[i], world_size);
+    char *codes = bytePtr(packed) + offsets[i];
+    rows[i][0] = (int64_t)(bytePtr(tensors[i]) +
+                           partitionBytes(tensors[i], world_size) * rank);
+    rows[i][1] = (int64_t)codes;
+    rows[i][2] = (int64_t)(codes + codesBytes(numel, bits));
+    rows[i][3] = numel;
+    rows[i][4] = activationType(tensors[i]);
+    max_numel = std::max(max_numel, numel);
+  }
+  checkpoint_quantize_segments_cuda(segments, max_numel, bits, device);
+  return packed;
+}
+
+// Like gather_unpack_forward, for buffers packed by
+// partition_pack_quantized_forward.
+void gather_unpack_quantized_forward(torch::Tensor gathered,
+                                     std::vector<torch::Tensor> outputs,
+                                     int world_size, int bits) {
+  CHECK_INPUT(gathered);
+  TORCH_CHECK(world_size > 0, "world size must be positive");
+  TORCH_CHECK(!outputs.empty(), "there are no activations to unpack");
+  checkBits(bits);
+  for (auto &output : outputs) {
+    CHECK_INPUT(output);
+    TORCH_CHECK(output.device() == gathered.device(),
+                "activations must be on the device of the gathered buffer");
+  }
+  const at::cuda::CUDAGuard device_guard(gathered.device());
+
+  const auto offsets = packedOffsets(outputs, world_size, bits);
+  const int64_t packed_bytes = offsets.back();
+  TORCH_CHECK(gathered.nbytes() == packed_bytes * world_size,
+              "gathered buffer does not match the packed activations");
+
+  auto segments =
+      torch::empty({(int64_t)outputs.size() * world_size, 5}, torch::kLong);
+  auto rows = segments.accessor<int64_t, 2>();
+  int64_t max_numel = 0;
+  for (size_t i = 0; i < outputs.size(); ++i) {
+    const int64_t numel = partitionNumel(outputs[i], world_size);
+    const int64_t bytes = partitionBytes(outputs[i], world_size);
+    for (int rank = 0; rank < world_size; ++rank) {
+      const int64_t row = (int64_t)i * world_size + rank;
+      char *codes = bytePtr(gathered) + packed_bytes * rank + offsets[i];
+      rows[row][0] = (int64_t)codes;
+      rows[row][1] = (int64_t)(bytePtr(outputs[i]) + bytes * rank);
+      rows[row][2] = (int64_t)(codes + codesBytes(numel, bits));
+      rows[row][3] = numel;
+      rows[row][4] = activationType(outputs[i]);
+    }
+    max_numel = std::max(max_numel, numel);
+  }
+  checkpoint_dequantize_segments_cuda(segments, max_numel, bits,
+                                      gathered.device());
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+  m.def("partition_pack_forward", &partition_pack_forward,
+        "Pack partitions of checkpointed activations (CUDA)");
+  m.def("gather_unpack_forward", &gather_unpack_forward,
+        "Unpack gathered partitions of checkpointed activations (CUDA)");
+  m.def("partition_pack_quantized_forward", &partition_pack_quantized_forward,
+        "Pack quantized partitions of checkpointed activations (CUDA)");
+  m.def("gather_unpack_quantized_forward", &gather_unpack_quantized_forward,
+        "Unpack gathered quantized partitions of checkpointed activations "
+        "(CUDA)");
+}
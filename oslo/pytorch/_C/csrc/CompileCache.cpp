@@ -24,6 +24,15 @@
 /// compiler.
 ///
 #include "CompileCache.h"
+#include <algorithm>
+#include <atomic>
+#include <c10/util/SmallVector.h>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <torch/csrc/autograd/custom_function.h>
 #include <torch/csrc/jit/python/pybind_utils.h>
 #include <torch/csrc/jit/tensorexpr/codegen.h>
@@ -56,7 +65,9 @@ static uint8_t packFlags(const LocalState &state, const at::Tensor &v) {
          (static_cast<uint8_t>(dtype) << 1);
 }
 
-using hash_key_t = std::vector<int64_t>;
+/// Specialization key of a call. Kept inline for the usual number of
+/// arguments, so that computing the key of a cache hit does not allocate.
+using hash_key_t = c10::SmallVector<int64_t, 64>;
 /// Per-tensor cache specialization key targeting dynamic shapes. Records
 /// dtype, dispatch options, aliasing, and per-dim contiguity/broadcasting
 /// information.
@@ -95,12 +106,89 @@ enum HasherFlags {
   NONE_HASH,
   STATIC_HASH,
   DYNAMIC_HASH,
+  BUCKETED_HASH,
 };
 
-std::vector<int> genDimFlags(c10::IntArrayRef sizes, c10::IntArrayRef strides) {
+/// Hasher selected by the caller, parsed once per call instead of per
+/// argument.
+enum class HasherType {
+  STATIC,
+  DYNAMIC,
+  BUCKETED,
+};
+
+/// Rounding of chosen dimensions of the tensor arguments up to buckets, so
+/// that one specialization serves every shape of a bucket. dimMasks[i] has
+/// bit d set when dimension d of the i-th tensor argument is bucketed.
+struct ShapeBucketing {
+  ShapeBucketing(std::vector<uint64_t> dimMasks, int64_t multiple)
+      : dimMasks(std::move(dimMasks)), multiple(multiple) {
+    if (multiple < 0) {
+      throw std::runtime_error("multiple must be non-negative");
+    }
+  }
+
+  /// Round size up to a multiple of `multiple`, or to a power of two when
+  /// multiple is 0.
+  int64_t bucket(int64_t size) const {
+    if (size <= 1) {
+      return size;
+    }
+    if (multiple > 0) {
+      return (size + multiple - 1) / multiple * multiple;
+    }
+    int64_t rounded = 1;
+    while (rounded < size) {
+      rounded <<= 1;
+    }
+    return rounded;
+  }
+
+  uint64_t dimMask(int index) const {
+    return index < (int)dimMasks.size() ? dimMasks[index] : 0;
+  }
+
+  std::vector<uint64_t> dimMasks;
+  int64_t multiple;
+};
+
+struct Hasher {
+  HasherType type;
+  const ShapeBucketing *bucketing;
+};
+
+Hasher parseHasherType(PyObject *hasherType) {
+  py::handle handle(hasherType);
+  if (py::isinstance<ShapeBucketing>(handle)) {
+    return {HasherType::BUCKETED, handle.cast<const ShapeBucketing *>()};
+  }
+  if (PyLong_Check(hasherType)) {
+    long value = PyLong_AsLong(hasherType);
+    if (value == static_cast<long>(HasherType::STATIC) ||
+        value == static_cast<long>(HasherType::DYNAMIC)) {
+      return {static_cast<HasherType>(value), nullptr};
+    }
+  }
+  if (PyUnicode_Check(hasherType)) {
+    if (PyUnicode_CompareWithASCIIString(hasherType, "StaticShapeHasher") ==
+        0) {
+      return {HasherType::STATIC, nullptr};
+    }
+    if (PyUnicode_CompareWithASCIIString(hasherType, "DynamicShapeHasher") ==
+        0) {
+      return {HasherType::DYNAMIC, nullptr};
+    }
+  }
+  throw std::runtime_error("Unknown hasher type " +
+                           std::string(py::str(handle)) +
+                           ", bucketed hashers are given as ShapeBucketing");
+}
+
+void genDimFlags(c10::IntArrayRef sizes, c10::IntArrayRef strides,
+                 hash_key_t &hash) {
   // Pack all the properties for each dimension into a uint8.
   int nDims = sizes.size();
-  std::vector<int> dimflags(nDims);
+  uint8_t prevFlag = 0;
   for (int64_t dim = 0; dim < nDims; ++dim) {
     uint8_t flag =
         (sizes[dim] == 0 ? SIZE_MISSING
@@ -113,41 +201,81 @@ std::vector<int> genDimFlags(c10::IntArrayRef sizes, c10::IntArrayRef strides) {
                strides[dim] == strides[dim + 1] * sizes[dim + 1]) {
       flag |= STRIDE_CONTIGUOUS;
     } else if (dim > 0 && strides[dim] == strides[dim - 1] * sizes[dim - 1] &&
-               (dimflags[dim - 1] & STRIDE_CONTIGUOUS) == 0) {
+               (prevFlag & STRIDE_CONTIGUOUS) == 0) {
       flag |= STRIDE_TRANSPOSED_CONTIGUOUS;
     } else {
       flag |= STRIDE_AS_ARG;
     }
-    dimflags[dim] = flag;
+    hash.push_back(flag);
+    prevFlag = flag;
   }
-  return dimflags;
 }
 
-hash_key_t dynamic_hasher(const LocalState &state, const at::Tensor &v) {
-  hash_key_t hash = {DYNAMIC_HASH, static_cast<int>(packFlags(state, v)),
-                     static_cast<int>(state.apply(v.key_set()).raw_repr()),
-                     static_cast<int>(v.ndimension())};
-  auto dimFlags = genDimFlags(v.sizes(), v.strides());
-  hash.insert(hash.end(), dimFlags.begin(), dimFlags.end());
-  return hash;
+void dynamic_hasher(const LocalState &state, const at::Tensor &v,
+                    hash_key_t &hash) {
+  hash.push_back(DYNAMIC_HASH);
+  hash.push_back(static_cast<int>(packFlags(state, v)));
+  hash.push_back(static_cast<int>(state.apply(v.key_set()).raw_repr()));
+  hash.push_back(static_cast<int>(v.ndimension()));
+  genDimFlags(v.sizes(), v.strides(), hash);
 }
 
 /// Per-tensor cache specialization key targeting static shapes. Recordsdtype,
 /// dispatch options, aliasing, and full shapes and strides.
-hash_key_t static_hasher(const LocalState &state, const at::Tensor &v) {
-  hash_key_t hash = {STATIC_HASH, static_cast<int>(packFlags(state, v)),
-                     static_cast<int>(state.apply(v.key_set()).raw_repr()),
-                     static_cast<int>(v.ndimension())};
-  hash.insert(hash.end(), v.sizes().begin(), v.sizes().end());
-  hash.insert(hash.end(), v.strides().begin(), v.strides().end());
-  return hash;
+void static_hasher(const LocalState &state, const at::Tensor &v,
+                   hash_key_t &hash) {
+  hash.push_back(STATIC_HASH);
+  hash.push_back(static_cast<int>(packFlags(state, v)));
+  hash.push_back(static_cast<int>(state.apply(v.key_set()).raw_repr()));
+  hash.push_back(static_cast<int>(v.ndimension()));
+  hash.append(v.sizes().begin(), v.sizes().end());
+  hash.append(v.strides().begin(), v.strides().end());
+}
+
+/// Per-tensor cache specialization key targeting bucketed shapes. Records
+/// the static key, with the bucketed dimensions rounded up and per-dim
+/// stride flags, since the caller pads the tensor to the bucket.
+void bucketed_hasher(const LocalState &state, const at::Tensor &v,
+                     const ShapeBucketing &bucketing, uint64_t dimMask,
+                     hash_key_t &hash) {
+  hash.push_back(BUCKETED_HASH);
+  hash.push_back(static_cast<int>(packFlags(state, v)));
+  hash.push_back(static_cast<int>(state.apply(v.key_set()).raw_repr()));
+  hash.push_back(static_cast<int>(v.ndimension()));
+  for (int64_t dim = 0; dim < v.ndimension(); ++dim) {
+    int64_t size = v.sizes()[dim];
+    hash.push_back((dimMask >> dim) & 1 ? bucketing.bucket(size) : size);
+  }
+  genDimFlags(v.sizes(), v.strides(), hash);
 }
 
 /// ArgCompileCache is a templated class allowing plugging of different types of
 /// Hasher/Specialization Keys.
 struct CompileCache {
 public:
-  CompileCache() = default;
+  /// In concurrent mode the keys are spread over numShards maps with their
+  /// own reader/writer lock, and the lookup in at() releases the GIL.
+  ///
+  /// maxEntries and maxBytes bound the cache, maxEntriesPerId bounds the
+  /// specializations of a single function; 0 means unbounded. Beyond a
+  /// bound the least recently used entry is evicted. The bounds hold for the
+  /// whole cache, the victim is the least recently used entry of all shards.
+  CompileCache(bool concurrent = false, int64_t numShards = 16,
+               int64_t maxEntries = 0, int64_t maxBytes = 0,
+               int64_t maxEntriesPerId = 0)
+      : concurrent_(concurrent), maxEntries_(maxEntries), maxBytes_(maxBytes),
+        maxEntriesPerId_(maxEntriesPerId) {
+    if (numShards < 1) {
+      throw std::runtime_error("num_shards must be positive");
+    }
+    if (maxEntries < 0 || maxBytes < 0 || maxEntriesPerId < 0) {
+      throw std::runtime_error("cache limits must be non-negative");
+    }
+    int64_t n = concurrent ? numShards : 1;
+    for (int64_t i = 0; i < n; ++i) {
+      shards_.emplace_back(new Shard());
+    }
+  }
   ~CompileCache() = default;
 
   /// Array defining groups of aliased tensors.
@@ -163,54 +291,49 @@ public:
       return seed;
     }
   };
-  using Cache = std::unordered_map<hash_key_t, py::object, vector_hasher>;
 
-  /// Compute the set of specialization keys based on the inputs to
-  /// the kernel.
-  hash_key_t computeCacheKey(PyObject *args,
-                             const std::vector<at::Tensor> &tensorArgs,
-                             int numTensorArgs, const std::string &hasherType,
-                             int64_t id, int64_t fw_compiler_id,
-                             int64_t bw_compiler_id) {
-    LocalState state;
-    hash_key_t cacheKey;
-    for (int i = 0; i < numTensorArgs; ++i) {
-      if (tensorArgs[i].defined()) {
-        // Only hash the tensor when its defined.
-        if (hasherType == "StaticShapeHasher") {
-          auto res = static_hasher(state, tensorArgs[i]);
-          cacheKey.insert(cacheKey.end(), res.begin(), res.end());
-        } else if (hasherType == "DynamicShapeHasher") {
-          auto res = dynamic_hasher(state, tensorArgs[i]);
-          cacheKey.insert(cacheKey.end(), res.begin(), res.end());
-        }
-      } else {
-        // Add a value to the cacheKey to indicate a None tensor.
-        cacheKey.push_back(NONE_HASH);
-      }
-    }
-    cacheKey.push_back(id);
-    cacheKey.push_back(fw_compiler_id);
-    cacheKey.push_back(bw_compiler_id);
-    cacheKey.push_back(numTensorArgs);
+  /// Compiled function shared between the cache and lookups running without
+  /// the GIL. The last owner takes the GIL back to release the object.
+  using CacheValue = std::shared_ptr<PyObject>;
 
-    // Cache the non-tensor args. Currently, all the non-tensor args are cached.
-    for (int i = numTensorArgs; i < PyTuple_Size(args); i++) {
-      PyObject *arg = PyTuple_GET_ITEM(args, i);
-      assert(PyLong_Check(arg));
-      cacheKey.push_back(PyLong_AsLong(arg));
+  /// Entries are bucketed by the hash of their key, so a lookup hashes the
+  /// inline key once and compares it with the stored keys in place.
+  struct CacheEntry {
+    std::vector<int64_t> key;
+    CacheValue value;
+    int64_t id;
+    int64_t nbytes;
+
+    /// Tick of the last lookup, updated under the shared lock.
+    mutable std::atomic<uint64_t> lastUse;
+
+    bool matches(const hash_key_t &other) const {
+      return key.size() == other.size() &&
+             std::equal(other.begin(), other.end(), key.begin());
     }
-    return cacheKey;
+  };
+  using Bucket = std::vector<std::unique_ptr<CacheEntry>>;
+  using Cache = std::unordered_map<std::size_t, Bucket>;
+
+  static CacheValue makeCacheValue(const py::object &obj) {
+    return CacheValue(obj.inc_ref().ptr(), [](PyObject *ptr) {
+      py::gil_scoped_acquire acquire;
+      Py_DECREF(ptr);
+    });
   }
 
-  std::vector<at::Tensor> parsePythonArgs(int numTensorArgs, PyObject *args) {
-    // Convert to Tensor Args
-    std::vector<at::Tensor> tensorArgs(numTensorArgs);
+  /// Compute the set of specialization keys based on the inputs to
+  /// the kernel.
+  void computeCacheKey(PyObject *args, int numTensorArgs,
+                       const Hasher &hasher, int64_t id,
+                       int64_t fw_compiler_id, int64_t bw_compiler_id,
+                       hash_key_t &cacheKey) {
+    LocalState state;
     for (int i = 0; i < numTensorArgs; ++i) {
       PyObject *arg = PyTuple_GET_ITEM(args, i);
       if (arg == Py_None) {
-        // If an input tensor is None, add it as an undefined tensor.
-        tensorArgs[i] = at::Tensor();
+        // Add a value to the cacheKey to indicate a None tensor.
+        cacheKey.push_back(NONE_HASH);
       } else if (!THPVariable_Check(arg)) {
         // Fail if its a non-tensor arg. It should be marked static.
         std::string dtype = Py_TYPE(arg)->tp_name;
@@ -222,52 +345,445 @@ public:
                                  "mark the argument at index " +
                                  index + " static.");
       } else {
-        tensorArgs[i] = THPVariable_Unpack(arg);
+        // Hash the tensor in place, without taking a reference to it.
+        const at::Tensor &tensor = THPVariable_Unpack(arg);
+        const uint64_t dimMask =
+            hasher.bucketing ? hasher.bucketing->dimMask(i) : 0;
+        if (dimMask != 0) {
+          bucketed_hasher(state, tensor, *hasher.bucketing, dimMask, cacheKey);
+        } else if (hasher.type == HasherType::DYNAMIC) {
+          dynamic_hasher(state, tensor, cacheKey);
+        } else {
+          static_hasher(state, tensor, cacheKey);
+        }
       }
     }
-    return tensorArgs;
+    cacheKey.push_back(id);
+    cacheKey.push_back(fw_compiler_id);
+    cacheKey.push_back(bw_compiler_id);
+    cacheKey.push_back(numTensorArgs);
+
+    // Cache the non-tensor args. Currently, all the non-tensor args are cached.
+    for (int i = numTensorArgs; i < PyTuple_Size(args); i++) {
+      PyObject *arg = PyTuple_GET_ITEM(args, i);
+      assert(PyLong_Check(arg));
+      cacheKey.push_back(PyLong_AsLong(arg));
+    }
   }
 
   /// Check if the function has already been compiled.
   py::object at(int64_t id, int64_t fw_compiler_id, int64_t bw_compiler_id,
-                int numTensorArgs, const std::string &hasherType,
-                PyObject *args) {
-    std::vector<at::Tensor> tensorArgs = parsePythonArgs(numTensorArgs, args);
-    hash_key_t cacheKey =
-        computeCacheKey(args, tensorArgs, numTensorArgs, hasherType, id,
-                        fw_compiler_id, bw_compiler_id);
-
-    auto item = cache_.find(cacheKey); // protected by GIL
+                int numTensorArgs, PyObject *hasherType, PyObject *args) {
+    hash_key_t cacheKey;
+    Counters &counters = countersOf(id);
+    timeKey(counters, [&] {
+      computeCacheKey(args, numTensorArgs, parseHasherType(hasherType), id,
+                      fw_compiler_id, bw_compiler_id, cacheKey);
+    });
+    const std::size_t hash = vector_hasher()(cacheKey);
+
+    CacheValue item;
+    if (concurrent_) {
+      py::gil_scoped_release release;
+      item = find(cacheKey, hash);
+    } else {
+      item = find(cacheKey, hash); // protected by GIL
+    }
 
-    if (C10_LIKELY(item != cache_.end())) {
-      return item->second;
+    if (C10_LIKELY(item)) {
+      counters.hits++;
+      totals_.hits++;
+      trace("hit", id, cacheKey);
+      return py::reinterpret_borrow<py::object>(item.get());
     }
+    counters.misses++;
+    totals_.misses++;
+    trace("miss", id, cacheKey);
     return py::none();
   }
 
-  /// Insert a new compiled functions for new tensor properties.
+  /// Insert a new compiled functions for new tensor properties. nbytes is
+  /// the caller's estimate of the memory kept alive by the entry.
   void insert(int64_t id, int64_t fw_compiler_id, int64_t bw_compiler_id,
-              int numTensorArgs, const std::string &hasherType,
-              const py::object &compileFn, PyObject *args) {
-    std::vector<at::Tensor> tensorArgs = parsePythonArgs(numTensorArgs, args);
-    LocalState state;
-    hash_key_t cacheKey =
-        computeCacheKey(args, tensorArgs, numTensorArgs, hasherType, id,
-                        fw_compiler_id, bw_compiler_id);
-    cache_.emplace(cacheKey, compileFn);
+              int numTensorArgs, PyObject *hasherType,
+              const py::object &compileFn, PyObject *args,
+              int64_t nbytes = 0) {
+    hash_key_t cacheKey;
+    Counters &counters = countersOf(id);
+    timeKey(counters, [&] {
+      computeCacheKey(args, numTensorArgs, parseHasherType(hasherType), id,
+                      fw_compiler_id, bw_compiler_id, cacheKey);
+    });
+    const std::size_t hash = vector_hasher()(cacheKey);
+
+    std::unique_ptr<CacheEntry> entry(new CacheEntry());
+    entry->key.assign(cacheKey.begin(), cacheKey.end());
+    entry->value = makeCacheValue(compileFn);
+    entry->id = id;
+    entry->nbytes = nbytes;
+    entry->lastUse = tick();
+
+    // Evicted entries are released once no lock is held, their destructors
+    // may run arbitrary Python code.
+    std::vector<std::unique_ptr<CacheEntry>> evicted;
+    {
+      Shard &shard = shardOf(hash);
+      std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+      auto &bucket = shard.cache[hash];
+      for (auto &other : bucket) {
+        if (other->matches(cacheKey)) {
+          return;
+        }
+      }
+      bucket.push_back(std::move(entry));
+      shard.size++;
+      shard.nbytes += nbytes;
+      totalBytes_ += nbytes;
+      counters.inserts++;
+      counters.entries++;
+      totals_.inserts++;
+      totals_.entries++;
+    }
+    while ((maxEntries_ > 0 && totals_.entries > maxEntries_) ||
+           (maxBytes_ > 0 && totalBytes_ > maxBytes_ && totals_.entries > 1)) {
+      auto victim = evictOldest(nullptr);
+      if (!victim) {
+        break;
+      }
+      evicted.push_back(std::move(victim));
+    }
+    if (maxEntriesPerId_ > 0) {
+      while (counters.entries > maxEntriesPerId_) {
+        auto victim = evictOldest(&id);
+        if (!victim) {
+          break;
+        }
+        evicted.push_back(std::move(victim));
+      }
+    }
+
+    trace("insert", id, cacheKey);
+    for (auto &victim : evicted) {
+      trace("evict", victim->id, victim->key);
+    }
+  }
+
+  /// Record the time the caller spent compiling an entry of a function.
+  void recordCompileTime(int64_t id, double seconds) {
+    const auto ns = static_cast<int64_t>(seconds * 1e9);
+    countersOf(id).compileTimeNs += ns;
+    totals_.compileTimeNs += ns;
+    if (traceHook_) {
+      traceHook_("compile", id, py::float_(seconds));
+    }
+  }
+
+  /// Global counters, and the counters of every function under "functions".
+  py::dict stats() const {
+    py::dict result = totals_.toDict();
+    py::dict functions;
+    std::shared_lock<std::shared_timed_mutex> lock(countersMutex_);
+    for (auto &item : counters_) {
+      functions[py::int_(item.first)] = item.second->toDict();
+    }
+    result["functions"] = functions;
+    return result;
+  }
+
+  /// Reset the counters, the entries are kept.
+  void resetStats() {
+    std::shared_lock<std::shared_timed_mutex> lock(countersMutex_);
+    totals_.reset();
+    for (auto &item : counters_) {
+      item.second->reset();
+    }
+  }
+
+  /// Called with (event, id, key) on every "hit", "miss", "insert" and
+  /// "evict", and with (event, id, seconds) on "compile". None disables it.
+  void setTraceHook(py::object hook) {
+    traceHook_ = hook.is_none() ? py::object() : std::move(hook);
   }
 
-  const int64_t size() const { return cache_.size(); }
+  /// Specialization key of the arguments, to name entries outside of the
+  /// process. Ids should be stable values for that purpose.
+  py::tuple key(int64_t id, int64_t fw_compiler_id, int64_t bw_compiler_id,
+                int numTensorArgs, PyObject *hasherType, PyObject *args) {
+    hash_key_t cacheKey;
+    computeCacheKey(args, numTensorArgs, parseHasherType(hasherType), id,
+                    fw_compiler_id, bw_compiler_id, cacheKey);
+    py::tuple result(cacheKey.size());
+    for (size_t i = 0; i < cacheKey.size(); ++i) {
+      result[i] = py::int_(cacheKey[i]);
+    }
+    return result;
+  }
+
+  /// Specialization keys of the entries of a function. With a bucketed
+  /// hasher they record the bucket every entry serves.
+  py::list keys(int64_t id) const {
+    std::vector<std::vector<int64_t>> keys;
+    for (auto &shard : shards_) {
+      std::shared_lock<std::shared_timed_mutex> lock(shard->mutex);
+      for (auto &bucket : shard->cache) {
+        for (auto &entry : bucket.second) {
+          if (entry->id == id) {
+            keys.push_back(entry->key);
+          }
+        }
+      }
+    }
+
+    py::list result;
+    for (auto &key : keys) {
+      py::tuple item(key.size());
+      for (size_t i = 0; i < key.size(); ++i) {
+        item[i] = py::int_(key[i]);
+      }
+      result.append(item);
+    }
+    return result;
+  }
+
+  const int64_t size() const {
+    int64_t size = 0;
+    for (auto &shard : shards_) {
+      std::shared_lock<std::shared_timed_mutex> lock(shard->mutex);
+      size += shard->size;
+    }
+    return size;
+  }
+
+  /// Estimated memory kept alive by the entries.
+  const int64_t nbytes() const {
+    int64_t nbytes = 0;
+    for (auto &shard : shards_) {
+      std::shared_lock<std::shared_timed_mutex> lock(shard->mutex);
+      nbytes += shard->nbytes;
+    }
+    return nbytes;
+  }
+
+  /// Number of entries evicted since the cache was created.
+  const int64_t evictions() const { return totals_.evictions; }
 
   /// Clear the cache.
-  void clear() { cache_.clear(); }
+  void clear() {
+    for (auto &shard : shards_) {
+      // Release the compiled functions outside of the lock, their
+      // destructors may run arbitrary Python code.
+      Cache entries;
+      {
+        std::unique_lock<std::shared_timed_mutex> lock(shard->mutex);
+        entries.swap(shard->cache);
+        shard->size = 0;
+        shard->nbytes = 0;
+      }
+    }
+    totalBytes_ = 0;
+    std::shared_lock<std::shared_timed_mutex> lock(countersMutex_);
+    totals_.entries = 0;
+    for (auto &item : counters_) {
+      item.second->entries = 0;
+    }
+  }
 
 private:
-  /// Compilation cache holding key and the compiled function.
-  Cache cache_;
+  struct Shard {
+    mutable std::shared_timed_mutex mutex;
+    Cache cache;
+    int64_t size = 0;
+    int64_t nbytes = 0;
+  };
+
+  /// Counters of the cache or of a single function id. Entries are the
+  /// live specializations, the others accumulate since the last reset.
+  struct Counters {
+    std::atomic<int64_t> hits{0};
+    std::atomic<int64_t> misses{0};
+    std::atomic<int64_t> inserts{0};
+    std::atomic<int64_t> evictions{0};
+    std::atomic<int64_t> entries{0};
+    std::atomic<int64_t> keyTimeNs{0};
+    std::atomic<int64_t> compileTimeNs{0};
+
+    void reset() {
+      hits = 0;
+      misses = 0;
+      inserts = 0;
+      evictions = 0;
+      keyTimeNs = 0;
+      compileTimeNs = 0;
+    }
+
+    py::dict toDict() const {
+      py::dict result;
+      result["hits"] = hits.load();
+      result["misses"] = misses.load();
+      result["inserts"] = inserts.load();
+      result["evictions"] = evictions.load();
+      result["entries"] = entries.load();
+      result["key_time"] = keyTimeNs.load() * 1e-9;
+      result["compile_time"] = compileTimeNs.load() * 1e-9;
+      return result;
+    }
+  };
+
+  uint64_t tick() const { return clock_.fetch_add(1) + 1; }
+
+  Counters &countersOf(int64_t id) {
+    {
+      std::shared_lock<std::shared_timed_mutex> lock(countersMutex_);
+      auto counters = counters_.find(id);
+      if (C10_LIKELY(counters != counters_.end())) {
+        return *counters->second;
+      }
+    }
+    std::unique_lock<std::shared_timed_mutex> lock(countersMutex_);
+    auto &counters = counters_[id];
+    if (!counters) {
+      counters.reset(new Counters());
+    }
+    return *counters;
+  }
+
+  template <typename F> void timeKey(Counters &counters, const F &computeKey) {
+    const auto start = std::chrono::steady_clock::now();
+    computeKey();
+    const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    counters.keyTimeNs += ns;
+    totals_.keyTimeNs += ns;
+  }
+
+  template <typename Key>
+  void trace(const char *event, int64_t id, const Key &key) {
+    if (C10_LIKELY(!traceHook_)) {
+      return;
+    }
+    py::tuple item(key.size());
+    for (size_t i = 0; i < key.size(); ++i) {
+      item[i] = py::int_(key[i]);
+    }
+    traceHook_(event, id, item);
+  }
+
+  /// Remove the least recently used entry of the shard, of the function id
+  /// when given. The exclusive lock of the shard must be held.
+  std::unique_ptr<CacheEntry> evictLocked(Shard &shard, const int64_t *id) {
+    Cache::iterator victimBucket = shard.cache.end();
+    size_t victimIndex = 0;
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (auto bucket = shard.cache.begin(); bucket != shard.cache.end();
+         ++bucket) {
+      for (size_t i = 0; i < bucket->second.size(); ++i) {
+        const CacheEntry &entry = *bucket->second[i];
+        const uint64_t lastUse = entry.lastUse.load();
+        if ((id == nullptr || entry.id == *id) && lastUse < oldest) {
+          oldest = lastUse;
+          victimBucket = bucket;
+          victimIndex = i;
+        }
+      }
+    }
+    if (victimBucket == shard.cache.end()) {
+      return nullptr;
+    }
+
+    Bucket &bucket = victimBucket->second;
+    std::unique_ptr<CacheEntry> victim = std::move(bucket[victimIndex]);
+    bucket.erase(bucket.begin() + victimIndex);
+    if (bucket.empty()) {
+      shard.cache.erase(victimBucket);
+    }
+    shard.size--;
+    shard.nbytes -= victim->nbytes;
+    totalBytes_ -= victim->nbytes;
+    Counters &counters = countersOf(victim->id);
+    counters.entries--;
+    counters.evictions++;
+    totals_.entries--;
+    totals_.evictions++;
+    return victim;
+  }
+
+  /// Remove the least recently used entry of all shards, of the function id
+  /// when given.
+  std::unique_ptr<CacheEntry> evictOldest(const int64_t *id) {
+    Shard *victimShard = nullptr;
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (auto &shard : shards_) {
+      std::shared_lock<std::shared_timed_mutex> lock(shard->mutex);
+      for (auto &bucket : shard->cache) {
+        for (auto &entry : bucket.second) {
+          const uint64_t lastUse = entry->lastUse.load();
+          if ((id == nullptr || entry->id == *id) && lastUse < oldest) {
+            oldest = lastUse;
+            victimShard = shard.get();
+          }
+        }
+      }
+    }
+    if (victimShard == nullptr) {
+      return nullptr;
+    }
+    std::unique_lock<std::shared_timed_mutex> lock(victimShard->mutex);
+    return evictLocked(*victimShard, id);
+  }
+
+  Shard &shardOf(std::size_t hash) const {
+    return *shards_[hash % shards_.size()];
+  }
+
+  CacheValue find(const hash_key_t &key, std::size_t hash) const {
+    Shard &shard = shardOf(hash);
+    std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+    auto bucket = shard.cache.find(hash);
+    if (bucket != shard.cache.end()) {
+      for (auto &entry : bucket->second) {
+        if (entry->matches(key)) {
+          entry->lastUse.store(tick(), std::memory_order_relaxed);
+          return entry->value;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  /// Whether lookups release the GIL.
+  bool concurrent_;
+
+  /// Bounds of the cache, 0 when unbounded.
+  int64_t maxEntries_;
+  int64_t maxBytes_;
+  int64_t maxEntriesPerId_;
+
+  /// Estimated memory of all shards, checked against maxBytes_.
+  std::atomic<int64_t> totalBytes_{0};
+
+  /// Clock ordering the lookups for LRU eviction.
+  mutable std::atomic<uint64_t> clock_{0};
+
+  /// Counters of the cache and of every function id.
+  Counters totals_;
+  mutable std::shared_timed_mutex countersMutex_;
+  std::unordered_map<int64_t, std::unique_ptr<Counters>> counters_;
+
+  /// Optional Python callable traced with the cache events, GIL protected.
+  py::object traceHook_;
+
+  /// Compilation cache holding key and the compiled function, split in
+  /// shards by the hash of the key.
+  std::vector<std::unique_ptr<Shard>> shards_;
 };
 
-static CompileCache *createCompileCache() { return new CompileCache(); }
+static CompileCache *createCompileCache(bool concurrent, int64_t numShards,
+                                        int64_t maxEntries, int64_t maxBytes,
+                                        int64_t maxEntriesPerId) {
+  return new CompileCache(concurrent, numShards, maxEntries, maxBytes,
+                          maxEntriesPerId);
+}
 
 } // namespace
 
@@ -276,25 +792,85 @@ namespace functorch {
 
 void initCompileCacheBindings(PyObject *module) {
   py::handle te(module);
+  py::enum_<HasherType>(te, "HasherType")
+      .value("StaticShapeHasher", HasherType::STATIC)
+      .value("DynamicShapeHasher", HasherType::DYNAMIC)
+      .value("BucketedShapeHasher", HasherType::BUCKETED);
+  py::class_<ShapeBucketing>(te, "ShapeBucketing")
+      .def(py::init([](const std::map<int, std::vector<int>> &argDims,
+                       int64_t multiple) {
+             std::vector<uint64_t> dimMasks;
+             for (auto &item : argDims) {
+               if (item.first < 0) {
+                 throw std::runtime_error(
+                     "argument index must be non-negative");
+               }
+               if (item.first >= (int)dimMasks.size()) {
+                 dimMasks.resize(item.first + 1, 0);
+               }
+               for (int dim : item.second) {
+                 if (dim < 0 || dim >= 64) {
+                   throw std::runtime_error("bucketed dim must be in [0, 64)");
+                 }
+                 dimMasks[item.first] |= uint64_t(1) << dim;
+               }
+             }
+             return new ShapeBucketing(std::move(dimMasks), multiple);
+           }),
+           py::arg("arg_dims"), py::arg("multiple") = 0)
+      .def("bucket", &ShapeBucketing::bucket)
+      .def("dims", [](const ShapeBucketing &self, int index) {
+        std::vector<int> dims;
+        for (int dim = 0; dim < 64; ++dim) {
+          if ((self.dimMask(index) >> dim) & 1) {
+            dims.push_back(dim);
+          }
+        }
+        return dims;
+      });
   py::class_<CompileCache>(te, "CompileCache")
-      .def(py::init(&createCompileCache))
+      .def(py::init(&createCompileCache), py::arg("concurrent") = false,
+           py::arg("num_shards") = 16, py::arg("max_entries") = 0,
+           py::arg("max_bytes") = 0, py::arg("max_entries_per_id") = 0)
       .def("at",
            [](CompileCache &self, int64_t id, int64_t fw_compiler_id,
-              int64_t bw_compiler_id, int numTensorArgs,
-              const std::string &hasherType, py::args args) {
+              int64_t bw_compiler_id, int numTensorArgs, py::handle hasherType,
+              py::args args) {
              return self.at(id, fw_compiler_id, bw_compiler_id, numTensorArgs,
-                            hasherType, args.ptr());
+                            hasherType.ptr(), args.ptr());
            })
       .def("insert",
            [](CompileCache &self, int64_t id, int64_t fw_compiler_id,
-              int64_t bw_compiler_id, int numTensorArgs,
-              const std::string &hasherType, const py::object &compileFn,
-              py::args args, py::kwargs kwargs) {
+              int64_t bw_compiler_id, int numTensorArgs, py::handle hasherType,
+              const py::object &compileFn, py::args args, py::kwargs kwargs) {
+             int64_t nbytes = kwargs.contains("nbytes")
+                                  ? kwargs["nbytes"].cast<int64_t>()
+                                  : 0;
              self.insert(id, fw_compiler_id, bw_compiler_id, numTensorArgs,
-                         hasherType, compileFn, args.ptr());
+                         hasherType.ptr(), compileFn, args.ptr(), nbytes);
            })
+      .def("key",
+           [](CompileCache &self, int64_t id, int64_t fw_compiler_id,
+              int64_t bw_compiler_id, int numTensorArgs, py::handle hasherType,
+              py::args args) {
+             return self.key(id, fw_compiler_id, bw_compiler_id, numTensorArgs,
+                             hasherType.ptr(), args.ptr());
+           })
+      .def("keys",
+           [](CompileCache &self, int64_t id) { return self.keys(id); })
       .def("clear", [](CompileCache &self) { self.clear(); })
-      .def("size", [](CompileCache &self) { return self.size(); });
+      .def("size", [](CompileCache &self) { return self.size(); })
+      .def("nbytes", [](CompileCache &self) { return self.nbytes(); })
+      .def("evictions", [](CompileCache &self) { return self.evictions(); })
+      .def("record_compile_time",
+           [](CompileCache &self, int64_t id, double seconds) {
+             self.recordCompileTime(id, seconds);
+           })
+      .def("stats", [](CompileCache &self) { return self.stats(); })
+      .def("reset_stats", [](CompileCache &self) { self.resetStats(); })
+      .def("set_trace_hook", [](CompileCache &self, py::object hook) {
+        self.setTraceHook(std::move(hook));
+      });
 }
 
 } // namespace functorch
@@ -0,0 +1,232 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+
+/*
+Kernel implementation for the fused bias add and GeLU activation.
+*/
+
+#include "ATen/ATen.h"
+#include "ATen/cuda/CUDAContext.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include "type_shim.h"
+
+namespace {
+// Elements of a thread are loaded and stored as a single access.
+template <typename T, int N> struct alignas(sizeof(T) * N) VecT {
+  T val[N];
+};
+
+constexpr float kAlpha = 0.7978845608028654f; // sqrt(2 / pi)
+constexpr float kBeta = 0.044715f;
+constexpr float kInvSqrt2 = 0.7071067811865476f;
+constexpr float kInvSqrt2Pi = 0.3989422804014327f;
+
+__device__ __forceinline__ float cuGeLU(float x, bool approximate) {
+  if (approximate) {
+    return 0.5f * x * (1.f + tanhf(kAlpha * x * (1.f + kBeta * x * x)));
+  }
+  return 0.5f * x * (1.f + erff(x * kInvSqrt2));
+}
+
+__device__ __forceinline__ float cuGeLUDerivative(float x, bool approximate) {
+  if (approximate) {
+    const float tanh_out = tanhf(kAlpha * x * (1.f + kBeta * x * x));
+    return 0.5f * x * (1.f - tanh_out * tanh_out) *
+               (kAlpha + 3.f * kAlpha * kBeta * x * x) +
+           0.5f * (1.f + tanh_out);
+  }
+  return 0.5f * (1.f + erff(x * kInvSqrt2)) +
+         x * kInvSqrt2Pi * expf(-0.5f * x * x);
+}
+
+// output = gelu(input + bias), with the bias broadcast over rows of n2
+// elements. The derivative is stored too when it is not null, so that the
+// backward does not recompute it.
+template <typename T, int VEC>
+__global__ void
+cuBiasGeLUForward(T *__restrict__ output, T *__restrict__ derivative,
+                  const T *__restrict__ input, const T *__restrict__ bias,
+                  int64_t numel, int n2, bool approximate) {
+  using Vec = VecT<T, VEC>;
+  const int64_t stride = (int64_t)gridDim.x * blockDim.x;
+  for (int64_t v = (int64_t)blockIdx.x * blockDim.x + threadIdx.x;
+       v < numel / VEC; v += stride) {
+    const Vec in = reinterpret_cast<const Vec *>(input)[v];
+    const int col = (int)((v * VEC) % n2);
+    Vec out, der;
+#pragma unroll
+    for (int k = 0; k < VEC; ++k) {
+      float x = static_cast<float>(in.val[k]);
+      if (bias != nullptr) {
+        x += static_cast<float>(bias[col + k]);
+      }
+      out.val[k] = static_cast<T>(cuGeLU(x, approximate));
+      if (derivative != nullptr) {
+        der.val[k] = static_cast<T>(cuGeLUDerivative(x, approximate));
+      }
+    }
+    reinterpret_cast<Vec *>(output)[v] = out;
+    if (derivative != nullptr) {
+      reinterpret_cast<Vec *>(derivative)[v] = der;
+    }
+  }
+}
+
+// grad_input = grad_output * gelu'(input + bias), from the derivative saved
+// by the forward when it is not null.
+template <typename T, int VEC>
+__global__ void cuBiasGeLUBackward(T *__restrict__ grad_input,
+                                   const T *__restrict__ grad_output,
+                                   const T *__restrict__ input,
+                                   const T *__restrict__ bias,
+                                   const T *__restrict__ derivative,
+                                   int64_t numel, int n2, bool approximate) {
+  using Vec = VecT<T, VEC>;
+  const int64_t stride = (int64_t)gridDim.x * blockDim.x;
+  for (int64_t v = (int64_t)blockIdx.x * blockDim.x + threadIdx.x;
+       v < numel / VEC; v += stride) {
+    const Vec grad = reinterpret_cast<const Vec *>(grad_output)[v];
+    Vec saved;
+    if (derivative != nullptr) {
+      saved = reinterpret_cast<const Vec *>(derivative)[v];
+    } else {
+      saved = reinterpret_cast<const Vec *>(input)[v];
+    }
+    const int col = (int)((v * VEC) % n2);
+    Vec out;
+#pragma unroll
+    for (int k = 0; k < VEC; ++k) {
+      float der;
+      if (derivative != nullptr) {
+        der = static_cast<float>(saved.val[k]);
+      } else {
+        float x = static_cast<float>(saved.val[k]);
+        if (bias != nullptr) {
+          x += static_cast<float>(bias[col + k]);
+        }
+        der = cuGeLUDerivative(x, approximate);
+      }
+      out.val[k] = static_cast<T>(static_cast<float>(grad.val[k]) * der);
+    }
+    reinterpret_cast<Vec *>(grad_input)[v] = out;
+  }
+}
+
+// Number of elements per access, 16 bytes when every pointer is aligned and
+// rows are made of whole vectors so that a vector never straddles two rows.
+template <typename T>
+int GetVectorSize(std::initializer_list<const void *> ptrs, int n2) {
+  int vec = 16 / sizeof(T);
+  for (const void *ptr : ptrs) {
+    const auto addr = reinterpret_cast<uintptr_t>(ptr);
+    while (addr % (vec * sizeof(T)) != 0)
+      vec /= 2;
+  }
+  while (n2 % vec != 0)
+    vec /= 2;
+  return vec;
+}
+
+dim3 GetGeLUGrid(int64_t numel, int vec, int threads) {
+  const int64_t max_blocks =
+      at::cuda::getCurrentDeviceProperties()->multiProcessorCount * 8;
+  const int64_t blocks = (numel / vec + threads - 1) / threads;
+  return dim3(std::max<int64_t>(1, std::min(blocks, max_blocks)));
+}
+
+template <typename T>
+void HostApplyBiasGeLU(T *output, T *derivative, const T *input, const T *bias,
+                       int64_t numel, int n2, bool approximate) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int threads = 256;
+  const int vec = GetVectorSize<T>({output, derivative, input}, n2);
+  const dim3 blocks = GetGeLUGrid(numel, vec, threads);
+  switch (vec) {
+  case 8:
+    cuBiasGeLUForward<T, 8><<<blocks, threads, 0, stream>>>(
+        output, derivative, input, bias, numel, n2, approximate);
+    break;
+  case 4:
+    cuBiasGeLUForward<T, 4><<<blocks, threads, 0, stream>>>(
+        output, derivative, input, bias, numel, n2, approximate);
+    break;
+  case 2:
+    cuBiasGeLUForward<T, 2><<<blocks, threads, 0, stream>>>(
+        output, derivative, input, bias, numel, n2, approximate);
+    break;
+  default:
+    cuBiasGeLUForward<T, 1><<<blocks, threads, 0, stream>>>(
+        output, derivative, input, bias, numel, n2, approximate);
+  }
+}
+
+template <typename T>
+void HostBiasGeLUGradient(T *grad_input, const T *grad_output, const T *input,
+                          const T *bias, const T *derivative, int64_t numel,
+                          int n2, bool approximate) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int threads = 256;
+  const int vec = GetVectorSize<T>(
+      {grad_input, grad_output, derivative != nullptr ? derivative : input},
+      n2);
+  const dim3 blocks = GetGeLUGrid(numel, vec, threads);
+  switch (vec) {
+  case 8:
+    cuBiasGeLUBackward<T, 8><<<blocks, threads, 0, stream>>>(
+        grad_input, grad_output, input, bias, derivative, numel, n2,
+        approximate);
+    break;
+  case 4:
+    cuBiasGeLUBackward<T, 4><<<blocks, threads, 0, stream>>>(
+        grad_input, grad_output, input, bias, derivative, numel, n2,
+        approximate);
+    break;
+  case 2:
+    cuBiasGeLUBackward<T, 2><<<blocks, threads, 0, stream>>>(
+        grad_input, grad_output, input, bias, derivative, numel, n2,
+        approximate);
+    break;
+  default:
+    cuBiasGeLUBackward<T, 1><<<blocks, threads, 0, stream>>>(
+        grad_input, grad_output, input, bias, derivative, numel, n2,
+        approximate);
+  }
+}
+} // namespace
+
+// 'derivative' and 'bias' are skipped when they are NULL.
+void cuda_bias_gelu(at::Tensor *output, at::Tensor *derivative,
+                    at::Tensor *input, at::Tensor *bias, int n2,
+                    bool approximate) {
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      input->scalar_type(), 0, "cuBiasGeLUForward",
+      HostApplyBiasGeLU<scalar_t_0>(
+          output->DATA_PTR<scalar_t_0>(),
+          derivative != NULL ? derivative->DATA_PTR<scalar_t_0>() : NULL,
+          input->DATA_PTR<scalar_t_0>(),
+          bias != NULL ? bias->DATA_PTR<scalar_t_0>() : NULL, input->numel(),
+          n2, approximate);)
+}
+
+// The derivative saved by cuda_bias_gelu is used instead of 'input' and
+// 'bias' when it is not NULL.
+void cuda_bias_gelu_gradient(at::Tensor *grad_input, at::Tensor *grad_output,
+                             at::Tensor *input, at::Tensor *bias,
+                             at::Tensor *derivative, int n2,
+                             bool approximate) {
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      grad_output->scalar_type(), 0, "cuBiasGeLUBackward",
+      HostBiasGeLUGradient<scalar_t_0>(
+          grad_input->DATA_PTR<scalar_t_0>(),
+          grad_output->DATA_PTR<scalar_t_0>(),
+          input != NULL ? input->DATA_PTR<scalar_t_0>() : NULL,
+          bias != NULL ? bias->DATA_PTR<scalar_t_0>() : NULL,
+          derivative != NULL ? derivative->DATA_PTR<scalar_t_0>() : NULL,
+          grad_output->numel(), n2, approximate);)
+}
@@ -0,0 +1,272 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+
+/*
+Kernel implementation for packing checkpointed activations into flat buffers,
+optionally quantized to int8 or int4 codes with blockwise absmax scales.
+*/
+
+#include <ATen/cuda/CUDAContext.h>
+#include <algorithm>
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <mutex>
+#include <string>
+#include <torch/extension.h>
+#include <unordered_map>
+
+#include "CheckpointPartition.h"
+
+namespace {
+// Layout of a row of the int64 segments tensor built on the host.
+struct CopySegment {
+  const char *src;
+  char *dst;
+  int64_t bytes;
+};
+
+// One row of blocks per segment. Segments whose both ends are 16 byte
+// aligned are copied with 16 byte accesses, the tail byte by byte.
+__global__ void cuCopySegments(const CopySegment *__restrict__ segments) {
+  const CopySegment segment = segments[blockIdx.y];
+  const int64_t stride = (int64_t)gridDim.x * blockDim.x;
+  const int64_t tid = (int64_t)blockIdx.x * blockDim.x + threadIdx.x;
+
+  int64_t copied = 0;
+  const auto src_addr = reinterpret_cast<uintptr_t>(segment.src);
+  const auto dst_addr = reinterpret_cast<uintptr_t>(segment.dst);
+  if (((src_addr | dst_addr) & 15) == 0) {
+    const int64_t vecs = segment.bytes / 16;
+    const uint4 *src = reinterpret_cast<const uint4 *>(segment.src);
+    uint4 *dst = reinterpret_cast<uint4 *>(segment.dst);
+    for (int64_t i = tid; i < vecs; i += stride) {
+      dst[i] = src[i];
+    }
+    copied = vecs * 16;
+  }
+  for (int64_t i = copied + tid; i < segment.bytes; i += stride) {
+    segment.dst[i] = segment.src[i];
+  }
+}
+
+// Layout of a row of the int64 segments tensor of quantized copies. The
+// source is the activations and the destination the codes when quantizing,
+// the other way around when dequantizing.
+struct QuantSegment {
+  const char *src;
+  char *dst;
+  float *scales;
+  int64_t numel;
+  int64_t dtype;
+};
+
+__device__ __forceinline__ float cuLoadActivation(const char *ptr, int64_t i,
+                                                  int64_t dtype) {
+  switch (dtype) {
+  case ACTIVATION_HALF:
+    return static_cast<float>(reinterpret_cast<const at::Half *>(ptr)[i]);
+  case ACTIVATION_BFLOAT16:
+    return static_cast<float>(reinterpret_cast<const at::BFloat16 *>(ptr)[i]);
+  default:
+    return reinterpret_cast<const float *>(ptr)[i];
+  }
+}
+
+__device__ __forceinline__ void cuStoreActivation(char *ptr, int64_t i,
+                                                  int64_t dtype, float value) {
+  switch (dtype) {
+  case ACTIVATION_HALF:
+    reinterpret_cast<at::Half *>(ptr)[i] = static_cast<at::Half>(value);
+    break;
+  case ACTIVATION_BFLOAT16:
+    reinterpret_cast<at::BFloat16 *>(ptr)[i] = static_cast<at::BFloat16>(value);
+    break;
+  default:
+    reinterpret_cast<float *>(ptr)[i] = value;
+  }
+}
+
+// One thread per element of a quantization block, blocks of a segment are
+// strided over gridDim.x. 4 bit codes are packed two per byte, the even
+// element in the low nibble.
+template <int Bits>
+__global__ void cuQuantizeSegments(const QuantSegment *__restrict__ segments) {
+  constexpr float qmax = (1 << (Bits - 1)) - 1;
+  constexpr int warps = kQuantBlockSize / 32;
+  __shared__ float warp_absmax[warps];
+
+  const QuantSegment segment = segments[blockIdx.y];
+  const int64_t num_blocks =
+      (segment.numel + kQuantBlockSize - 1) / kQuantBlockSize;
+  const int lane = threadIdx.x % 32;
+  const int warp = threadIdx.x / 32;
+
+  for (int64_t block = blockIdx.x; block < num_blocks; block += gridDim.x) {
+    const int64_t i = block * kQuantBlockSize + threadIdx.x;
+    const float value =
+        i < segment.numel ? cuLoadActivation(segment.src, i, segment.dtype)
+                          : 0.f;
+
+    float absmax = fabsf(value);
+    for (int offset = 16; offset > 0; offset /= 2) {
+      absmax = fmaxf(absmax, __shfl_xor_sync(0xffffffff, absmax, offset));
+    }
+    if (lane == 0) {
+      warp_absmax[warp] = absmax;
+    }
+    __syncthreads();
+    absmax = warp_absmax[0];
+    for (int w = 1; w < warps; ++w) {
+      absmax = fmaxf(absmax, warp_absmax[w]);
+    }
+    // the next block overwrites the maxima
+    __syncthreads();
+
+    const float scale = absmax / qmax;
+    int code = scale > 0.f ? __float2int_rn(value / scale) : 0;
+    code = max(-(int)qmax, min((int)qmax, code));
+    if (threadIdx.x == 0) {
+      segment.scales[block] = scale;
+    }
+
+    if (Bits == 8) {
+      if (i < segment.numel) {
+        reinterpret_cast<int8_t *>(segment.dst)[i] = (int8_t)code;
+      }
+    } else {
+      const int next = __shfl_down_sync(0xffffffff, code, 1);
+      if (threadIdx.x % 2 == 0 && i < segment.numel) {
+        segment.dst[i / 2] = (char)((code & 15) | ((next & 15) << 4));
+      }
+    }
+  }
+}
+
+template <int Bits>
+__global__ void
+cuDequantizeSegments(const QuantSegment *__restrict__ segments) {
+  const QuantSegment segment = segments[blockIdx.y];
+  const int64_t stride = (int64_t)gridDim.x * blockDim.x;
+  for (int64_t i = (int64_t)blockIdx.x * blockDim.x + threadIdx.x;
+       i < segment.numel; i += stride) {
+    int code;
+    if (Bits == 8) {
+      code = reinterpret_cast<const int8_t *>(segment.src)[i];
+    } else {
+      const int byte = reinterpret_cast<const uint8_t *>(segment.src)[i / 2];
+      code = i % 2 == 0 ? byte & 15 : byte >> 4;
+      code = code >= 8 ? code - 16 : code;
+    }
+    const float value = code * segment.scales[i / kQuantBlockSize];
+    cuStoreActivation(segment.dst, i, segment.dtype, value);
+  }
+}
+
+// Device copies of the segment tables uploaded on a stream. The caching
+// allocator hands the same addresses to the activations of every step, so
+// the tables of a layer repeat and are uploaded once.
+constexpr size_t kMaxCachedSegmentTables = 256;
+
+struct SegmentTableCache {
+  std::mutex mutex;
+  std::unordered_map<std::string, torch::Tensor> tables;
+};
+
+// Segments are built on the host, the pinned copy does not synchronize.
+torch::Tensor uploadSegments(torch::Tensor segments, torch::Device device) {
+  const int max_segments =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  TORCH_CHECK(segments.size(0) <= max_segments,
+              "too many checkpointed activations to pack at once");
+
+  // a table is only reused on the stream that uploaded it, where the
+  // launches reading it are ordered before the one that replaces it
+  const int64_t stream_key[2] = {
+      device.index(), at::cuda::getCurrentCUDAStream(device.index()).id()};
+  auto contiguous = segments.contiguous();
+  std::string key(reinterpret_cast<const char *>(stream_key),
+                  sizeof(stream_key));
+  key.append(reinterpret_cast<const char *>(contiguous.data_ptr<int64_t>()),
+             contiguous.numel() * sizeof(int64_t));
+
+  static SegmentTableCache cache;
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto it = cache.tables.find(key);
+  if (it != cache.tables.end()) {
+    return it->second;
+  }
+  if (cache.tables.size() >= kMaxCachedSegmentTables) {
+    cache.tables.clear();
+  }
+  auto uploaded = contiguous.pin_memory().to(device, /*non_blocking=*/true);
+  cache.tables.emplace(std::move(key), uploaded);
+  return uploaded;
+}
+
+dim3 segmentsGrid(int64_t num_segments, int64_t max_blocks) {
+  return dim3(std::min<int64_t>(std::max<int64_t>(max_blocks, 1), 1024),
+              num_segments);
+}
+} // namespace
+
+// Copy every (src, dst, bytes) row of the CPU int64 tensor 'segments' in a
+// single launch on the current stream of 'device'.
+void checkpoint_copy_segments_cuda(torch::Tensor segments, int64_t max_bytes,
+                                   torch::Device device) {
+  if (segments.size(0) == 0 || max_bytes == 0) {
+    return;
+  }
+  auto device_segments = uploadSegments(segments, device);
+
+  const int threads = 256;
+  const dim3 grid = segmentsGrid(segments.size(0),
+                                 (max_bytes / 16 + threads - 1) / threads);
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  cuCopySegments<<<grid, threads, 0, stream>>>(
+      reinterpret_cast<const CopySegment *>(
+          device_segments.data_ptr<int64_t>()));
+}
+
+void checkpoint_quantize_segments_cuda(torch::Tensor segments,
+                                       int64_t max_numel, int bits,
+                                       torch::Device device) {
+  if (segments.size(0) == 0 || max_numel == 0) {
+    return;
+  }
+  auto device_segments = uploadSegments(segments, device);
+  auto *quant_segments = reinterpret_cast<const QuantSegment *>(
+      device_segments.data_ptr<int64_t>());
+
+  const dim3 grid = segmentsGrid(
+      segments.size(0), (max_numel + kQuantBlockSize - 1) / kQuantBlockSize);
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  if (bits == 8) {
+    cuQuantizeSegments<8>
+        <<<grid, kQuantBlockSize, 0, stream>>>(quant_segments);
+  } else {
+    cuQuantizeSegments<4>
+        <<<grid, kQuantBlockSize, 0, stream>>>(quant_segments);
+  }
+}
+
+void checkpoint_dequantize_segments_cuda(torch::Tensor segments,
+                                         int64_t max_numel, int bits,
+                                         torch::Device device) {
+  if (segments.size(0) == 0 || max_numel == 0) {
+    return;
+  }
+  auto device_segments = uploadSegments(segments, device);
+  auto *quant_segments = reinterpret_cast<const QuantSegment *>(
+      device_segments.data_ptr<int64_t>());
+
+  const int threads = 256;
+  const dim3 grid =
+      segmentsGrid(segments.size(0), (max_numel + threads - 1) / threads);
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  if (bits == 8) {
+    cuDequantizeSegments<8><<<grid, threads, 0, stream>>>(quant_segments);
+  } else {
+    cuDequantizeSegments<4><<<grid, threads, 0, stream>>>(quant_segments);
+  }
+}
@@ -0,0 +1,235 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+
+/*
+Kernel implementation for the cross entropy over vocabulary parallel logits.
+*/
+
+#include "ATen/ATen.h"
+#include "ATen/cuda/CUDAContext.h"
+#include "ATen/cuda/DeviceUtils.cuh"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include "type_shim.h"
+
+namespace {
+constexpr int kThreads = 512;
+
+// Elements of a thread are loaded and stored as a single access.
+template <typename T, int N> struct alignas(sizeof(T) * N) VecT {
+  T val[N];
+};
+
+// Running max and sum of exp(x - max) of a part of a row.
+struct SoftmaxStats {
+  float max;
+  float sum;
+};
+
+__device__ __forceinline__ SoftmaxStats cuMergeStats(SoftmaxStats a,
+                                                     SoftmaxStats b) {
+  const float max = fmaxf(a.max, b.max);
+  if (max == -FLT_MAX) {
+    return {max, 0.f};
+  }
+  return {max, a.sum * expf(a.max - max) + b.sum * expf(b.max - max)};
+}
+
+__device__ __forceinline__ SoftmaxStats cuAddStats(SoftmaxStats a, float x) {
+  if (x > a.max) {
+    return {x, a.sum * expf(a.max - x) + 1.f};
+  }
+  return {a.max, a.sum + expf(x - a.max)};
+}
+
+__device__ SoftmaxStats cuBlockMergeStats(SoftmaxStats stats) {
+  __shared__ float max_buffer[32];
+  __shared__ float sum_buffer[32];
+  const int lane = threadIdx.x % 32;
+  const int warp = threadIdx.x / 32;
+#pragma unroll
+  for (int offset = 16; offset > 0; offset /= 2) {
+    stats = cuMergeStats(stats, {WARP_SHFL_XOR(stats.max, offset),
+                                 WARP_SHFL_XOR(stats.sum, offset)});
+  }
+  if (lane == 0) {
+    max_buffer[warp] = stats.max;
+    sum_buffer[warp] = stats.sum;
+  }
+  __syncthreads();
+  stats = {-FLT_MAX, 0.f};
+  if (lane < blockDim.x / 32) {
+    stats = {max_buffer[lane], sum_buffer[lane]};
+  }
+#pragma unroll
+  for (int offset = 16; offset > 0; offset /= 2) {
+    stats = cuMergeStats(stats, {WARP_SHFL_XOR(stats.max, offset),
+                                 WARP_SHFL_XOR(stats.sum, offset)});
+  }
+  return stats;
+}
+
+// One block per row of the [n1, n2] local logits. Writes the local max, the
+// local sum of exp(x - max) and the target logit, or 0 when the target is
+// outside of the local vocabulary [vocab_start, vocab_start + n2).
+template <typename T, int VEC>
+__global__ void cuVocabParallelCrossEntropyStats(
+    float *__restrict__ stats, const T *__restrict__ logits,
+    const int64_t *__restrict__ targets, int64_t vocab_start, int n2) {
+  using Vec = VecT<T, VEC>;
+  const int64_t row = blockIdx.x;
+  const T *x = logits + row * n2;
+  const Vec *xv = reinterpret_cast<const Vec *>(x);
+
+  SoftmaxStats local = {-FLT_MAX, 0.f};
+  for (int v = threadIdx.x; v < n2 / VEC; v += blockDim.x) {
+    const Vec in = xv[v];
+#pragma unroll
+    for (int k = 0; k < VEC; ++k) {
+      local = cuAddStats(local, static_cast<float>(in.val[k]));
+    }
+  }
+  local = cuBlockMergeStats(local);
+
+  if (threadIdx.x == 0) {
+    const int64_t target = targets[row] - vocab_start;
+    stats[row * 3] = local.max;
+    stats[row * 3 + 1] = local.sum;
+    stats[row * 3 + 2] =
+        target >= 0 && target < n2 ? static_cast<float>(x[target]) : 0.f;
+  }
+}
+
+// grad = (softmax(x) - onehot(target)) * grad_loss from the max and the sum
+// of exp(x - max) over the whole vocabulary. Rows of 'ignore_index' targets
+// get a null gradient. 'grad' may be 'logits', which is then overwritten.
+template <typename T, int VEC>
+__global__ void cuVocabParallelCrossEntropyGradient(
+    T *grad, const T *logits, const float *__restrict__ grad_loss,
+    const float *__restrict__ max, const float *__restrict__ sum,
+    const int64_t *__restrict__ targets, int64_t vocab_start, int n2,
+    int64_t ignore_index) {
+  using Vec = VecT<T, VEC>;
+  const int64_t row = blockIdx.x;
+  const Vec *xv = reinterpret_cast<const Vec *>(logits + row * n2);
+  Vec *gv = reinterpret_cast<Vec *>(grad + row * n2);
+
+  const bool ignored = targets[row] == ignore_index;
+  const int64_t target = targets[row] - vocab_start;
+  const float row_max = max[row];
+  const float row_scale = ignored ? 0.f : grad_loss[row] / sum[row];
+  const float target_grad = ignored ? 0.f : grad_loss[row];
+
+  for (int v = threadIdx.x; v < n2 / VEC; v += blockDim.x) {
+    const Vec in = xv[v];
+    Vec out;
+#pragma unroll
+    for (int k = 0; k < VEC; ++k) {
+      float g = expf(static_cast<float>(in.val[k]) - row_max) * row_scale;
+      if (v * VEC + k == target) {
+        g -= target_grad;
+      }
+      out.val[k] = static_cast<T>(g);
+    }
+    gv[v] = out;
+  }
+}
+
+// Number of elements per access, 16 bytes when the rows allow it.
+template <typename T> int GetVectorSize(const void *ptr, int n2) {
+  int vec = 16 / sizeof(T);
+  const auto addr = reinterpret_cast<uintptr_t>(ptr);
+  while (addr % (vec * sizeof(T)) != 0 || n2 % vec != 0) {
+    vec /= 2;
+  }
+  return vec;
+}
+
+template <typename T>
+void HostApplyVocabParallelCrossEntropy(float *stats, const T *logits,
+                                        const int64_t *targets,
+                                        int64_t vocab_start, int n1, int n2) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  switch (GetVectorSize<T>(logits, n2)) {
+  case 8:
+    cuVocabParallelCrossEntropyStats<T, 8><<<n1, kThreads, 0, stream>>>(
+        stats, logits, targets, vocab_start, n2);
+    break;
+  case 4:
+    cuVocabParallelCrossEntropyStats<T, 4><<<n1, kThreads, 0, stream>>>(
+        stats, logits, targets, vocab_start, n2);
+    break;
+  case 2:
+    cuVocabParallelCrossEntropyStats<T, 2><<<n1, kThreads, 0, stream>>>(
+        stats, logits, targets, vocab_start, n2);
+    break;
+  default:
+    cuVocabParallelCrossEntropyStats<T, 1><<<n1, kThreads, 0, stream>>>(
+        stats, logits, targets, vocab_start, n2);
+  }
+}
+
+template <typename T>
+void HostVocabParallelCrossEntropyGradient(
+    T *grad, const T *logits, const float *grad_loss, const float *max,
+    const float *sum, const int64_t *targets, int64_t vocab_start, int n1,
+    int n2, int64_t ignore_index) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int vec = std::min(GetVectorSize<T>(logits, n2),
+                           GetVectorSize<T>(grad, n2));
+  switch (vec) {
+  case 8:
+    cuVocabParallelCrossEntropyGradient<T, 8><<<n1, kThreads, 0, stream>>>(
+        grad, logits, grad_loss, max, sum, targets, vocab_start, n2,
+        ignore_index);
+    break;
+  case 4:
+    cuVocabParallelCrossEntropyGradient<T, 4><<<n1, kThreads, 0, stream>>>(
+        grad, logits, grad_loss, max, sum, targets, vocab_start, n2,
+        ignore_index);
+    break;
+  case 2:
+    cuVocabParallelCrossEntropyGradient<T, 2><<<n1, kThreads, 0, stream>>>(
+        grad, logits, grad_loss, max, sum, targets, vocab_start, n2,
+        ignore_index);
+    break;
+  default:
+    cuVocabParallelCrossEntropyGradient<T, 1><<<n1, kThreads, 0, stream>>>(
+        grad, logits, grad_loss, max, sum, targets, vocab_start, n2,
+        ignore_index);
+  }
+}
+} // namespace
+
+// 'stats' is the [n1, 3] float tensor of the local max, sum of exp(x - max)
+// and target logit of every row of the [n1, n2] local 'logits'.
+void cuda_vocab_parallel_cross_entropy(at::Tensor *stats, at::Tensor *logits,
+                                       at::Tensor *targets,
+                                       int64_t vocab_start, int n1, int n2) {
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      logits->scalar_type(), 0, "cuVocabParallelCrossEntropyStats",
+      HostApplyVocabParallelCrossEntropy<scalar_t_0>(
+          stats->DATA_PTR<float>(), logits->DATA_PTR<scalar_t_0>(),
+          targets->DATA_PTR<int64_t>(), vocab_start, n1, n2);)
+}
+
+// 'max' and 'sum' are reduced over the whole vocabulary. 'grad' may be
+// 'logits' to write the gradient in place.
+void cuda_vocab_parallel_cross_entropy_gradient(
+    at::Tensor *grad, at::Tensor *logits, at::Tensor *grad_loss,
+    at::Tensor *max, at::Tensor *sum, at::Tensor *targets,
+    int64_t vocab_start, int n1, int n2, int64_t ignore_index) {
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      logits->scalar_type(), 0, "cuVocabParallelCrossEntropyGradient",
+      HostVocabParallelCrossEntropyGradient<scalar_t_0>(
+          grad->DATA_PTR<scalar_t_0>(), logits->DATA_PTR<scalar_t_0>(),
+          grad_loss->DATA_PTR<float>(), max->DATA_PTR<float>(),
+          sum->DATA_PTR<float>(), targets->DATA_PTR<int64_t>(), vocab_start,
+          n1, n2, ignore_index);)
+}
@@ -0,0 +1,124 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+
+/*
+Kernel implementation for the flattening of gradients into a bucket, fused
+with their unscaling and overflow check.
+*/
+
+#include "ATen/ATen.h"
+#include "ATen/cuda/CUDAContext.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <vector>
+
+#include "type_shim.h"
+
+namespace {
+constexpr int kThreads = 512;
+// Elements copied by one block, every block copies a chunk of one gradient.
+constexpr int kChunkSize = 4 * kThreads;
+
+// Upper bound on the gradients handled by one launch. The table is passed by
+// value as a kernel argument and has to stay below its 4KB limit.
+constexpr int kFlattenMaxTensors = 96;
+
+template <typename T> struct FlattenDescriptor {
+  const T *grad;
+  int64_t offset;
+  int64_t numel;
+};
+
+template <typename T> struct FlattenTable {
+  FlattenDescriptor<T> tensors[kFlattenMaxTensors];
+  // exclusive prefix sum of the chunks per gradient
+  int chunks[kFlattenMaxTensors + 1];
+  int num_tensors;
+};
+
+__device__ int cuFindChunkTensor(const int *chunks, const int num_tensors,
+                                 const int chunk) {
+  int lo = 0, hi = num_tensors - 1;
+  while (lo < hi) {
+    const int mid = (lo + hi + 1) / 2;
+    if (chunks[mid] <= chunk) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+template <typename T>
+__global__ void cuFlattenUnscale(const FlattenTable<T> table, T *arena,
+                                 float *found_inf, const float *inv_scale,
+                                 const float factor) {
+  // Assumptions:
+  // 1) blockDim.x == kThreads, one block per chunk of kChunkSize elements
+  // 2) a gradient may alias its slice of the arena, every element is read
+  //    and written by the same thread
+  //
+  const int chunk = blockIdx.x;
+  const int t = cuFindChunkTensor(table.chunks, table.num_tensors, chunk);
+  const FlattenDescriptor<T> &desc = table.tensors[t];
+  const int64_t begin = int64_t(chunk - table.chunks[t]) * kChunkSize;
+  const int64_t end = min(begin + kChunkSize, desc.numel);
+  const float scale = inv_scale != NULL ? *inv_scale * factor : factor;
+
+  bool overflow = false;
+  T *dst = arena + desc.offset;
+  for (int64_t i = begin + threadIdx.x; i < end; i += blockDim.x) {
+    const float value = static_cast<float>(desc.grad[i]) * scale;
+    overflow |= !isfinite(value);
+    dst[i] = static_cast<T>(value);
+  }
+  if (found_inf != NULL && __syncthreads_or(overflow) && threadIdx.x == 0) {
+    *found_inf = 1.f;
+  }
+}
+
+template <typename T>
+void HostFlattenUnscale(T *arena, const std::vector<at::Tensor> &grads,
+                        const std::vector<int64_t> &offsets, float *found_inf,
+                        const float *inv_scale, float factor) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int num_tensors = grads.size();
+  for (int begin = 0; begin < num_tensors; begin += kFlattenMaxTensors) {
+    const int end = std::min(begin + kFlattenMaxTensors, num_tensors);
+    FlattenTable<T> table = {};
+    for (int i = begin; i < end; ++i) {
+      FlattenDescriptor<T> &desc = table.tensors[i - begin];
+      desc.grad = grads[i].DATA_PTR<T>();
+      desc.offset = offsets[i];
+      desc.numel = grads[i].numel();
+      const int64_t chunks = (desc.numel + kChunkSize - 1) / kChunkSize;
+      table.chunks[i - begin + 1] = table.chunks[i - begin] + (int)chunks;
+    }
+    table.num_tensors = end - begin;
+    const int num_chunks = table.chunks[table.num_tensors];
+    if (num_chunks == 0) {
+      continue;
+    }
+    cuFlattenUnscale<T><<<num_chunks, kThreads, 0, stream>>>(
+        table, arena, found_inf, inv_scale, factor);
+  }
+}
+} // namespace
+
+void cuda_flatten_unscale(at::Tensor *arena,
+                          const std::vector<at::Tensor> &grads,
+                          const std::vector<int64_t> &offsets,
+                          at::Tensor *found_inf, at::Tensor *inv_scale,
+                          float factor) {
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      arena->scalar_type(), 0, "cuFlattenUnscale",
+      HostFlattenUnscale<scalar_t_0>(
+          arena->DATA_PTR<scalar_t_0>(), grads, offsets,
+          found_inf != NULL ? found_inf->DATA_PTR<float>() : NULL,
+          inv_scale != NULL ? inv_scale->DATA_PTR<float>() : NULL, factor);)
+}
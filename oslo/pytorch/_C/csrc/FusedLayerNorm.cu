@@ -5,9 +5,22 @@
 
 #include <cuda.h>
 #include <cuda_runtime.h>
+#include <curand_kernel.h>
+
+#include <limits>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "type_shim.h"
 
+#ifdef OSLO_ENABLE_FLOAT8
+#include <c10/util/Float8_e4m3fn.h>
+#include <c10/util/Float8_e5m2.h>
+#endif
+
 template <typename U>
 __device__ void cuWelfordOnlineSum(const U curr, U &mu, U &sigma2, U &count) {
   count = count + U(1);
@@ -304,8 +317,169 @@ template <> struct SharedMemory<double> {
     return s_double;
   }
 };
+
+// Packs VEC consecutive elements so that they are moved with a single wide
+// (up to 128-bit) memory transaction.
+template <typename T, int VEC> struct alignas(sizeof(T) * VEC) AlignedVector {
+  T val[VEC];
+};
 } // namespace
 
+template <typename U>
+__device__ void cuWelfordReduce(U &mu, U &sigma2, U &count, U *buf,
+                                const int n2, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) 2*blockDim.y*sizeof(U)+blockDim.y*sizeof(int) shared memory available.
+  //
+  // intra-warp reductions
+  for (int l = 0; l <= 4; ++l) {
+    int srcLaneB = (threadIdx.x + (1 << l)) & 31;
+    U sigma2B = WARP_SHFL(sigma2, srcLaneB);
+    if (!rms_only) {
+      U muB = WARP_SHFL(mu, srcLaneB);
+      U countB = WARP_SHFL(count, srcLaneB);
+      cuChanOnlineSum<U>(muB, sigma2B, countB, mu, sigma2, count);
+    } else {
+      cuChanRMSOnlineSum<U>(sigma2B, sigma2);
+    }
+  }
+  // threadIdx.x == 0 has correct values for each warp
+  // inter-warp reductions
+  if (blockDim.y > 1) {
+    U *ubuf = (U *)buf;
+    U *ibuf = (U *)(ubuf + blockDim.y);
+    for (int offset = blockDim.y / 2; offset > 0; offset /= 2) {
+      // upper half of warps write to shared
+      if (threadIdx.x == 0 && threadIdx.y >= offset &&
+          threadIdx.y < 2 * offset) {
+        const int wrt_y = threadIdx.y - offset;
+        if (!rms_only) {
+          ubuf[2 * wrt_y] = mu;
+          ibuf[wrt_y] = count;
+        }
+        ubuf[2 * wrt_y + 1] = sigma2;
+      }
+      __syncthreads();
+      // lower half merges
+      if (threadIdx.x == 0 && threadIdx.y < offset) {
+        U sigma2B = ubuf[2 * threadIdx.y + 1];
+        if (!rms_only) {
+          U muB = ubuf[2 * threadIdx.y];
+          U countB = ibuf[threadIdx.y];
+          cuChanOnlineSum<U>(muB, sigma2B, countB, mu, sigma2, count);
+        } else {
+          cuChanRMSOnlineSum<U>(sigma2B, sigma2);
+        }
+      }
+      __syncthreads();
+    }
+    // threadIdx.x = 0 && threadIdx.y == 0 only thread that has correct values
+    if (threadIdx.x == 0 && threadIdx.y == 0) {
+      if (!rms_only) {
+        ubuf[0] = mu;
+      }
+      ubuf[1] = sigma2;
+    }
+    __syncthreads();
+    if (!rms_only) {
+      mu = ubuf[0];
+    }
+    sigma2 = ubuf[1] / U(n2);
+    // don't care about final value of count, we know count == n2
+  } else {
+    if (!rms_only) {
+      mu = WARP_SHFL(mu, 0);
+    }
+    sigma2 = WARP_SHFL(sigma2 / U(n2), 0);
+  }
+}
+
+template <typename T, typename U, int VEC>
+__device__ void cuWelfordMuSigma2Vectorized(const T *__restrict__ vals,
+                                            const int n1, const int n2,
+                                            const int i1, U &mu, U &sigma2,
+                                            U *buf, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) Tensor is contiguous
+  // 3) vals + i1 * n2 is aligned to VEC * sizeof(T) bytes
+  // 4) 2*blockDim.y*sizeof(U)+blockDim.y*sizeof(int) shared memory available.
+  //
+  // compute variance and mean over n2
+  U count = U(0);
+  mu = U(0);
+  sigma2 = U(0);
+  if (i1 < n1) {
+    const int numx = blockDim.x * blockDim.y;
+    const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+    const T *lvals = vals + i1 * n2;
+    const int nvec = n2 / VEC;
+    const AlignedVector<T, VEC> *vvals =
+        reinterpret_cast<const AlignedVector<T, VEC> *>(lvals);
+    for (int l = thrx; l < nvec; l += numx) {
+      const AlignedVector<T, VEC> curr_vec = vvals[l];
+#pragma unroll
+      for (int k = 0; k < VEC; ++k) {
+        U curr = static_cast<U>(curr_vec.val[k]);
+        if (!rms_only) {
+          cuWelfordOnlineSum<U>(curr, mu, sigma2, count);
+        } else {
+          cuRMSOnlineSum<U>(curr, sigma2);
+        }
+      }
+    }
+    // scalar tail
+    for (int l = nvec * VEC + thrx; l < n2; l += numx) {
+      U curr = static_cast<U>(lvals[l]);
+      if (!rms_only) {
+        cuWelfordOnlineSum<U>(curr, mu, sigma2, count);
+      } else {
+        cuRMSOnlineSum<U>(curr, sigma2);
+      }
+    }
+    cuWelfordReduce<U>(mu, sigma2, count, buf, n2, rms_only);
+  }
+}
+
+template <typename T, typename U, typename V>
+__device__ void
+cuApplyLayerNormRow_(V *__restrict__ ovals, U *__restrict__ mean,
+                     U *__restrict__ invvar, const T *__restrict__ lvals,
+                     const int n2, const int i1, const U mu, const U sigma2,
+                     const U epsilon, const V *__restrict__ gamma,
+                     const V *__restrict__ beta, bool rms_only) {
+  // normalizes the row lvals with the statistics of cuWelfordMuSigma2
+  U c_invvar = rsqrt(sigma2 + epsilon);
+  const int numx = blockDim.x * blockDim.y;
+  const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+  if (gamma != NULL && (beta != NULL || rms_only)) {
+    for (int i = thrx; i < n2; i += numx) {
+      U curr = static_cast<U>(lvals[i]);
+      if (!rms_only) {
+        ovals[i] = gamma[i] * static_cast<V>(c_invvar * (curr - mu)) + beta[i];
+      } else {
+        ovals[i] = gamma[i] * static_cast<V>(c_invvar * curr);
+      }
+    }
+  } else {
+    for (int i = thrx; i < n2; i += numx) {
+      U curr = static_cast<U>(lvals[i]);
+      if (!rms_only) {
+        ovals[i] = static_cast<V>(c_invvar * (curr - mu));
+      } else {
+        ovals[i] = static_cast<V>(c_invvar * curr);
+      }
+    }
+  }
+  if (threadIdx.x == 0 && threadIdx.y == 0) {
+    if (!rms_only) {
+      mean[i1] = mu;
+    }
+    invvar[i1] = c_invvar;
+  }
+}
+
 template <typename T, typename U, typename V>
 __device__ void cuApplyLayerNorm_(V *__restrict__ output_vals,
                                   U *__restrict__ mean, U *__restrict__ invvar,
@@ -316,43 +490,20 @@ __device__ void cuApplyLayerNorm_(V *__restrict__ output_vals,
   // Assumptions:
   // 1) blockDim.x == warpSize
   // 2) Tensors are contiguous
+  // 3) blockDim.z rows are normalized per block, blockDim.z > 1 implies
+  //    blockDim.y == 1 (see GetLayerNormLaunchConfig)
   //
-  for (auto i1 = blockIdx.y; i1 < n1; i1 += gridDim.y) {
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
     SharedMemory<U> shared;
     U *buf = shared.getPointer();
     U mu, sigma2;
     cuWelfordMuSigma2(vals, n1, n2, i1, mu, sigma2, buf, rms_only);
 
-    const T *lvals = vals + i1 * n2;
-    V *ovals = output_vals + i1 * n2;
-    U c_invvar = rsqrt(sigma2 + epsilon);
-    const int numx = blockDim.x * blockDim.y;
-    const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
-    if (gamma != NULL && (beta != NULL || rms_only)) {
-      for (int i = thrx; i < n2; i += numx) {
-        U curr = static_cast<U>(lvals[i]);
-        if (!rms_only) {
-          ovals[i] =
-              gamma[i] * static_cast<V>(c_invvar * (curr - mu)) + beta[i];
-        } else {
-          ovals[i] = gamma[i] * static_cast<V>(c_invvar * curr);
-        }
-      }
-    } else {
-      for (int i = thrx; i < n2; i += numx) {
-        U curr = static_cast<U>(lvals[i]);
-        if (!rms_only) {
-          ovals[i] = static_cast<V>(c_invvar * (curr - mu));
-        } else {
-          ovals[i] = static_cast<V>(c_invvar * curr);
-        }
-      }
-    }
-    if (threadIdx.x == 0 && threadIdx.y == 0) {
-      if (!rms_only) {
-        mean[i1] = mu;
-      }
-      invvar[i1] = c_invvar;
+    if (i1 < n1) {
+      cuApplyLayerNormRow_(output_vals + i1 * n2, mean, invvar, vals + i1 * n2,
+                           n2, i1, mu, sigma2, epsilon, gamma, beta, rms_only);
     }
     __syncthreads();
   }
@@ -377,395 +528,1569 @@ cuApplyRMSNorm(V *__restrict__ output_vals, U *__restrict__ invvar,
                              gamma, NULL, true);
 }
 
-template <typename T, typename U, typename V>
-__device__ void cuLoadWriteStridedInputs(
-    const int i1_block, const int thr_load_row_off, const int thr_load_col_off,
-    const int i2_off, const int row_stride, U *warp_buf1, U *warp_buf2,
-    const T *input, const V *dout, const int i1_end, const int n2,
-    const U *__restrict__ mean, const U *__restrict__ invvar, bool rms_only) {
-  int i1 = i1_block + thr_load_row_off;
-  if (i1 < i1_end) {
-    U curr_mean;
-    if (!rms_only) {
-      curr_mean = mean[i1];
+template <typename T, typename U>
+__global__ void cuComputeLayerNormPartialStats(U *__restrict__ stats,
+                                               const T *__restrict__ vals,
+                                               const int n1, const int n2,
+                                               bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) blockDim.z rows are reduced per block, blockDim.z > 1 implies
+  //    blockDim.y == 1 (see GetLayerNormLaunchConfig)
+  // 3) stats is laid out as [n1, 3] holding the (count, mean, M2) Welford
+  //    partials of the local shard of the row. If rms_only the mean is zero
+  //    and M2 is the plain sum of squares.
+  //
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    SharedMemory<U> shared;
+    U *buf = shared.getPointer();
+    U mu, sigma2;
+    cuWelfordMuSigma2(vals, n1, n2, i1, mu, sigma2, buf, rms_only);
+    if (i1 < n1 && threadIdx.x == 0 && threadIdx.y == 0) {
+      U *lstats = stats + 3 * i1;
+      lstats[0] = U(n2);
+      lstats[1] = !rms_only ? mu : U(0);
+      lstats[2] = sigma2 * U(n2);
     }
-    U curr_invvar = invvar[i1];
-    for (int k = 0; k < blockDim.y; ++k) {
-      int i2 = i2_off + k;
-      int load_idx = i1 * n2 + i2;
-      int write_idx = thr_load_row_off * row_stride + thr_load_col_off + k;
-      if (i2 < n2) {
-        U curr_input = static_cast<U>(input[load_idx]);
-        U curr_dout = static_cast<U>(dout[load_idx]);
-        if (!rms_only) {
-          warp_buf1[write_idx] = curr_dout;
-          warp_buf2[write_idx] =
-              curr_dout * (curr_input - curr_mean) * curr_invvar;
-        } else {
-          warp_buf2[write_idx] = curr_dout * (curr_input)*curr_invvar;
-        }
+    __syncthreads();
+  }
+}
+
+template <typename U>
+__global__ void
+cuMergeLayerNormPartialStats(U *__restrict__ mean, U *__restrict__ invvar,
+                             const U *__restrict__ stats, const int world_size,
+                             const int n1, const U epsilon, bool rms_only) {
+  // Assumptions:
+  // 1) stats is laid out as [world_size, n1, 3], one slice per shard as
+  //    written by cuComputeLayerNormPartialStats
+  //
+  for (int i1 = blockIdx.x * blockDim.x + threadIdx.x; i1 < n1;
+       i1 += gridDim.x * blockDim.x) {
+    U count = U(0);
+    U mu = U(0);
+    U sigma2 = U(0);
+    for (int r = 0; r < world_size; ++r) {
+      const U *lstats = stats + 3 * (r * n1 + i1);
+      if (!rms_only) {
+        cuChanOnlineSum<U>(lstats[1], lstats[2], lstats[0], mu, sigma2, count);
       } else {
-        if (!rms_only) {
-          warp_buf1[write_idx] = U(0);
-        }
-        warp_buf2[write_idx] = U(0);
+        count = count + lstats[0];
+        cuChanRMSOnlineSum<U>(lstats[2], sigma2);
       }
     }
-  } else {
-    for (int k = 0; k < blockDim.y; ++k) {
-      int write_idx = thr_load_row_off * row_stride + thr_load_col_off + k;
-      if (!rms_only) {
-        warp_buf1[write_idx] = U(0);
-      }
-      warp_buf2[write_idx] = U(0);
+    if (!rms_only) {
+      mean[i1] = mu;
     }
+    invvar[i1] = rsqrt(sigma2 / count + epsilon);
   }
 }
 
 template <typename T, typename U, typename V>
-__device__ void cuLoadAddStridedInputs(
-    const int i1_block, const int thr_load_row_off, const int thr_load_col_off,
-    const int i2_off, const int row_stride, U *warp_buf1, U *warp_buf2,
-    const T *input, const V *dout, const int i1_end, const int n2,
-    const U *__restrict__ mean, const U *__restrict__ invvar, bool rms_only) {
-  int i1 = i1_block + thr_load_row_off;
-  if (i1 < i1_end) {
-    U curr_mean;
-    if (!rms_only) {
-      curr_mean = mean[i1];
-    }
-    U curr_invvar = invvar[i1];
-    for (int k = 0; k < blockDim.y; ++k) {
-      int i2 = i2_off + k;
-      int load_idx = i1 * n2 + i2;
-      int write_idx = thr_load_row_off * row_stride + thr_load_col_off + k;
-      if (i2 < n2) {
-        U curr_input = static_cast<U>(input[load_idx]);
-        U curr_dout = static_cast<U>(dout[load_idx]);
-        if (!rms_only) {
-          warp_buf1[write_idx] += curr_dout;
-          warp_buf2[write_idx] +=
-              curr_dout * (curr_input - curr_mean) * curr_invvar;
-        } else {
-          warp_buf2[write_idx] += curr_dout * (curr_input)*curr_invvar;
+__global__ void cuApplyLayerNormWithStats(
+    V *__restrict__ output_vals, const T *__restrict__ vals, const int n1,
+    const int n2, const U *__restrict__ mean, const U *__restrict__ invvar,
+    const V *__restrict__ gamma, const V *__restrict__ beta, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) blockDim.z rows are normalized per block
+  // 3) mean and invvar already cover the full (possibly sharded) row
+  //
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    if (i1 < n1) {
+      const T *lvals = vals + i1 * n2;
+      V *ovals = output_vals + i1 * n2;
+      const U mu = !rms_only ? mean[i1] : U(0);
+      const U c_invvar = invvar[i1];
+      const int numx = blockDim.x * blockDim.y;
+      const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+      for (int i = thrx; i < n2; i += numx) {
+        U curr = c_invvar * (static_cast<U>(lvals[i]) - mu);
+        if (gamma != NULL) {
+          curr = static_cast<U>(gamma[i]) * curr;
+          if (beta != NULL) {
+            curr = curr + static_cast<U>(beta[i]);
+          }
         }
+        ovals[i] = static_cast<V>(curr);
       }
     }
   }
 }
 
-template <typename T, typename U, typename V>
-__global__ void cuComputePartGradGammaBeta(
-    const V *__restrict__ dout, const T *__restrict__ input, const int n1,
-    const int n2, const U *__restrict__ mean, const U *__restrict__ invvar,
-    U epsilon, U *part_grad_gamma, U *part_grad_beta, bool rms_only) {
-  const int numsegs_n1 =
-      (n1 + blockDim.y * blockDim.y - 1) / (blockDim.y * blockDim.y);
-  const int segs_per_block = (numsegs_n1 + gridDim.y - 1) / gridDim.y;
-  const int i1_beg = blockIdx.y * segs_per_block * blockDim.y * blockDim.y;
-  const int i1_beg_plus_one =
-      (blockIdx.y + 1) * segs_per_block * blockDim.y * blockDim.y;
-  const int i1_end = i1_beg_plus_one < n1 ? i1_beg_plus_one : n1;
-  const int row_stride = blockDim.x + 1;
-  const int thr_load_col_off = (threadIdx.x * blockDim.y) & (blockDim.x - 1);
-  const int thr_load_row_off =
-      (threadIdx.x * blockDim.y) / blockDim.x + threadIdx.y * blockDim.y;
-  const int i2_off = blockIdx.x * blockDim.x + thr_load_col_off;
-  SharedMemory<U> shared;
-  U *buf = shared.getPointer(); // buf has at least blockDim.x * blockDim.y *
-                                // blockDim.y + (blockDim.y -
-                                // 1)*(blockDim.x/blockDim.y) elements
-  U *warp_buf1 = (U *)buf;
-  U *warp_buf2 = warp_buf1 + blockDim.y * blockDim.y * row_stride;
-  // compute partial sums from strided inputs
-  // do this to increase number of loads in flight
-  cuLoadWriteStridedInputs(i1_beg, thr_load_row_off, thr_load_col_off, i2_off,
-                           row_stride, warp_buf1, warp_buf2, input, dout,
-                           i1_end, n2, mean, invvar, rms_only);
-  for (int i1_block = i1_beg + blockDim.y * blockDim.y; i1_block < i1_end;
-       i1_block += blockDim.y * blockDim.y) {
-    cuLoadAddStridedInputs(i1_block, thr_load_row_off, thr_load_col_off, i2_off,
-                           row_stride, warp_buf1, warp_buf2, input, dout,
-                           i1_end, n2, mean, invvar, rms_only);
-  }
-  __syncthreads();
-  // inter-warp reductions
-  // sum within each warp
-  U acc1 = U(0);
-  U acc2 = U(0);
-  for (int k = 0; k < blockDim.y; ++k) {
-    int row1 = threadIdx.y + k * blockDim.y;
-    int idx1 = row1 * row_stride + threadIdx.x;
-    if (!rms_only) {
-      acc1 += warp_buf1[idx1];
-    }
-    acc2 += warp_buf2[idx1];
+template <typename Q> struct QuantizedTraits;
+
+template <> struct QuantizedTraits<int8_t> {
+  static constexpr float max() { return 127.0f; }
+  __device__ static int8_t cast(float v) {
+    return static_cast<int8_t>(__float2int_rn(fminf(fmaxf(v, -max()), max())));
   }
-  if (!rms_only) {
-    warp_buf1[threadIdx.y * row_stride + threadIdx.x] = acc1;
+};
+
+#ifdef OSLO_ENABLE_FLOAT8
+template <> struct QuantizedTraits<at::Float8_e4m3fn> {
+  static constexpr float max() { return 448.0f; }
+  __device__ static at::Float8_e4m3fn cast(float v) {
+    return at::Float8_e4m3fn(fminf(fmaxf(v, -max()), max()));
   }
-  warp_buf2[threadIdx.y * row_stride + threadIdx.x] = acc2;
-  __syncthreads();
-  // sum all warps
-  for (int offset = blockDim.y / 2; offset > 1; offset /= 2) {
-    if (threadIdx.y < offset) {
-      int row1 = threadIdx.y;
-      int row2 = threadIdx.y + offset;
-      int idx1 = row1 * row_stride + threadIdx.x;
-      int idx2 = row2 * row_stride + threadIdx.x;
-      if (!rms_only) {
-        warp_buf1[idx1] += warp_buf1[idx2];
-      }
-      warp_buf2[idx1] += warp_buf2[idx2];
-    }
-    __syncthreads();
+};
+
+template <> struct QuantizedTraits<at::Float8_e5m2> {
+  static constexpr float max() { return 57344.0f; }
+  __device__ static at::Float8_e5m2 cast(float v) {
+    return at::Float8_e5m2(fminf(fmaxf(v, -max()), max()));
   }
-  int i2 = blockIdx.x * blockDim.x + threadIdx.x;
-  if (threadIdx.y == 0 && i2 < n2) {
-    int row1 = threadIdx.y;
-    int row2 = threadIdx.y + 1;
-    int idx1 = row1 * row_stride + threadIdx.x;
-    int idx2 = row2 * row_stride + threadIdx.x;
-    if (!rms_only) {
-      part_grad_beta[blockIdx.y * n2 + i2] = warp_buf1[idx1] + warp_buf1[idx2];
+};
+#endif
+
+template <typename U, typename V>
+__device__ U cuNormalizeValue(const U curr, const U mu, const U c_invvar,
+                              const V *__restrict__ gamma,
+                              const V *__restrict__ beta, const int i,
+                              bool rms_only) {
+  U val = !rms_only ? c_invvar * (curr - mu) : c_invvar * curr;
+  if (gamma != NULL) {
+    val = static_cast<U>(gamma[i]) * val;
+    if (!rms_only && beta != NULL) {
+      val = val + static_cast<U>(beta[i]);
     }
-    part_grad_gamma[blockIdx.y * n2 + i2] = warp_buf2[idx1] + warp_buf2[idx2];
   }
+  return val;
 }
 
-template <typename U, typename V>
-__global__ void
-cuComputeGradGammaBeta(const U *part_grad_gamma, const U *part_grad_beta,
-                       const int part_size, const int n1, const int n2,
-                       V *grad_gamma, V *grad_beta, bool rms_only) {
-  // sum partial gradients for gamma and beta
-  SharedMemory<U> shared;
-  U *buf = shared.getPointer();
-  int i2 = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i2 < n2) {
-    // each warp does sequential reductions until reduced part_size is num_warps
-    int num_warp_reductions = part_size / blockDim.y;
-    U sum_gamma = U(0);
-    U sum_beta = U(0);
-    const U *part_grad_gamma_ptr =
-        part_grad_gamma + threadIdx.y * num_warp_reductions * n2 + i2;
-    const U *part_grad_beta_ptr =
-        part_grad_beta + threadIdx.y * num_warp_reductions * n2 + i2;
-    for (int warp_offset = 0; warp_offset < num_warp_reductions;
-         ++warp_offset) {
-      sum_gamma += part_grad_gamma_ptr[warp_offset * n2];
-      if (!rms_only) {
-        sum_beta += part_grad_beta_ptr[warp_offset * n2];
-      }
-    }
-    // inter-warp reductions
-    const int nbsize3 = blockDim.x * blockDim.y / 2;
-    for (int offset = blockDim.y / 2; offset >= 1; offset /= 2) {
-      // top half write to shared memory
-      if (threadIdx.y >= offset && threadIdx.y < 2 * offset) {
-        const int write_idx = (threadIdx.y - offset) * blockDim.x + threadIdx.x;
-        buf[write_idx] = sum_gamma;
-        if (!rms_only) {
-          buf[write_idx + nbsize3] = sum_beta;
+template <typename T, typename U, typename V, typename Q>
+__device__ void cuApplyLayerNormQuantized_(
+    Q *__restrict__ output_vals, U *__restrict__ mean, U *__restrict__ invvar,
+    float *__restrict__ row_scale, const float *__restrict__ tensor_scale,
+    const T *__restrict__ vals, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) Tensors are contiguous
+  // 3) blockDim.z rows are normalized per block, blockDim.z > 1 implies
+  //    blockDim.y == 1 (see GetLayerNormLaunchConfig)
+  // 4) output = quantize(y / scale), with scale = *tensor_scale if given,
+  //    otherwise amax(|y|) / max(Q) of the row, written to row_scale[i1]
+  //
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    SharedMemory<U> shared;
+    U *buf = shared.getPointer();
+    U mu, sigma2;
+    cuWelfordMuSigma2(vals, n1, n2, i1, mu, sigma2, buf, rms_only);
+
+    if (i1 < n1) {
+      const T *lvals = vals + i1 * n2;
+      Q *ovals = output_vals + i1 * n2;
+      const U c_invvar = rsqrt(sigma2 + epsilon);
+      const int numx = blockDim.x * blockDim.y;
+      const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+      U inv_scale;
+      if (tensor_scale != NULL) {
+        inv_scale = U(1) / static_cast<U>(*tensor_scale);
+      } else {
+        // the row is normalized twice, once for its amax and once for the
+        // output, which is cheaper than keeping it around in shared memory
+        U amax = U(0);
+        for (int i = thrx; i < n2; i += numx) {
+          const U val = cuNormalizeValue(static_cast<U>(lvals[i]), mu,
+                                         c_invvar, gamma, beta, i, rms_only);
+          amax = fmax(amax, fabs(val));
+        }
+        for (int mask = blockDim.x / 2; mask > 0; mask /= 2) {
+          amax = fmax(amax, WARP_SHFL_XOR(amax, mask));
+        }
+        if (blockDim.y > 1) {
+          // buf is still being read by cuWelfordMuSigma2
+          __syncthreads();
+          if (threadIdx.x == 0) {
+            buf[threadIdx.y] = amax;
+          }
+          __syncthreads();
+          for (int k = 0; k < blockDim.y; ++k) {
+            amax = fmax(amax, buf[k]);
+          }
+        }
+        const U scale =
+            amax > U(0) ? amax / U(QuantizedTraits<Q>::max()) : U(1);
+        if (threadIdx.x == 0 && threadIdx.y == 0) {
+          row_scale[i1] = static_cast<float>(scale);
         }
+        inv_scale = U(1) / scale;
       }
-      __syncthreads();
-      // bottom half sums
-      if (threadIdx.y < offset) {
-        const int read_idx = threadIdx.y * blockDim.x + threadIdx.x;
-        sum_gamma += buf[read_idx];
+      for (int i = thrx; i < n2; i += numx) {
+        const U val = cuNormalizeValue(static_cast<U>(lvals[i]), mu, c_invvar,
+                                       gamma, beta, i, rms_only);
+        ovals[i] =
+            QuantizedTraits<Q>::cast(static_cast<float>(val * inv_scale));
+      }
+      if (threadIdx.x == 0 && threadIdx.y == 0) {
         if (!rms_only) {
-          sum_beta += buf[read_idx + nbsize3];
+          mean[i1] = mu;
         }
-      }
-      __syncthreads();
-    }
-    // write out fully summed gradients
-    if (threadIdx.y == 0) {
-      grad_gamma[i2] = sum_gamma;
-      if (!rms_only) {
-        grad_beta[i2] = sum_beta;
+        invvar[i1] = c_invvar;
       }
     }
+    __syncthreads();
   }
 }
 
-template <typename T, typename U, typename V>
-__global__ void
-cuComputeGradInput(const V *__restrict__ dout, const T *__restrict__ input,
-                   const int n1, const int n2, const U *__restrict__ mean,
-                   const U *__restrict__ invvar, U epsilon, const V *gamma,
-                   T *grad_input, bool rms_only) {
-  for (auto i1 = blockIdx.y; i1 < n1; i1 += gridDim.y) {
-    U sum_loss1 = U(0);
-    U sum_loss2 = U(0);
-    U c_mean;
-    if (!rms_only) {
-      c_mean = mean[i1];
-    }
-    const U c_invvar = invvar[i1];
-    const T *k_input = input + i1 * n2;
-    const V *k_dout = dout + i1 * n2;
-    const int numx = blockDim.x * blockDim.y;
-    const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
-    if (gamma != NULL) {
-      int l = 4 * thrx;
-      for (; l + 3 < n2; l += 4 * numx) {
-        for (int k = 0; k < 4; ++k) {
-          const U c_h = static_cast<U>(k_input[l + k]);
-          const U c_loss = static_cast<U>(k_dout[l + k]);
+template <typename T, typename U, typename V, typename Q>
+__global__ void cuApplyLayerNormQuantized(
+    Q *__restrict__ output_vals, U *__restrict__ mean, U *__restrict__ invvar,
+    float *__restrict__ row_scale, const float *__restrict__ tensor_scale,
+    const T *__restrict__ vals, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta) {
+  cuApplyLayerNormQuantized_<T, U, V, Q>(output_vals, mean, invvar, row_scale,
+                                         tensor_scale, vals, n1, n2, epsilon,
+                                         gamma, beta, false);
+}
+
+template <typename T, typename U, typename V, typename Q>
+__global__ void cuApplyRMSNormQuantized(
+    Q *__restrict__ output_vals, U *__restrict__ invvar,
+    float *__restrict__ row_scale, const float *__restrict__ tensor_scale,
+    const T *__restrict__ vals, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma) {
+  cuApplyLayerNormQuantized_<T, U, V, Q>(output_vals, NULL, invvar, row_scale,
+                                         tensor_scale, vals, n1, n2, epsilon,
+                                         gamma, NULL, true);
+}
+
+template <typename T, typename U, typename V, int VEC>
+__device__ void cuApplyLayerNormVectorized_(
+    V *__restrict__ output_vals, U *__restrict__ mean, U *__restrict__ invvar,
+    const T *__restrict__ vals, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) Tensors are contiguous
+  // 3) vals, output_vals, gamma and beta are aligned to VEC elements and
+  //    n2 % VEC == 0, so that every row starts on a VEC boundary
+  // 4) blockDim.z rows are normalized per block, blockDim.z > 1 implies
+  //    blockDim.y == 1 (see GetLayerNormLaunchConfig)
+  //
+  using in_vec_t = AlignedVector<T, VEC>;
+  using out_vec_t = AlignedVector<V, VEC>;
+  const bool affine = gamma != NULL && (beta != NULL || rms_only);
+  const out_vec_t *vgamma = reinterpret_cast<const out_vec_t *>(gamma);
+  const out_vec_t *vbeta = reinterpret_cast<const out_vec_t *>(beta);
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    SharedMemory<U> shared;
+    U *buf = shared.getPointer();
+    U mu, sigma2;
+    cuWelfordMuSigma2Vectorized<T, U, VEC>(vals, n1, n2, i1, mu, sigma2, buf,
+                                           rms_only);
+
+    if (i1 < n1) {
+      const T *lvals = vals + i1 * n2;
+      V *ovals = output_vals + i1 * n2;
+      const in_vec_t *vvals = reinterpret_cast<const in_vec_t *>(lvals);
+      out_vec_t *vovals = reinterpret_cast<out_vec_t *>(ovals);
+      U c_invvar = rsqrt(sigma2 + epsilon);
+      const int numx = blockDim.x * blockDim.y;
+      const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+      const int nvec = n2 / VEC;
+      for (int i = thrx; i < nvec; i += numx) {
+        const in_vec_t curr_vec = vvals[i];
+        out_vec_t out_vec;
+        if (affine) {
+          const out_vec_t gamma_vec = vgamma[i];
           if (!rms_only) {
-            sum_loss1 += c_loss * gamma[l + k];
-            sum_loss2 += c_loss * gamma[l + k] * (c_h - c_mean) * c_invvar;
+            const out_vec_t beta_vec = vbeta[i];
+#pragma unroll
+            for (int k = 0; k < VEC; ++k) {
+              U curr = static_cast<U>(curr_vec.val[k]);
+              out_vec.val[k] =
+                  gamma_vec.val[k] * static_cast<V>(c_invvar * (curr - mu)) +
+                  beta_vec.val[k];
+            }
           } else {
-            sum_loss2 += c_loss * gamma[l + k] * (c_h)*c_invvar;
+#pragma unroll
+            for (int k = 0; k < VEC; ++k) {
+              U curr = static_cast<U>(curr_vec.val[k]);
+              out_vec.val[k] =
+                  gamma_vec.val[k] * static_cast<V>(c_invvar * curr);
+            }
           }
-        }
-      }
-      for (; l < n2; ++l) {
-        const U c_h = static_cast<U>(k_input[l]);
-        const U c_loss = static_cast<U>(k_dout[l]);
-        if (!rms_only) {
-          sum_loss1 += c_loss * gamma[l];
-          sum_loss2 += c_loss * gamma[l] * (c_h - c_mean) * c_invvar;
         } else {
-          sum_loss2 += c_loss * gamma[l] * (c_h)*c_invvar;
+#pragma unroll
+          for (int k = 0; k < VEC; ++k) {
+            U curr = static_cast<U>(curr_vec.val[k]);
+            if (!rms_only) {
+              out_vec.val[k] = static_cast<V>(c_invvar * (curr - mu));
+            } else {
+              out_vec.val[k] = static_cast<V>(c_invvar * curr);
+            }
+          }
         }
+        vovals[i] = out_vec;
       }
-    } else {
-      int l = 4 * thrx;
-      for (; l + 3 < n2; l += 4 * numx) {
-        for (int k = 0; k < 4; ++k) {
-          const U c_h = static_cast<U>(k_input[l + k]);
-          const U c_loss = static_cast<U>(k_dout[l + k]);
+      // scalar tail
+      for (int i = nvec * VEC + thrx; i < n2; i += numx) {
+        U curr = static_cast<U>(lvals[i]);
+        if (affine) {
+          if (!rms_only) {
+            ovals[i] =
+                gamma[i] * static_cast<V>(c_invvar * (curr - mu)) + beta[i];
+          } else {
+            ovals[i] = gamma[i] * static_cast<V>(c_invvar * curr);
+          }
+        } else {
           if (!rms_only) {
-            sum_loss1 += c_loss;
-            sum_loss2 += c_loss * (c_h - c_mean) * c_invvar;
+            ovals[i] = static_cast<V>(c_invvar * (curr - mu));
           } else {
-            sum_loss2 += c_loss * (c_h)*c_invvar;
+            ovals[i] = static_cast<V>(c_invvar * curr);
           }
         }
       }
-      for (; l < n2; ++l) {
-        const U c_h = static_cast<U>(k_input[l]);
-        const U c_loss = static_cast<U>(k_dout[l]);
+      if (threadIdx.x == 0 && threadIdx.y == 0) {
         if (!rms_only) {
-          sum_loss1 += c_loss;
-          sum_loss2 += c_loss * (c_h - c_mean) * c_invvar;
+          mean[i1] = mu;
+        }
+        invvar[i1] = c_invvar;
+      }
+    }
+    __syncthreads();
+  }
+}
+
+template <typename T, typename U, typename V, int VEC>
+__global__ void cuApplyLayerNormVectorized(
+    V *__restrict__ output_vals, U *__restrict__ mean, U *__restrict__ invvar,
+    const T *__restrict__ vals, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta) {
+  cuApplyLayerNormVectorized_<T, U, V, VEC>(output_vals, mean, invvar, vals,
+                                            n1, n2, epsilon, gamma, beta,
+                                            false);
+}
+
+template <typename T, typename U, typename V, int VEC>
+__global__ void
+cuApplyRMSNormVectorized(V *__restrict__ output_vals, U *__restrict__ invvar,
+                         const T *__restrict__ vals, const int n1,
+                         const int n2, const U epsilon,
+                         const V *__restrict__ gamma) {
+  cuApplyLayerNormVectorized_<T, U, V, VEC>(output_vals, NULL, invvar, vals,
+                                            n1, n2, epsilon, gamma, NULL, true);
+}
+
+template <typename U, int WARPS_PER_ROW>
+__device__ U cuRowReduceSum(U val, U *buf) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) WARPS_PER_ROW > 1 implies blockDim.y == WARPS_PER_ROW and
+  //    WARPS_PER_ROW*sizeof(U) shared memory available.
+  //
+  // every thread of the row receives the sum
+  for (int mask = 16; mask > 0; mask /= 2) {
+    val += WARP_SHFL_XOR(val, mask);
+  }
+  if (WARPS_PER_ROW > 1) {
+    if (threadIdx.x == 0) {
+      buf[threadIdx.y] = val;
+    }
+    __syncthreads();
+    val = U(0);
+#pragma unroll
+    for (int w = 0; w < WARPS_PER_ROW; ++w) {
+      val += buf[w];
+    }
+    // prevent race where buf is written again before reads are done
+    __syncthreads();
+  }
+  return val;
+}
+
+template <typename T, typename U, typename V, int N2, int WARPS_PER_ROW,
+          int VEC>
+__device__ void cuApplyLayerNormRegister_(
+    V *__restrict__ output_vals, U *__restrict__ mean, U *__restrict__ invvar,
+    const T *__restrict__ vals, const int n1, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) blockDim.y is a multiple of WARPS_PER_ROW, WARPS_PER_ROW warps
+  //    cooperate on one row and there is one row per block if
+  //    WARPS_PER_ROW > 1
+  // 3) Tensors are contiguous, aligned to VEC elements and n2 == N2
+  //
+  // The whole row is kept in registers, so the input is read exactly once.
+  constexpr int ROW_THREADS = 32 * WARPS_PER_ROW;
+  constexpr int VECS_PER_THREAD = N2 / (ROW_THREADS * VEC);
+  static_assert(N2 % (ROW_THREADS * VEC) == 0,
+                "N2 must be divisible by the number of elements per row pass");
+  using in_vec_t = AlignedVector<T, VEC>;
+  using out_vec_t = AlignedVector<V, VEC>;
+  SharedMemory<U> shared;
+  U *buf = shared.getPointer();
+  const bool affine = gamma != NULL && (beta != NULL || rms_only);
+  const out_vec_t *vgamma = reinterpret_cast<const out_vec_t *>(gamma);
+  const out_vec_t *vbeta = reinterpret_cast<const out_vec_t *>(beta);
+  const int rows_per_block = blockDim.y / WARPS_PER_ROW;
+  const int row_thrx = threadIdx.x + (threadIdx.y % WARPS_PER_ROW) * 32;
+  for (int i1 = blockIdx.y * rows_per_block + threadIdx.y / WARPS_PER_ROW;
+       i1 < n1; i1 += gridDim.y * rows_per_block) {
+    const in_vec_t *vvals = reinterpret_cast<const in_vec_t *>(vals + i1 * N2);
+    out_vec_t *vovals = reinterpret_cast<out_vec_t *>(output_vals + i1 * N2);
+    U regs[VECS_PER_THREAD * VEC];
+    U sum = U(0);
+#pragma unroll
+    for (int j = 0; j < VECS_PER_THREAD; ++j) {
+      const in_vec_t curr_vec = vvals[row_thrx + j * ROW_THREADS];
+#pragma unroll
+      for (int k = 0; k < VEC; ++k) {
+        regs[j * VEC + k] = static_cast<U>(curr_vec.val[k]);
+        sum += regs[j * VEC + k];
+      }
+    }
+    U mu = U(0);
+    if (!rms_only) {
+      mu = cuRowReduceSum<U, WARPS_PER_ROW>(sum, buf) / U(N2);
+    }
+    // second pass over the registers, (x - mu)^2 is exact for the variance
+    U sum_sq = U(0);
+#pragma unroll
+    for (int l = 0; l < VECS_PER_THREAD * VEC; ++l) {
+      const U diff = regs[l] - mu;
+      sum_sq += diff * diff;
+    }
+    const U sigma2 = cuRowReduceSum<U, WARPS_PER_ROW>(sum_sq, buf) / U(N2);
+    const U c_invvar = rsqrt(sigma2 + epsilon);
+#pragma unroll
+    for (int j = 0; j < VECS_PER_THREAD; ++j) {
+      const int idx = row_thrx + j * ROW_THREADS;
+      out_vec_t out_vec;
+      if (affine) {
+        const out_vec_t gamma_vec = vgamma[idx];
+        if (!rms_only) {
+          const out_vec_t beta_vec = vbeta[idx];
+#pragma unroll
+          for (int k = 0; k < VEC; ++k) {
+            out_vec.val[k] = gamma_vec.val[k] *
+                                 static_cast<V>(c_invvar *
+                                                (regs[j * VEC + k] - mu)) +
+                             beta_vec.val[k];
+          }
         } else {
-          sum_loss2 += c_loss * (c_h)*c_invvar;
+#pragma unroll
+          for (int k = 0; k < VEC; ++k) {
+            out_vec.val[k] = gamma_vec.val[k] *
+                             static_cast<V>(c_invvar * regs[j * VEC + k]);
+          }
+        }
+      } else {
+#pragma unroll
+        for (int k = 0; k < VEC; ++k) {
+          out_vec.val[k] = static_cast<V>(c_invvar * (regs[j * VEC + k] - mu));
         }
       }
+      vovals[idx] = out_vec;
     }
-    // intra-warp reductions
-    for (int mask = blockDim.x / 2; mask > 0; mask /= 2) {
+    if (row_thrx == 0) {
       if (!rms_only) {
-        sum_loss1 += WARP_SHFL_XOR(sum_loss1, mask);
+        mean[i1] = mu;
       }
-      sum_loss2 += WARP_SHFL_XOR(sum_loss2, mask);
+      invvar[i1] = c_invvar;
     }
-    // inter-warp reductions
-    if (blockDim.y > 1) {
-      SharedMemory<U> shared;
-      U *buf = shared.getPointer();
-      for (int offset = blockDim.y / 2; offset > 0; offset /= 2) {
-        // upper half of warps write to shared
-        if (threadIdx.y >= offset && threadIdx.y < 2 * offset) {
-          const int wrt_i = (threadIdx.y - offset) * blockDim.x + threadIdx.x;
+  }
+}
+
+template <typename T, typename U, typename V, int N2, int WARPS_PER_ROW,
+          int VEC>
+__global__ void cuApplyLayerNormRegister(
+    V *__restrict__ output_vals, U *__restrict__ mean, U *__restrict__ invvar,
+    const T *__restrict__ vals, const int n1, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta) {
+  cuApplyLayerNormRegister_<T, U, V, N2, WARPS_PER_ROW, VEC>(
+      output_vals, mean, invvar, vals, n1, epsilon, gamma, beta, false);
+}
+
+template <typename T, typename U, typename V, int N2, int WARPS_PER_ROW,
+          int VEC>
+__global__ void
+cuApplyRMSNormRegister(V *__restrict__ output_vals, U *__restrict__ invvar,
+                       const T *__restrict__ vals, const int n1,
+                       const U epsilon, const V *__restrict__ gamma) {
+  cuApplyLayerNormRegister_<T, U, V, N2, WARPS_PER_ROW, VEC>(
+      output_vals, NULL, invvar, vals, n1, epsilon, gamma, NULL, true);
+}
+
+template <typename T, typename U, typename V>
+__device__ void cuApplyLayerNormResidual_(
+    V *__restrict__ output_vals, T *__restrict__ sum_vals,
+    uint8_t *__restrict__ mask, U *__restrict__ mean, U *__restrict__ invvar,
+    const T *__restrict__ vals, const T *__restrict__ residual,
+    const T *__restrict__ bias, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta, const float p,
+    const uint64_t seed, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) Tensors are contiguous
+  // 3) blockDim.z rows are normalized per block, blockDim.z > 1 implies
+  //    blockDim.y == 1 (see GetLayerNormLaunchConfig)
+  // 4) mask == NULL disables dropout
+  //
+  // sum = residual + dropout(vals + bias) is computed in the load phase and
+  // written out for the backward pass, each thread reads back only the
+  // elements it has written itself.
+  const U scale = p < 1.0f ? U(1) / (U(1) - U(p)) : U(0);
+  const int numx = blockDim.x * blockDim.y;
+  const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    SharedMemory<U> shared;
+    U *buf = shared.getPointer();
+    U count = U(0);
+    U mu = U(0);
+    U sigma2 = U(0);
+    if (i1 < n1) {
+      const T *lvals = vals + i1 * n2;
+      const T *lresidual = residual + i1 * n2;
+      T *lsum = sum_vals + i1 * n2;
+      curandStatePhilox4_32_10_t state;
+      if (mask != NULL) {
+        curand_init(seed, (uint64_t)i1 * numx + thrx, 0, &state);
+      }
+      for (int i = thrx; i < n2; i += numx) {
+        U curr = static_cast<U>(lvals[i]) + static_cast<U>(bias[i]);
+        if (mask != NULL) {
+          const uint8_t keep = curand_uniform(&state) > p;
+          mask[i1 * n2 + i] = keep;
+          curr = keep ? curr * scale : U(0);
+        }
+        curr += static_cast<U>(lresidual[i]);
+        // normalize exactly what the backward pass will see
+        const T curr_sum = static_cast<T>(curr);
+        lsum[i] = curr_sum;
+        curr = static_cast<U>(curr_sum);
+        if (!rms_only) {
+          cuWelfordOnlineSum<U>(curr, mu, sigma2, count);
+        } else {
+          cuRMSOnlineSum<U>(curr, sigma2);
+        }
+      }
+      cuWelfordReduce<U>(mu, sigma2, count, buf, n2, rms_only);
+
+      V *ovals = output_vals + i1 * n2;
+      U c_invvar = rsqrt(sigma2 + epsilon);
+      if (gamma != NULL && (beta != NULL || rms_only)) {
+        for (int i = thrx; i < n2; i += numx) {
+          U curr = static_cast<U>(lsum[i]);
           if (!rms_only) {
-            buf[2 * wrt_i] = sum_loss1;
+            ovals[i] =
+                gamma[i] * static_cast<V>(c_invvar * (curr - mu)) + beta[i];
+          } else {
+            ovals[i] = gamma[i] * static_cast<V>(c_invvar * curr);
           }
-          buf[2 * wrt_i + 1] = sum_loss2;
         }
-        __syncthreads();
-        // lower half merges
-        if (threadIdx.y < offset) {
-          const int read_i = threadIdx.y * blockDim.x + threadIdx.x;
+      } else {
+        for (int i = thrx; i < n2; i += numx) {
+          U curr = static_cast<U>(lsum[i]);
           if (!rms_only) {
-            sum_loss1 += buf[2 * read_i];
+            ovals[i] = static_cast<V>(c_invvar * (curr - mu));
+          } else {
+            ovals[i] = static_cast<V>(c_invvar * curr);
           }
-          sum_loss2 += buf[2 * read_i + 1];
         }
-        __syncthreads();
       }
-      if (threadIdx.y == 0) {
+      if (threadIdx.x == 0 && threadIdx.y == 0) {
         if (!rms_only) {
-          buf[2 * threadIdx.x] = sum_loss1;
+          mean[i1] = mu;
         }
-        buf[2 * threadIdx.x + 1] = sum_loss2;
+        invvar[i1] = c_invvar;
       }
-      __syncthreads();
-      if (threadIdx.y != 0) {
+    }
+    __syncthreads();
+  }
+}
+
+template <typename T, typename U, typename V = T>
+__global__ void cuApplyLayerNormResidual(
+    V *__restrict__ output_vals, T *__restrict__ sum_vals,
+    uint8_t *__restrict__ mask, U *__restrict__ mean, U *__restrict__ invvar,
+    const T *__restrict__ vals, const T *__restrict__ residual,
+    const T *__restrict__ bias, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma, const V *__restrict__ beta, const float p,
+    const uint64_t seed) {
+  cuApplyLayerNormResidual_<T, U, V>(output_vals, sum_vals, mask, mean, invvar,
+                                     vals, residual, bias, n1, n2, epsilon,
+                                     gamma, beta, p, seed, false);
+}
+
+template <typename T, typename U, typename V = T>
+__global__ void cuApplyRMSNormResidual(
+    V *__restrict__ output_vals, T *__restrict__ sum_vals,
+    uint8_t *__restrict__ mask, U *__restrict__ invvar,
+    const T *__restrict__ vals, const T *__restrict__ residual,
+    const T *__restrict__ bias, const int n1, const int n2, const U epsilon,
+    const V *__restrict__ gamma, const float p, const uint64_t seed) {
+  cuApplyLayerNormResidual_<T, U, V>(output_vals, sum_vals, mask, NULL, invvar,
+                                     vals, residual, bias, n1, n2, epsilon,
+                                     gamma, NULL, p, seed, true);
+}
+
+template <typename T, typename U>
+__global__ void
+cuComputeResidualDropoutGrad(T *__restrict__ grad_sum,
+                             const T *__restrict__ dsum,
+                             const uint8_t *__restrict__ mask, const U scale,
+                             const int64_t numel, T *__restrict__ grad_input) {
+  // grad_sum += dsum, grad_input = grad_sum * mask * scale
+  for (int64_t i = blockIdx.x * (int64_t)blockDim.x + threadIdx.x; i < numel;
+       i += (int64_t)gridDim.x * blockDim.x) {
+    const U curr = static_cast<U>(grad_sum[i]) + static_cast<U>(dsum[i]);
+    grad_sum[i] = static_cast<T>(curr);
+    if (mask != NULL) {
+      grad_input[i] = static_cast<T>(mask[i] ? curr * scale : U(0));
+    } else {
+      grad_input[i] = static_cast<T>(curr);
+    }
+  }
+}
+
+template <typename T, typename U, typename V>
+__device__ void cuLoadWriteStridedInputs(
+    const int i1_block, const int thr_load_row_off, const int thr_load_col_off,
+    const int i2_off, const int row_stride, U *warp_buf1, U *warp_buf2,
+    const T *input, const V *dout, const int i1_end, const int n2,
+    const U *__restrict__ mean, const U *__restrict__ invvar, bool rms_only) {
+  int i1 = i1_block + thr_load_row_off;
+  if (i1 < i1_end) {
+    U curr_mean;
+    if (!rms_only) {
+      curr_mean = mean[i1];
+    }
+    U curr_invvar = invvar[i1];
+    for (int k = 0; k < blockDim.y; ++k) {
+      int i2 = i2_off + k;
+      int load_idx = i1 * n2 + i2;
+      int write_idx = thr_load_row_off * row_stride + thr_load_col_off + k;
+      if (i2 < n2) {
+        U curr_input = static_cast<U>(input[load_idx]);
+        U curr_dout = static_cast<U>(dout[load_idx]);
         if (!rms_only) {
-          sum_loss1 = buf[2 * threadIdx.x];
+          warp_buf1[write_idx] = curr_dout;
+          warp_buf2[write_idx] =
+              curr_dout * (curr_input - curr_mean) * curr_invvar;
+        } else {
+          warp_buf2[write_idx] = curr_dout * (curr_input)*curr_invvar;
         }
-        sum_loss2 = buf[2 * threadIdx.x + 1];
+      } else {
+        if (!rms_only) {
+          warp_buf1[write_idx] = U(0);
+        }
+        warp_buf2[write_idx] = U(0);
       }
     }
-    // all threads now have the two sums over l
-    U fH = (U)n2;
-    U term1 = (U(1) / fH) * c_invvar;
-    T *k_grad_input = grad_input + i1 * n2;
-    if (gamma != NULL) {
-      for (int l = thrx; l < n2; l += numx) {
-        const U c_h = static_cast<U>(k_input[l]);
-        const U c_loss = static_cast<U>(k_dout[l]);
-        U f_grad_input = fH * c_loss * gamma[l];
+  } else {
+    for (int k = 0; k < blockDim.y; ++k) {
+      int write_idx = thr_load_row_off * row_stride + thr_load_col_off + k;
+      if (!rms_only) {
+        warp_buf1[write_idx] = U(0);
+      }
+      warp_buf2[write_idx] = U(0);
+    }
+  }
+}
+
+template <typename T, typename U, typename V>
+__device__ void cuLoadAddStridedInputs(
+    const int i1_block, const int thr_load_row_off, const int thr_load_col_off,
+    const int i2_off, const int row_stride, U *warp_buf1, U *warp_buf2,
+    const T *input, const V *dout, const int i1_end, const int n2,
+    const U *__restrict__ mean, const U *__restrict__ invvar, bool rms_only) {
+  int i1 = i1_block + thr_load_row_off;
+  if (i1 < i1_end) {
+    U curr_mean;
+    if (!rms_only) {
+      curr_mean = mean[i1];
+    }
+    U curr_invvar = invvar[i1];
+    for (int k = 0; k < blockDim.y; ++k) {
+      int i2 = i2_off + k;
+      int load_idx = i1 * n2 + i2;
+      int write_idx = thr_load_row_off * row_stride + thr_load_col_off + k;
+      if (i2 < n2) {
+        U curr_input = static_cast<U>(input[load_idx]);
+        U curr_dout = static_cast<U>(dout[load_idx]);
         if (!rms_only) {
-          f_grad_input -= sum_loss1;
-          f_grad_input -= (c_h - c_mean) * c_invvar * sum_loss2;
+          warp_buf1[write_idx] += curr_dout;
+          warp_buf2[write_idx] +=
+              curr_dout * (curr_input - curr_mean) * curr_invvar;
         } else {
-          f_grad_input -= (c_h)*c_invvar * sum_loss2;
+          warp_buf2[write_idx] += curr_dout * (curr_input)*curr_invvar;
         }
-        f_grad_input *= term1;
-        k_grad_input[l] = static_cast<T>(f_grad_input);
       }
-    } else {
-      for (int l = thrx; l < n2; l += numx) {
-        const U c_h = static_cast<U>(k_input[l]);
-        const U c_loss = static_cast<U>(k_dout[l]);
-        U f_grad_input = fH * c_loss;
+    }
+  }
+}
+
+template <typename T, typename U, typename V>
+__device__ void cuComputePartGradGammaBeta_(
+    const V *__restrict__ dout, const T *__restrict__ input, const int n1,
+    const int n2, const U *__restrict__ mean, const U *__restrict__ invvar,
+    U epsilon, U *part_grad_gamma, U *part_grad_beta, bool rms_only,
+    const int i2_tile) {
+  // i2_tile is the column tile of this block, blockIdx.x unless launched
+  // for several tensors at once
+  const int numsegs_n1 =
+      (n1 + blockDim.y * blockDim.y - 1) / (blockDim.y * blockDim.y);
+  const int segs_per_block = (numsegs_n1 + gridDim.y - 1) / gridDim.y;
+  const int i1_beg = blockIdx.y * segs_per_block * blockDim.y * blockDim.y;
+  const int i1_beg_plus_one =
+      (blockIdx.y + 1) * segs_per_block * blockDim.y * blockDim.y;
+  const int i1_end = i1_beg_plus_one < n1 ? i1_beg_plus_one : n1;
+  const int row_stride = blockDim.x + 1;
+  const int thr_load_col_off = (threadIdx.x * blockDim.y) & (blockDim.x - 1);
+  const int thr_load_row_off =
+      (threadIdx.x * blockDim.y) / blockDim.x + threadIdx.y * blockDim.y;
+  const int i2_off = i2_tile * blockDim.x + thr_load_col_off;
+  SharedMemory<U> shared;
+  U *buf = shared.getPointer(); // buf has at least blockDim.x * blockDim.y *
+                                // blockDim.y + (blockDim.y -
+                                // 1)*(blockDim.x/blockDim.y) elements
+  U *warp_buf1 = (U *)buf;
+  U *warp_buf2 = warp_buf1 + blockDim.y * blockDim.y * row_stride;
+  // compute partial sums from strided inputs
+  // do this to increase number of loads in flight
+  cuLoadWriteStridedInputs(i1_beg, thr_load_row_off, thr_load_col_off, i2_off,
+                           row_stride, warp_buf1, warp_buf2, input, dout,
+                           i1_end, n2, mean, invvar, rms_only);
+  for (int i1_block = i1_beg + blockDim.y * blockDim.y; i1_block < i1_end;
+       i1_block += blockDim.y * blockDim.y) {
+    cuLoadAddStridedInputs(i1_block, thr_load_row_off, thr_load_col_off, i2_off,
+                           row_stride, warp_buf1, warp_buf2, input, dout,
+                           i1_end, n2, mean, invvar, rms_only);
+  }
+  __syncthreads();
+  // inter-warp reductions
+  // sum within each warp
+  U acc1 = U(0);
+  U acc2 = U(0);
+  for (int k = 0; k < blockDim.y; ++k) {
+    int row1 = threadIdx.y + k * blockDim.y;
+    int idx1 = row1 * row_stride + threadIdx.x;
+    if (!rms_only) {
+      acc1 += warp_buf1[idx1];
+    }
+    acc2 += warp_buf2[idx1];
+  }
+  if (!rms_only) {
+    warp_buf1[threadIdx.y * row_stride + threadIdx.x] = acc1;
+  }
+  warp_buf2[threadIdx.y * row_stride + threadIdx.x] = acc2;
+  __syncthreads();
+  // sum all warps
+  for (int offset = blockDim.y / 2; offset > 1; offset /= 2) {
+    if (threadIdx.y < offset) {
+      int row1 = threadIdx.y;
+      int row2 = threadIdx.y + offset;
+      int idx1 = row1 * row_stride + threadIdx.x;
+      int idx2 = row2 * row_stride + threadIdx.x;
+      if (!rms_only) {
+        warp_buf1[idx1] += warp_buf1[idx2];
+      }
+      warp_buf2[idx1] += warp_buf2[idx2];
+    }
+    __syncthreads();
+  }
+  int i2 = i2_tile * blockDim.x + threadIdx.x;
+  if (threadIdx.y == 0 && i2 < n2) {
+    int row1 = threadIdx.y;
+    int row2 = threadIdx.y + 1;
+    int idx1 = row1 * row_stride + threadIdx.x;
+    int idx2 = row2 * row_stride + threadIdx.x;
+    if (!rms_only) {
+      part_grad_beta[blockIdx.y * n2 + i2] = warp_buf1[idx1] + warp_buf1[idx2];
+    }
+    part_grad_gamma[blockIdx.y * n2 + i2] = warp_buf2[idx1] + warp_buf2[idx2];
+  }
+}
+
+template <typename U, typename V>
+__device__ void
+cuFinishGradGammaBeta_(const int i2_tile, const int n2,
+                       const U *part_grad_gamma, const U *part_grad_beta,
+                       unsigned int *counter, V *grad_gamma, V *grad_beta,
+                       bool rms_only) {
+  // Assumptions:
+  // 1) called by every block of the column tile after it wrote its partial
+  //    row with cuComputePartGradGammaBeta_, gridDim.y blocks per tile
+  // 2) *counter is zero on entry and is reset to zero by the last block of
+  //    the column tile, so the workspace can be reused by the next launch on
+  //    the same stream without clearing
+  //
+  // publish the partial sums before signalling that this block is done
+  __threadfence();
+  __syncthreads();
+  __shared__ bool is_last_block;
+  if (threadIdx.x == 0 && threadIdx.y == 0) {
+    is_last_block = atomicAdd(counter, 1u) == gridDim.y - 1;
+  }
+  __syncthreads();
+  if (!is_last_block) {
+    return;
+  }
+  // the last block of a column tile sums the partial rows of all blocks,
+  // bypassing L1 since they were written by other SMs
+  SharedMemory<U> shared;
+  U *buf = shared.getPointer();
+  const int i2 = i2_tile * blockDim.x + threadIdx.x;
+  U sum_gamma = U(0);
+  U sum_beta = U(0);
+  if (i2 < n2) {
+    for (int k = threadIdx.y; k < gridDim.y; k += blockDim.y) {
+      sum_gamma += __ldcg(part_grad_gamma + k * n2 + i2);
+      if (!rms_only) {
+        sum_beta += __ldcg(part_grad_beta + k * n2 + i2);
+      }
+    }
+  }
+  // inter-warp reductions
+  const int nbsize3 = blockDim.x * blockDim.y / 2;
+  for (int offset = blockDim.y / 2; offset >= 1; offset /= 2) {
+    // top half write to shared memory
+    if (threadIdx.y >= offset && threadIdx.y < 2 * offset) {
+      const int write_idx = (threadIdx.y - offset) * blockDim.x + threadIdx.x;
+      buf[write_idx] = sum_gamma;
+      if (!rms_only) {
+        buf[write_idx + nbsize3] = sum_beta;
+      }
+    }
+    __syncthreads();
+    // bottom half sums
+    if (threadIdx.y < offset) {
+      const int read_idx = threadIdx.y * blockDim.x + threadIdx.x;
+      sum_gamma += buf[read_idx];
+      if (!rms_only) {
+        sum_beta += buf[read_idx + nbsize3];
+      }
+    }
+    __syncthreads();
+  }
+  // write out fully summed gradients
+  if (threadIdx.y == 0 && i2 < n2) {
+    grad_gamma[i2] = sum_gamma;
+    if (!rms_only) {
+      grad_beta[i2] = sum_beta;
+    }
+  }
+  if (threadIdx.x == 0 && threadIdx.y == 0) {
+    *counter = 0;
+  }
+}
+
+template <typename T, typename U, typename V>
+__global__ void cuComputeGradGammaBetaSinglePass(
+    const V *__restrict__ dout, const T *__restrict__ input, const int n1,
+    const int n2, const U *__restrict__ mean, const U *__restrict__ invvar,
+    U epsilon, U *part_grad_gamma, U *part_grad_beta, unsigned int *counters,
+    V *grad_gamma, V *grad_beta, bool rms_only) {
+  // Assumptions:
+  // 1) gridDim == (ceil(n2 / blockDim.x), part_size)
+  // 2) counters holds gridDim.x zeroed counters, see cuFinishGradGammaBeta_
+  //
+  cuComputePartGradGammaBeta_(dout, input, n1, n2, mean, invvar, epsilon,
+                              part_grad_gamma, part_grad_beta, rms_only,
+                              blockIdx.x);
+  cuFinishGradGammaBeta_(blockIdx.x, n2, part_grad_gamma, part_grad_beta,
+                         &counters[blockIdx.x], grad_gamma, grad_beta,
+                         rms_only);
+}
+
+template <typename T, typename U, typename V>
+__device__ void cuComputeGradInputSums_(const V *__restrict__ k_dout,
+                                        const T *__restrict__ k_input,
+                                        const int n2, const U c_mean,
+                                        const U c_invvar, const V *gamma,
+                                        U &sum_loss1, U &sum_loss2,
+                                        bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) blockDim.y*blockDim.x*2*sizeof(U) shared memory available if
+  //    blockDim.y > 1
+  //
+  // on return every thread of the row holds the two sums over n2
+  sum_loss1 = U(0);
+  sum_loss2 = U(0);
+  const int numx = blockDim.x * blockDim.y;
+  const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+  if (gamma != NULL) {
+    int l = 4 * thrx;
+    for (; l + 3 < n2; l += 4 * numx) {
+      for (int k = 0; k < 4; ++k) {
+        const U c_h = static_cast<U>(k_input[l + k]);
+        const U c_loss = static_cast<U>(k_dout[l + k]);
         if (!rms_only) {
-          f_grad_input -= sum_loss1;
-          f_grad_input -= (c_h - c_mean) * c_invvar * sum_loss2;
+          sum_loss1 += c_loss * gamma[l + k];
+          sum_loss2 += c_loss * gamma[l + k] * (c_h - c_mean) * c_invvar;
         } else {
-          f_grad_input -= (c_h)*c_invvar * sum_loss2;
+          sum_loss2 += c_loss * gamma[l + k] * (c_h)*c_invvar;
+        }
+      }
+    }
+    for (; l < n2; ++l) {
+      const U c_h = static_cast<U>(k_input[l]);
+      const U c_loss = static_cast<U>(k_dout[l]);
+      if (!rms_only) {
+        sum_loss1 += c_loss * gamma[l];
+        sum_loss2 += c_loss * gamma[l] * (c_h - c_mean) * c_invvar;
+      } else {
+        sum_loss2 += c_loss * gamma[l] * (c_h)*c_invvar;
+      }
+    }
+  } else {
+    int l = 4 * thrx;
+    for (; l + 3 < n2; l += 4 * numx) {
+      for (int k = 0; k < 4; ++k) {
+        const U c_h = static_cast<U>(k_input[l + k]);
+        const U c_loss = static_cast<U>(k_dout[l + k]);
+        if (!rms_only) {
+          sum_loss1 += c_loss;
+          sum_loss2 += c_loss * (c_h - c_mean) * c_invvar;
+        } else {
+          sum_loss2 += c_loss * (c_h)*c_invvar;
+        }
+      }
+    }
+    for (; l < n2; ++l) {
+      const U c_h = static_cast<U>(k_input[l]);
+      const U c_loss = static_cast<U>(k_dout[l]);
+      if (!rms_only) {
+        sum_loss1 += c_loss;
+        sum_loss2 += c_loss * (c_h - c_mean) * c_invvar;
+      } else {
+        sum_loss2 += c_loss * (c_h)*c_invvar;
+      }
+    }
+  }
+  // intra-warp reductions
+  for (int mask = blockDim.x / 2; mask > 0; mask /= 2) {
+    if (!rms_only) {
+      sum_loss1 += WARP_SHFL_XOR(sum_loss1, mask);
+    }
+    sum_loss2 += WARP_SHFL_XOR(sum_loss2, mask);
+  }
+  // inter-warp reductions
+  if (blockDim.y > 1) {
+    SharedMemory<U> shared;
+    U *buf = shared.getPointer();
+    for (int offset = blockDim.y / 2; offset > 0; offset /= 2) {
+      // upper half of warps write to shared
+      if (threadIdx.y >= offset && threadIdx.y < 2 * offset) {
+        const int wrt_i = (threadIdx.y - offset) * blockDim.x + threadIdx.x;
+        if (!rms_only) {
+          buf[2 * wrt_i] = sum_loss1;
+        }
+        buf[2 * wrt_i + 1] = sum_loss2;
+      }
+      __syncthreads();
+      // lower half merges
+      if (threadIdx.y < offset) {
+        const int read_i = threadIdx.y * blockDim.x + threadIdx.x;
+        if (!rms_only) {
+          sum_loss1 += buf[2 * read_i];
         }
-        f_grad_input *= term1;
-        k_grad_input[l] = static_cast<T>(f_grad_input);
+        sum_loss2 += buf[2 * read_i + 1];
       }
+      __syncthreads();
+    }
+    if (threadIdx.y == 0) {
+      if (!rms_only) {
+        buf[2 * threadIdx.x] = sum_loss1;
+      }
+      buf[2 * threadIdx.x + 1] = sum_loss2;
+    }
+    __syncthreads();
+    if (threadIdx.y != 0) {
+      if (!rms_only) {
+        sum_loss1 = buf[2 * threadIdx.x];
+      }
+      sum_loss2 = buf[2 * threadIdx.x + 1];
+    }
+  }
+}
+
+template <typename T, typename U, typename V>
+__device__ void cuApplyGradInput_(const V *__restrict__ k_dout,
+                                  const T *__restrict__ k_input, const int n2,
+                                  const U fH, const U c_mean, const U c_invvar,
+                                  const U sum_loss1, const U sum_loss2,
+                                  const V *gamma, T *k_grad_input,
+                                  bool rms_only) {
+  // fH is the size of the full normalized dimension, which differs from n2
+  // when the row is sharded over a tensor parallel group.
+  const int numx = blockDim.x * blockDim.y;
+  const int thrx = threadIdx.x + threadIdx.y * blockDim.x;
+  const U term1 = (U(1) / fH) * c_invvar;
+  if (gamma != NULL) {
+    for (int l = thrx; l < n2; l += numx) {
+      const U c_h = static_cast<U>(k_input[l]);
+      const U c_loss = static_cast<U>(k_dout[l]);
+      U f_grad_input = fH * c_loss * gamma[l];
+      if (!rms_only) {
+        f_grad_input -= sum_loss1;
+        f_grad_input -= (c_h - c_mean) * c_invvar * sum_loss2;
+      } else {
+        f_grad_input -= (c_h)*c_invvar * sum_loss2;
+      }
+      f_grad_input *= term1;
+      k_grad_input[l] = static_cast<T>(f_grad_input);
+    }
+  } else {
+    for (int l = thrx; l < n2; l += numx) {
+      const U c_h = static_cast<U>(k_input[l]);
+      const U c_loss = static_cast<U>(k_dout[l]);
+      U f_grad_input = fH * c_loss;
+      if (!rms_only) {
+        f_grad_input -= sum_loss1;
+        f_grad_input -= (c_h - c_mean) * c_invvar * sum_loss2;
+      } else {
+        f_grad_input -= (c_h)*c_invvar * sum_loss2;
+      }
+      f_grad_input *= term1;
+      k_grad_input[l] = static_cast<T>(f_grad_input);
+    }
+  }
+}
+
+template <typename T, typename U, typename V>
+__global__ void
+cuComputeGradInput(const V *__restrict__ dout, const T *__restrict__ input,
+                   const int n1, const int n2, const U *__restrict__ mean,
+                   const U *__restrict__ invvar, U epsilon, const V *gamma,
+                   T *grad_input, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) blockDim.z rows are processed per block, blockDim.z > 1 implies
+  //    blockDim.y == 1 (see GetLayerNormLaunchConfig)
+  //
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    if (i1 < n1) {
+      const U c_mean = !rms_only ? mean[i1] : U(0);
+      const U c_invvar = invvar[i1];
+      const T *k_input = input + i1 * n2;
+      const V *k_dout = dout + i1 * n2;
+      U sum_loss1, sum_loss2;
+      cuComputeGradInputSums_(k_dout, k_input, n2, c_mean, c_invvar, gamma,
+                              sum_loss1, sum_loss2, rms_only);
+      cuApplyGradInput_(k_dout, k_input, n2, U(n2), c_mean, c_invvar,
+                        sum_loss1, sum_loss2, gamma, grad_input + i1 * n2,
+                        rms_only);
+    }
+    // prevent race where buf is written again before reads are done
+    __syncthreads();
+  }
+}
+
+template <typename T, typename U, typename V>
+__global__ void cuComputeGradInputPartialSums(
+    U *__restrict__ sums, const V *__restrict__ dout,
+    const T *__restrict__ input, const int n1, const int n2,
+    const U *__restrict__ mean, const U *__restrict__ invvar, const V *gamma,
+    bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize
+  // 2) blockDim.z rows are processed per block, blockDim.z > 1 implies
+  //    blockDim.y == 1 (see GetLayerNormLaunchConfig)
+  // 3) sums is laid out as [n1, 2] holding (sum_loss1, sum_loss2) over the
+  //    local shard of the row
+  //
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    if (i1 < n1) {
+      const U c_mean = !rms_only ? mean[i1] : U(0);
+      U sum_loss1, sum_loss2;
+      cuComputeGradInputSums_(dout + i1 * n2, input + i1 * n2, n2, c_mean,
+                              invvar[i1], gamma, sum_loss1, sum_loss2,
+                              rms_only);
+      if (threadIdx.x == 0 && threadIdx.y == 0) {
+        sums[2 * i1] = sum_loss1;
+        sums[2 * i1 + 1] = sum_loss2;
+      }
+    }
+    __syncthreads();
+  }
+}
+
+template <typename T, typename U, typename V>
+__global__ void cuComputeGradInputWithSums(
+    const V *__restrict__ dout, const T *__restrict__ input, const int n1,
+    const int n2, const int n2_global, const U *__restrict__ mean,
+    const U *__restrict__ invvar, const U *__restrict__ sums, const V *gamma,
+    T *grad_input, bool rms_only) {
+  // Assumptions:
+  // 1) sums holds (sum_loss1, sum_loss2) already reduced over all shards of
+  //    the row, see cuComputeGradInputPartialSums
+  //
+  for (auto i1_block = blockIdx.y * blockDim.z; i1_block < n1;
+       i1_block += gridDim.y * blockDim.z) {
+    const int i1 = i1_block + threadIdx.z;
+    if (i1 < n1) {
+      const U c_mean = !rms_only ? mean[i1] : U(0);
+      cuApplyGradInput_(dout + i1 * n2, input + i1 * n2, n2, U(n2_global),
+                        c_mean, invvar[i1], sums[2 * i1], sums[2 * i1 + 1],
+                        gamma, grad_input + i1 * n2, rms_only);
     }
-    // prevent race where buf is written again before reads are done
+  }
+}
+
+// Upper bound on the tensors handled by one multi-tensor launch. The table is
+// passed by value as a kernel argument and has to stay below its 4KB limit.
+constexpr int kMultiLayerNormMaxTensors = 24;
+
+template <typename T, typename U, typename V> struct MultiLayerNormDescriptor {
+  const T *input;
+  V *output;
+  const V *dout;
+  T *grad_input;
+  const V *gamma;
+  const V *beta;
+  U *mean;
+  U *invvar;
+  V *grad_gamma;
+  V *grad_beta;
+  U *part_grad_gamma;
+  U *part_grad_beta;
+  int n1;
+  int n2;
+};
+
+template <typename T, typename U, typename V> struct MultiLayerNormTable {
+  MultiLayerNormDescriptor<T, U, V> tensors[kMultiLayerNormMaxTensors];
+  // exclusive prefix sum of the work items (rows or column tiles) per tensor
+  int offsets[kMultiLayerNormMaxTensors + 1];
+  int num_tensors;
+};
+
+__device__ int cuFindTensor(const int *offsets, const int num_tensors,
+                            const int index) {
+  int t = 0;
+  while (t + 1 < num_tensors && offsets[t + 1] <= index) {
+    ++t;
+  }
+  return t;
+}
+
+template <typename T, typename U, typename V>
+__global__ void cuApplyMultiLayerNorm(const MultiLayerNormTable<T, U, V> table,
+                                      const U epsilon, bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize, blockDim.z == 1
+  // 2) table.offsets counts rows, one block normalizes one row at a time
+  //
+  const int num_rows = table.offsets[table.num_tensors];
+  for (int row = blockIdx.y; row < num_rows; row += gridDim.y) {
+    const int t = cuFindTensor(table.offsets, table.num_tensors, row);
+    const MultiLayerNormDescriptor<T, U, V> &desc = table.tensors[t];
+    const int i1 = row - table.offsets[t];
+    SharedMemory<U> shared;
+    U *buf = shared.getPointer();
+    U mu, sigma2;
+    cuWelfordMuSigma2(desc.input, desc.n1, desc.n2, i1, mu, sigma2, buf,
+                      rms_only);
+    cuApplyLayerNormRow_(desc.output + i1 * desc.n2, desc.mean, desc.invvar,
+                         desc.input + i1 * desc.n2, desc.n2, i1, mu, sigma2,
+                         epsilon, desc.gamma, desc.beta, rms_only);
+    __syncthreads();
+  }
+}
+
+template <typename T, typename U, typename V>
+__global__ void
+cuComputeMultiGradInput(const MultiLayerNormTable<T, U, V> table,
+                        bool rms_only) {
+  // Assumptions:
+  // 1) blockDim.x == warpSize, blockDim.z == 1
+  // 2) table.offsets counts rows, as for cuApplyMultiLayerNorm
+  //
+  const int num_rows = table.offsets[table.num_tensors];
+  for (int row = blockIdx.y; row < num_rows; row += gridDim.y) {
+    const int t = cuFindTensor(table.offsets, table.num_tensors, row);
+    const MultiLayerNormDescriptor<T, U, V> &desc = table.tensors[t];
+    const int i1 = row - table.offsets[t];
+    const int n2 = desc.n2;
+    const U c_mean = !rms_only ? desc.mean[i1] : U(0);
+    const U c_invvar = desc.invvar[i1];
+    U sum_loss1, sum_loss2;
+    cuComputeGradInputSums_(desc.dout + i1 * n2, desc.input + i1 * n2, n2,
+                            c_mean, c_invvar, desc.gamma, sum_loss1, sum_loss2,
+                            rms_only);
+    cuApplyGradInput_(desc.dout + i1 * n2, desc.input + i1 * n2, n2, U(n2),
+                      c_mean, c_invvar, sum_loss1, sum_loss2, desc.gamma,
+                      desc.grad_input + i1 * n2, rms_only);
     __syncthreads();
   }
 }
 
+template <typename T, typename U, typename V>
+__global__ void
+cuComputeMultiGradGammaBeta(const MultiLayerNormTable<T, U, V> table,
+                            unsigned int *counters, U epsilon, bool rms_only) {
+  // Assumptions:
+  // 1) table.offsets counts column tiles of blockDim.x columns, gridDim.x is
+  //    the total number of tiles and gridDim.y the shared part_size
+  // 2) counters holds gridDim.x zeroed counters, see cuFinishGradGammaBeta_
+  //
+  const int t = cuFindTensor(table.offsets, table.num_tensors, blockIdx.x);
+  const MultiLayerNormDescriptor<T, U, V> &desc = table.tensors[t];
+  const int i2_tile = blockIdx.x - table.offsets[t];
+  cuComputePartGradGammaBeta_(desc.dout, desc.input, desc.n1, desc.n2,
+                              desc.mean, desc.invvar, epsilon,
+                              desc.part_grad_gamma, desc.part_grad_beta,
+                              rms_only, i2_tile);
+  cuFinishGradGammaBeta_(i2_tile, desc.n2, desc.part_grad_gamma,
+                         desc.part_grad_beta, &counters[blockIdx.x],
+                         desc.grad_gamma, desc.grad_beta, rms_only);
+}
+
+template <typename T> bool IsAligned(const T *ptr, int vec_size) {
+  // NULL pointers (no gamma / beta) never block vectorization
+  return ptr == NULL ||
+         reinterpret_cast<uintptr_t>(ptr) % (vec_size * sizeof(T)) == 0;
+}
+
+// Returns the widest number of elements per access (at most 128 bits for the
+// larger of T and V) usable for every row of the given tensors, or 1 if the
+// scalar kernels have to be used.
+template <typename T, typename V>
+int GetVectorizedWidth(const V *output, const T *input, int n2,
+                       const V *gamma, const V *beta) {
+  const int max_size = sizeof(T) > sizeof(V) ? sizeof(T) : sizeof(V);
+  for (int vec_size = 16 / max_size; vec_size > 1; vec_size /= 2) {
+    if (n2 % vec_size == 0 && IsAligned(input, vec_size) &&
+        IsAligned(output, vec_size) && IsAligned(gamma, vec_size) &&
+        IsAligned(beta, vec_size)) {
+      return vec_size;
+    }
+  }
+  return 1;
+}
+
+namespace {
+struct LayerNormLaunchConfig {
+  // warps cooperating on one row (blockDim.y)
+  int warps_per_row;
+  // rows handled by one block (blockDim.z), > 1 only if warps_per_row == 1
+  int rows_per_block;
+  // number of partial gamma / beta gradient rows (gridDim.y of
+  // cuComputePartGradGammaBeta_), a multiple of 8
+  int part_size;
+};
+
+int CeilLog2(int64_t v) {
+  int log2 = 0;
+  while ((int64_t{1} << log2) < v) {
+    ++log2;
+  }
+  return log2;
+}
+
+// Power-of-two bucket of a size, clamped to the range of the launch sizes.
+int BucketSize(int log2) {
+  TORCH_CHECK(log2 <= 31, "layer norm size out of range");
+  return (int)std::min<int64_t>(int64_t{1} << log2,
+                                std::numeric_limits<int>::max());
+}
+
+LayerNormLaunchConfig ComputeLayerNormLaunchConfig(const cudaDeviceProp *prop,
+                                                   int n1, int n2,
+                                                   int element_size) {
+  LayerNormLaunchConfig config;
+  const int sm_count = prop->multiProcessorCount;
+  const int max_warps = std::min(prop->maxThreadsPerBlock / 32, 16);
+  // each thread should issue about four 128-bit loads per row
+  const int elements_per_warp = 32 * (64 / element_size);
+  int warps_per_row = 1;
+  while (warps_per_row < max_warps &&
+         warps_per_row * elements_per_warp < n2) {
+    warps_per_row *= 2;
+  }
+  // spread the few rows we have over more warps to fill the device
+  while (warps_per_row < max_warps &&
+         (int64_t)n1 * warps_per_row < 4 * sm_count &&
+         warps_per_row * 32 * (16 / element_size) < n2) {
+    warps_per_row *= 2;
+  }
+  config.warps_per_row = warps_per_row;
+  // narrow rows leave most of a single-warp block idle, pack several rows in
+  // a block when there are enough of them to keep every SM busy
+  config.rows_per_block = (warps_per_row == 1 && n1 >= 16 * sm_count) ? 4 : 1;
+  // aim at two waves of cuComputePartGradGammaBeta_ blocks, every partition
+  // covers at least one 16-row segment
+  const int n2_blocks = (int)(((int64_t)n2 + 31) / 32);
+  const int segments = (int)(((int64_t)n1 + 15) / 16);
+  int part_size = (2 * sm_count + n2_blocks - 1) / n2_blocks;
+  part_size = std::min(part_size, segments);
+  part_size = ((part_size + 7) / 8) * 8;
+  config.part_size = std::max(8, std::min(part_size, 64));
+  return config;
+}
+
+// Returns the launch configuration for the current device, chosen configs are
+// cached per (device, element size, power-of-two bucket of n1 and n2).
+LayerNormLaunchConfig GetLayerNormLaunchConfig(int n1, int n2,
+                                               int element_size) {
+  static std::mutex mutex;
+  static std::unordered_map<int64_t, LayerNormLaunchConfig> cache;
+  const int device = at::cuda::current_device();
+  const int log2_n1 = CeilLog2(n1);
+  const int log2_n2 = CeilLog2(n2);
+  const int64_t key = (int64_t(device) << 32) | (int64_t(element_size) << 16) |
+                      (int64_t(log2_n1) << 8) | int64_t(log2_n2);
+  std::lock_guard<std::mutex> lock(mutex);
+  auto item = cache.find(key);
+  if (item != cache.end()) {
+    return item->second;
+  }
+  LayerNormLaunchConfig config = ComputeLayerNormLaunchConfig(
+      at::cuda::getCurrentDeviceProperties(), BucketSize(log2_n1),
+      BucketSize(log2_n2), element_size);
+  cache.emplace(key, config);
+  return config;
+}
+
+// Most streams whose workspaces are kept at once, so that applications
+// creating short-lived streams do not grow the map without bound.
+constexpr size_t kMaxStreamWorkspaces = 16;
+
+// Byte workspaces of the gamma/beta gradient. The registry is never destroyed,
+// so that no tensor is freed after the CUDA context is gone.
+struct LayerNormWorkspaces {
+  std::mutex mutex;
+  std::map<std::pair<int, cudaStream_t>, at::Tensor> streams;
+  // used by every stream of a device while it is captured into a CUDA graph,
+  // allocated by layer_norm_prepare_capture with the largest size requested
+  std::map<int, at::Tensor> capture;
+  std::map<int, int64_t> max_bytes;
+};
+
+LayerNormWorkspaces &GetLayerNormWorkspaces() {
+  static auto *workspaces = new LayerNormWorkspaces();
+  return *workspaces;
+}
+
+bool IsCurrentStreamCapturing() {
+  cudaStreamCaptureStatus status;
+  AT_CUDA_CHECK(cudaStreamIsCapturing(
+      at::cuda::getCurrentCUDAStream().stream(), &status));
+  return status != cudaStreamCaptureStatusNone;
+}
+
+// Returns a byte workspace of at least `bytes` for the current device and
+// stream, so the gamma/beta gradient does not hit the caching allocator on
+// every backward. Launches on one stream are ordered, which makes reusing the
+// buffer between them safe. When more than kMaxStreamWorkspaces streams have
+// one, the workspaces are dropped: each was allocated on the stream it is used
+// on, so the caching allocator only hands its memory out again in order after
+// the launches still pending there. While capturing, the capture workspace is
+// used instead since nothing may be allocated. The callers clear the counters
+// at the front of the workspace on every launch; when captured, that memset
+// is a node of the graph, so every replay starts from zeroed counters even
+// though all the captured shapes share the workspace.
+at::Tensor GetLayerNormWorkspace(const at::Tensor &input, int64_t bytes) {
+  auto &workspaces = GetLayerNormWorkspaces();
+  const int device = at::cuda::current_device();
+  const bool capturing = IsCurrentStreamCapturing();
+  std::lock_guard<std::mutex> lock(workspaces.mutex);
+  if (capturing) {
+    const at::Tensor &workspace = workspaces.capture[device];
+    TORCH_CHECK(workspace.defined() && workspace.numel() >= bytes,
+                "the layer norm workspace is too small to be captured, run "
+                "the op once before prepare_cuda_graph_capture()");
+    return workspace;
+  }
+
+  int64_t &max_bytes = workspaces.max_bytes[device];
+  max_bytes = std::max(max_bytes, bytes);
+  const auto key =
+      std::make_pair(device, at::cuda::getCurrentCUDAStream().stream());
+  if (workspaces.streams.size() >= kMaxStreamWorkspaces &&
+      workspaces.streams.count(key) == 0) {
+    workspaces.streams.clear();
+  }
+  at::Tensor &workspace = workspaces.streams[key];
+  if (!workspace.defined() || workspace.numel() < bytes) {
+    workspace = at::zeros({bytes}, input.options().dtype(at::ScalarType::Byte));
+  }
+  return workspace;
+}
+} // namespace
+
+// Allocates the workspace used while capturing CUDA graphs on the current
+// device, with at least 'bytes' and the largest size requested by the ops run
+// so far. Graphs sharing it must not be replayed concurrently, and every launch
+// using it clears its counters first, so stale partial sums of another shape
+// are never read as counters.
+void layer_norm_prepare_capture(int64_t bytes) {
+  auto &workspaces = GetLayerNormWorkspaces();
+  const int device = at::cuda::current_device();
+  std::lock_guard<std::mutex> lock(workspaces.mutex);
+  bytes = std::max(bytes, workspaces.max_bytes[device]);
+  at::Tensor &workspace = workspaces.capture[device];
+  if (bytes > 0 && (!workspace.defined() || workspace.numel() < bytes)) {
+    workspace = at::zeros({bytes}, at::TensorOptions()
+                                       .dtype(at::ScalarType::Byte)
+                                       .device(at::kCUDA, device));
+  }
+}
+
 template <typename T, typename U, typename V = T>
 void HostApplyLayerNorm(V *output, U *mean, U *invvar, const T *input, int n1,
                         int n2, double epsilon, const V *gamma, const V *beta) {
   auto stream = at::cuda::getCurrentCUDAStream().stream();
-  const dim3 threads(32, 4, 1);
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const dim3 threads(32, config.warps_per_row, config.rows_per_block);
   const uint64_t maxGridY =
       at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
-  const dim3 blocks(1, std::min((uint64_t)n1, maxGridY), 1);
+  const uint64_t nblocks = (n1 + threads.z - 1) / threads.z;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
   int nshared =
       threads.y > 1 ? threads.y * sizeof(U) + (threads.y / 2) * sizeof(U) : 0;
-  cuApplyLayerNorm<<<blocks, threads, nshared, stream>>>(
-      output, mean, invvar, input, n1, n2, U(epsilon), gamma, beta);
+  switch (GetVectorizedWidth(output, input, n2, gamma, beta)) {
+  case 8:
+    cuApplyLayerNormVectorized<T, U, V, 8>
+        <<<blocks, threads, nshared, stream>>>(output, mean, invvar, input, n1,
+                                               n2, U(epsilon), gamma, beta);
+    break;
+  case 4:
+    cuApplyLayerNormVectorized<T, U, V, 4>
+        <<<blocks, threads, nshared, stream>>>(output, mean, invvar, input, n1,
+                                               n2, U(epsilon), gamma, beta);
+    break;
+  case 2:
+    cuApplyLayerNormVectorized<T, U, V, 2>
+        <<<blocks, threads, nshared, stream>>>(output, mean, invvar, input, n1,
+                                               n2, U(epsilon), gamma, beta);
+    break;
+  default:
+    cuApplyLayerNorm<<<blocks, threads, nshared, stream>>>(
+        output, mean, invvar, input, n1, n2, U(epsilon), gamma, beta);
+  }
 }
 
 template <typename T, typename U, typename V = T>
 void HostApplyRMSNorm(V *output, U *invvar, const T *input, int n1, int n2,
                       double epsilon, const V *gamma) {
   auto stream = at::cuda::getCurrentCUDAStream().stream();
-  const dim3 threads(32, 4, 1);
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const dim3 threads(32, config.warps_per_row, config.rows_per_block);
   const uint64_t maxGridY =
       at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
-  const dim3 blocks(1, std::min((uint64_t)n1, maxGridY), 1);
+  const uint64_t nblocks = (n1 + threads.z - 1) / threads.z;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
   int nshared =
       threads.y > 1 ? threads.y * sizeof(U) + (threads.y / 2) * sizeof(U) : 0;
-  cuApplyRMSNorm<<<blocks, threads, nshared, stream>>>(
-      output, invvar, input, n1, n2, U(epsilon), gamma);
+  switch (GetVectorizedWidth(output, input, n2, gamma, (const V *)NULL)) {
+  case 8:
+    cuApplyRMSNormVectorized<T, U, V, 8><<<blocks, threads, nshared, stream>>>(
+        output, invvar, input, n1, n2, U(epsilon), gamma);
+    break;
+  case 4:
+    cuApplyRMSNormVectorized<T, U, V, 4><<<blocks, threads, nshared, stream>>>(
+        output, invvar, input, n1, n2, U(epsilon), gamma);
+    break;
+  case 2:
+    cuApplyRMSNormVectorized<T, U, V, 2><<<blocks, threads, nshared, stream>>>(
+        output, invvar, input, n1, n2, U(epsilon), gamma);
+    break;
+  default:
+    cuApplyRMSNorm<<<blocks, threads, nshared, stream>>>(
+        output, invvar, input, n1, n2, U(epsilon), gamma);
+  }
+}
+
+template <typename T, typename U, typename V, int N2, int WARPS_PER_ROW,
+          int VEC>
+void HostApplyLayerNormRegister_(V *output, U *mean, U *invvar,
+                                 const T *input, int n1, double epsilon,
+                                 const V *gamma, const V *beta,
+                                 bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  // narrow rows are packed four to a block, wide rows get a block each
+  constexpr int BLOCK_WARPS = WARPS_PER_ROW < 4 ? 4 : WARPS_PER_ROW;
+  constexpr int ROWS_PER_BLOCK = BLOCK_WARPS / WARPS_PER_ROW;
+  const dim3 threads(32, BLOCK_WARPS, 1);
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const uint64_t nblocks = (n1 + ROWS_PER_BLOCK - 1) / ROWS_PER_BLOCK;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
+  int nshared = WARPS_PER_ROW > 1 ? WARPS_PER_ROW * sizeof(U) : 0;
+  if (!rms_only) {
+    cuApplyLayerNormRegister<T, U, V, N2, WARPS_PER_ROW, VEC>
+        <<<blocks, threads, nshared, stream>>>(output, mean, invvar, input, n1,
+                                               U(epsilon), gamma, beta);
+  } else {
+    cuApplyRMSNormRegister<T, U, V, N2, WARPS_PER_ROW, VEC>
+        <<<blocks, threads, nshared, stream>>>(output, invvar, input, n1,
+                                               U(epsilon), gamma);
+  }
+}
+
+// Launches the register-resident kernel specialized for n2 if there is one.
+// Returns false if the caller has to fall back to HostApplyLayerNorm or
+// HostApplyRMSNorm, i.e. for hidden sizes without a specialization and for
+// tensors that cannot be accessed with full 128-bit vectors.
+template <typename T, typename U, typename V>
+bool HostApplyLayerNormRegister(V *output, U *mean, U *invvar, const T *input,
+                                int n1, int n2, double epsilon, const V *gamma,
+                                const V *beta, bool rms_only) {
+  constexpr int VEC = 16 / (sizeof(T) > sizeof(V) ? sizeof(T) : sizeof(V));
+  if (GetVectorizedWidth(output, input, n2, gamma, beta) != VEC) {
+    return false;
+  }
+  switch (n2) {
+  case 768:
+    HostApplyLayerNormRegister_<T, U, V, 768, 1, VEC>(
+        output, mean, invvar, input, n1, epsilon, gamma, beta, rms_only);
+    return true;
+  case 1024:
+    HostApplyLayerNormRegister_<T, U, V, 1024, 1, VEC>(
+        output, mean, invvar, input, n1, epsilon, gamma, beta, rms_only);
+    return true;
+  case 2048:
+    HostApplyLayerNormRegister_<T, U, V, 2048, 4, VEC>(
+        output, mean, invvar, input, n1, epsilon, gamma, beta, rms_only);
+    return true;
+  case 4096:
+    HostApplyLayerNormRegister_<T, U, V, 4096, 4, VEC>(
+        output, mean, invvar, input, n1, epsilon, gamma, beta, rms_only);
+    return true;
+  case 5120:
+    HostApplyLayerNormRegister_<T, U, V, 5120, 4, VEC>(
+        output, mean, invvar, input, n1, epsilon, gamma, beta, rms_only);
+    return true;
+  case 8192:
+    HostApplyLayerNormRegister_<T, U, V, 8192, 8, VEC>(
+        output, mean, invvar, input, n1, epsilon, gamma, beta, rms_only);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// double inputs keep using the generic kernels, the extra instantiations
+// are not worth it for a dtype that is not used on the hot path.
+template <typename U, typename V>
+bool HostApplyLayerNormRegister(V *output, U *mean, U *invvar,
+                                const double *input, int n1, int n2,
+                                double epsilon, const V *gamma, const V *beta,
+                                bool rms_only) {
+  return false;
 }
 
 void cuda_layer_norm(at::Tensor *output, at::Tensor *mean, at::Tensor *invvar,
@@ -780,11 +2105,21 @@ void cuda_layer_norm(at::Tensor *output, at::Tensor *mean, at::Tensor *invvar,
   DISPATCH_DOUBLE_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
       input->scalar_type(), output->scalar_type(), "layer_norm_cuda_kernel",
       using accscalar_t = at::acc_type<scalar_t_in, true>;
-      HostApplyLayerNorm<scalar_t_in, accscalar_t, scalar_t_out>(
-          output->DATA_PTR<scalar_t_out>(), mean->DATA_PTR<accscalar_t>(),
-          invvar->DATA_PTR<accscalar_t>(), input->DATA_PTR<scalar_t_in>(), n1,
-          n2, epsilon, gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL,
-          beta != NULL ? beta->DATA_PTR<scalar_t_out>() : NULL);)
+      scalar_t_out *output_ptr = output->DATA_PTR<scalar_t_out>();
+      accscalar_t *mean_ptr = mean->DATA_PTR<accscalar_t>();
+      accscalar_t *invvar_ptr = invvar->DATA_PTR<accscalar_t>();
+      const scalar_t_in *input_ptr = input->DATA_PTR<scalar_t_in>();
+      const scalar_t_out *gamma_ptr =
+          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL;
+      const scalar_t_out *beta_ptr =
+          beta != NULL ? beta->DATA_PTR<scalar_t_out>() : NULL;
+      if (!HostApplyLayerNormRegister(output_ptr, mean_ptr, invvar_ptr,
+                                      input_ptr, n1, n2, epsilon, gamma_ptr,
+                                      beta_ptr, false)) {
+        HostApplyLayerNorm<scalar_t_in, accscalar_t, scalar_t_out>(
+            output_ptr, mean_ptr, invvar_ptr, input_ptr, n1, n2, epsilon,
+            gamma_ptr, beta_ptr);
+      })
 }
 
 void cuda_rms_norm(at::Tensor *output, at::Tensor *invvar, at::Tensor *input,
@@ -799,10 +2134,55 @@ void cuda_rms_norm(at::Tensor *output, at::Tensor *invvar, at::Tensor *input,
   DISPATCH_DOUBLE_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
       input->scalar_type(), output->scalar_type(), "rms_norm_cuda_kernel",
       using accscalar_t = at::acc_type<scalar_t_in, true>;
-      HostApplyRMSNorm<scalar_t_in, accscalar_t, scalar_t_out>(
-          output->DATA_PTR<scalar_t_out>(), invvar->DATA_PTR<accscalar_t>(),
-          input->DATA_PTR<scalar_t_in>(), n1, n2, epsilon,
-          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL);)
+      scalar_t_out *output_ptr = output->DATA_PTR<scalar_t_out>();
+      accscalar_t *invvar_ptr = invvar->DATA_PTR<accscalar_t>();
+      const scalar_t_in *input_ptr = input->DATA_PTR<scalar_t_in>();
+      const scalar_t_out *gamma_ptr =
+          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL;
+      if (!HostApplyLayerNormRegister(output_ptr, (accscalar_t *)NULL,
+                                      invvar_ptr, input_ptr, n1, n2, epsilon,
+                                      gamma_ptr, (const scalar_t_out *)NULL,
+                                      true)) {
+        HostApplyRMSNorm<scalar_t_in, accscalar_t, scalar_t_out>(
+            output_ptr, invvar_ptr, input_ptr, n1, n2, epsilon, gamma_ptr);
+      })
+}
+
+template <typename T, typename U, typename V>
+void HostLayerNormGammaBetaGradient(const V *dout, const U *mean,
+                                    const U *invvar, at::Tensor *input, int n1,
+                                    int n2, double epsilon, int part_size,
+                                    V *grad_gamma, V *grad_beta,
+                                    bool rms_only) {
+  // mean and grad_beta are unused if rms_only
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const dim3 threads2(32, 4, 1);
+  const dim3 blocks2((n2 + threads2.x - 1) / threads2.x, part_size, 1);
+  const int nshared2_a =
+      2 * sizeof(U) * threads2.y * threads2.y * (threads2.x + 1);
+  const int nshared2_b = threads2.x * threads2.y * sizeof(U);
+  const int nshared2 = nshared2_a > nshared2_b ? nshared2_a : nshared2_b;
+  // workspace layout: one counter per column tile, padded to 16 bytes,
+  // followed by the [part_size, n2] partial gamma and beta gradients
+  const int64_t counter_bytes =
+      ((blocks2.x * sizeof(unsigned int) + 15) / 16) * 16;
+  const int64_t part_bytes = int64_t(part_size) * n2 * sizeof(U);
+  at::Tensor workspace = GetLayerNormWorkspace(
+      *input, counter_bytes + (rms_only ? 1 : 2) * part_bytes);
+  uint8_t *workspace_ptr = workspace.DATA_PTR<uint8_t>();
+  // the counters reset themselves, but a larger one may overlap the partial
+  // sums of an earlier call on a smaller part_size
+  AT_CUDA_CHECK(cudaMemsetAsync(workspace_ptr, 0, counter_bytes, stream));
+  unsigned int *counters = reinterpret_cast<unsigned int *>(workspace_ptr);
+  U *part_grad_gamma = reinterpret_cast<U *>(workspace_ptr + counter_bytes);
+  U *part_grad_beta = !rms_only ? reinterpret_cast<U *>(workspace_ptr +
+                                                        counter_bytes +
+                                                        part_bytes)
+                                : part_grad_gamma;
+  cuComputeGradGammaBetaSinglePass<<<blocks2, threads2, nshared2, stream>>>(
+      dout, input->DATA_PTR<T>(), n1, n2, mean, invvar, U(epsilon),
+      part_grad_gamma, part_grad_beta, counters, grad_gamma, grad_beta,
+      rms_only);
 }
 
 template <typename T, typename U = float, typename V = T>
@@ -811,43 +2191,22 @@ void HostLayerNormGradient(const V *dout, const U *mean, const U *invvar,
                            const V *beta, double epsilon, T *grad_input,
                            V *grad_gamma, V *grad_beta) {
   auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
 
   if (gamma != NULL && beta != NULL) {
     // compute grad_gamma(j) and grad_beta(j)
-    const int part_size = 16;
-    const dim3 threads2(32, 4, 1);
-    const dim3 blocks2((n2 + threads2.x - 1) / threads2.x, part_size, 1);
-    const int nshared2_a =
-        2 * sizeof(U) * threads2.y * threads2.y * (threads2.x + 1);
-    const int nshared2_b = threads2.x * threads2.y * sizeof(U);
-    const int nshared2 = nshared2_a > nshared2_b ? nshared2_a : nshared2_b;
-    // note (mkozuki): I can hard code part_grad_gamma's dtype as float given
-    // that the `cuda_layer_norm_gradient` doesn't support double.
-    const auto part_grad_dtype =
-        (input->scalar_type() == at::ScalarType::Half ||
-         input->scalar_type() == at::ScalarType::BFloat16)
-            ? at::ScalarType::Float
-            : input->scalar_type();
-    at::Tensor part_grad_gamma =
-        at::empty({part_size, n2}, input->options().dtype(part_grad_dtype));
-    at::Tensor part_grad_beta = at::empty_like(part_grad_gamma);
-    cuComputePartGradGammaBeta<<<blocks2, threads2, nshared2, stream>>>(
-        dout, input->DATA_PTR<T>(), n1, n2, mean, invvar, U(epsilon),
-        part_grad_gamma.DATA_PTR<U>(), part_grad_beta.DATA_PTR<U>(), false);
-
-    const dim3 threads3(32, 8, 1);
-    const dim3 blocks3((n2 + threads2.x - 1) / threads2.x, 1, 1);
-    const int nshared3 = threads3.x * threads3.y * sizeof(U);
-    cuComputeGradGammaBeta<<<blocks3, threads3, nshared3, stream>>>(
-        part_grad_gamma.DATA_PTR<U>(), part_grad_beta.DATA_PTR<U>(), part_size,
-        n1, n2, grad_gamma, grad_beta, false);
+    HostLayerNormGammaBetaGradient<T, U, V>(dout, mean, invvar, input, n1, n2,
+                                            epsilon, config.part_size,
+                                            grad_gamma, grad_beta, false);
   }
 
   // compute grad_input
   const uint64_t maxGridY =
       at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
-  const dim3 blocks1(1, std::min((uint64_t)n1, maxGridY), 1);
-  const dim3 threads1(32, 4, 1);
+  const dim3 threads1(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t nblocks1 = (n1 + threads1.z - 1) / threads1.z;
+  const dim3 blocks1(1, std::min(nblocks1, maxGridY), 1);
   int nshared = threads1.y > 1 ? threads1.y * threads1.x * sizeof(U) : 0;
   cuComputeGradInput<<<blocks1, threads1, nshared, stream>>>(
       dout, input->DATA_PTR<T>(), n1, n2, mean, invvar, U(epsilon), gamma,
@@ -859,46 +2218,23 @@ void HostRMSNormGradient(const V *dout, const U *invvar, at::Tensor *input,
                          int n1, int n2, const V *gamma, double epsilon,
                          T *grad_input, V *grad_gamma) {
   auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
 
   if (gamma != NULL) {
-    const int part_size = 16;
-    const dim3 threads2(32, 4, 1);
-    const dim3 blocks2((n2 + threads2.x - 1) / threads2.x, part_size, 1);
-    const int nshared2_a =
-        2 * sizeof(U) * threads2.y * threads2.y * (threads2.x + 1);
-    const int nshared2_b = threads2.x * threads2.y * sizeof(U);
-    const int nshared2 = nshared2_a > nshared2_b ? nshared2_a : nshared2_b;
-    // note (mkozuki): I can hard code part_grad_gamma's dtype as float given
-    // that the `cuda_layer_norm_gradient` doesn't support double.
-    const auto part_grad_dtype =
-        (input->scalar_type() == at::ScalarType::Half ||
-         input->scalar_type() == at::ScalarType::BFloat16)
-            ? at::ScalarType::Float
-            : input->scalar_type();
-    at::Tensor part_grad_gamma =
-        at::empty({part_size, n2}, input->options().dtype(part_grad_dtype));
-    cuComputePartGradGammaBeta<<<blocks2, threads2, nshared2, stream>>>(
-        dout, input->DATA_PTR<T>(), n1, n2,
-        invvar, // unused
-        invvar, U(epsilon), part_grad_gamma.DATA_PTR<U>(),
-        part_grad_gamma.DATA_PTR<U>(), /* unused */
-        true);
-
-    const dim3 threads3(32, 8, 1);
-    const dim3 blocks3((n2 + threads2.x - 1) / threads2.x, 1, 1);
-    const int nshared3 = threads3.x * threads3.y * sizeof(U);
-    cuComputeGradGammaBeta<<<blocks3, threads3, nshared3, stream>>>(
-        part_grad_gamma.DATA_PTR<U>(),
-        part_grad_gamma.DATA_PTR<U>(),             /* unused */
-        part_size, n1, n2, grad_gamma, grad_gamma, /* unused */
-        true);
+    HostLayerNormGammaBetaGradient<T, U, V>(dout, invvar, /* unused */
+                                            invvar, input, n1, n2, epsilon,
+                                            config.part_size, grad_gamma,
+                                            grad_gamma, /* unused */
+                                            true);
   }
 
   // compute grad_input
   const uint64_t maxGridY =
       at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
-  const dim3 blocks1(1, std::min((uint64_t)n1, maxGridY), 1);
-  const dim3 threads1(32, 4, 1);
+  const dim3 threads1(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t nblocks1 = (n1 + threads1.z - 1) / threads1.z;
+  const dim3 blocks1(1, std::min(nblocks1, maxGridY), 1);
   int nshared = threads1.y > 1 ? threads1.y * threads1.x * sizeof(U) : 0;
   cuComputeGradInput<<<blocks1, threads1, nshared, stream>>>(
       dout, input->DATA_PTR<T>(), n1, n2, invvar, /* unused */
@@ -917,9 +2253,8 @@ void cuda_layer_norm_gradient(at::Tensor *dout, at::Tensor *mean,
                               double epsilon, at::Tensor *grad_input,
                               at::Tensor *grad_gamma, at::Tensor *grad_beta) {
   using namespace at;
-  // we can do away with `accscalar_t` as there're only three dtypes: fp32,
-  // fp16, bf16
-  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+  // double like the forward, the residual op also runs its backward here
+  DISPATCH_DOUBLE_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
       input->scalar_type(),
       gamma == NULL ? input->scalar_type() : gamma->scalar_type(),
       "cuComputeGradInput", using accscalar_t = at::acc_type<scalar_t_in, true>;
@@ -961,3 +2296,528 @@ void cuda_rms_norm_gradient(at::Tensor *dout, at::Tensor *invvar,
           grad_input->DATA_PTR<scalar_t_in>(),
           gamma != NULL ? grad_gamma->DATA_PTR<scalar_t_out>() : NULL);)
 }
+
+template <typename T, typename U, typename V = T>
+void HostApplyLayerNormResidual(V *output, T *sum, uint8_t *mask, U *mean,
+                                U *invvar, const T *input, const T *residual,
+                                const T *bias, int n1, int n2, double epsilon,
+                                const V *gamma, const V *beta, double p,
+                                int64_t seed) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const dim3 threads(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const uint64_t nblocks = (n1 + threads.z - 1) / threads.z;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
+  int nshared =
+      threads.y > 1 ? threads.y * sizeof(U) + (threads.y / 2) * sizeof(U) : 0;
+  cuApplyLayerNormResidual<<<blocks, threads, nshared, stream>>>(
+      output, sum, mask, mean, invvar, input, residual, bias, n1, n2,
+      U(epsilon), gamma, beta, float(p), uint64_t(seed));
+}
+
+template <typename T, typename U, typename V = T>
+void HostApplyRMSNormResidual(V *output, T *sum, uint8_t *mask, U *invvar,
+                              const T *input, const T *residual,
+                              const T *bias, int n1, int n2, double epsilon,
+                              const V *gamma, double p, int64_t seed) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const dim3 threads(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const uint64_t nblocks = (n1 + threads.z - 1) / threads.z;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
+  int nshared =
+      threads.y > 1 ? threads.y * sizeof(U) + (threads.y / 2) * sizeof(U) : 0;
+  cuApplyRMSNormResidual<<<blocks, threads, nshared, stream>>>(
+      output, sum, mask, invvar, input, residual, bias, n1, n2, U(epsilon),
+      gamma, float(p), uint64_t(seed));
+}
+
+void cuda_layer_norm_residual(at::Tensor *output, at::Tensor *sum,
+                              at::Tensor *mask, at::Tensor *mean,
+                              at::Tensor *invvar, at::Tensor *input,
+                              at::Tensor *residual, at::Tensor *bias, int n1,
+                              int n2,
+#ifdef VERSION_GE_1_1
+                              at::IntArrayRef normalized_shape,
+#else
+                              at::IntList normalized_shape,
+#endif
+                              at::Tensor *gamma, at::Tensor *beta,
+                              double epsilon, double p, int64_t seed) {
+  using namespace at;
+  DISPATCH_DOUBLE_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+      input->scalar_type(), output->scalar_type(),
+      "layer_norm_residual_cuda_kernel",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostApplyLayerNormResidual<scalar_t_in, accscalar_t, scalar_t_out>(
+          output->DATA_PTR<scalar_t_out>(), sum->DATA_PTR<scalar_t_in>(),
+          mask != NULL ? mask->DATA_PTR<uint8_t>() : NULL,
+          mean->DATA_PTR<accscalar_t>(), invvar->DATA_PTR<accscalar_t>(),
+          input->DATA_PTR<scalar_t_in>(), residual->DATA_PTR<scalar_t_in>(),
+          bias->DATA_PTR<scalar_t_in>(), n1, n2, epsilon,
+          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL,
+          beta != NULL ? beta->DATA_PTR<scalar_t_out>() : NULL, p, seed);)
+}
+
+void cuda_rms_norm_residual(at::Tensor *output, at::Tensor *sum,
+                            at::Tensor *mask, at::Tensor *invvar,
+                            at::Tensor *input, at::Tensor *residual,
+                            at::Tensor *bias, int n1, int n2,
+#ifdef VERSION_GE_1_1
+                            at::IntArrayRef normalized_shape,
+#else
+                            at::IntList normalized_shape,
+#endif
+                            at::Tensor *gamma, double epsilon, double p,
+                            int64_t seed) {
+  using namespace at;
+  DISPATCH_DOUBLE_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+      input->scalar_type(), output->scalar_type(),
+      "rms_norm_residual_cuda_kernel",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostApplyRMSNormResidual<scalar_t_in, accscalar_t, scalar_t_out>(
+          output->DATA_PTR<scalar_t_out>(), sum->DATA_PTR<scalar_t_in>(),
+          mask != NULL ? mask->DATA_PTR<uint8_t>() : NULL,
+          invvar->DATA_PTR<accscalar_t>(), input->DATA_PTR<scalar_t_in>(),
+          residual->DATA_PTR<scalar_t_in>(), bias->DATA_PTR<scalar_t_in>(),
+          n1, n2, epsilon,
+          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL, p, seed);)
+}
+
+template <typename T, typename U>
+void HostResidualDropoutGradient(T *grad_sum, const T *dsum,
+                                 const uint8_t *mask, int n1, int n2,
+                                 double p, T *grad_input) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int64_t numel = (int64_t)n1 * n2;
+  const int threads = 256;
+  const int64_t max_blocks =
+      4 * at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+  const dim3 blocks(std::min((numel + threads - 1) / threads, max_blocks));
+  const U scale = p < 1.0 ? U(1) / (U(1) - U(p)) : U(0);
+  cuComputeResidualDropoutGrad<<<blocks, threads, 0, stream>>>(
+      grad_sum, dsum, mask, scale, numel, grad_input);
+}
+
+void cuda_residual_dropout_gradient(at::Tensor *grad_sum, at::Tensor *dsum,
+                                    at::Tensor *mask, int n1, int n2,
+                                    double p, at::Tensor *grad_input) {
+  using namespace at;
+  DISPATCH_DOUBLE_FLOAT_HALF_AND_BFLOAT(
+      grad_sum->scalar_type(), 0, "cuComputeResidualDropoutGrad",
+      using accscalar_t = at::acc_type<scalar_t_0, true>;
+      HostResidualDropoutGradient<scalar_t_0, accscalar_t>(
+          grad_sum->DATA_PTR<scalar_t_0>(), dsum->DATA_PTR<scalar_t_0>(),
+          mask != NULL ? mask->DATA_PTR<uint8_t>() : NULL, n1, n2, p,
+          grad_input->DATA_PTR<scalar_t_0>());)
+}
+
+template <typename T, typename U>
+void HostLayerNormPartialStats(U *stats, const T *input, int n1, int n2,
+                               bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const dim3 threads(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const uint64_t nblocks = (n1 + threads.z - 1) / threads.z;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
+  int nshared =
+      threads.y > 1 ? threads.y * sizeof(U) + (threads.y / 2) * sizeof(U) : 0;
+  cuComputeLayerNormPartialStats<<<blocks, threads, nshared, stream>>>(
+      stats, input, n1, n2, rms_only);
+}
+
+void cuda_layer_norm_partial_stats(at::Tensor *stats, at::Tensor *input,
+                                   int n1, int n2, bool rms_only) {
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      input->scalar_type(), 0, "cuComputeLayerNormPartialStats",
+      using accscalar_t = at::acc_type<scalar_t_0, true>;
+      HostLayerNormPartialStats<scalar_t_0, accscalar_t>(
+          stats->DATA_PTR<accscalar_t>(), input->DATA_PTR<scalar_t_0>(), n1,
+          n2, rms_only);)
+}
+
+template <typename T, typename U, typename V>
+void HostApplyLayerNormSharded(V *output, U *mean, U *invvar, const T *input,
+                               const U *stats, int world_size, int n1, int n2,
+                               double epsilon, const V *gamma, const V *beta,
+                               bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int merge_threads = 256;
+  const int64_t max_merge_blocks =
+      4 * at::cuda::getCurrentDeviceProperties()->multiProcessorCount;
+  const dim3 merge_blocks(std::min(
+      ((int64_t)n1 + merge_threads - 1) / merge_threads, max_merge_blocks));
+  cuMergeLayerNormPartialStats<<<merge_blocks, merge_threads, 0, stream>>>(
+      mean, invvar, stats, world_size, n1, U(epsilon), rms_only);
+
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const dim3 threads(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const uint64_t nblocks = (n1 + threads.z - 1) / threads.z;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
+  cuApplyLayerNormWithStats<<<blocks, threads, 0, stream>>>(
+      output, input, n1, n2, mean, invvar, gamma, beta, rms_only);
+}
+
+void cuda_layer_norm_sharded(at::Tensor *output, at::Tensor *mean,
+                             at::Tensor *invvar, at::Tensor *input,
+                             at::Tensor *stats, int world_size, int n1, int n2,
+                             at::Tensor *gamma, at::Tensor *beta,
+                             double epsilon, bool rms_only) {
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+      input->scalar_type(), output->scalar_type(), "cuApplyLayerNormSharded",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostApplyLayerNormSharded<scalar_t_in, accscalar_t, scalar_t_out>(
+          output->DATA_PTR<scalar_t_out>(),
+          mean != NULL ? mean->DATA_PTR<accscalar_t>() : NULL,
+          invvar->DATA_PTR<accscalar_t>(), input->DATA_PTR<scalar_t_in>(),
+          stats->DATA_PTR<accscalar_t>(), world_size, n1, n2, epsilon,
+          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL,
+          beta != NULL ? beta->DATA_PTR<scalar_t_out>() : NULL, rms_only);)
+}
+
+template <typename T, typename U, typename V>
+void HostLayerNormGradInputPartialSums(U *sums, const V *dout, const U *mean,
+                                       const U *invvar, const T *input, int n1,
+                                       int n2, const V *gamma, bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const dim3 threads1(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t nblocks1 = (n1 + threads1.z - 1) / threads1.z;
+  const dim3 blocks1(1, std::min(nblocks1, maxGridY), 1);
+  int nshared = threads1.y > 1 ? threads1.y * threads1.x * sizeof(U) : 0;
+  cuComputeGradInputPartialSums<<<blocks1, threads1, nshared, stream>>>(
+      sums, dout, input, n1, n2, mean, invvar, gamma, rms_only);
+}
+
+void cuda_layer_norm_grad_input_partial_sums(at::Tensor *sums,
+                                             at::Tensor *dout,
+                                             at::Tensor *mean,
+                                             at::Tensor *invvar,
+                                             at::Tensor *input, int n1, int n2,
+                                             at::Tensor *gamma, bool rms_only) {
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+      input->scalar_type(),
+      gamma == NULL ? input->scalar_type() : gamma->scalar_type(),
+      "cuComputeGradInputPartialSums",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostLayerNormGradInputPartialSums<scalar_t_in, accscalar_t,
+                                        scalar_t_out>(
+          sums->DATA_PTR<accscalar_t>(), dout->DATA_PTR<scalar_t_out>(),
+          mean != NULL ? mean->DATA_PTR<accscalar_t>() : NULL,
+          invvar->DATA_PTR<accscalar_t>(), input->DATA_PTR<scalar_t_in>(), n1,
+          n2, gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL,
+          rms_only);)
+}
+
+template <typename T, typename U, typename V>
+void HostLayerNormShardedGradient(const V *dout, const U *sums, const U *mean,
+                                  const U *invvar, at::Tensor *input, int n1,
+                                  int n2, int n2_global, const V *gamma,
+                                  double epsilon, T *grad_input,
+                                  V *grad_gamma, V *grad_beta, bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+
+  // gamma and beta are sharded along with the row, so their gradients only
+  // depend on the local columns and the already reduced mean and invvar
+  if (gamma != NULL) {
+    HostLayerNormGammaBetaGradient<T, U, V>(
+        dout, !rms_only ? mean : invvar, invvar, input, n1, n2, epsilon,
+        config.part_size, grad_gamma, !rms_only ? grad_beta : grad_gamma,
+        rms_only);
+  }
+
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const dim3 threads1(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t nblocks1 = (n1 + threads1.z - 1) / threads1.z;
+  const dim3 blocks1(1, std::min(nblocks1, maxGridY), 1);
+  cuComputeGradInputWithSums<<<blocks1, threads1, 0, stream>>>(
+      dout, input->DATA_PTR<T>(), n1, n2, n2_global, mean, invvar, sums, gamma,
+      grad_input, rms_only);
+}
+
+void cuda_layer_norm_sharded_gradient(
+    at::Tensor *dout, at::Tensor *sums, at::Tensor *mean, at::Tensor *invvar,
+    at::Tensor *input, int n1, int n2, int n2_global, at::Tensor *gamma,
+    double epsilon, at::Tensor *grad_input, at::Tensor *grad_gamma,
+    at::Tensor *grad_beta, bool rms_only) {
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+      input->scalar_type(),
+      gamma == NULL ? input->scalar_type() : gamma->scalar_type(),
+      "cuComputeGradInputWithSums",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostLayerNormShardedGradient<scalar_t_in, accscalar_t, scalar_t_out>(
+          dout->DATA_PTR<scalar_t_out>(), sums->DATA_PTR<accscalar_t>(),
+          mean != NULL ? mean->DATA_PTR<accscalar_t>() : NULL,
+          invvar->DATA_PTR<accscalar_t>(), input, n1, n2, n2_global,
+          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL, epsilon,
+          grad_input->DATA_PTR<scalar_t_in>(),
+          gamma != NULL ? grad_gamma->DATA_PTR<scalar_t_out>() : NULL,
+          grad_beta != NULL ? grad_beta->DATA_PTR<scalar_t_out>() : NULL,
+          rms_only);)
+}
+
+template <typename T, typename U, typename V, typename Q>
+void HostApplyLayerNormQuantized(Q *output, U *mean, U *invvar,
+                                 float *row_scale, const float *tensor_scale,
+                                 const T *input, int n1, int n2,
+                                 double epsilon, const V *gamma, const V *beta,
+                                 bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const LayerNormLaunchConfig config =
+      GetLayerNormLaunchConfig(n1, n2, sizeof(T));
+  const dim3 threads(32, config.warps_per_row, config.rows_per_block);
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const uint64_t nblocks = (n1 + threads.z - 1) / threads.z;
+  const dim3 blocks(1, std::min(nblocks, maxGridY), 1);
+  int nshared =
+      threads.y > 1 ? threads.y * sizeof(U) + (threads.y / 2) * sizeof(U) : 0;
+  if (!rms_only) {
+    cuApplyLayerNormQuantized<<<blocks, threads, nshared, stream>>>(
+        output, mean, invvar, row_scale, tensor_scale, input, n1, n2,
+        U(epsilon), gamma, beta);
+  } else {
+    cuApplyRMSNormQuantized<<<blocks, threads, nshared, stream>>>(
+        output, invvar, row_scale, tensor_scale, input, n1, n2, U(epsilon),
+        gamma);
+  }
+}
+
+void cuda_layer_norm_quantized(at::Tensor *output, at::Tensor *mean,
+                               at::Tensor *invvar, at::Tensor *row_scale,
+                               at::Tensor *tensor_scale, at::Tensor *input,
+                               int n1, int n2,
+#ifdef VERSION_GE_1_1
+                               at::IntArrayRef normalized_shape,
+#else
+                               at::IntList normalized_shape,
+#endif
+                               at::Tensor *gamma, at::Tensor *beta,
+                               double epsilon, bool rms_only) {
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_QUANT_TYPES(
+      input->scalar_type(),
+      gamma == NULL ? input->scalar_type() : gamma->scalar_type(),
+      output->scalar_type(), "cuApplyLayerNormQuantized",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostApplyLayerNormQuantized<scalar_t_in, accscalar_t, scalar_t_out,
+                                  scalar_t_quant>(
+          output->DATA_PTR<scalar_t_quant>(),
+          mean != NULL ? mean->DATA_PTR<accscalar_t>() : NULL,
+          invvar->DATA_PTR<accscalar_t>(),
+          row_scale != NULL ? row_scale->DATA_PTR<float>() : NULL,
+          tensor_scale != NULL ? tensor_scale->DATA_PTR<float>() : NULL,
+          input->DATA_PTR<scalar_t_in>(), n1, n2, epsilon,
+          gamma != NULL ? gamma->DATA_PTR<scalar_t_out>() : NULL,
+          beta != NULL ? beta->DATA_PTR<scalar_t_out>() : NULL, rms_only);)
+}
+
+template <typename T, typename U, typename V>
+void HostApplyMultiLayerNorm(std::vector<at::Tensor> &outputs,
+                             std::vector<at::Tensor> &means,
+                             std::vector<at::Tensor> &invvars,
+                             const std::vector<at::Tensor> &inputs,
+                             const std::vector<int> &n1s,
+                             const std::vector<int> &n2s,
+                             const std::vector<at::Tensor> &gammas,
+                             const std::vector<at::Tensor> &betas,
+                             double epsilon, bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const int num_tensors = inputs.size();
+  for (int begin = 0; begin < num_tensors;
+       begin += kMultiLayerNormMaxTensors) {
+    const int end = std::min(begin + kMultiLayerNormMaxTensors, num_tensors);
+    MultiLayerNormTable<T, U, V> table = {};
+    int max_n2 = 0;
+    for (int i = begin; i < end; ++i) {
+      MultiLayerNormDescriptor<T, U, V> &desc = table.tensors[i - begin];
+      desc.input = inputs[i].DATA_PTR<T>();
+      desc.output = outputs[i].DATA_PTR<V>();
+      desc.gamma = !gammas.empty() ? gammas[i].DATA_PTR<V>() : NULL;
+      desc.beta = !betas.empty() ? betas[i].DATA_PTR<V>() : NULL;
+      desc.mean = !rms_only ? means[i].DATA_PTR<U>() : NULL;
+      desc.invvar = invvars[i].DATA_PTR<U>();
+      desc.n1 = n1s[i];
+      desc.n2 = n2s[i];
+      table.offsets[i - begin + 1] = table.offsets[i - begin] + n1s[i];
+      max_n2 = std::max(max_n2, n2s[i]);
+    }
+    table.num_tensors = end - begin;
+    const int num_rows = table.offsets[table.num_tensors];
+    if (num_rows == 0) {
+      continue;
+    }
+    // one row per block, sized for the widest row of the chunk
+    const LayerNormLaunchConfig config =
+        GetLayerNormLaunchConfig(num_rows, max_n2, sizeof(T));
+    const dim3 threads(32, config.warps_per_row, 1);
+    const dim3 blocks(1, std::min(uint64_t(num_rows), maxGridY), 1);
+    int nshared =
+        threads.y > 1 ? threads.y * sizeof(U) + (threads.y / 2) * sizeof(U)
+                      : 0;
+    cuApplyMultiLayerNorm<<<blocks, threads, nshared, stream>>>(
+        table, U(epsilon), rms_only);
+  }
+}
+
+void cuda_multi_layer_norm(std::vector<at::Tensor> &outputs,
+                           std::vector<at::Tensor> &means,
+                           std::vector<at::Tensor> &invvars,
+                           const std::vector<at::Tensor> &inputs,
+                           const std::vector<int> &n1s,
+                           const std::vector<int> &n2s,
+                           const std::vector<at::Tensor> &gammas,
+                           const std::vector<at::Tensor> &betas,
+                           double epsilon, bool rms_only) {
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+      inputs[0].scalar_type(), outputs[0].scalar_type(),
+      "cuApplyMultiLayerNorm",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostApplyMultiLayerNorm<scalar_t_in, accscalar_t, scalar_t_out>(
+          outputs, means, invvars, inputs, n1s, n2s, gammas, betas, epsilon,
+          rms_only);)
+}
+
+template <typename T, typename U, typename V>
+void HostMultiLayerNormGradient(
+    std::vector<at::Tensor> &grad_inputs, std::vector<at::Tensor> &grad_gammas,
+    std::vector<at::Tensor> &grad_betas, const std::vector<at::Tensor> &douts,
+    const std::vector<at::Tensor> &means,
+    const std::vector<at::Tensor> &invvars,
+    const std::vector<at::Tensor> &inputs, const std::vector<int> &n1s,
+    const std::vector<int> &n2s, const std::vector<at::Tensor> &gammas,
+    double epsilon, bool rms_only) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const uint64_t maxGridY =
+      at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const bool affine = !gammas.empty();
+  const int num_tensors = inputs.size();
+  for (int begin = 0; begin < num_tensors;
+       begin += kMultiLayerNormMaxTensors) {
+    const int end = std::min(begin + kMultiLayerNormMaxTensors, num_tensors);
+    MultiLayerNormTable<T, U, V> table = {};
+    int max_n1 = 0;
+    int max_n2 = 0;
+    int sum_n2 = 0;
+    for (int i = begin; i < end; ++i) {
+      MultiLayerNormDescriptor<T, U, V> &desc = table.tensors[i - begin];
+      desc.input = inputs[i].DATA_PTR<T>();
+      desc.dout = douts[i].DATA_PTR<V>();
+      desc.grad_input = grad_inputs[i].DATA_PTR<T>();
+      desc.gamma = affine ? gammas[i].DATA_PTR<V>() : NULL;
+      desc.mean = !rms_only ? means[i].DATA_PTR<U>() : NULL;
+      desc.invvar = invvars[i].DATA_PTR<U>();
+      desc.grad_gamma = affine ? grad_gammas[i].DATA_PTR<V>() : NULL;
+      desc.grad_beta =
+          affine && !rms_only ? grad_betas[i].DATA_PTR<V>() : desc.grad_gamma;
+      desc.n1 = n1s[i];
+      desc.n2 = n2s[i];
+      table.offsets[i - begin + 1] = table.offsets[i - begin] + n1s[i];
+      max_n1 = std::max(max_n1, n1s[i]);
+      max_n2 = std::max(max_n2, n2s[i]);
+      sum_n2 += n2s[i];
+    }
+    table.num_tensors = end - begin;
+    const int num_rows = table.offsets[table.num_tensors];
+    if (num_rows == 0) {
+      continue;
+    }
+
+    if (affine) {
+      // compute grad_gamma(j) and grad_beta(j), the partial rows of all
+      // tensors share one workspace and one part_size
+      const LayerNormLaunchConfig config =
+          GetLayerNormLaunchConfig(max_n1, sum_n2, sizeof(T));
+      const int part_size = config.part_size;
+      const dim3 threads2(32, 4, 1);
+      int64_t part_elems = 0;
+      MultiLayerNormTable<T, U, V> tiles = table;
+      for (int t = 0; t < table.num_tensors; ++t) {
+        const int n2 = table.tensors[t].n2;
+        tiles.offsets[t + 1] =
+            tiles.offsets[t] + (n2 + threads2.x - 1) / threads2.x;
+        part_elems += int64_t(part_size) * n2;
+      }
+      const int num_tiles = tiles.offsets[tiles.num_tensors];
+      const int64_t counter_bytes =
+          ((num_tiles * sizeof(unsigned int) + 15) / 16) * 16;
+      const int64_t part_bytes = part_elems * sizeof(U);
+      at::Tensor workspace = GetLayerNormWorkspace(
+          inputs[begin], counter_bytes + (rms_only ? 1 : 2) * part_bytes);
+      uint8_t *workspace_ptr = workspace.DATA_PTR<uint8_t>();
+      // cleared per launch, see HostLayerNormGammaBetaGradient
+      AT_CUDA_CHECK(cudaMemsetAsync(workspace_ptr, 0, counter_bytes, stream));
+      U *part_grad = reinterpret_cast<U *>(workspace_ptr + counter_bytes);
+      int64_t part_offset = 0;
+      for (int t = 0; t < tiles.num_tensors; ++t) {
+        MultiLayerNormDescriptor<T, U, V> &desc = tiles.tensors[t];
+        desc.part_grad_gamma = part_grad + part_offset;
+        desc.part_grad_beta = !rms_only
+                                  ? part_grad + part_elems + part_offset
+                                  : desc.part_grad_gamma;
+        part_offset += int64_t(part_size) * desc.n2;
+      }
+      const dim3 blocks2(num_tiles, part_size, 1);
+      const int nshared2_a =
+          2 * sizeof(U) * threads2.y * threads2.y * (threads2.x + 1);
+      const int nshared2_b = threads2.x * threads2.y * sizeof(U);
+      const int nshared2 = nshared2_a > nshared2_b ? nshared2_a : nshared2_b;
+      cuComputeMultiGradGammaBeta<<<blocks2, threads2, nshared2, stream>>>(
+          tiles, reinterpret_cast<unsigned int *>(workspace_ptr), U(epsilon),
+          rms_only);
+    }
+
+    // compute grad_input, one row per block
+    const LayerNormLaunchConfig config =
+        GetLayerNormLaunchConfig(num_rows, max_n2, sizeof(T));
+    const dim3 threads1(32, config.warps_per_row, 1);
+    const dim3 blocks1(1, std::min(uint64_t(num_rows), maxGridY), 1);
+    int nshared = threads1.y > 1 ? threads1.y * threads1.x * sizeof(U) : 0;
+    cuComputeMultiGradInput<<<blocks1, threads1, nshared, stream>>>(table,
+                                                                   rms_only);
+  }
+}
+
+void cuda_multi_layer_norm_gradient(
+    std::vector<at::Tensor> &grad_inputs, std::vector<at::Tensor> &grad_gammas,
+    std::vector<at::Tensor> &grad_betas, const std::vector<at::Tensor> &douts,
+    const std::vector<at::Tensor> &means,
+    const std::vector<at::Tensor> &invvars,
+    const std::vector<at::Tensor> &inputs, const std::vector<int> &n1s,
+    const std::vector<int> &n2s, const std::vector<at::Tensor> &gammas,
+    double epsilon, bool rms_only) {
+  using namespace at;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(
+      inputs[0].scalar_type(),
+      gammas.empty() ? inputs[0].scalar_type() : gammas[0].scalar_type(),
+      "cuComputeMultiGradInput",
+      using accscalar_t = at::acc_type<scalar_t_in, true>;
+      HostMultiLayerNormGradient<scalar_t_in, accscalar_t, scalar_t_out>(
+          grad_inputs, grad_gammas, grad_betas, douts, means, invvars, inputs,
+          n1s, n2s, gammas, epsilon, rms_only);)
+}
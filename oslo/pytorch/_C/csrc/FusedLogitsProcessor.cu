@@ -0,0 +1,221 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+
+/*
+Kernel implementation for a fused chain of logits processors.
+*/
+
+#include <ATen/cuda/CUDAContext.h>
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <math.h>
+#include <mutex>
+#include <torch/extension.h>
+#include <unordered_map>
+#include <vector>
+
+#include "type_shim.h"
+
+namespace {
+// Every processor of the chain is disabled by its neutral value.
+struct LogitsProcessorParams {
+  int no_repeat_ngram_size; // 0 disables ngram blocking
+  float repetition_penalty; // 1 disables repetition penalty
+  float presence_penalty;   // 0 disables presence penalty
+  float temperature;        // 1 disables temperature
+  int top_k;                // 0 disables top-k
+  int min_length;           // applied when eos_token_id >= 0
+  int eos_token_id;
+};
+
+// Map a float to an unsigned key with the same order.
+__device__ __forceinline__ unsigned int cuOrderedKey(float value) {
+  const unsigned int bits = __float_as_uint(value);
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+__device__ __forceinline__ void cuSetFlag(unsigned int *flags, long token) {
+  atomicOr(flags + token / 32, 1u << (token % 32));
+}
+
+__device__ __forceinline__ bool cuTestFlag(const unsigned int *flags,
+                                           int token) {
+  return (flags[token / 32] >> (token % 32)) & 1u;
+}
+
+// Radix select of the top_k-th largest score of a row, 8 bits at a time.
+// Returns the ordered key of that score so that ties are kept like the
+// torch.topk based warper does.
+template <typename T>
+__device__ unsigned int cuSelectTopKKey(const T *row_scores, int vocab_size,
+                                        int top_k) {
+  __shared__ unsigned int hist[256];
+  __shared__ unsigned int s_desired;
+  __shared__ int s_remaining;
+  unsigned int desired = 0;
+  unsigned int mask = 0;
+  int remaining = top_k;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    for (int i = threadIdx.x; i < 256; i += blockDim.x) {
+      hist[i] = 0;
+    }
+    __syncthreads();
+    for (int v = threadIdx.x; v < vocab_size; v += blockDim.x) {
+      const unsigned int key = cuOrderedKey(static_cast<float>(row_scores[v]));
+      if ((key & mask) == desired) {
+        atomicAdd(hist + ((key >> shift) & 255u), 1u);
+      }
+    }
+    __syncthreads();
+    if (threadIdx.x == 0) {
+      int digit = 255;
+      for (; digit > 0; --digit) {
+        if ((int)hist[digit] >= remaining)
+          break;
+        remaining -= hist[digit];
+      }
+      s_desired = desired | ((unsigned int)digit << shift);
+      s_remaining = remaining;
+    }
+    __syncthreads();
+    desired = s_desired;
+    remaining = s_remaining;
+    mask |= 255u << shift;
+  }
+  return desired;
+}
+
+// One block per row. The history is scanned once to flag the tokens it
+// contains and the tokens that would repeat an ngram, then a single pass
+// over the vocabulary applies every elementwise processor, and top-k masks
+// the processed row. The flags are cleared once they are read, so the
+// workspace is zero again for the next launch.
+template <typename T>
+__global__ void
+cuProcessLogits(T *__restrict__ scores, const long *__restrict__ tokens,
+                unsigned int *__restrict__ flags, int max_predict_len,
+                int vocab_size, int step, LogitsProcessorParams params) {
+  const auto row = blockIdx.x;
+  const int words = (vocab_size + 31) / 32;
+  const long *row_tokens = tokens + (int64_t)row * max_predict_len;
+  T *row_scores = scores + (int64_t)row * vocab_size;
+  unsigned int *present = flags + (int64_t)row * 2 * words;
+  unsigned int *banned = present + words;
+
+  const bool penalize =
+      params.repetition_penalty != 1.f || params.presence_penalty != 0.f;
+  if (penalize) {
+    for (int i = threadIdx.x; i <= step; i += blockDim.x) {
+      cuSetFlag(present, row_tokens[i]);
+    }
+  }
+  const int n = params.no_repeat_ngram_size;
+  if (n > 0) {
+    // each thread compares ngrams starting from its index with the final
+    // ngram starting from step - no_repeat_ngram_size + 2
+    const int num_ngrams = step - n + 2;
+    for (int col = threadIdx.x; col < num_ngrams; col += blockDim.x) {
+      bool equal = true;
+      for (int k = 0; k < n - 1 && equal; k++) {
+        equal = row_tokens[col + k] == row_tokens[num_ngrams + k];
+      }
+      if (equal) {
+        cuSetFlag(banned, row_tokens[col + n - 1]);
+      }
+    }
+  }
+  __syncthreads();
+
+  const bool ban_eos =
+      params.eos_token_id >= 0 && step + 1 < params.min_length;
+  for (int v = threadIdx.x; v < vocab_size; v += blockDim.x) {
+    float value = static_cast<float>(row_scores[v]);
+    if (penalize && cuTestFlag(present, v)) {
+      value = value < 0.f ? value * params.repetition_penalty
+                          : value / params.repetition_penalty;
+      value -= params.presence_penalty;
+    }
+    if ((n > 0 && cuTestFlag(banned, v)) ||
+        (ban_eos && v == params.eos_token_id)) {
+      value = -INFINITY;
+    }
+    row_scores[v] = static_cast<T>(value / params.temperature);
+  }
+  if (penalize || n > 0) {
+    __syncthreads();
+    for (int i = threadIdx.x; i < 2 * words; i += blockDim.x) {
+      present[i] = 0;
+    }
+  }
+
+  if (params.top_k <= 0 || params.top_k >= vocab_size)
+    return;
+  __syncthreads();
+  const unsigned int threshold =
+      cuSelectTopKKey(row_scores, vocab_size, params.top_k);
+  for (int v = threadIdx.x; v < vocab_size; v += blockDim.x) {
+    if (cuOrderedKey(static_cast<float>(row_scores[v])) < threshold) {
+      row_scores[v] = static_cast<T>(-INFINITY);
+    }
+  }
+}
+
+// Flags of the last launch on a device. The kernel leaves them zero, so
+// they are only allocated again when they grow or the stream changes.
+struct LogitsFlagsWorkspace {
+  torch::Tensor flags;
+  c10::StreamId stream_id = 0;
+};
+
+torch::Tensor getLogitsFlags(int64_t numel,
+                             const torch::TensorOptions &options) {
+  static std::mutex mutex;
+  static std::unordered_map<int64_t, LogitsFlagsWorkspace> workspaces;
+  const auto stream = at::cuda::getCurrentCUDAStream();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &workspace = workspaces[stream.device_index()];
+  if (!workspace.flags.defined() || workspace.flags.numel() < numel ||
+      workspace.stream_id != stream.id()) {
+    workspace.flags = torch::zeros({numel}, options);
+    workspace.stream_id = stream.id();
+  }
+  return workspace.flags;
+}
+} // namespace
+
+// Apply the chain of logits processors to 'scores' in place.
+torch::Tensor logits_process_cuda_forward(
+    const torch::Tensor tokens, torch::Tensor scores, int step,
+    int no_repeat_ngram_size, float repetition_penalty, float presence_penalty,
+    float temperature, int top_k, int min_length, int eos_token_id) {
+  int rows = scores.size(0);
+  int vocab_size = scores.size(1);
+  int max_predict_len = tokens.size(1);
+  int words = (vocab_size + 31) / 32;
+  // history and ngram flags of every row, one bit per token of the vocab
+  auto flags = getLogitsFlags((int64_t)rows * 2 * words,
+                              scores.options().dtype(torch::kInt));
+
+  LogitsProcessorParams params;
+  params.no_repeat_ngram_size =
+      step - no_repeat_ngram_size + 2 > 0 ? no_repeat_ngram_size : 0;
+  params.repetition_penalty = repetition_penalty;
+  params.presence_penalty = presence_penalty;
+  params.temperature = temperature;
+  params.top_k = top_k;
+  params.min_length = min_length;
+  params.eos_token_id = eos_token_id;
+
+  // Launching N blocks where N is number of samples in a batch (beams*bsz)
+  const int threads = 1024;
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      scores.scalar_type(), 0, "cuProcessLogits",
+      cuProcessLogits<<<rows, threads, 0, stream>>>(
+          scores.data_ptr<scalar_t_0>(), tokens.data_ptr<long>(),
+          reinterpret_cast<unsigned int *>(flags.data_ptr<int>()),
+          max_predict_len, vocab_size, step, params);)
+  return scores;
+}
@@ -8,6 +8,8 @@ Licensed under the MIT License.
 Kernel implementation for blocking repeated n-grams.
 */
 
+#include <ATen/cuda/CUDAContext.h>
+#include <algorithm>
 #include <cuda.h>
 #include <cuda_runtime.h>
 #include <math.h>
@@ -48,6 +50,73 @@ __global__ void banRepeatedTokens(long *__restrict__ tokens,
   lprobs[lprob_start + token_to_be_banned] = -INFINITY;
 }
 
+// Ban the repeated ngrams of one row with the blocks of gridDim.y.
+// Candidates are tiled over the blocks in whole warps, and every warp
+// compares 32 consecutive candidates with the current suffix at once, so a
+// warp stops as soon as none of its candidates can match.
+__device__ void banRowRepeatedTokens(const long *row_tokens,
+                                     float *row_lprobs,
+                                     int no_repeat_ngram_size,
+                                     int num_ngrams) {
+  // Assumptions:
+  // 1) blockDim.x is a multiple of warpSize
+  // 2) num_ngrams == step - no_repeat_ngram_size + 2, the suffix to compare
+  //    with starts at num_ngrams
+  //
+  extern __shared__ long suffix_shm[];
+  for (int k = threadIdx.x; k < no_repeat_ngram_size - 1; k += blockDim.x) {
+    suffix_shm[k] = row_tokens[num_ngrams + k];
+  }
+  __syncthreads();
+
+  const int lane = threadIdx.x & 31;
+  // whole warps iterate, so that every lane takes part in the ballots
+  for (int warp_start = blockIdx.y * blockDim.x + threadIdx.x - lane;
+       warp_start < num_ngrams; warp_start += gridDim.y * blockDim.x) {
+    const int col = warp_start + lane;
+    const bool active = col < num_ngrams;
+    unsigned int matched = __ballot_sync(0xffffffff, active);
+    for (int k = 0; k < no_repeat_ngram_size - 1 && matched != 0; ++k) {
+      const bool equal = active && row_tokens[col + k] == suffix_shm[k];
+      matched &= __ballot_sync(0xffffffff, equal);
+    }
+    if ((matched >> lane) & 1) {
+      // reach here means ban
+      row_lprobs[row_tokens[col + no_repeat_ngram_size - 1]] = -INFINITY;
+    }
+  }
+}
+
+// Ban repeated ngrams for histories longer than one block can hold.
+__global__ void banRepeatedTokensTiled(const long *__restrict__ tokens,
+                                       float *__restrict__ lprobs,
+                                       int max_predict_len, int vocab_size,
+                                       int no_repeat_ngram_size,
+                                       int num_ngrams) {
+  const auto row = blockIdx.x;
+  banRowRepeatedTokens(tokens + (int64_t)row * max_predict_len,
+                       lprobs + (int64_t)row * vocab_size,
+                       no_repeat_ngram_size, num_ngrams);
+}
+
+// Ban repeated ngrams of a ragged batch. The history of a row is the
+// seq_lens[row] tokens starting at seq_starts[row] of the flat tokens, so
+// packed (cu_seqlens) and left padded batches are both supported.
+__global__ void banRepeatedTokensRagged(const long *__restrict__ tokens,
+                                        float *__restrict__ lprobs,
+                                        const int *__restrict__ seq_starts,
+                                        const int *__restrict__ seq_lens,
+                                        int vocab_size,
+                                        int no_repeat_ngram_size) {
+  const auto row = blockIdx.x;
+  const int num_ngrams = seq_lens[row] - no_repeat_ngram_size + 1;
+  if (num_ngrams <= 0)
+    return;
+  banRowRepeatedTokens(tokens + seq_starts[row],
+                       lprobs + (int64_t)row * vocab_size,
+                       no_repeat_ngram_size, num_ngrams);
+}
+
 // Allocate blocks and threads based on
 // batch size and sequence length and launch
 // kernel
@@ -70,7 +139,156 @@ torch::Tensor ngram_repeat_block_cuda_forward(const torch::Tensor tokens,
   // Allocating shared mem per block for faster access of input tokens since
   // each token will be accessed N times to compare with current Ngram where
   // N is Ngram size.
-  banRepeatedTokens<<<blocks, threads, shared_mem_size>>>(
-      token_ptr, lprob_ptr, max_predict_len, vocab_size, no_repeat_ngram_size);
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  if (threads <= 1024) {
+    banRepeatedTokens<<<blocks, threads, shared_mem_size, stream>>>(
+        token_ptr, lprob_ptr, max_predict_len, vocab_size,
+        no_repeat_ngram_size);
+    return lprobs;
+  }
+
+  // Longer histories exceed the block size, tile the candidate ngrams of
+  // every sample over several blocks and keep only the suffix shared.
+  const int tiled_threads = 256;
+  const int max_tiles = at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const int tiles =
+      std::min((threads + tiled_threads - 1) / tiled_threads, max_tiles);
+  const dim3 tiled_blocks(blocks, tiles);
+  banRepeatedTokensTiled<<<tiled_blocks, tiled_threads,
+                           (no_repeat_ngram_size - 1) * sizeof(long), stream>>>(
+      token_ptr, lprob_ptr, max_predict_len, vocab_size, no_repeat_ngram_size,
+      threads);
+  return lprobs;
+}
+
+// Launch one block row per sequence of the ragged batch, enough tiles to
+// cover the longest one.
+torch::Tensor ngram_repeat_block_ragged_cuda_forward(
+    const torch::Tensor tokens, torch::Tensor lprobs,
+    const torch::Tensor seq_starts, const torch::Tensor seq_lens,
+    int max_seqlen, int no_repeat_ngram_size) {
+  int max_ngrams = max_seqlen - no_repeat_ngram_size + 1;
+  int rows = lprobs.size(0);
+  if (max_ngrams <= 0 || rows == 0)
+    return lprobs;
+  int vocab_size = lprobs.size(1);
+
+  const int threads = 256;
+  const int max_tiles = at::cuda::getCurrentDeviceProperties()->maxGridSize[1];
+  const int tiles = std::min((max_ngrams + threads - 1) / threads, max_tiles);
+  const dim3 blocks(rows, tiles);
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  banRepeatedTokensRagged<<<blocks, threads,
+                            (no_repeat_ngram_size - 1) * sizeof(long),
+                            stream>>>(
+      tokens.data_ptr<long>(), lprobs.data_ptr<float>(),
+      seq_starts.data_ptr<int>(), seq_lens.data_ptr<int>(), vocab_size,
+      no_repeat_ngram_size);
+  return lprobs;
+}
+
+// Hash of the (no_repeat_ngram_size - 1) tokens starting at 'tokens'.
+// 0 marks an empty slot of the index, so a valid key is never 0.
+__device__ __forceinline__ unsigned long long
+hashNGramPrefix(const long *tokens, int prefix_size) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (int k = 0; k < prefix_size; k++) {
+    hash = (hash ^ (unsigned long long)tokens[k]) * 1099511628211ULL;
+  }
+  hash ^= hash >> 29;
+  return hash | 1ULL;
+}
+
+// Ban repeated ngrams with an open addressing index of every ngram a sample
+// has seen. The index of a row maps the hash of an ngram prefix to the
+// position of that ngram in the row, so only the ngrams completed since the
+// last call are inserted and the current suffix is looked up instead of
+// rescanning the whole history.
+__global__ void banRepeatedTokensIndexed(
+    const long *__restrict__ tokens, float *__restrict__ lprobs,
+    unsigned long long *__restrict__ keys, int *__restrict__ positions,
+    int max_predict_len, int vocab_size, int capacity,
+    int no_repeat_ngram_size, int num_indexed, int num_ngrams) {
+  // Assumptions:
+  // 1) capacity is a power of two larger than num_ngrams
+  // 2) blockDim.x is a multiple of warpSize
+  //
+  const auto row = blockIdx.x;
+  const int prefix_size = no_repeat_ngram_size - 1;
+  const long *row_tokens = tokens + (int64_t)row * max_predict_len;
+  float *row_lprobs = lprobs + (int64_t)row * vocab_size;
+  unsigned long long *row_keys = keys + (int64_t)row * capacity;
+  int *row_positions = positions + (int64_t)row * capacity;
+
+  // insert ngrams completed since the last call
+  for (int col = num_indexed + threadIdx.x; col < num_ngrams;
+       col += blockDim.x) {
+    const unsigned long long key =
+        hashNGramPrefix(row_tokens + col, prefix_size);
+    for (int probe = 0; probe < capacity; probe++) {
+      const int slot = (key + probe) & (capacity - 1);
+      if (atomicCAS(row_keys + slot, 0ULL, key) == 0ULL) {
+        row_positions[slot] = col;
+        break;
+      }
+    }
+  }
+  __syncthreads();
+
+  // the first warp looks the current suffix up, 32 slots at a time
+  if (threadIdx.x >= 32)
+    return;
+  const int lane = threadIdx.x;
+  const long *suffix = row_tokens + num_ngrams;
+  const unsigned long long key = hashNGramPrefix(suffix, prefix_size);
+  for (int probe = 0; probe < capacity; probe += 32) {
+    const int slot = (key + probe + lane) & (capacity - 1);
+    const unsigned long long slot_key = row_keys[slot];
+    const unsigned int empty = __ballot_sync(0xffffffff, slot_key == 0ULL);
+    // slots past the first empty one belong to other chains
+    const int valid = empty ? __ffs(empty) - 1 : 32;
+    if (lane < valid && slot_key == key) {
+      const int col = row_positions[slot];
+      bool equal = true;
+      for (int k = 0; k < prefix_size && equal; k++) {
+        equal = row_tokens[col + k] == suffix[k];
+      }
+      if (equal) {
+        // reach here means ban
+        row_lprobs[row_tokens[col + prefix_size]] = -INFINITY;
+      }
+    }
+    if (empty)
+      break;
+  }
+}
+
+// Update the ngram index of every sample with the ngrams completed since
+// 'num_indexed' and ban the tokens that repeat one of them.
+torch::Tensor ngram_repeat_block_index_cuda_forward(
+    const torch::Tensor tokens, torch::Tensor lprobs, torch::Tensor keys,
+    torch::Tensor positions, int step, int num_indexed,
+    int no_repeat_ngram_size) {
+  int num_ngrams = step - no_repeat_ngram_size + 2;
+  if (num_ngrams <= 0)
+    return lprobs;
+  int rows = tokens.size(0);
+  int max_predict_len = tokens.size(1);
+  int vocab_size = lprobs.size(1);
+  int capacity = keys.size(1);
+  auto keys_ptr =
+      reinterpret_cast<unsigned long long *>(keys.data_ptr<int64_t>());
+
+  // Launching N blocks where N is number of samples in a batch (beams*bsz)
+  // Launching T threads where T covers the ngrams completed since the last
+  // call, a single warp when decoding one token at a time.
+  const int new_ngrams = num_ngrams - std::min(num_indexed, num_ngrams);
+  const int threads =
+      std::min(std::max((new_ngrams + 31) / 32 * 32, 32), 1024);
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  banRepeatedTokensIndexed<<<rows, threads, 0, stream>>>(
+      tokens.data_ptr<long>(), lprobs.data_ptr<float>(), keys_ptr,
+      positions.data_ptr<int>(), max_predict_len, vocab_size, capacity,
+      no_repeat_ngram_size, num_indexed, num_ngrams);
   return lprobs;
 }
@@ -0,0 +1,399 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+
+/*
+Kernel implementation for the softmax of scaled and masked attention scores.
+*/
+
+#include "ATen/ATen.h"
+#include "ATen/cuda/CUDAContext.h"
+#include "ATen/cuda/DeviceUtils.cuh"
+
+#include <cfloat>
+#include <cstdint>
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include "type_shim.h"
+
+namespace {
+// Rows of up to 2^kMaxWarpLog2Cols elements are kept in the registers of a
+// single warp, longer ones are tiled over a block.
+constexpr int kMaxWarpLog2Cols = 12;
+constexpr int kWarpsPerBlock = 4;
+constexpr int kTiledThreads = 1024;
+
+// Scores of masked positions, as the additive masks of the HF models.
+constexpr float kMaskedScore = -10000.f;
+
+// Layout of the [b, h, sq, sk] scores and of the [1 or b, 1, 1 or sq, sk]
+// mask. The strides of the mask are 0 along its broadcast dims.
+struct SoftmaxShape {
+  int64_t rows;
+  int cols;
+  int query_len;
+  int rows_per_batch;
+  int64_t mask_batch_stride;
+  int64_t mask_row_stride;
+  float scale;
+};
+
+// Causal scores are [b * h, sq, sk] with the query i attending the keys up
+// to sk - sq + i, the ones after it are excluded from the softmax.
+template <bool CAUSAL>
+__device__ __forceinline__ float cuLoadScore(const float value,
+                                             const uint8_t *mask_row,
+                                             int64_t row, int col,
+                                             const SoftmaxShape &shape) {
+  if (CAUSAL) {
+    const int last = shape.cols - shape.query_len + row % shape.query_len;
+    return col <= last ? value * shape.scale : -FLT_MAX;
+  }
+  if (mask_row != nullptr && mask_row[col]) {
+    return kMaskedScore;
+  }
+  return value * shape.scale;
+}
+
+__device__ __forceinline__ const uint8_t *
+cuMaskRow(const uint8_t *mask, int64_t row, const SoftmaxShape &shape) {
+  if (mask == nullptr) {
+    return nullptr;
+  }
+  return mask + row / shape.rows_per_batch * shape.mask_batch_stride +
+         row % shape.query_len * shape.mask_row_stride;
+}
+
+template <typename U> __device__ __forceinline__ U cuWarpMax(U value) {
+#pragma unroll
+  for (int offset = 16; offset > 0; offset /= 2) {
+    value = fmaxf(value, WARP_SHFL_XOR(value, offset));
+  }
+  return value;
+}
+
+template <typename U> __device__ __forceinline__ U cuWarpSum(U value) {
+#pragma unroll
+  for (int offset = 16; offset > 0; offset /= 2) {
+    value += WARP_SHFL_XOR(value, offset);
+  }
+  return value;
+}
+
+// Reduction over the block, every thread gets the result. 'buffer' holds a
+// value per warp.
+template <bool MAX>
+__device__ float cuBlockReduce(float value, float *buffer) {
+  const int lane = threadIdx.x % 32;
+  const int warp = threadIdx.x / 32;
+  const int warps = blockDim.x / 32;
+  value = MAX ? cuWarpMax(value) : cuWarpSum(value);
+  if (lane == 0) {
+    buffer[warp] = value;
+  }
+  __syncthreads();
+  value = lane < warps ? buffer[lane] : (MAX ? -FLT_MAX : 0.f);
+  value = MAX ? cuWarpMax(value) : cuWarpSum(value);
+  // the buffer is reused by the next reduction
+  __syncthreads();
+  return value;
+}
+
+// One warp per row, the 2^LOG2_COLS padded elements of a row stay in
+// registers between the max, the sum and the normalization.
+template <typename T, int LOG2_COLS, bool CAUSAL>
+__global__ void
+cuScaledMaskedSoftmaxWarpForward(T *__restrict__ output,
+                                 const T *__restrict__ input,
+                                 const uint8_t *__restrict__ mask,
+                                 SoftmaxShape shape) {
+  constexpr int cols_pow2 = 1 << LOG2_COLS;
+  constexpr int iters = cols_pow2 < 32 ? 1 : cols_pow2 / 32;
+  const int64_t row = (int64_t)blockIdx.x * blockDim.y + threadIdx.y;
+  if (row >= shape.rows) {
+    return;
+  }
+  const int lane = threadIdx.x;
+  const T *x = input + row * shape.cols;
+  const uint8_t *mask_row = cuMaskRow(mask, row, shape);
+
+  float values[iters];
+  float max_value = -FLT_MAX;
+#pragma unroll
+  for (int it = 0; it < iters; ++it) {
+    const int col = it * 32 + lane;
+    values[it] = col < shape.cols
+                     ? cuLoadScore<CAUSAL>(static_cast<float>(x[col]),
+                                           mask_row, row, col, shape)
+                     : -FLT_MAX;
+    max_value = fmaxf(max_value, values[it]);
+  }
+  max_value = cuWarpMax(max_value);
+
+  float sum = 0.f;
+#pragma unroll
+  for (int it = 0; it < iters; ++it) {
+    values[it] = values[it] == -FLT_MAX ? 0.f : expf(values[it] - max_value);
+    sum += values[it];
+  }
+  sum = cuWarpSum(sum);
+
+  T *y = output + row * shape.cols;
+#pragma unroll
+  for (int it = 0; it < iters; ++it) {
+    const int col = it * 32 + lane;
+    if (col < shape.cols) {
+      y[col] = static_cast<T>(values[it] / sum);
+    }
+  }
+}
+
+// One block per row, for rows too long for the registers of a warp. The row
+// is read from global memory by every pass.
+template <typename T, bool CAUSAL>
+__global__ void
+cuScaledMaskedSoftmaxTiledForward(T *__restrict__ output,
+                                  const T *__restrict__ input,
+                                  const uint8_t *__restrict__ mask,
+                                  SoftmaxShape shape) {
+  __shared__ float buffer[32];
+  const int64_t row = blockIdx.x;
+  const T *x = input + row * shape.cols;
+  T *y = output + row * shape.cols;
+  const uint8_t *mask_row = cuMaskRow(mask, row, shape);
+
+  float max_value = -FLT_MAX;
+  for (int col = threadIdx.x; col < shape.cols; col += blockDim.x) {
+    max_value = fmaxf(max_value,
+                      cuLoadScore<CAUSAL>(static_cast<float>(x[col]),
+                                          mask_row, row, col, shape));
+  }
+  max_value = cuBlockReduce<true>(max_value, buffer);
+
+  float sum = 0.f;
+  for (int col = threadIdx.x; col < shape.cols; col += blockDim.x) {
+    const float value = cuLoadScore<CAUSAL>(static_cast<float>(x[col]),
+                                            mask_row, row, col, shape);
+    sum += value == -FLT_MAX ? 0.f : expf(value - max_value);
+  }
+  sum = cuBlockReduce<false>(sum, buffer);
+
+  for (int col = threadIdx.x; col < shape.cols; col += blockDim.x) {
+    const float value = cuLoadScore<CAUSAL>(static_cast<float>(x[col]),
+                                            mask_row, row, col, shape);
+    y[col] = static_cast<T>(
+        value == -FLT_MAX ? 0.f : expf(value - max_value) / sum);
+  }
+}
+
+// grad_input = scale * y * (grad_output - sum(grad_output * y)), masked
+// positions have a null y and so a null gradient.
+template <typename T, int LOG2_COLS>
+__global__ void cuScaledSoftmaxWarpBackward(T *__restrict__ grad_input,
+                                            const T *__restrict__ grad_output,
+                                            const T *__restrict__ output,
+                                            SoftmaxShape shape) {
+  constexpr int cols_pow2 = 1 << LOG2_COLS;
+  constexpr int iters = cols_pow2 < 32 ? 1 : cols_pow2 / 32;
+  const int64_t row = (int64_t)blockIdx.x * blockDim.y + threadIdx.y;
+  if (row >= shape.rows) {
+    return;
+  }
+  const int lane = threadIdx.x;
+  const T *dy = grad_output + row * shape.cols;
+  const T *y = output + row * shape.cols;
+
+  float grads[iters], values[iters];
+  float dot = 0.f;
+#pragma unroll
+  for (int it = 0; it < iters; ++it) {
+    const int col = it * 32 + lane;
+    grads[it] = col < shape.cols ? static_cast<float>(dy[col]) : 0.f;
+    values[it] = col < shape.cols ? static_cast<float>(y[col]) : 0.f;
+    dot += grads[it] * values[it];
+  }
+  dot = cuWarpSum(dot);
+
+  T *dx = grad_input + row * shape.cols;
+#pragma unroll
+  for (int it = 0; it < iters; ++it) {
+    const int col = it * 32 + lane;
+    if (col < shape.cols) {
+      dx[col] =
+          static_cast<T>(shape.scale * values[it] * (grads[it] - dot));
+    }
+  }
+}
+
+template <typename T>
+__global__ void cuScaledSoftmaxTiledBackward(T *__restrict__ grad_input,
+                                             const T *__restrict__ grad_output,
+                                             const T *__restrict__ output,
+                                             SoftmaxShape shape) {
+  __shared__ float buffer[32];
+  const int64_t row = blockIdx.x;
+  const T *dy = grad_output + row * shape.cols;
+  const T *y = output + row * shape.cols;
+  T *dx = grad_input + row * shape.cols;
+
+  float dot = 0.f;
+  for (int col = threadIdx.x; col < shape.cols; col += blockDim.x) {
+    dot += static_cast<float>(dy[col]) * static_cast<float>(y[col]);
+  }
+  dot = cuBlockReduce<false>(dot, buffer);
+
+  for (int col = threadIdx.x; col < shape.cols; col += blockDim.x) {
+    dx[col] = static_cast<T>(shape.scale * static_cast<float>(y[col]) *
+                             (static_cast<float>(dy[col]) - dot));
+  }
+}
+
+int GetLog2Cols(int cols) {
+  int log2_cols = 0;
+  while ((1 << log2_cols) < cols) {
+    ++log2_cols;
+  }
+  return log2_cols;
+}
+
+dim3 GetWarpGrid(int64_t rows) {
+  return dim3((rows + kWarpsPerBlock - 1) / kWarpsPerBlock);
+}
+
+// Instantiates the warp kernels for every LOG2_COLS up to kMaxWarpLog2Cols
+// and launches the one of 'log2_cols'.
+template <typename T, bool CAUSAL, int LOG2_COLS> struct WarpForwardLauncher {
+  static void launch(int log2_cols, T *output, const T *input,
+                     const uint8_t *mask, const SoftmaxShape &shape,
+                     cudaStream_t stream) {
+    if (log2_cols == LOG2_COLS) {
+      cuScaledMaskedSoftmaxWarpForward<T, LOG2_COLS, CAUSAL>
+          <<<GetWarpGrid(shape.rows), dim3(32, kWarpsPerBlock), 0, stream>>>(
+              output, input, mask, shape);
+    } else {
+      WarpForwardLauncher<T, CAUSAL, LOG2_COLS - 1>::launch(
+          log2_cols, output, input, mask, shape, stream);
+    }
+  }
+};
+
+template <typename T, bool CAUSAL> struct WarpForwardLauncher<T, CAUSAL, -1> {
+  static void launch(int, T *, const T *, const uint8_t *,
+                     const SoftmaxShape &, cudaStream_t) {}
+};
+
+template <typename T, int LOG2_COLS> struct WarpBackwardLauncher {
+  static void launch(int log2_cols, T *grad_input, const T *grad_output,
+                     const T *output, const SoftmaxShape &shape,
+                     cudaStream_t stream) {
+    if (log2_cols == LOG2_COLS) {
+      cuScaledSoftmaxWarpBackward<T, LOG2_COLS>
+          <<<GetWarpGrid(shape.rows), dim3(32, kWarpsPerBlock), 0, stream>>>(
+              grad_input, grad_output, output, shape);
+    } else {
+      WarpBackwardLauncher<T, LOG2_COLS - 1>::launch(
+          log2_cols, grad_input, grad_output, output, shape, stream);
+    }
+  }
+};
+
+template <typename T> struct WarpBackwardLauncher<T, -1> {
+  static void launch(int, T *, const T *, const T *, const SoftmaxShape &,
+                     cudaStream_t) {}
+};
+
+template <typename T, bool CAUSAL>
+void HostApplyScaledMaskedSoftmax(T *output, const T *input,
+                                  const uint8_t *mask,
+                                  const SoftmaxShape &shape) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int log2_cols = GetLog2Cols(shape.cols);
+  if (log2_cols <= kMaxWarpLog2Cols) {
+    WarpForwardLauncher<T, CAUSAL, kMaxWarpLog2Cols>::launch(
+        log2_cols, output, input, mask, shape, stream);
+  } else {
+    cuScaledMaskedSoftmaxTiledForward<T, CAUSAL>
+        <<<shape.rows, kTiledThreads, 0, stream>>>(output, input, mask,
+                                                   shape);
+  }
+}
+
+template <typename T>
+void HostScaledSoftmaxGradient(T *grad_input, const T *grad_output,
+                               const T *output, const SoftmaxShape &shape) {
+  auto stream = at::cuda::getCurrentCUDAStream().stream();
+  const int log2_cols = GetLog2Cols(shape.cols);
+  if (log2_cols <= kMaxWarpLog2Cols) {
+    WarpBackwardLauncher<T, kMaxWarpLog2Cols>::launch(
+        log2_cols, grad_input, grad_output, output, shape, stream);
+  } else {
+    cuScaledSoftmaxTiledBackward<T>
+        <<<shape.rows, kTiledThreads, 0, stream>>>(grad_input, grad_output,
+                                                   output, shape);
+  }
+}
+} // namespace
+
+// 'input' is [b, h, sq, sk] and 'mask' is NULL or the [1 or b, 1, 1 or sq,
+// sk] bool or byte mask of the positions to exclude.
+void cuda_scaled_masked_softmax(at::Tensor *output, at::Tensor *input,
+                                at::Tensor *mask, float scale) {
+  SoftmaxShape shape;
+  shape.cols = input->size(3);
+  shape.query_len = input->size(2);
+  shape.rows_per_batch = input->size(1) * input->size(2);
+  shape.rows = input->numel() / shape.cols;
+  shape.mask_batch_stride = 0;
+  shape.mask_row_stride = 0;
+  shape.scale = scale;
+  if (mask != NULL) {
+    shape.mask_batch_stride = mask->size(0) == 1 ? 0 : mask->stride(0);
+    shape.mask_row_stride = mask->size(2) == 1 ? 0 : mask->stride(2);
+  }
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      input->scalar_type(), 0, "cuScaledMaskedSoftmaxForward",
+      HostApplyScaledMaskedSoftmax<scalar_t_0, false>(
+          output->DATA_PTR<scalar_t_0>(), input->DATA_PTR<scalar_t_0>(),
+          mask != NULL ? static_cast<const uint8_t *>(mask->data_ptr()) : NULL,
+          shape);)
+}
+
+// 'input' is [b * h, sq, sk] with sq <= sk, the query i attends the keys up
+// to sk - sq + i.
+void cuda_scaled_upper_triang_masked_softmax(at::Tensor *output,
+                                             at::Tensor *input, float scale) {
+  SoftmaxShape shape;
+  shape.cols = input->size(2);
+  shape.query_len = input->size(1);
+  shape.rows_per_batch = input->size(1);
+  shape.rows = input->numel() / shape.cols;
+  shape.mask_batch_stride = 0;
+  shape.mask_row_stride = 0;
+  shape.scale = scale;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      input->scalar_type(), 0, "cuScaledUpperTriangMaskedSoftmaxForward",
+      HostApplyScaledMaskedSoftmax<scalar_t_0, true>(
+          output->DATA_PTR<scalar_t_0>(), input->DATA_PTR<scalar_t_0>(),
+          NULL, shape);)
+}
+
+// The backward of both softmaxes, from their 'output'.
+void cuda_scaled_softmax_gradient(at::Tensor *grad_input,
+                                  at::Tensor *grad_output, at::Tensor *output,
+                                  float scale) {
+  SoftmaxShape shape;
+  shape.cols = output->size(-1);
+  shape.query_len = 1;
+  shape.rows_per_batch = 1;
+  shape.rows = output->numel() / shape.cols;
+  shape.mask_batch_stride = 0;
+  shape.mask_row_stride = 0;
+  shape.scale = scale;
+  DISPATCH_FLOAT_HALF_AND_BFLOAT(
+      output->scalar_type(), 0, "cuScaledSoftmaxBackward",
+      HostScaledSoftmaxGradient<scalar_t_0>(
+          grad_input->DATA_PTR<scalar_t_0>(),
+          grad_output->DATA_PTR<scalar_t_0>(),
+          output->DATA_PTR<scalar_t_0>(), shape);)
+}
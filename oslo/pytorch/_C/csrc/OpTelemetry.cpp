@@ -0,0 +1,259 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+
+#include "OpTelemetry.h"
+
+#include <ATen/cuda/CUDAContext.h>
+#include <ATen/cuda/CUDAEvent.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// NVTX 3 is header only, so that no library has to be linked.
+#if defined(__has_include)
+#if __has_include(<nvtx3/nvToolsExt.h>)
+#include <nvtx3/nvToolsExt.h>
+#define OSLO_HAS_NVTX
+#endif
+#endif
+
+namespace {
+// Timings are folded into the stats once their events complete, the oldest
+// ones are waited for beyond this many pending timings.
+constexpr size_t kMaxPendingTimings = 4096;
+
+// Distinct labels kept in the stats, the other shapes of an op are counted
+// under a single label of the op.
+constexpr size_t kMaxLabels = 1024;
+
+struct OpStats {
+  int64_t calls = 0;
+  int64_t timedCalls = 0;
+  double totalMs = 0.0;
+  double minMs = std::numeric_limits<double>::infinity();
+  double maxMs = 0.0;
+};
+
+using OpEntry = std::pair<const std::string, OpStats>;
+
+// Op names are string literals, so that a call is looked up without
+// formatting its label.
+struct OpKey {
+  const char *name;
+  at::ScalarType dtype;
+  int64_t n1;
+  int64_t n2;
+
+  bool operator==(const OpKey &other) const {
+    return name == other.name && dtype == other.dtype && n1 == other.n1 &&
+           n2 == other.n2;
+  }
+};
+
+struct OpKeyHash {
+  size_t operator()(const OpKey &key) const {
+    size_t seed = std::hash<const void *>()(key.name);
+    for (size_t value : {(size_t)key.dtype, (size_t)key.n1, (size_t)key.n2}) {
+      seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+  }
+};
+} // namespace
+
+// The events are created once and reused by later timings of the device.
+struct OpTiming {
+  c10::DeviceIndex device;
+  uint64_t generation;
+  OpEntry *entry;
+  at::cuda::CUDAEvent start{cudaEventDefault};
+  at::cuda::CUDAEvent stop{cudaEventDefault};
+};
+
+namespace {
+struct OpTelemetry {
+  std::atomic<bool> nvtx{false};
+  std::atomic<bool> timing{false};
+  std::mutex mutex;
+  std::unordered_map<std::string, OpStats> stats;
+  std::unordered_map<OpKey, OpEntry *, OpKeyHash> interned;
+  // Bumped by a reset, the timings of earlier generations are dropped.
+  uint64_t generation = 0;
+  std::deque<std::unique_ptr<OpTiming>> pending;
+  std::unordered_map<c10::DeviceIndex, std::vector<std::unique_ptr<OpTiming>>>
+      free;
+};
+
+OpTelemetry &telemetry() {
+  static OpTelemetry instance;
+  return instance;
+}
+
+std::string opLabel(const char *name, at::ScalarType dtype, int64_t n1,
+                    int64_t n2) {
+  char buffer[256];
+  std::snprintf(buffer, sizeof(buffer), "%s(n1=%lld, n2=%lld, dtype=%s)",
+                name, (long long)n1, (long long)n2, c10::toString(dtype));
+  return buffer;
+}
+
+// Requires the mutex. Returns the stats entry of a call, the entries of the
+// map keep their address until the next reset.
+OpEntry &lookupEntry(OpTelemetry &state, const char *name,
+                     at::ScalarType dtype, int64_t n1, int64_t n2) {
+  const OpKey key{name, dtype, n1, n2};
+  auto interned = state.interned.find(key);
+  if (interned != state.interned.end()) {
+    return *interned->second;
+  }
+  std::string label = opLabel(name, dtype, n1, n2);
+  if (state.stats.size() >= kMaxLabels && !state.stats.count(label)) {
+    label = std::string(name) + "(other shapes)";
+  }
+  OpEntry &entry = *state.stats.emplace(std::move(label), OpStats()).first;
+  if (state.interned.size() < kMaxLabels) {
+    state.interned.emplace(key, &entry);
+  }
+  return entry;
+}
+
+// Requires the mutex.
+std::unique_ptr<OpTiming> acquireTiming(OpTelemetry &state) {
+  const c10::DeviceIndex device =
+      at::cuda::getCurrentCUDAStream().device_index();
+  auto &free = state.free[device];
+  std::unique_ptr<OpTiming> timing;
+  if (free.empty()) {
+    timing.reset(new OpTiming());
+    timing->device = device;
+  } else {
+    timing = std::move(free.back());
+    free.pop_back();
+  }
+  return timing;
+}
+
+// Requires the mutex. Folds in the completed timings, and waits for the
+// oldest ones until at most 'max_pending' are left.
+void drainTimings(OpTelemetry &state, size_t max_pending) {
+  while (!state.pending.empty()) {
+    if (state.pending.size() <= max_pending &&
+        !state.pending.front()->stop.query()) {
+      break;
+    }
+    std::unique_ptr<OpTiming> timing = std::move(state.pending.front());
+    state.pending.pop_front();
+    timing->stop.synchronize();
+    if (timing->generation == state.generation) {
+      const double ms = timing->start.elapsed_time(timing->stop);
+      OpStats &stats = timing->entry->second;
+      stats.timedCalls += 1;
+      stats.totalMs += ms;
+      stats.minMs = std::min(stats.minMs, ms);
+      stats.maxMs = std::max(stats.maxMs, ms);
+    }
+    state.free[timing->device].push_back(std::move(timing));
+  }
+}
+
+bool isCurrentStreamCapturing() {
+  cudaStreamCaptureStatus status;
+  const auto stream = at::cuda::getCurrentCUDAStream().stream();
+  return cudaStreamIsCapturing(stream, &status) == cudaSuccess &&
+         status != cudaStreamCaptureStatusNone;
+}
+} // namespace
+
+void op_telemetry_set_enabled(bool nvtx, bool timing) {
+#ifndef OSLO_HAS_NVTX
+  TORCH_CHECK(!nvtx, "oslo was built without NVTX");
+#endif
+  auto &state = telemetry();
+  state.nvtx = nvtx;
+  state.timing = timing;
+}
+
+std::map<std::string, std::map<std::string, double>> op_telemetry_stats() {
+  auto &state = telemetry();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  drainTimings(state, /*max_pending=*/0);
+
+  std::map<std::string, std::map<std::string, double>> result;
+  for (const auto &item : state.stats) {
+    const OpStats &stats = item.second;
+    auto &entry = result[item.first];
+    entry["calls"] = (double)stats.calls;
+    entry["timed_calls"] = (double)stats.timedCalls;
+    if (stats.timedCalls > 0) {
+      entry["total_ms"] = stats.totalMs;
+      entry["mean_ms"] = stats.totalMs / stats.timedCalls;
+      entry["min_ms"] = stats.minMs;
+      entry["max_ms"] = stats.maxMs;
+    }
+  }
+  return result;
+}
+
+void op_telemetry_reset() {
+  auto &state = telemetry();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  drainTimings(state, /*max_pending=*/0);
+  // scopes still open hold entries of the cleared stats
+  state.generation += 1;
+  state.interned.clear();
+  state.stats.clear();
+}
+
+OpTelemetryScope::OpTelemetryScope(const char *name, at::ScalarType dtype,
+                                   int64_t n1, int64_t n2) {
+  auto &state = telemetry();
+  const bool nvtx = state.nvtx.load(std::memory_order_relaxed);
+  const bool timing = state.timing.load(std::memory_order_relaxed);
+  if (!nvtx && !timing) {
+    return;
+  }
+
+  // timing events can not be recorded into a CUDA graph
+  const bool timed = timing && !isCurrentStreamCapturing();
+  {
+    std::lock_guard<std::mutex> guard(state.mutex);
+    OpEntry &entry = lookupEntry(state, name, dtype, n1, n2);
+    entry.second.calls += 1;
+#ifdef OSLO_HAS_NVTX
+    if (nvtx) {
+      nvtxRangePushA(entry.first.c_str());
+      nvtx_ = true;
+    }
+#endif
+    if (timed) {
+      timing_ = acquireTiming(state);
+      timing_->generation = state.generation;
+      timing_->entry = &entry;
+    }
+  }
+  if (timing_) {
+    timing_->start.record();
+  }
+}
+
+OpTelemetryScope::~OpTelemetryScope() {
+  if (timing_) {
+    timing_->stop.record();
+    auto &state = telemetry();
+    std::lock_guard<std::mutex> guard(state.mutex);
+    state.pending.push_back(std::move(timing_));
+    drainTimings(state, kMaxPendingTimings);
+  }
+#ifdef OSLO_HAS_NVTX
+  if (nvtx_) {
+    nvtxRangePop();
+  }
+#endif
+}
@@ -0,0 +1,31 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+#pragma once
+
+#include <torch/extension.h>
+
+// Number of elements sharing the absmax scale of a quantized activation.
+constexpr int64_t kQuantBlockSize = 256;
+
+// Dtype of the activations in a row of quantized segments.
+enum ActivationType : int64_t {
+  ACTIVATION_FLOAT = 0,
+  ACTIVATION_HALF = 1,
+  ACTIVATION_BFLOAT16 = 2,
+};
+
+// Copy every (src, dst, bytes) row of the CPU int64 tensor 'segments'.
+void checkpoint_copy_segments_cuda(torch::Tensor segments, int64_t max_bytes,
+                                   torch::Device device);
+
+// Quantize every (activations, codes, scales, numel, dtype) row of
+// 'segments' to 'bits' bit codes with one scale per kQuantBlockSize elements.
+void checkpoint_quantize_segments_cuda(torch::Tensor segments,
+                                       int64_t max_numel, int bits,
+                                       torch::Device device);
+
+// Restore every (codes, activations, scales, numel, dtype) row of 'segments'.
+void checkpoint_dequantize_segments_cuda(torch::Tensor segments,
+                                         int64_t max_numel, int bits,
+                                         torch::Device device);
@@ -0,0 +1,43 @@
+/*
+Copyright 2021 TUNiB Inc.
+*/
+#pragma once
+
+#include <ATen/ATen.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+// Runtime switches of the telemetry of the ops, both are off by default.
+// Calls are counted whenever one of them is on.
+void op_telemetry_set_enabled(bool nvtx, bool timing);
+
+// Calls and CUDA event timings of every (op, n1, n2, dtype), once the
+// pending events have completed. Beyond 1024 labels the other shapes of an op
+// are counted under "op(other shapes)".
+std::map<std::string, std::map<std::string, double>> op_telemetry_stats();
+
+void op_telemetry_reset();
+
+struct OpTiming;
+
+// Annotates the launches of an op while it is in scope, with an NVTX range
+// carrying the op name and shape, and with a pair of CUDA events on the
+// current stream. It does nothing when the telemetry is off.
+class OpTelemetryScope {
+public:
+  OpTelemetryScope(const char *name, at::ScalarType dtype, int64_t n1,
+                   int64_t n2);
+  ~OpTelemetryScope();
+
+  OpTelemetryScope(const OpTelemetryScope &) = delete;
+  OpTelemetryScope &operator=(const OpTelemetryScope &) = delete;
+
+private:
+  bool nvtx_ = false;
+  std::unique_ptr<OpTiming> timing_;
+};
+
+#define OP_TELEMETRY_SCOPE(NAME, DTYPE, N1, N2)                                \
+  OpTelemetryScope op_telemetry_scope(NAME, DTYPE, N1, N2)
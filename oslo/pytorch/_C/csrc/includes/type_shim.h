@@ -109,6 +109,32 @@
     AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'");            \
   }
 
+#define DISPATCH_DOUBLE_FLOAT_HALF_AND_BFLOAT(TYPE, LEVEL, NAME, ...)          \
+  switch (TYPE) {                                                              \
+  case at::ScalarType::Double: {                                               \
+    using scalar_t_##LEVEL = double;                                           \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }                                                                            \
+  case at::ScalarType::Float: {                                                \
+    using scalar_t_##LEVEL = float;                                            \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }                                                                            \
+  case at::ScalarType::Half: {                                                 \
+    using scalar_t_##LEVEL = at::Half;                                         \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }                                                                            \
+  case at::ScalarType::BFloat16: {                                             \
+    using scalar_t_##LEVEL = at::BFloat16;                                     \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }                                                                            \
+  default:                                                                     \
+    AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'");            \
+  }
+
 #define DISPATCH_HALF_AND_BFLOAT(TYPE, NAME, ...)                              \
   switch (TYPE) {                                                              \
   case at::ScalarType::Half: {                                                 \
@@ -236,6 +262,42 @@
     AT_ERROR(#NAME, " not implemented for '", toString(TYPEIN), "'");          \
   }
 
+// FP8 storage types are only available from PyTorch 2.1, the binder defines
+// OSLO_ENABLE_FLOAT8 when the installed version provides them.
+#ifdef OSLO_ENABLE_FLOAT8
+#define DISPATCH_FLOAT8_OUT_CASES(...)                                         \
+  case at::ScalarType::Float8_e4m3fn: {                                        \
+    using scalar_t_quant = at::Float8_e4m3fn;                                  \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }                                                                            \
+  case at::ScalarType::Float8_e5m2: {                                          \
+    using scalar_t_quant = at::Float8_e5m2;                                    \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }
+#else
+#define DISPATCH_FLOAT8_OUT_CASES(...)
+#endif
+
+#define DISPATCH_INT8_AND_FLOAT8_OUT_TYPES(TYPEOUT, NAME, ...)                 \
+  switch (TYPEOUT) {                                                           \
+  case at::ScalarType::Char: {                                                 \
+    using scalar_t_quant = int8_t;                                             \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }                                                                            \
+    DISPATCH_FLOAT8_OUT_CASES(__VA_ARGS__)                                     \
+  default:                                                                     \
+    AT_ERROR(#NAME, " not implemented for '", toString(TYPEOUT), "'");         \
+  }
+
+#define DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_QUANT_TYPES(TYPEIN, TYPEOUT,      \
+                                                         TYPEQUANT, NAME, ...) \
+  DISPATCH_FLOAT_HALF_AND_BFLOAT_INOUT_TYPES(                                  \
+      TYPEIN, TYPEOUT, NAME,                                                   \
+      DISPATCH_INT8_AND_FLOAT8_OUT_TYPES(TYPEQUANT, NAME, __VA_ARGS__))
+
 template <typename T>
 __device__ __forceinline__ T reduce_block_into_lanes(
     T *x, T val, int lanes = 1,
@@ -42,10 +42,13 @@ SUPPORTED_FEATURES = {
         "partitioned_checkpointing": _type(bool),
         "contiguous_checkpointing": _type(bool),
         "cpu_checkpointing": _type(bool),
+        "native_checkpointing": _type(bool),
+        "compression_tolerance": _type((float, list)),
     },
     "kernel_fusion": {
         "enable": _type(bool),
         "memory_efficient_fusion": _type(bool),
+        "async_compile": _type(bool),
         "custom_cuda_kernels": _type(list),
     },
 }
@@ -46,6 +46,8 @@ def initialize_activation_checkpointing(model, config, **kwargs):
                 contiguous_checkpointing=ac_config.get(
                     "contiguous_checkpointing", False
                 ),
+                native_checkpointing=ac_config.get("native_checkpointing", True),
+                compression_tolerance=ac_config.get("compression_tolerance", None),
             )
 
             module = importlib.import_module(model.__module__)
@@ -16,6 +16,8 @@ class ActivationCheckpointingEngine(object):
         partitioned_checkpointing,
         cpu_checkpointing,
         contiguous_checkpointing,
+        native_checkpointing=True,
+        compression_tolerance=None,
         mpu=None,
     ):
         rng_tracker = CudaRNGStatesTracker(mpu=mpu)
@@ -25,6 +27,8 @@ class ActivationCheckpointingEngine(object):
             partitioned_checkpointing=partitioned_checkpointing,
             contiguous_checkpointing=contiguous_checkpointing,
             cpu_checkpointing=cpu_checkpointing,
+            native_checkpointing=native_checkpointing,
+            compression_tolerance=compression_tolerance,
         )
         self.options = {
             "rng_tracker": rng_tracker,
@@ -25,17 +25,23 @@ class CheckpointFunction(torch.autograd.Function):
         ctx.run_function = run_function
 
         # 2. partitioning or moving to cpu if user want.
-        if ctx.partitioner.partitioned_checkpointing:
-            inputs = ctx.partitioner.make_partitioned_activations(args)
-        elif ctx.partitioner.cpu_checkpointing:
-            inputs = copy_to_device(
-                args,
-                torch.device("cpu"),
-                partial(
-                    is_activation_to_checkpoint,
-                    world_size=ctx.partitioner.mp_size,
-                ),
-            )
+        ctx.packed = None
+        layer_index = ctx.partitioner.next_layer_index()
+        if ctx.partitioner.native is not None:
+            ctx.packed = ctx.partitioner.pack_activations(args, layer_index)
+
+        if ctx.packed is None:
+            if ctx.partitioner.partitioned_checkpointing:
+                inputs = ctx.partitioner.make_partitioned_activations(args)
+            elif ctx.partitioner.cpu_checkpointing:
+                inputs = copy_to_device(
+                    args,
+                    torch.device("cpu"),
+                    partial(
+                        is_activation_to_checkpoint,
+                        world_size=ctx.partitioner.mp_size,
+                    ),
+                )
 
         inputs_cuda = copy_to_device(
             args,
@@ -57,7 +63,10 @@ class CheckpointFunction(torch.autograd.Function):
         del inputs_cuda
 
         # 5. save inputs of partition_checkpoint or cpu_checkpoint for backward stage.
-        if ctx.partitioner.partitioned_checkpointing:
+        if ctx.packed is not None:
+            ctx.partitioner.release_activations(args, ctx.packed)
+            save_args_for_backward(*args)
+        elif ctx.partitioner.partitioned_checkpointing:
             new_args = ctx.partitioner.get_partitioned_activations_for_backward(
                 args, inputs
             )
@@ -93,6 +102,7 @@ class CheckpointFunction(torch.autograd.Function):
     @staticmethod
     def backward(ctx, *grads):
         # 1. frees up all the pointers if user want contiguous checkpointing.
+        ctx.partitioner.layer_index = 0
         if ctx.partitioner.contiguous_checkpointing:
             ctx.partitioner.contiguous_data_buffers = []
             ctx.partitioner.contiguous_size_buffers = []
@@ -106,7 +116,12 @@ class CheckpointFunction(torch.autograd.Function):
             )
 
         # 2. gathering or moving to gpu if user want and detach all the tensors.
-        if ctx.partitioner.partitioned_checkpointing:
+        if ctx.packed is not None:
+            inputs = ctx.partitioner.unpack_activations(
+                ctx._saved_tensors, ctx.packed
+            )
+            detached_inputs = detach(inputs)
+        elif ctx.partitioner.partitioned_checkpointing:
             inputs = ctx.partitioner.gather_partitioned_activations(
                 ctx._saved_tensors,
                 device=torch.cuda.current_device()
@@ -175,6 +190,7 @@ class CheckpointFunction(torch.autograd.Function):
         ctx._saved_tensors = None
         ctx.non_tensor_args = None
         ctx.tensor_flags = None
+        ctx.packed = None
 
         # 11. return gradients
         ret_list = [None, None, None]
@@ -1,4 +1,6 @@
 import mmap
+import weakref
+from logging import getLogger
 
 import torch
 import torch.distributed as dist
@@ -7,6 +9,36 @@ from oslo.pytorch.activation_checkpointing.utils.utils import (
     is_activation_to_checkpoint,
 )
 
+logger = getLogger(__name__)
+
+_all_gather_into_tensor = getattr(
+    dist, "all_gather_into_tensor", getattr(dist, "_all_gather_base", None)
+)
+
+# Worst relative error of the codes of every quantization width, half a level
+# of the blockwise absmax scale.
+QUANTIZATION_ERRORS = {4: 1 / 14, 8: 1 / 254}
+QUANTIZABLE_DTYPES = (torch.float32, torch.float16, torch.bfloat16)
+
+
+class PackedActivations(object):
+    """
+    Checkpointed activations of a layer packed into a single flat buffer, with
+    the positions, sizes and dtypes needed to restore them.
+    """
+
+    def __init__(self, indices, sizes, dtypes, device, buffer, bits=0):
+        self.indices = indices
+        self.sizes = sizes
+        self.dtypes = dtypes
+        self.device = device
+        self.buffer = buffer
+        # width of the quantized codes, 0 when stored as is
+        self.bits = bits
+        # device copy of an offloaded buffer and the event of its copy
+        self.prefetched = None
+        self.prefetch_event = None
+
 
 class CheckpointPartitioner(object):
     def __init__(
@@ -16,6 +48,8 @@ class CheckpointPartitioner(object):
         cpu_checkpointing,
         partitioned_checkpointing,
         contiguous_checkpointing,
+        native_checkpointing=True,
+        compression_tolerance=None,
     ):
         self.mp_size = mpu.get_tensor_parallel_world_size() if mpu is not None else 1
         self.mp_rank = mpu.get_tensor_parallel_rank() if mpu is not None else 0
@@ -31,6 +65,33 @@ class CheckpointPartitioner(object):
         self.data_offsets = []
         self.size_offsets = []
 
+        self.native = None
+        if native_checkpointing and (partitioned_checkpointing or cpu_checkpointing):
+            try:
+                from oslo.pytorch._C import CheckpointBinder
+
+                self.native = CheckpointBinder().bind()
+            except Exception as e:
+                logger.warning(
+                    f"Unable to use the native checkpoint kernels, "
+                    f"falling back to the python implementation: {e}"
+                )
+
+        # relative error allowed for the activations of every layer, a single
+        # value for all of them or None to store them losslessly
+        self.compression_tolerance = compression_tolerance
+        self.layer_index = 0
+        if compression_tolerance is not None and self.native is None:
+            logger.warning(
+                "``compression_tolerance`` needs the native checkpoint kernels, "
+                "activations are stored losslessly."
+            )
+
+        # side stream of the pinned memory copies and the offloaded buffers
+        # that are still waiting for their backward, most recent last.
+        self.offload_stream = None
+        self.offloaded_activations = []
+
     def get_partition_start(self, item):
         size = item.numel()
         partition_size = size / self.mp_size
@@ -181,6 +242,173 @@ class CheckpointPartitioner(object):
 
         return tuple(inputs)
 
+    def compression_bits(self, layer_index, dtypes):
+        """
+        Returns the fewest bits whose quantization error is within the
+        tolerance of the layer, or 0 to store its activations losslessly.
+        """
+        tolerance = self.compression_tolerance
+        if isinstance(tolerance, (list, tuple)):
+            tolerance = tolerance[layer_index] if layer_index < len(tolerance) else None
+        if tolerance is None or not all(d in QUANTIZABLE_DTYPES for d in dtypes):
+            return 0
+
+        for bits in sorted(QUANTIZATION_ERRORS):
+            if QUANTIZATION_ERRORS[bits] <= tolerance:
+                return bits
+        return 0
+
+    def next_layer_index(self):
+        """
+        Returns the layer of the next checkpoint call. Every call counts, the
+        ones whose activations are not packed as well.
+        """
+        layer_index = self.layer_index % self.num_layers
+        self.layer_index += 1
+        return layer_index
+
+    def pack_activations(self, args, layer_index):
+        """
+        Packs the partitions of every activation to checkpoint in ``args`` into
+        one flat buffer with a single kernel, quantized within the compression
+        tolerance of the layer ``layer_index`` and offloaded to pinned memory
+        with cpu checkpointing. Returns None when the native kernels do not
+        apply.
+        """
+        tensors = [arg for arg in args if torch.is_tensor(arg)]
+        indices = [
+            i
+            for i, item in enumerate(tensors)
+            if is_activation_to_checkpoint(item, self.mp_size)
+        ]
+        if len(indices) == 0 or not all(tensors[i].is_cuda for i in indices):
+            return None
+
+        if self.partitioned_checkpointing:
+            world_size, rank = self.mp_size, self.mp_rank
+        else:
+            world_size, rank = 1, 0
+
+        activations = [tensors[i].detach() for i in indices]
+        dtypes = [item.dtype for item in activations]
+        bits = self.compression_bits(layer_index, dtypes)
+
+        if bits > 0:
+            buffer = self.native.partition_pack_quantized_forward(
+                activations, world_size, rank, bits
+            )
+        else:
+            buffer = self.native.partition_pack_forward(activations, world_size, rank)
+
+        packed = PackedActivations(
+            indices=indices,
+            sizes=[item.size() for item in activations],
+            dtypes=dtypes,
+            device=activations[0].device,
+            buffer=buffer,
+            bits=bits,
+        )
+        if self.cpu_checkpointing:
+            self.offload(packed)
+        return packed
+
+    def release_activations(self, args, packed):
+        """
+        Frees the full size activations of ``args`` once the forward is done,
+        they are restored from ``packed`` in backward.
+        """
+        tensors = [arg for arg in args if torch.is_tensor(arg)]
+        for i, dtype in zip(packed.indices, packed.dtypes):
+            tensors[i].data = torch.empty(0, dtype=dtype, device=packed.device)
+
+    def unpack_activations(self, tensors, packed):
+        """
+        Restores the activations of ``tensors`` released by
+        ``release_activations``, gathering the partitions of every rank with a
+        single collective.
+        """
+        buffer = packed.buffer
+        if self.cpu_checkpointing:
+            self.prefetch(packed)
+            torch.cuda.current_stream().wait_event(packed.prefetch_event)
+            buffer = packed.prefetched
+            self.offloaded_activations = [
+                ref
+                for ref in self.offloaded_activations
+                if ref() is not None and ref() is not packed
+            ]
+            # overlap the copy of the next layer with this one's backward
+            if len(self.offloaded_activations) > 0:
+                self.prefetch(self.offloaded_activations[-1]())
+
+        world_size = self.mp_size if self.partitioned_checkpointing else 1
+        if world_size > 1 and self.mp_group is not None:
+            gathered = torch.empty(
+                [world_size * buffer.numel()],
+                dtype=buffer.dtype,
+                device=buffer.device,
+            )
+            _all_gather_into_tensor(gathered, buffer, group=self.mp_group)
+        else:
+            gathered = buffer
+
+        outputs = [
+            torch.empty(size, dtype=dtype, device=packed.device)
+            for size, dtype in zip(packed.sizes, packed.dtypes)
+        ]
+        if packed.bits > 0:
+            self.native.gather_unpack_quantized_forward(
+                gathered, outputs, world_size, packed.bits
+            )
+        else:
+            self.native.gather_unpack_forward(gathered, outputs, world_size)
+
+        for i, output in zip(packed.indices, outputs):
+            tensors[i].data = output
+        return tuple(tensors)
+
+    def get_offload_stream(self):
+        if self.offload_stream is None:
+            self.offload_stream = torch.cuda.Stream()
+        return self.offload_stream
+
+    def offload(self, packed):
+        # the side stream runs the copy once the packing kernel is done, while
+        # the forward goes on
+        stream = self.get_offload_stream()
+        buffer = packed.buffer
+        host_buffer = torch.empty(buffer.size(), dtype=buffer.dtype, pin_memory=True)
+        stream.wait_stream(torch.cuda.current_stream())
+        with torch.cuda.stream(stream):
+            host_buffer.copy_(buffer, non_blocking=True)
+        buffer.record_stream(stream)
+        packed.buffer = host_buffer
+
+        self.offloaded_activations = [
+            ref for ref in self.offloaded_activations if ref() is not None
+        ]
+        self.offloaded_activations.append(weakref.ref(packed))
+
+    def prefetch(self, packed):
+        """
+        Copies an offloaded buffer back to the device on the side stream, the
+        current stream waits for ``packed.prefetch_event`` before using it.
+        """
+        if packed.prefetched is None:
+            stream = self.get_offload_stream()
+            buffer = torch.empty(
+                packed.buffer.size(),
+                dtype=packed.buffer.dtype,
+                device=packed.device,
+            )
+            stream.wait_stream(torch.cuda.current_stream())
+            with torch.cuda.stream(stream):
+                buffer.copy_(packed.buffer, non_blocking=True)
+            buffer.record_stream(stream)
+            packed.prefetched = buffer
+            packed.prefetch_event = torch.cuda.Event()
+            packed.prefetch_event.record(stream)
+
     @staticmethod
     def merge_tensors(tensor_objects, non_tensor_objects, tensor_flags):
         tensor_idx = 0
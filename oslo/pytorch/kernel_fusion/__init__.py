@@ -22,6 +22,7 @@ def initialize_kernel_fusion(model, config, **kwargs):
                 model = model.cuda()
 
             memory_efficient_fusion = kf_config.get("memory_efficient_fusion", False)
+            async_compile = kf_config.get("async_compile", False)
             custom_cuda_kernels = kf_config.get("custom_cuda_kernels", None)
 
             if memory_efficient_fusion is True:
@@ -49,6 +50,7 @@ def initialize_kernel_fusion(model, config, **kwargs):
                 model=model,
                 memory_efficient_fusion=memory_efficient_fusion,
                 custom_cuda_kernels=custom_cuda_kernels,
+                async_compile=async_compile,
             )
             model = engine.fuse()
 
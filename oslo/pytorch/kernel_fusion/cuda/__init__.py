@@ -1,6 +1,13 @@
+import os
+
 from oslo.pytorch._C import CUDABinder
 
 CUDA = None
 
 if CUDA is None:
     CUDA = CUDABinder().bind()
+    # e.g. OSLO_OP_TELEMETRY=nvtx,timing annotates and times the ops from the
+    # start, see oslo.pytorch.kernel_fusion.cuda.telemetry
+    _telemetry = os.environ.get("OSLO_OP_TELEMETRY", "").lower().split(",")
+    if "nvtx" in _telemetry or "timing" in _telemetry:
+        CUDA.set_op_telemetry(nvtx="nvtx" in _telemetry, timing="timing" in _telemetry)
@@ -0,0 +1,172 @@
+from typing import Callable, Dict, Sequence
+
+import torch
+import torch.utils._pytree as pytree
+
+from oslo.pytorch.kernel_fusion.cuda import CUDA
+
+
+def bucket_size(size, multiple=0):
+    """Rounds ``size`` up to a multiple of ``multiple``, or a power of two."""
+    if multiple > 0:
+        return (size + multiple - 1) // multiple * multiple
+    return 1 << max(size - 1, 0).bit_length()
+
+
+class CUDAGraphRunner(object):
+    """
+    Captures ``fn`` into a CUDA graph once per shape bucket and replays it on
+    the next calls of the bucket, so that the small kernels of e.g. a decoding
+    step are not bounded by their launch overhead.
+
+    The tensors of the args are copied into the static inputs of the graph and
+    views of its static outputs are returned, they are overwritten by the next
+    replay of the bucket. ``fn`` must not synchronize with the host. Int and
+    float args, e.g. the step of a decoding loop, are passed to ``fn`` as 0-dim
+    tensors on the device, so that they are not baked into the graph. The other
+    args are part of the bucket since they are.
+
+    Args:
+        fn (Callable): function of tensors, or of pytrees of tensors
+        bucket_dims (Dict[int, Sequence[int]]): dims of every flattened tensor
+            arg that are rounded up to a bucket. The args are copied into the
+            leading slice of zero padded static inputs, so ``fn`` must ignore
+            the padding, e.g. through an attention mask.
+        bucket_output_dims (Dict[int, Sequence]): dims of every flattened output
+            sliced back to the size of a padded arg dim, either ``dim`` for the
+            same dim of the first tensor arg or ``(dim, arg, arg_dim)``.
+            Default: the bucketed dims of the first tensor arg for every output.
+        bucket_multiple (int): buckets are multiples of it, or powers of two
+            when it is 0
+        warmup_steps (int): eager calls on a side stream before a capture,
+            which allocate the workspaces of the ops
+    """
+
+    def __init__(
+        self,
+        fn: Callable,
+        bucket_dims: Dict[int, Sequence[int]] = None,
+        bucket_output_dims: Dict[int, Sequence] = None,
+        bucket_multiple: int = 0,
+        warmup_steps: int = 2,
+    ):
+        self.fn = fn
+        self.bucket_dims = bucket_dims if bucket_dims is not None else {}
+        self.bucket_output_dims = bucket_output_dims
+        self.bucket_multiple = bucket_multiple
+        self.warmup_steps = warmup_steps
+        self.graphs = {}
+        # the graphs of the runner are never replayed concurrently, so they
+        # share one memory pool
+        self.pool = None
+
+    @staticmethod
+    def is_scalar(arg):
+        return isinstance(arg, (int, float)) and not isinstance(arg, bool)
+
+    def key(self, flat_args, spec):
+        key = [str(spec)]
+        tensor_idx = 0
+        for arg in flat_args:
+            if self.is_scalar(arg):
+                key.append(type(arg))
+                continue
+            if not torch.is_tensor(arg):
+                key.append(arg)
+                continue
+            shape = list(arg.shape)
+            for dim in self.bucket_dims.get(tensor_idx, ()):
+                shape[dim] = bucket_size(shape[dim], self.bucket_multiple)
+            key.append((tuple(shape), arg.dtype, arg.device))
+            tensor_idx += 1
+        return tuple(key)
+
+    @classmethod
+    def copy_inputs(cls, static_args, flat_args):
+        for static_arg, arg in zip(static_args, flat_args):
+            if cls.is_scalar(arg):
+                static_arg.fill_(arg)
+                continue
+            if not torch.is_tensor(arg):
+                continue
+            if static_arg.shape == arg.shape:
+                static_arg.copy_(arg)
+            else:
+                static_arg.zero_()
+                static_arg[tuple(slice(0, size) for size in arg.shape)].copy_(arg)
+
+    def capture(self, key, flat_args, spec):
+        device = next(
+            (arg.device for arg in flat_args if torch.is_tensor(arg)),
+            torch.device("cuda", torch.cuda.current_device()),
+        )
+        static_args = []
+        for arg, item in zip(flat_args, key[1:]):
+            if torch.is_tensor(arg):
+                arg = torch.zeros(item[0], dtype=item[1], device=item[2])
+            elif self.is_scalar(arg):
+                arg = torch.tensor(arg, device=device)
+            static_args.append(arg)
+        self.copy_inputs(static_args, flat_args)
+
+        def run():
+            args, kwargs = pytree.tree_unflatten(static_args, spec)
+            return self.fn(*args, **kwargs)
+
+        stream = torch.cuda.Stream()
+        stream.wait_stream(torch.cuda.current_stream())
+        with torch.cuda.stream(stream):
+            for _ in range(self.warmup_steps):
+                run()
+        torch.cuda.current_stream().wait_stream(stream)
+
+        # the workspaces of the ops can not be allocated while capturing
+        CUDA.prepare_cuda_graph_capture()
+        graph = torch.cuda.CUDAGraph()
+        with torch.cuda.graph(graph, pool=self.pool):
+            outputs = run()
+        if self.pool is None:
+            self.pool = graph.pool()
+
+        self.graphs[key] = (graph, static_args, outputs)
+
+    def __call__(self, *args, **kwargs):
+        flat_args, spec = pytree.tree_flatten((args, kwargs))
+        key = self.key(flat_args, spec)
+        if key not in self.graphs:
+            self.capture(key, flat_args, spec)
+
+        graph, static_args, outputs = self.graphs[key]
+        self.copy_inputs(static_args, flat_args)
+        graph.replay()
+        return self.unpad_outputs(outputs, flat_args)
+
+    def output_dims(self, idx):
+        if self.bucket_output_dims is None:
+            return self.bucket_dims.get(0, ())
+        return self.bucket_output_dims.get(idx, ())
+
+    def unpad_outputs(self, outputs, flat_args):
+        """Slices the static outputs back to the sizes of the padded args."""
+        if len(self.bucket_dims) == 0:
+            return outputs
+        tensor_args = [arg for arg in flat_args if torch.is_tensor(arg)]
+        flat_outs, out_spec = pytree.tree_flatten(outputs)
+        for idx, out in enumerate(flat_outs):
+            if not torch.is_tensor(out):
+                continue
+            for item in self.output_dims(idx):
+                dim, arg, arg_dim = (item, 0, item) if isinstance(item, int) else item
+                # only the dims the bucket actually padded are sliced
+                if arg_dim not in self.bucket_dims.get(arg, ()):
+                    continue
+                size = tensor_args[arg].size(arg_dim)
+                if dim < out.dim() and out.size(dim) > size:
+                    out = out.narrow(dim, 0, size)
+            flat_outs[idx] = out
+        return pytree.tree_unflatten(flat_outs, out_spec)
+
+    def reset(self):
+        """Releases every captured graph."""
+        self.graphs.clear()
+        self.pool = None
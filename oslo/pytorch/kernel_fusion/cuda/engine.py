@@ -1,14 +1,24 @@
+import types
+
+import torch
+
+from oslo.pytorch.kernel_fusion.cuda.fused_logits_processing import (
+    get_fused_logits_processor,
+)
 from oslo.pytorch.kernel_fusion.cuda.fused_ngram_blocking import (
     get_ngram_logit_processor,
 )
 from oslo.pytorch.kernel_fusion.cuda.fused_normalization import FusedRMSNorm
+from oslo.pytorch.kernel_fusion.cuda.fused_softmax import FusedScaleMaskSoftmax
 
 
 class CustomCUDAKernelEngine(object):
     def supported_kernels(self):
         return {
+            "FusedLogitsProcessor": self.fused_logits_processor,
             "FusedNoRepeatNGram": self.fused_no_repeat_ngram_logits_processor,
             "FusedRMSNorm": self.fused_rms_norm,
+            "FusedScaleMaskSoftmax": self.fused_scale_mask_softmax,
         }
 
     def __init__(self, model, kernels):
@@ -32,18 +42,84 @@ class CustomCUDAKernelEngine(object):
         from transformers import generation_utils
 
         orig_generate_fn = model._partition
+        orig_reorder_cache_fn = model._reorder_cache
 
         def generate(*args, **kwargs):
             num_beams = kwargs.get("num_beams", 1)
+            num_beam_groups = kwargs.get("num_beam_groups") or 1
             input_ids = kwargs.get("input_ids") if "input_ids" in kwargs else args[0]
 
             generation_utils.NoRepeatNGramLogitsProcessor = get_ngram_logit_processor(
-                num_beams=num_beams, batch_size=input_ids.size(0)
+                num_beams=num_beams,
+                batch_size=input_ids.size(0),
+                num_beam_groups=num_beam_groups,
             )
 
             return orig_generate_fn(*args, **kwargs)
 
+        def reorder_cache(past, beam_idx):
+            # keep the ngram indices in sync with the reselected beams
+            processor = generation_utils.NoRepeatNGramLogitsProcessor
+            if hasattr(processor, "reorder"):
+                processor.reorder(beam_idx)
+
+            return orig_reorder_cache_fn(past, beam_idx)
+
         model._partition = generate
+        model._reorder_cache = reorder_cache
+
+    @staticmethod
+    def fused_logits_processor(model):
+        from transformers import LogitsProcessorList
+        from transformers import generation_logits_process as processors
+
+        FusedLogitsProcessor = get_fused_logits_processor()
+        orig_logits_processor_fn = model._get_logits_processor
+        orig_logits_warper_fn = model._get_logits_warper
+
+        def fuse(processor_list):
+            # processors fused into one launch, and the arguments they take
+            fused, positions = {}, []
+            for i, processor in enumerate(processor_list):
+                if type(processor) is processors.RepetitionPenaltyLogitsProcessor:
+                    fused["repetition_penalty"] = processor.penalty
+                elif type(processor) is processors.NoRepeatNGramLogitsProcessor:
+                    fused["no_repeat_ngram_size"] = processor.ngram_size
+                elif type(processor) is processors.MinLengthLogitsProcessor:
+                    fused["min_length"] = processor.min_length
+                    fused["eos_token_id"] = processor.eos_token_id
+                elif type(processor) is processors.TemperatureLogitsWarper:
+                    fused["temperature"] = processor.temperature
+                elif (
+                    type(processor) is processors.TopKLogitsWarper
+                    and processor.filter_value == -float("inf")
+                ):
+                    fused["top_k"] = processor.top_k
+                else:
+                    continue
+                positions.append(i)
+
+            if len(positions) == 0:
+                return processor_list
+            # in the order transformers builds the lists, the processors
+            # between the fused ones only mask scores, so moving the fused
+            # ones to the first of them does not change the result
+            fused_list = LogitsProcessorList()
+            for i, processor in enumerate(processor_list):
+                if i == positions[0]:
+                    fused_list.append(FusedLogitsProcessor(**fused))
+                elif i not in positions:
+                    fused_list.append(processor)
+            return fused_list
+
+        def get_logits_processor(*args, **kwargs):
+            return fuse(orig_logits_processor_fn(*args, **kwargs))
+
+        def get_logits_warper(*args, **kwargs):
+            return fuse(orig_logits_warper_fn(*args, **kwargs))
+
+        model._get_logits_processor = get_logits_processor
+        model._get_logits_warper = get_logits_warper
 
     @staticmethod
     def fused_rms_norm(model):
@@ -64,3 +140,51 @@ class CustomCUDAKernelEngine(object):
                 setattr(module, "normalized_shape", module.weight.size())
                 setattr(module, "eps", module.variance_epsilon)
                 module.__class__ = FusedRMSNorm
+
+    @staticmethod
+    def fused_scale_mask_softmax(model):
+        from transformers.models.gpt2.modeling_gpt2 import (
+            GPT2Attention,
+            GPT2PreTrainedModel,
+        )
+
+        if not isinstance(model, GPT2PreTrainedModel):
+            raise ValueError(
+                f"FusedScaleMaskSoftmax is available only for GPT2 based models. "
+                f"but your model is {model.__class__.__qualname__}."
+            )
+
+        for module in model.modules():
+            if isinstance(module, GPT2Attention):
+                setattr(
+                    module,
+                    "softmax",
+                    FusedScaleMaskSoftmax(causal=not module.is_cross_attention),
+                )
+                module._attn = types.MethodType(fused_gpt2_attn, module)
+
+
+def fused_gpt2_attn(self, query, key, value, attention_mask=None, head_mask=None):
+    """``GPT2Attention._attn`` with the scaling, the masks and the softmax fused."""
+    scale = 1.0
+    if self.scale_attn_weights:
+        scale /= float(value.size(-1)) ** 0.5
+    if getattr(self, "scale_attn_by_inverse_layer_idx", False):
+        scale /= float(self.layer_idx + 1)
+    self.softmax.scale = scale
+
+    mask = None
+    if attention_mask is not None:
+        # the additive mask of the padding is negative where it is masked
+        mask = attention_mask < 0
+
+    attn_weights = torch.matmul(query, key.transpose(-1, -2))
+    attn_weights = self.softmax(attn_weights, mask)
+    attn_weights = attn_weights.type(value.dtype)
+    attn_weights = self.attn_dropout(attn_weights)
+
+    if head_mask is not None:
+        attn_weights = attn_weights * head_mask
+
+    attn_output = torch.matmul(attn_weights, value)
+    return attn_output, attn_weights
@@ -0,0 +1,42 @@
+import torch
+
+from oslo.pytorch.kernel_fusion.cuda import CUDA
+
+
+class FusedBiasGeLUFunction(torch.autograd.Function):
+    """
+    Kernel fusion function: Bias + GeLU
+
+    The tanh approximation is used if ``approximate`` else the exact erf form.
+    With ``recompute`` the backward recomputes the derivative from the input
+    and the bias instead of saving it, which saves an activation sized buffer.
+    """
+
+    @staticmethod
+    def forward(ctx, input, bias, approximate, recompute):
+        ctx.approximate = approximate
+        ctx.has_bias = bias is not None
+        input_ = input.contiguous()
+        bias_ = bias.contiguous() if bias is not None else input_.new_empty(0)
+        output, derivative = CUDA.fused_bias_gelu_forward(
+            input_, bias_, approximate, not recompute
+        )
+        # the input is not read by the backward once the derivative is saved,
+        # the derivative stands in for it
+        ctx.save_for_backward(input_ if recompute else derivative, bias_, derivative)
+        return output
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        input_, bias_, derivative = ctx.saved_tensors
+        grad_input = CUDA.fused_bias_gelu_backward(
+            grad_output.contiguous(), input_, bias_, derivative, ctx.approximate
+        )
+        grad_bias = None
+        if ctx.has_bias:
+            grad_bias = grad_input.view(-1, grad_input.size(-1)).sum(0)
+        return grad_input, grad_bias, None, None
+
+
+def fused_bias_gelu(input, bias=None, approximate=True, recompute=True):
+    return FusedBiasGeLUFunction.apply(input, bias, approximate, recompute)
@@ -0,0 +1,115 @@
+import math
+
+import torch
+import torch.distributed as dist
+
+from oslo.pytorch.kernel_fusion.cuda import CUDA
+
+
+class VocabParallelCrossEntropyFunction(torch.autograd.Function):
+    """
+    Kernel fusion function: Softmax + Cross Entropy over vocabulary parallel logits
+
+    Every rank of the tensor parallel group holds the logits of a shard of the
+    vocabulary. Only the max, the sum of exponentials and the target logit of
+    every token are all-reduced, the logits are never gathered. With
+    ``inplace_backward`` the gradient is written into the logits, which then
+    must not be used after the backward.
+    """
+
+    @staticmethod
+    def forward(ctx, logits, targets, vocab_start, ignore_index, group, inplace):
+        logits_ = logits.contiguous().view(-1, logits.size(-1))
+        targets_ = targets.contiguous().view(-1)
+        stats = CUDA.vocab_parallel_cross_entropy_forward(
+            logits_, targets_, vocab_start
+        )
+        local_max, local_sum, target_logit = stats.unbind(dim=1)
+
+        global_max = local_max.contiguous()
+        if group is not None:
+            dist.all_reduce(global_max, op=dist.ReduceOp.MAX, group=group)
+
+        # rescale the local sums to the global max before adding them up
+        sums = torch.stack(
+            [local_sum * torch.exp(local_max - global_max), target_logit], dim=1
+        )
+        if group is not None:
+            dist.all_reduce(sums, group=group)
+        global_sum, target_logit = sums.unbind(dim=1)
+
+        loss = torch.log(global_sum) + global_max - target_logit
+        loss = loss.masked_fill(targets_ == ignore_index, 0.0)
+
+        ctx.vocab_start = vocab_start
+        ctx.ignore_index = ignore_index
+        ctx.inplace = inplace
+        ctx.shape = logits.shape
+        ctx.save_for_backward(logits_, global_max, global_sum.contiguous(), targets_)
+        return loss.view(targets.shape)
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        logits_, global_max, global_sum, targets_ = ctx.saved_tensors
+        grad_input = CUDA.vocab_parallel_cross_entropy_backward(
+            grad_output.float().contiguous().view(-1),
+            logits_,
+            global_max,
+            global_sum,
+            targets_,
+            ctx.vocab_start,
+            ctx.ignore_index,
+            ctx.inplace,
+        )
+        return grad_input.view(ctx.shape), None, None, None, None, None
+
+
+def vocab_parallel_cross_entropy(
+    logits,
+    targets,
+    mpu=None,
+    vocab_size=None,
+    ignore_index=-100,
+    reduction="mean",
+    inplace_backward=True,
+):
+    """
+    Cross entropy of the logits of a vocabulary shard, as split by
+    ``torch.chunk`` over the tensor parallel group of ``mpu``.
+
+    Args:
+        logits (Tensor): [..., vocab_size / tp_world_size] logits of the shard
+        targets (Tensor): [...] target tokens in the whole vocabulary
+        mpu (MPU): model parallel unit, the logits are not sharded if None
+        vocab_size (int): size of the whole vocabulary, needed when it is not
+            divisible by the tensor parallel world size
+        ignore_index (int): target whose loss and gradient are 0
+        reduction (str): 'none', 'mean' over the targets not ignored or 'sum'
+        inplace_backward (bool): write the gradient into the logits
+
+    Returns:
+        Tensor: loss
+    """
+    group, vocab_start = None, 0
+    if mpu is not None and mpu.get_tensor_parallel_world_size() > 1:
+        world_size = mpu.get_tensor_parallel_world_size()
+        shard_size = logits.size(-1)
+        if vocab_size is not None:
+            shard_size = math.ceil(vocab_size / world_size)
+        group = mpu.get_tensor_parallel_group()
+        vocab_start = mpu.get_tensor_parallel_rank() * shard_size
+
+    loss = VocabParallelCrossEntropyFunction.apply(
+        logits, targets, vocab_start, ignore_index, group, inplace_backward
+    )
+
+    if reduction == "none":
+        return loss
+    if reduction == "sum":
+        return loss.sum()
+    if reduction == "mean":
+        return loss.sum() / (targets != ignore_index).sum().clamp(min=1)
+    raise ValueError(
+        f"Unknown reduction - {reduction}. "
+        f"Currently we support ['none', 'mean', 'sum']."
+    )
@@ -0,0 +1,156 @@
+import torch
+
+from oslo.pytorch.kernel_fusion.cuda import CUDA
+
+
+class FusedLogitsProcessFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx,
+        tokens,
+        scores,
+        step,
+        no_repeat_ngram_size,
+        repetition_penalty,
+        presence_penalty,
+        temperature,
+        top_k,
+        min_length,
+        eos_token_id,
+    ):
+        return CUDA.logits_process_forward(
+            tokens,
+            scores,
+            step,
+            no_repeat_ngram_size,
+            repetition_penalty,
+            presence_penalty,
+            temperature,
+            top_k,
+            min_length,
+            eos_token_id,
+        )
+
+    def backward(*args):
+        raise NotImplementedError
+
+
+def get_fused_logits_processor():
+    from transformers import LogitsProcessor
+    from transformers.generation_logits_process import (
+        _calc_banned_ngram_tokens,
+    )
+
+    class FusedLogitsProcessor(LogitsProcessor):
+        """
+        Repetition and presence penalty, ngram blocking, min length,
+        temperature and top-k applied in a single kernel over every row of
+        scores. Each processor is disabled by its default value.
+
+        Args:
+            no_repeat_ngram_size (int): size of the ngrams to block
+            repetition_penalty (float): penalty of previously generated tokens
+            presence_penalty (float): value subtracted from previously
+                generated tokens
+            temperature (float): temperature of the distribution
+            top_k (int): number of highest scores to keep
+            min_length (int): minimum length before eos can be generated
+            eos_token_id (int): id of the eos token
+        """
+
+        def __init__(
+            self,
+            no_repeat_ngram_size: int = 0,
+            repetition_penalty: float = 1.0,
+            presence_penalty: float = 0.0,
+            temperature: float = 1.0,
+            top_k: int = 0,
+            min_length: int = 0,
+            eos_token_id: int = None,
+        ):
+            if not isinstance(no_repeat_ngram_size, int) or no_repeat_ngram_size < 0:
+                raise ValueError(
+                    f"`no_repeat_ngram_size` has to be a non-negative integer, "
+                    f"but is {no_repeat_ngram_size}"
+                )
+            if repetition_penalty <= 0:
+                raise ValueError(
+                    f"`repetition_penalty` has to be a strictly positive float, "
+                    f"but is {repetition_penalty}"
+                )
+            if temperature <= 0:
+                raise ValueError(
+                    f"`temperature` has to be a strictly positive float, "
+                    f"but is {temperature}"
+                )
+            if not isinstance(top_k, int) or top_k < 0:
+                raise ValueError(
+                    f"`top_k` has to be a non-negative integer, but is {top_k}"
+                )
+
+            self.no_repeat_ngram_size = no_repeat_ngram_size
+            self.repetition_penalty = float(repetition_penalty)
+            self.presence_penalty = float(presence_penalty)
+            self.temperature = float(temperature)
+            self.top_k = top_k
+            self.min_length = min_length
+            self.eos_token_id = -1 if eos_token_id is None else eos_token_id
+
+        def __call__(
+            self,
+            input_ids: torch.LongTensor,
+            scores: torch.FloatTensor,
+        ) -> torch.FloatTensor:
+            cur_len = input_ids.shape[-1]
+
+            if input_ids.is_cuda and scores.is_cuda:
+                return FusedLogitsProcessFunction.apply(
+                    input_ids.contiguous(),
+                    scores.contiguous(),
+                    cur_len - 1,
+                    self.no_repeat_ngram_size,
+                    self.repetition_penalty,
+                    self.presence_penalty,
+                    self.temperature,
+                    self.top_k,
+                    self.min_length,
+                    self.eos_token_id,
+                )
+
+            return self._process(input_ids, scores)
+
+        def _process(self, input_ids, scores):
+            cur_len = input_ids.shape[-1]
+
+            if self.repetition_penalty != 1.0 or self.presence_penalty != 0.0:
+                score = torch.gather(scores, 1, input_ids)
+                score = torch.where(
+                    score < 0,
+                    score * self.repetition_penalty,
+                    score / self.repetition_penalty,
+                )
+                scores = scores.scatter(1, input_ids, score - self.presence_penalty)
+
+            if self.no_repeat_ngram_size > 0:
+                banned_batch_tokens = _calc_banned_ngram_tokens(
+                    self.no_repeat_ngram_size,
+                    input_ids,
+                    scores.shape[0],
+                    cur_len,
+                )
+
+                for i, banned_tokens in enumerate(banned_batch_tokens):
+                    scores[i, banned_tokens] = -float("inf")
+
+            if self.eos_token_id >= 0 and cur_len < self.min_length:
+                scores[:, self.eos_token_id] = -float("inf")
+
+            scores = scores / self.temperature
+
+            if 0 < self.top_k < scores.size(-1):
+                kth_scores = torch.topk(scores, self.top_k)[0][..., -1, None]
+                scores = scores.masked_fill(scores < kth_scores, -float("inf"))
+
+            return scores
+
+    return FusedLogitsProcessor
@@ -1,3 +1,5 @@
+import weakref
+
 import torch
 
 from oslo.pytorch.kernel_fusion.cuda import CUDA
@@ -14,19 +16,190 @@ class NGramRepeatBlockFunction(torch.autograd.Function):
         raise NotImplementedError
 
 
-def get_ngram_logit_processor(batch_size, num_beams):
+class RaggedNGramRepeatBlockFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(
+        ctx, tokens, lprobs, seq_starts, seq_lens, max_seqlen, no_repeat_ngram_size
+    ):
+        return CUDA.ngram_repeat_block_ragged_forward(
+            tokens, lprobs, seq_starts, seq_lens, max_seqlen, no_repeat_ngram_size
+        )
+
+    def backward(*args):
+        raise NotImplementedError
+
+
+def ngram_repeat_block_ragged(
+    tokens,
+    lprobs,
+    no_repeat_ngram_size,
+    cu_seqlens=None,
+    attention_mask=None,
+    max_seqlen=None,
+):
+    """
+    Block repeated ngrams of a ragged batch in a single launch.
+
+    Args:
+        tokens (torch.LongTensor): packed histories of shape [total_tokens] with
+            ``cu_seqlens``, or padded histories of shape [rows, max_len] with
+            ``attention_mask``
+        lprobs (torch.FloatTensor): scores of shape [rows, vocab_size]
+        no_repeat_ngram_size (int): size of the ngrams to block
+        cu_seqlens (torch.Tensor): offsets of the histories in ``tokens``
+            of shape [rows + 1]
+        attention_mask (torch.Tensor): left padding mask of ``tokens``
+        max_seqlen (int): length of the longest history, computed from
+            ``cu_seqlens`` with a device sync when not given
+
+    Returns:
+        torch.FloatTensor: lprobs with repeated ngrams set to -inf
+    """
+    if (cu_seqlens is None) == (attention_mask is None):
+        raise ValueError("Exactly one of `cu_seqlens` and `attention_mask` is needed.")
+
+    if cu_seqlens is not None:
+        seq_starts = cu_seqlens[:-1]
+        seq_lens = cu_seqlens[1:] - cu_seqlens[:-1]
+        if max_seqlen is None:
+            max_seqlen = int(seq_lens.max().item()) if seq_lens.numel() > 0 else 0
+    else:
+        rows, max_len = tokens.size()
+        seq_lens = attention_mask.sum(dim=-1)
+        seq_starts = (
+            torch.arange(rows, device=tokens.device) * max_len + max_len - seq_lens
+        )
+        tokens = tokens.reshape(-1)
+        max_seqlen = max_len
+
+    return RaggedNGramRepeatBlockFunction.apply(
+        tokens.contiguous(),
+        lprobs,
+        seq_starts.int().contiguous(),
+        seq_lens.int().contiguous(),
+        max_seqlen,
+        no_repeat_ngram_size,
+    )
+
+
+class NGramRepeatBlockIndex(object):
+    """
+    GPU-resident index of the ngrams every hypothesis has generated.
+
+    The index is updated with the newly generated tokens only, so blocking
+    repeated ngrams costs O(1) per decoding step instead of a rescan of the
+    whole history. Call ``reorder`` whenever hypotheses are reselected.
+
+    Args:
+        no_repeat_ngram_size (int): size of the ngrams to block
+    """
+
+    def __init__(self, no_repeat_ngram_size):
+        self.no_repeat_ngram_size = no_repeat_ngram_size
+        self.reset()
+
+    def reset(self):
+        self.keys = None
+        self.positions = None
+        self.num_indexed = 0
+
+    def reorder(self, beam_idx):
+        if self.keys is not None and self.keys.size(0) != beam_idx.numel():
+            # the rows do not map to these hypotheses, rebuild from scratch
+            self.reset()
+        if self.keys is not None:
+            self.keys = self.keys.index_select(0, beam_idx)
+            self.positions = self.positions.index_select(0, beam_idx)
+
+    def _allocate(self, tokens, num_ngrams):
+        # keep the load factor of the open addressing table under 1/2
+        capacity = 64
+        while capacity < 2 * num_ngrams:
+            capacity *= 2
+
+        size = (tokens.size(0), capacity)
+        self.keys = torch.zeros(size, dtype=torch.long, device=tokens.device)
+        self.positions = torch.empty(size, dtype=torch.int, device=tokens.device)
+        self.num_indexed = 0
+
+    def __call__(self, tokens, lprobs, step):
+        num_ngrams = step - self.no_repeat_ngram_size + 2
+        if num_ngrams <= 0:
+            return lprobs
+
+        if (
+            self.keys is None
+            or self.keys.size(0) != tokens.size(0)
+            or self.keys.device != tokens.device
+            or self.num_indexed > num_ngrams
+        ):
+            self._allocate(tokens, num_ngrams)
+        elif 2 * num_ngrams > self.keys.size(1):
+            # rebuild the index with twice the capacity
+            self._allocate(tokens, 2 * num_ngrams)
+
+        lprobs = CUDA.ngram_repeat_block_index_forward(
+            tokens,
+            lprobs,
+            self.keys,
+            self.positions,
+            step,
+            self.num_indexed,
+            self.no_repeat_ngram_size,
+        )
+        self.num_indexed = num_ngrams
+        return lprobs
+
+
+def get_ngram_logit_processor(batch_size, num_beams, num_beam_groups=1):
     from transformers import LogitsProcessor
     from transformers.generation_logits_process import (
         _calc_banned_ngram_tokens,
     )
 
+    # live processors of this generation, reordered together by `reorder`
+    processors = []
+    # group beam search calls the processors once per group and step, in the
+    # order of the groups, with the rows of that group only
+    group_size = num_beams // num_beam_groups
+
     class FusedNoRepeatNGramLogitsProcessor(LogitsProcessor):
+
         def __init__(self, ngram_size: int):
             if not isinstance(ngram_size, int) or ngram_size <= 0:
                 raise ValueError(
                     f"`ngram_size` has to be a strictly positive integer, but is {ngram_size}"
                 )
             self.ngram_size = ngram_size
+            self.indices = [
+                NGramRepeatBlockIndex(ngram_size) for _ in range(num_beam_groups)
+            ]
+            self.reordered = [False] * num_beam_groups
+            self.group = 0
+            processors.append(weakref.ref(self))
+
+        @staticmethod
+        def reorder(beam_idx):
+            processors[:] = [ref for ref in processors if ref() is not None]
+            for ref in processors:
+                processor = ref()
+                if processor is not None:
+                    processor.reorder_beams(beam_idx)
+
+        def reorder_beams(self, beam_idx):
+            if num_beam_groups == 1:
+                self.indices[0].reorder(beam_idx)
+                self.reordered[0] = True
+                return
+
+            # beams of a group are reselected from the same batch and group,
+            # map them to the rows of the group
+            grouped = beam_idx.view(-1, num_beam_groups, group_size)
+            for group, index in enumerate(self.indices):
+                rows = grouped[:, group].reshape(-1)
+                batch, beam = rows // num_beams, rows % num_beams
+                index.reorder(batch * group_size + beam - group * group_size)
+                self.reordered[group] = True
 
         def __call__(
             self,
@@ -35,16 +208,18 @@ def get_ngram_logit_processor(batch_size, num_beams):
         ) -> torch.FloatTensor:
             num_batch_hypotheses = scores.shape[0]
             cur_len = input_ids.shape[-1]
+            group = self.group
+            self.group = (group + 1) % num_beam_groups
 
             if input_ids.is_cuda and scores.is_cuda:
-                scores = NGramRepeatBlockFunction.apply(
-                    input_ids,
-                    scores.float(),
-                    batch_size,
-                    cur_len - 1,
-                    num_beams,
-                    self.ngram_size,
-                )
+                index = self.indices[group]
+                if num_beams > 1 and not self.reordered[group]:
+                    # hypotheses may have been reselected without a call to
+                    # `reorder`, so the index has to be rebuilt.
+                    index.reset()
+
+                self.reordered[group] = False
+                scores = index(input_ids, scores.float(), cur_len - 1)
 
             else:
                 banned_batch_tokens = _calc_banned_ngram_tokens(
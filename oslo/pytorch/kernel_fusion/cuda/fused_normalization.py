@@ -118,6 +118,320 @@ class FusedRMSNormAffineMixedDtypesFunction(FusedRMSNormAffineFunction):
         return output
 
 
+def _dropout_seed(p):
+    # drawn from the host generator so that no device synchronization is needed
+    if p == 0.0:
+        return 0
+    return int(torch.randint(0, 2**62, (1,), dtype=torch.int64).item())
+
+
+class FusedLayerNormResidualAffineFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, input, residual, bias, weight, ln_bias, normalized_shape, eps, p):
+        ctx.normalized_shape = normalized_shape
+        ctx.eps = eps
+        ctx.p = p
+        input_ = input.contiguous()
+        residual_ = residual.contiguous()
+        bias_ = bias.contiguous()
+        weight_ = weight.contiguous()
+        ln_bias_ = ln_bias.contiguous()
+        output, sum_, mean, invvar, mask = CUDA.layer_norm_residual_forward_affine(
+            input_,
+            residual_,
+            bias_,
+            ctx.normalized_shape,
+            weight_,
+            ln_bias_,
+            ctx.eps,
+            ctx.p,
+            _dropout_seed(ctx.p),
+        )
+        ctx.save_for_backward(sum_, weight_, ln_bias_, mean, invvar, mask)
+        return output, sum_
+
+    @staticmethod
+    def backward(ctx, grad_output, grad_sum):
+        sum_, weight_, ln_bias_, mean, invvar, mask = ctx.saved_tensors
+        (
+            grad_input,
+            grad_residual,
+            grad_bias,
+            grad_weight,
+            grad_ln_bias,
+        ) = CUDA.layer_norm_residual_backward_affine(
+            grad_output.contiguous(),
+            grad_sum.contiguous(),
+            mean,
+            invvar,
+            sum_,
+            mask,
+            ctx.normalized_shape,
+            weight_,
+            ln_bias_,
+            ctx.eps,
+            ctx.p,
+        )
+        return (
+            grad_input,
+            grad_residual,
+            grad_bias,
+            grad_weight,
+            grad_ln_bias,
+            None,
+            None,
+            None,
+        )
+
+
+class FusedRMSNormResidualAffineFunction(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, input, residual, bias, weight, normalized_shape, eps, p):
+        ctx.normalized_shape = normalized_shape
+        ctx.eps = eps
+        ctx.p = p
+        input_ = input.contiguous()
+        residual_ = residual.contiguous()
+        bias_ = bias.contiguous()
+        weight_ = weight.contiguous()
+        output, sum_, invvar, mask = CUDA.rms_norm_residual_forward_affine(
+            input_,
+            residual_,
+            bias_,
+            ctx.normalized_shape,
+            weight_,
+            ctx.eps,
+            ctx.p,
+            _dropout_seed(ctx.p),
+        )
+        ctx.save_for_backward(sum_, weight_, invvar, mask)
+        return output, sum_
+
+    @staticmethod
+    def backward(ctx, grad_output, grad_sum):
+        sum_, weight_, invvar, mask = ctx.saved_tensors
+        (
+            grad_input,
+            grad_residual,
+            grad_bias,
+            grad_weight,
+        ) = CUDA.rms_norm_residual_backward_affine(
+            grad_output.contiguous(),
+            grad_sum.contiguous(),
+            invvar,
+            sum_,
+            mask,
+            ctx.normalized_shape,
+            weight_,
+            ctx.eps,
+            ctx.p,
+        )
+        return grad_input, grad_residual, grad_bias, grad_weight, None, None, None
+
+
+def _all_gather_stats(stats, group):
+    world_size = torch.distributed.get_world_size(group=group)
+    if world_size == 1:
+        return stats.unsqueeze(0)
+    gathered = torch.empty(
+        (world_size,) + tuple(stats.size()), dtype=stats.dtype, device=stats.device
+    )
+    torch.distributed.all_gather(list(gathered.unbind(0)), stats, group=group)
+    return gathered
+
+
+def _normalized_numel(normalized_shape):
+    if isinstance(normalized_shape, numbers.Integral):
+        normalized_shape = (normalized_shape,)
+    return int(torch.Size(normalized_shape).numel())
+
+
+class FusedShardedLayerNormAffineFunction(torch.autograd.Function):
+    """
+    LayerNorm over a hidden dimension sharded across ``group``.
+    ``normalized_shape`` is the full shape, ``weight`` and ``bias`` are the local shard.
+    Only ``n1 * 3`` statistics (forward) and ``n1 * 2`` sums (backward) cross the group.
+    """
+
+    @staticmethod
+    def forward(ctx, input, weight, bias, normalized_shape, eps, group):
+        ctx.local_shape = weight.size()
+        ctx.global_size = _normalized_numel(normalized_shape)
+        ctx.eps = eps
+        ctx.group = group
+        input_ = input.contiguous()
+        weight_ = weight.contiguous()
+        bias_ = bias.contiguous()
+        stats = CUDA.layer_norm_partial_stats(input_, ctx.local_shape)
+        output, mean, invvar = CUDA.layer_norm_sharded_forward_affine(
+            input_,
+            _all_gather_stats(stats, group),
+            ctx.local_shape,
+            weight_,
+            bias_,
+            ctx.eps,
+        )
+        ctx.save_for_backward(input_, weight_, bias_, mean, invvar)
+        return output
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        input_, weight_, bias_, mean, invvar = ctx.saved_tensors
+        grad_output = grad_output.contiguous()
+        sums = CUDA.layer_norm_grad_input_partial_sums(
+            grad_output, mean, invvar, input_, ctx.local_shape, weight_
+        )
+        torch.distributed.all_reduce(sums, group=ctx.group)
+        grad_input, grad_weight, grad_bias = CUDA.layer_norm_sharded_backward_affine(
+            grad_output,
+            sums,
+            mean,
+            invvar,
+            input_,
+            ctx.local_shape,
+            ctx.global_size,
+            weight_,
+            bias_,
+            ctx.eps,
+        )
+        return grad_input, grad_weight, grad_bias, None, None, None
+
+
+class FusedShardedRMSNormAffineFunction(torch.autograd.Function):
+    """
+    RMSNorm over a hidden dimension sharded across ``group``.
+    See :class:`FusedShardedLayerNormAffineFunction`.
+    """
+
+    @staticmethod
+    def forward(ctx, input, weight, normalized_shape, eps, group):
+        ctx.local_shape = weight.size()
+        ctx.global_size = _normalized_numel(normalized_shape)
+        ctx.eps = eps
+        ctx.group = group
+        input_ = input.contiguous()
+        weight_ = weight.contiguous()
+        stats = CUDA.rms_norm_partial_stats(input_, ctx.local_shape)
+        output, invvar = CUDA.rms_norm_sharded_forward_affine(
+            input_,
+            _all_gather_stats(stats, group),
+            ctx.local_shape,
+            weight_,
+            ctx.eps,
+        )
+        ctx.save_for_backward(input_, weight_, invvar)
+        return output
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        input_, weight_, invvar = ctx.saved_tensors
+        grad_output = grad_output.contiguous()
+        sums = CUDA.rms_norm_grad_input_partial_sums(
+            grad_output, invvar, input_, ctx.local_shape, weight_
+        )
+        torch.distributed.all_reduce(sums, group=ctx.group)
+        grad_input, grad_weight = CUDA.rms_norm_sharded_backward_affine(
+            grad_output,
+            sums,
+            invvar,
+            input_,
+            ctx.local_shape,
+            ctx.global_size,
+            weight_,
+            ctx.eps,
+        )
+        return grad_input, grad_weight, None, None, None
+
+
+def _normalized_shapes(normalized_shapes):
+    return [
+        [shape] if isinstance(shape, numbers.Integral) else list(shape)
+        for shape in normalized_shapes
+    ]
+
+
+class FusedMultiLayerNormFunction(torch.autograd.Function):
+    """
+    LayerNorm of a list of tensors with their own ``normalized_shape`` in one launch.
+    ``tensors`` holds the inputs, followed by the weights and biases if affine.
+    """
+
+    @staticmethod
+    def forward(ctx, normalized_shapes, eps, num_inputs, *tensors):
+        ctx.normalized_shapes = normalized_shapes
+        ctx.eps = eps
+        ctx.num_inputs = num_inputs
+        inputs_ = [input.contiguous() for input in tensors[:num_inputs]]
+        weights_ = [weight.contiguous() for weight in tensors[num_inputs::2]]
+        biases_ = [bias.contiguous() for bias in tensors[num_inputs + 1 :: 2]]
+        outputs, means, invvars = CUDA.multi_layer_norm_forward(
+            inputs_, ctx.normalized_shapes, weights_, biases_, ctx.eps
+        )
+        ctx.affine = len(weights_) > 0
+        ctx.save_for_backward(*inputs_, *weights_, *biases_, *means, *invvars)
+        return tuple(outputs)
+
+    @staticmethod
+    def backward(ctx, *grad_outputs):
+        n = ctx.num_inputs
+        saved = ctx.saved_tensors
+        inputs_ = list(saved[:n])
+        weights_ = list(saved[n : 2 * n]) if ctx.affine else []
+        biases_ = list(saved[2 * n : 3 * n]) if ctx.affine else []
+        means = list(saved[-2 * n : -n])
+        invvars = list(saved[-n:])
+        grad_inputs, grad_weights, grad_biases = CUDA.multi_layer_norm_backward(
+            [grad.contiguous() for grad in grad_outputs],
+            means,
+            invvars,
+            inputs_,
+            ctx.normalized_shapes,
+            weights_,
+            biases_,
+            ctx.eps,
+        )
+        grad_params = [grad for pair in zip(grad_weights, grad_biases) for grad in pair]
+        return (None, None, None, *grad_inputs, *grad_params)
+
+
+class FusedMultiRMSNormFunction(torch.autograd.Function):
+    """
+    RMSNorm of a list of tensors with their own ``normalized_shape`` in one launch.
+    ``tensors`` holds the inputs, followed by the weights if affine.
+    """
+
+    @staticmethod
+    def forward(ctx, normalized_shapes, eps, num_inputs, *tensors):
+        ctx.normalized_shapes = normalized_shapes
+        ctx.eps = eps
+        ctx.num_inputs = num_inputs
+        inputs_ = [input.contiguous() for input in tensors[:num_inputs]]
+        weights_ = [weight.contiguous() for weight in tensors[num_inputs:]]
+        outputs, invvars = CUDA.multi_rms_norm_forward(
+            inputs_, ctx.normalized_shapes, weights_, ctx.eps
+        )
+        ctx.affine = len(weights_) > 0
+        ctx.save_for_backward(*inputs_, *weights_, *invvars)
+        return tuple(outputs)
+
+    @staticmethod
+    def backward(ctx, *grad_outputs):
+        n = ctx.num_inputs
+        saved = ctx.saved_tensors
+        inputs_ = list(saved[:n])
+        weights_ = list(saved[n : 2 * n]) if ctx.affine else []
+        invvars = list(saved[-n:])
+        grad_inputs, grad_weights = CUDA.multi_rms_norm_backward(
+            [grad.contiguous() for grad in grad_outputs],
+            invvars,
+            inputs_,
+            ctx.normalized_shapes,
+            weights_,
+            ctx.eps,
+        )
+        return (None, None, None, *grad_inputs, *grad_weights)
+
+
 class FusedLayerNormFunction(torch.autograd.Function):
     @staticmethod
     def forward(ctx, input, normalized_shape, eps):
@@ -203,6 +517,153 @@ def mixed_dtype_fused_rms_norm_affine(input, weight, normalized_shape, eps=1e-6)
         return FusedRMSNormAffineMixedDtypesFunction.apply(*args)
 
 
+def fused_layer_norm_residual_affine(
+    input, residual, bias, weight, ln_bias, normalized_shape, eps=1e-6, p=0.0
+):
+    """
+    Returns ``(LayerNorm(residual + dropout(input + bias)), residual + dropout(input + bias))``.
+    The second output is the pre-norm sum, e.g. the residual stream of the next block.
+    """
+    args = _cast_if_autocast_enabled(
+        input, residual, bias, weight, ln_bias, normalized_shape, eps, p
+    )
+    with torch.cuda.amp.autocast(enabled=False):
+        return FusedLayerNormResidualAffineFunction.apply(*args)
+
+
+def fused_rms_norm_residual_affine(
+    input, residual, bias, weight, normalized_shape, eps=1e-6, p=0.0
+):
+    """
+    Returns ``(RMSNorm(residual + dropout(input + bias)), residual + dropout(input + bias))``.
+    The second output is the pre-norm sum, e.g. the residual stream of the next block.
+    """
+    args = _cast_if_autocast_enabled(
+        input, residual, bias, weight, normalized_shape, eps, p
+    )
+    with torch.cuda.amp.autocast(enabled=False):
+        return FusedRMSNormResidualAffineFunction.apply(*args)
+
+
+def fused_sharded_layer_norm_affine(
+    input, weight, bias, normalized_shape, eps=1e-6, group=None
+):
+    """
+    LayerNorm of an input whose last dimension is sharded over the tensor parallel ``group``.
+    ``normalized_shape`` is the full (unsharded) shape, ``weight`` and ``bias`` hold the local shard.
+    """
+    args = _cast_if_autocast_enabled(input, weight, bias, normalized_shape, eps)
+    with torch.cuda.amp.autocast(enabled=False):
+        return FusedShardedLayerNormAffineFunction.apply(*args, group)
+
+
+def fused_sharded_rms_norm_affine(
+    input, weight, normalized_shape, eps=1e-6, group=None
+):
+    """
+    RMSNorm of an input whose last dimension is sharded over the tensor parallel ``group``.
+    ``normalized_shape`` is the full (unsharded) shape, ``weight`` holds the local shard.
+    """
+    args = _cast_if_autocast_enabled(input, weight, normalized_shape, eps)
+    with torch.cuda.amp.autocast(enabled=False):
+        return FusedShardedRMSNormAffineFunction.apply(*args, group)
+
+
+def fused_multi_layer_norm(
+    inputs, normalized_shapes, weights=None, biases=None, eps=1e-6
+):
+    """
+    Applies LayerNorm to every tensor of ``inputs`` with one launch for all of them,
+    e.g. for per-head or per-expert norms. ``weights`` and ``biases`` are given for
+    all tensors or for none.
+    """
+    params = []
+    if weights is not None:
+        params = [param for pair in zip(weights, biases) for param in pair]
+    args = _cast_if_autocast_enabled(*inputs, *params)
+    with torch.cuda.amp.autocast(enabled=False):
+        return list(
+            FusedMultiLayerNormFunction.apply(
+                _normalized_shapes(normalized_shapes), eps, len(inputs), *args
+            )
+        )
+
+
+def fused_multi_rms_norm(inputs, normalized_shapes, weights=None, eps=1e-6):
+    """
+    Applies RMSNorm to every tensor of ``inputs`` with one launch for all of them.
+    See :func:`fused_multi_layer_norm`.
+    """
+    params = list(weights) if weights is not None else []
+    args = _cast_if_autocast_enabled(*inputs, *params)
+    with torch.cuda.amp.autocast(enabled=False):
+        return list(
+            FusedMultiRMSNormFunction.apply(
+                _normalized_shapes(normalized_shapes), eps, len(inputs), *args
+            )
+        )
+
+
+def _quantized_format(dtype):
+    formats = {torch.int8: "int8"}
+    if hasattr(torch, "float8_e4m3fn"):
+        formats[torch.float8_e4m3fn] = "e4m3"
+        formats[torch.float8_e5m2] = "e5m2"
+    if dtype not in formats:
+        raise ValueError(
+            f"Unsupported quantized dtype {dtype}, expected one of {list(formats)}"
+        )
+    return formats[dtype]
+
+
+def _quantized_scale(input, scale):
+    if scale is None:
+        return torch.empty(0, dtype=torch.float, device=input.device)
+    if not torch.is_tensor(scale):
+        return torch.tensor([scale], dtype=torch.float, device=input.device)
+    return scale.float().reshape(1).contiguous()
+
+
+@torch.no_grad()
+def fused_layer_norm_affine_quantized(
+    input, weight, bias, normalized_shape, eps=1e-6, dtype=torch.int8, scale=None
+):
+    """
+    Inference-only LayerNorm that writes ``dtype`` (int8 or fp8) output directly.
+    Returns ``(output, scale)`` with ``LayerNorm(input) ~= output * scale``.
+    If ``scale`` is None a scale is computed per row, otherwise the given per-tensor scale is used.
+    """
+    output, _, _, scale = CUDA.layer_norm_forward_affine_quantized(
+        input.contiguous(),
+        normalized_shape,
+        weight.contiguous(),
+        bias.contiguous(),
+        eps,
+        _quantized_format(dtype),
+        _quantized_scale(input, scale),
+    )
+    return output, scale
+
+
+@torch.no_grad()
+def fused_rms_norm_affine_quantized(
+    input, weight, normalized_shape, eps=1e-6, dtype=torch.int8, scale=None
+):
+    """
+    Inference-only RMSNorm that writes ``dtype`` (int8 or fp8) output directly.
+    See :func:`fused_layer_norm_affine_quantized`.
+    """
+    output, _, scale = CUDA.rms_norm_forward_affine_quantized(
+        input.contiguous(),
+        normalized_shape,
+        weight.contiguous(),
+        eps,
+        _quantized_format(dtype),
+        _quantized_scale(input, scale),
+    )
+    return output, scale
+
+
 class FusedLayerNorm(torch.nn.Module):
     r"""Applies Layer Normalization over a mini-batch of inputs as described in
     the paper `Layer Normalization`_ .
@@ -0,0 +1,130 @@
+import torch
+from torch import nn
+
+from oslo.pytorch.kernel_fusion.cuda import CUDA
+
+# scores of masked positions, as the additive masks of the HF models
+MASKED_SCORE = -10000.0
+
+
+class ScaledMaskedSoftmaxFunction(torch.autograd.Function):
+    """
+    Kernel fusion function: Scale + Mask + Softmax
+
+    ``input`` is [b, h, sq, sk] and ``mask`` is None or a [1 or b, 1, 1 or sq, sk]
+    bool mask whose true positions are excluded.
+    """
+
+    @staticmethod
+    def forward(ctx, input, mask, scale):
+        ctx.scale = scale
+        input_ = input.contiguous()
+        mask_ = mask.contiguous() if mask is not None else input_.new_empty(0)
+        softmax_results = CUDA.scaled_masked_softmax_forward(input_, mask_, scale)
+        ctx.save_for_backward(softmax_results)
+        return softmax_results
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        (softmax_results,) = ctx.saved_tensors
+        grad_input = CUDA.scaled_masked_softmax_backward(
+            grad_output.contiguous(), softmax_results, ctx.scale
+        )
+        return grad_input, None, None
+
+
+class ScaledUpperTriangMaskedSoftmaxFunction(torch.autograd.Function):
+    """
+    Kernel fusion function: Scale + Causal Mask + Softmax
+
+    ``input`` is [b * h, sq, sk], the query i attends the keys up to sk - sq + i.
+    """
+
+    @staticmethod
+    def forward(ctx, input, scale):
+        ctx.scale = scale
+        softmax_results = CUDA.scaled_upper_triang_masked_softmax_forward(
+            input.contiguous(), scale
+        )
+        ctx.save_for_backward(softmax_results)
+        return softmax_results
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        (softmax_results,) = ctx.saved_tensors
+        grad_input = CUDA.scaled_upper_triang_masked_softmax_backward(
+            grad_output.contiguous(), softmax_results, ctx.scale
+        )
+        return grad_input, None
+
+
+def scaled_masked_softmax(input, mask=None, scale=1.0):
+    return ScaledMaskedSoftmaxFunction.apply(input, mask, scale)
+
+
+def scaled_upper_triang_masked_softmax(input, scale=1.0):
+    return ScaledUpperTriangMaskedSoftmaxFunction.apply(input, scale)
+
+
+class FusedScaleMaskSoftmax(nn.Module):
+    """
+    Softmax of scaled and masked attention scores in a single pass over them.
+
+    Args:
+        scale (float): factor of the scores
+        causal (bool): whether the query i only attends the keys up to
+            sk - sq + i, in addition to the mask
+
+    Shape:
+        - input: [b, h, sq, sk] scores
+        - mask: None or a [1 or b, 1, 1 or sq, sk] bool mask whose true
+          positions are excluded.
+
+    Inputs the kernels do not support run through the equivalent torch ops.
+    """
+
+    def __init__(self, scale=1.0, causal=False):
+        super().__init__()
+        self.scale = scale
+        self.causal = causal
+
+    @staticmethod
+    def is_kernel_available(input):
+        return input.is_cuda and input.dim() == 4 and input.dtype in (
+            torch.float,
+            torch.half,
+            torch.bfloat16,
+        )
+
+    def causal_mask(self, input):
+        query_len, key_len = input.size(-2), input.size(-1)
+        return torch.ones(
+            query_len, key_len, dtype=torch.bool, device=input.device
+        ).triu(key_len - query_len + 1)[None, None]
+
+    def forward(self, input, mask=None):
+        if mask is not None and mask.dtype != torch.bool:
+            mask = mask.bool()
+
+        if not self.is_kernel_available(input):
+            return self.forward_torch_softmax(input, mask)
+
+        if self.causal and mask is None:
+            b, h, sq, sk = input.size()
+            output = scaled_upper_triang_masked_softmax(
+                input.view(b * h, sq, sk), self.scale
+            )
+            return output.view(b, h, sq, sk)
+
+        if self.causal:
+            # future positions are masked like the padding
+            mask = mask | self.causal_mask(input)
+        return scaled_masked_softmax(input, mask, self.scale)
+
+    def forward_torch_softmax(self, input, mask):
+        scores = input.float() * self.scale
+        if mask is not None:
+            scores = scores.masked_fill(mask, MASKED_SCORE)
+        if self.causal:
+            scores = scores.masked_fill(self.causal_mask(input), float("-inf"))
+        return torch.softmax(scores, dim=-1).to(input.dtype)
@@ -0,0 +1,66 @@
+from contextlib import contextmanager
+
+from oslo.pytorch.kernel_fusion.cuda import CUDA
+
+
+def enable_op_telemetry(nvtx=True, timing=True):
+    """
+    Switches on the telemetry of the CUDA ops of oslo.
+
+    Every call of an op is counted by its name, (n1, n2) shape and dtype. With
+    ``nvtx`` the launches of the call are wrapped in an NVTX range of the same
+    label, shown by Nsight Systems, and with ``timing`` they are timed by a pair
+    of CUDA events on the current stream. The events are not recorded while a
+    CUDA graph is captured.
+
+    Args:
+        nvtx (bool): annotate the ops with NVTX ranges
+        timing (bool): time the ops with CUDA events
+    """
+    CUDA.set_op_telemetry(nvtx=nvtx, timing=timing)
+
+
+def disable_op_telemetry():
+    """Switches off the telemetry of the CUDA ops, the stats are kept."""
+    CUDA.set_op_telemetry(nvtx=False, timing=False)
+
+
+def op_telemetry_stats():
+    """
+    Returns the stats of the ops since the last reset, by label e.g.
+    ``layer_norm_forward_affine(n1=8192, n2=1024, dtype=Half)``. Every entry
+    has ``calls`` and ``timed_calls``, and ``total_ms``, ``mean_ms``,
+    ``min_ms`` and ``max_ms`` once it has been timed. Beyond 1024 labels, the
+    other shapes of an op are counted under e.g.
+    ``layer_norm_forward_affine(other shapes)``. It waits for the pending
+    timings of the ops.
+
+    Returns:
+        Dict[str, Dict[str, float]]: stats of the ops
+    """
+    return CUDA.op_telemetry_stats()
+
+
+def reset_op_telemetry():
+    """Clears the stats of the ops."""
+    CUDA.reset_op_telemetry()
+
+
+@contextmanager
+def op_telemetry(nvtx=True, timing=True):
+    """
+    Collects the telemetry of the ops within the block, from a reset.
+
+    Examples:
+        >>> with op_telemetry(nvtx=False) as stats:
+        ...     model(**inputs)
+        >>> print(stats)
+    """
+    stats = {}
+    reset_op_telemetry()
+    enable_op_telemetry(nvtx=nvtx, timing=timing)
+    try:
+        yield stats
+    finally:
+        disable_op_telemetry()
+        stats.update(op_telemetry_stats())
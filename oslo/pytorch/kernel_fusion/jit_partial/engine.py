@@ -2,7 +2,12 @@ from contextlib import suppress
 
 import torch
 
-from oslo.pytorch.kernel_fusion.jit_partial.fused_gelu import fused_gelu
+from oslo.pytorch.kernel_fusion.jit_partial.fused_gelu import (
+    ERF_GELU_ACTIVATIONS,
+    TANH_GELU_ACTIVATIONS,
+    fused_erf_gelu,
+    fused_gelu,
+)
 
 
 class JITPartialCompilingEngine(object):
@@ -16,12 +21,20 @@ class JITPartialCompilingEngine(object):
     def fuse_activation(module):
         from transformers.activations import ACT2FN
 
+        # the exact GeLU must not be swapped for the tanh approximation
+        fused_activations = {}
+        for name, val in ACT2FN.items():
+            if name in TANH_GELU_ACTIVATIONS:
+                fused_activations.setdefault(id(val), fused_gelu)
+            elif name in ERF_GELU_ACTIVATIONS:
+                fused_activations.setdefault(id(val), fused_erf_gelu)
+
         activations = list(ACT2FN.values())
         for name, child in module.named_modules():
             with suppress(Exception):
                 for key, val in child.__dict__.items():
                     if val in activations:
-                        if "gelu" in key.lower():
-                            child.__dict__[key] = fused_gelu
+                        if id(val) in fused_activations:
+                            child.__dict__[key] = fused_activations[id(val)]
                         else:
                             child.__dict__[key] = torch.jit.script(val)
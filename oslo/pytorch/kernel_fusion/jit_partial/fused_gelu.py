@@ -1,5 +1,14 @@
+from functools import lru_cache
+from logging import getLogger
+
 import torch
 
+logger = getLogger(__name__)
+
+# names of ``transformers.activations.ACT2FN`` for the two forms of GeLU
+TANH_GELU_ACTIVATIONS = ("gelu_new", "gelu_fast", "gelu_pytorch_tanh")
+ERF_GELU_ACTIVATIONS = ("gelu", "gelu_python")
+
 
 @torch.jit.script
 def fused_gelu_fwb(x):
@@ -15,22 +24,64 @@ def fused_gelu_bwd(g, x):
     return ff * g
 
 
+@torch.jit.script
+def fused_erf_gelu_fwb(x):
+    return x * 0.5 * (1.0 + torch.erf(x * 0.70710678))
+
+
+@torch.jit.script
+def fused_erf_gelu_bwd(g, x):
+    ff = 0.5 * (1.0 + torch.erf(x * 0.70710678)) + x * 0.39894228 * torch.exp(
+        -0.5 * x * x
+    )
+    return ff * g
+
+
 class FusedGeLUFunction(torch.autograd.Function):
     """
     Kernel fusion function: Bias + GeLU
     """
 
     @staticmethod
-    def forward(ctx, input):
+    def forward(ctx, input, approximate=True):
+        ctx.approximate = approximate
         ctx.save_for_backward(input)
-        return fused_gelu_fwb(input)
+        if approximate:
+            return fused_gelu_fwb(input)
+        return fused_erf_gelu_fwb(input)
 
     @staticmethod
     def backward(ctx, grad_output):
-        input = ctx.saved_tensors
-        tmp = fused_gelu_bwd(grad_output, input)
-        return tmp, tmp
+        (input,) = ctx.saved_tensors
+        if ctx.approximate:
+            return fused_gelu_bwd(grad_output, input), None
+        return fused_erf_gelu_bwd(grad_output, input), None
+
+
+@lru_cache(maxsize=None)
+def native_bias_gelu():
+    """Returns the native fused bias GeLU, or None when it can not be built."""
+    try:
+        from oslo.pytorch.kernel_fusion.cuda.fused_bias_gelu import fused_bias_gelu
+
+        return fused_bias_gelu
+    except Exception as e:
+        logger.warning(
+            f"Unable to use the native fused bias GeLU kernel, "
+            f"falling back to the TorchScript implementation: {e}"
+        )
+        return None
+
+
+def fused_gelu(x, approximate=True):
+    if (
+        x.is_cuda
+        and x.dtype in (torch.float, torch.half, torch.bfloat16)
+        and native_bias_gelu() is not None
+    ):
+        return native_bias_gelu()(x, approximate=approximate)
+    return FusedGeLUFunction.apply(x, approximate)
 
 
-def fused_gelu(x):
-    return FusedGeLUFunction.apply(x)
+def fused_erf_gelu(x):
+    return fused_gelu(x, approximate=False)
@@ -14,6 +14,7 @@ class KernelFusionEngine(object):
         model,
         memory_efficient_fusion,
         custom_cuda_kernels=None,
+        async_compile=False,
     ):
         if custom_cuda_kernels is None:
             custom_cuda_kernels = []
@@ -21,6 +22,7 @@ class KernelFusionEngine(object):
         self.model = model
         self.custom_cuda_kernels = custom_cuda_kernels
         self.memory_efficient_fusion = memory_efficient_fusion
+        self.async_compile = async_compile
         self._set_jit_fusion_options()
         self.is_fused = False
 
@@ -43,7 +45,7 @@ class KernelFusionEngine(object):
                 )
 
                 mem_efficient_fusion_engine = MemoryEfficientFusionEngine(
-                    model=self.model
+                    model=self.model, async_compile=self.async_compile
                 )
                 self.model = mem_efficient_fusion_engine.fuse()
             else:
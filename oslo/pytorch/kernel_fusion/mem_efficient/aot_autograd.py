@@ -1,4 +1,9 @@
-from typing import Any, Callable, Dict, List, Optional, Tuple
+import copy
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+from logging import getLogger
+from typing import Any, Callable, Dict, List, Optional, Sequence, Tuple, Union
 
 import torch
 import torch.nn as nn
@@ -9,11 +14,14 @@ from torch.fx import immutable_collections
 
 from ..utils.torch_version import higher_than
 from .compat import _stateless
-from .compat.aot_autograd import CompileCache
+from .compat.aot_autograd import CompileCache, HasherType, ShapeBucketing
 from .decompositions import register_decomposition
 from .partitioners import default_partition
+from .persistent_cache import PersistentCompileCache
 from .python_key import make_fx
 
+logger = getLogger(__name__)
+
 pytree._register_pytree_node(
     immutable_collections.immutable_list,
     lambda x: (list(x), None),
@@ -95,6 +103,23 @@ def normalize_as_list(x):
     return [x]
 
 
+def tensors_nbytes(tensors):
+    """Sums the bytes of the distinct tensors, others are ignored."""
+    sizes = {}
+    for t in tensors:
+        if isinstance(t, Tensor):
+            sizes[id(t)] = t.numel() * t.element_size()
+    return sum(sizes.values())
+
+
+def graph_nbytes(module):
+    """Estimates the bytes of the constants kept alive by an fx graph module."""
+    if not isinstance(module, nn.Module):
+        return 0
+    constants = [v for v in vars(module).values() if isinstance(v, Tensor)]
+    return tensors_nbytes([*module.parameters(), *module.buffers(), *constants])
+
+
 aot_autograd_decompositions = {}
 
 
@@ -111,7 +136,15 @@ if higher_than(1, 11):
 
 
 def create_aot_autograd_function(
-    flat_fn, fw_compiler, bw_compiler, partition_fn, decompositions, grad_state
+    flat_fn,
+    fw_compiler,
+    bw_compiler,
+    partition_fn,
+    decompositions,
+    grad_state,
+    persistent_cache=None,
+    persistent_key=None,
+    out_spec=None,
 ):
     """
     Traces the forward and backward graphs of the attr:`flat_fn` to generate a
@@ -122,43 +155,126 @@ def create_aot_autograd_function(
     provided attr:`fw_compiler` and attr:`bw_compiler`.
     The resulting compiled forward and backward graphs are then wrapped up in a
     ``torch.autograd.Function`` object.
+    With a :attr:`persistent_cache`, the graphs and compiled functions are
+    looked up by :attr:`persistent_key` first and stored there once compiled.
+    The output spec is stored with them and restored into :attr:`out_spec`,
+    since a cached function is never traced.
     """
     joint_forward_backward = create_joint_forward_backward(flat_fn)
 
     compiled_fw = None
     compiled_bw = None
     num_outs = None
+    entry_nbytes = 0
+    # outputs of the compiled forward run while compiling, reused by the call
+    # that compiled it instead of running the forward again
+    compiled_outs = None
+
+    def compile_artifact(flat_tensor_args):
+        with torch.set_grad_enabled(grad_state):
+            out = flat_fn(*flat_tensor_args)
+        out = pytree.tree_map(lambda x: x.detach() if isinstance(x, Tensor) else x, out)
+
+        if isinstance(out, (list, tuple)):
+            num_outs = len(out)
+        else:
+            num_outs = 1
+
+        joint_inputs = (flat_tensor_args, out)
+        aot_decompositions = {**aot_autograd_decompositions, **decompositions}
+        with torch.set_grad_enabled(grad_state):
+            fx_g = make_fx(joint_forward_backward, aot_decompositions)(*joint_inputs)
+        fw_module, bw_module = partition_fn(fx_g, joint_inputs)
+
+        compiled_fw = fw_compiler(fw_module, flat_tensor_args)
+        fw_outs = normalize_as_list(compiled_fw(*flat_tensor_args))
+
+        bw_args = fw_outs[num_outs:] + fw_outs[0:num_outs]
+        compiled_bw = bw_compiler(bw_module, bw_args)
+        artifact = {
+            "num_outs": num_outs,
+            "out_spec": out_spec.spec if out_spec is not None else None,
+            "fw_module": fw_module,
+            "bw_module": bw_module,
+            "compiled_fw": compiled_fw,
+            "compiled_bw": compiled_bw,
+            "saved_nbytes": tensors_nbytes(fw_outs[num_outs:]),
+        }
+        return artifact, fw_outs
+
+    def load_artifact(artifact, flat_tensor_args):
+        # compile the stored graphs again when the compiled functions
+        # could not be stored
+        num_outs = artifact["num_outs"]
+        if out_spec is not None and artifact.get("out_spec") is not None:
+            out_spec.set(artifact["out_spec"])
+        compiled_fw = artifact["compiled_fw"]
+        if compiled_fw is None:
+            compiled_fw = fw_compiler(artifact["fw_module"], flat_tensor_args)
+
+        fw_outs = None
+        compiled_bw = artifact["compiled_bw"]
+        if compiled_bw is None:
+            fw_outs = normalize_as_list(compiled_fw(*flat_tensor_args))
+            bw_args = fw_outs[num_outs:] + fw_outs[0:num_outs]
+            compiled_bw = bw_compiler(artifact["bw_module"], bw_args)
+        return compiled_fw, compiled_bw, num_outs, fw_outs
 
     class CompiledFunction(torch.autograd.Function):
         @staticmethod
-        def forward(ctx, *flat_tensor_args):
-            nonlocal compiled_fw, compiled_bw, num_outs
+        def compile(*flat_tensor_args, keep_outputs=True):
+            """
+            Compiles the graphs ahead of the first call, e.g. in a worker. With
+            ``keep_outputs`` the first forward of the same args reuses the
+            outputs of the compiled forward run while compiling.
+            """
+            nonlocal compiled_fw, compiled_bw, num_outs, entry_nbytes
+            nonlocal compiled_outs
             if compiled_fw is None:
-                with torch.set_grad_enabled(grad_state):
-                    out = flat_fn(*flat_tensor_args)
-                out = pytree.tree_map(
-                    lambda x: x.detach() if isinstance(x, Tensor) else x, out
-                )
+                fw_outs = None
 
-                if isinstance(out, (list, tuple)):
-                    num_outs = len(out)
-                else:
-                    num_outs = 1
+                def create_artifact():
+                    nonlocal fw_outs
+                    artifact, fw_outs = compile_artifact(flat_tensor_args)
+                    return artifact
 
-                joint_inputs = (flat_tensor_args, out)
-                aot_decompositions = {**aot_autograd_decompositions, **decompositions}
-                with torch.set_grad_enabled(grad_state):
-                    fx_g = make_fx(joint_forward_backward, aot_decompositions)(
-                        *joint_inputs
+                if persistent_cache is None:
+                    artifact = create_artifact()
+                else:
+                    artifact = persistent_cache.get_or_create(
+                        persistent_key, create_artifact
                     )
-                fw_module, bw_module = partition_fn(fx_g, joint_inputs)
+                compiled_fw, compiled_bw, num_outs, loaded_outs = load_artifact(
+                    artifact, flat_tensor_args
+                )
+                if fw_outs is None:
+                    fw_outs = loaded_outs
+                if keep_outputs and fw_outs is not None:
+                    compiled_outs = (list(flat_tensor_args), fw_outs)
+                entry_nbytes = (
+                    graph_nbytes(artifact.get("fw_module"))
+                    + graph_nbytes(artifact.get("bw_module"))
+                    + artifact.get("saved_nbytes", 0)
+                )
 
-                compiled_fw = fw_compiler(fw_module, flat_tensor_args)
-                fw_outs = normalize_as_list(compiled_fw(*flat_tensor_args))
+        @staticmethod
+        def nbytes():
+            """Estimated memory of the graph constants and saved buffers."""
+            return entry_nbytes
 
-                bw_args = fw_outs[num_outs:] + fw_outs[0:num_outs]
-                compiled_bw = bw_compiler(bw_module, bw_args)
-            else:
+        @staticmethod
+        def forward(ctx, *flat_tensor_args):
+            nonlocal compiled_outs
+            CompiledFunction.compile(*flat_tensor_args)
+            fw_outs = None
+            if compiled_outs is not None:
+                args, outs = compiled_outs
+                compiled_outs = None
+                if len(args) == len(flat_tensor_args) and all(
+                    a is b for a, b in zip(args, flat_tensor_args)
+                ):
+                    fw_outs = outs
+            if fw_outs is None:
                 fw_outs = normalize_as_list(compiled_fw(*flat_tensor_args))
             ctx.save_for_backward(*fw_outs[num_outs:])
             return tuple(fw_outs[0:num_outs])
@@ -179,6 +295,85 @@ class _CompileCache(CompileCache):
 
 
 compile_cache = None
+compile_cache_options = {}
+compile_cache_trace_hook = None
+
+
+def _create_compile_cache():
+    cache = CompileCache(**compile_cache_options)
+    cache.set_trace_hook(compile_cache_trace_hook)
+    return cache
+
+
+compile_worker = None
+pending_compilations = set()
+
+
+class PendingCompilation(object):
+    """
+    Entry of the compilation cache whose specialization is compiled by the
+    background worker. ``result`` is the cached entry once it is ready.
+    """
+
+    def __init__(self, future, result):
+        self.future = future
+        self.result = result
+
+    def ready(self):
+        return self.future.done() and self.future.exception() is None
+
+
+def compile_in_background(fn_id, compiled_function, result, flat_tensor_args):
+    """
+    Queues the compilation of ``compiled_function`` for ``flat_tensor_args`` on
+    the background worker. Returns the ``PendingCompilation`` to cache.
+    """
+    global compile_worker
+    if compile_worker is None:
+        compile_worker = ThreadPoolExecutor(
+            max_workers=1, thread_name_prefix="aot_compile"
+        )
+
+    # The worker traces clones, the caller may update its tensors in place,
+    # e.g. the parameters in the optimizer step, while the trace runs. The
+    # clones are queued on the stream of the caller, which the worker waits for.
+    example_args = [
+        arg.detach().clone().requires_grad_(arg.requires_grad)
+        if isinstance(arg, Tensor)
+        else arg
+        for arg in flat_tensor_args
+    ]
+    cloned = None
+    if any(isinstance(arg, Tensor) and arg.is_cuda for arg in example_args):
+        cloned = torch.cuda.Event()
+        cloned.record()
+
+    def compile_fn():
+        start = time.perf_counter()
+        if cloned is not None:
+            cloned.synchronize()
+        try:
+            compiled_function.compile(*example_args, keep_outputs=False)
+        except Exception as e:
+            logger.warning(f"Background compilation failed, running eagerly: {e}")
+            raise
+        if compile_cache is not None:
+            compile_cache.record_compile_time(fn_id, time.perf_counter() - start)
+
+    future = compile_worker.submit(compile_fn)
+    pending_compilations.add(future)
+    future.add_done_callback(pending_compilations.discard)
+    return PendingCompilation(future, result)
+
+
+def wait_for_compilations(timeout: Optional[float] = None):
+    """
+    Blocks until the specializations queued on the background worker are
+    compiled, e.g. at the end of a warm up.
+    """
+    for future in list(pending_compilations):
+        # failed compilations are logged and run eagerly
+        future.exception(timeout=timeout)
 
 
 # Inspired by autodidax (thanks!)
@@ -253,6 +448,55 @@ def rearrange(tensor_args, static_args, static_argnums):
     return args
 
 
+def pad_to_buckets(flat_tensor_args, bucketing, bucket_dims):
+    """
+    Zero pads the bucketed dims of the tensor args up to their bucket. Returns
+    the padded args and the original size of every padded ``(arg, dim)``.
+    """
+    padded_args = []
+    sizes = {}
+    for idx, arg in enumerate(flat_tensor_args):
+        dims = bucket_dims.get(idx, ())
+        if not isinstance(arg, Tensor) or len(dims) == 0:
+            padded_args.append(arg)
+            continue
+
+        padding = [0] * (2 * arg.dim())
+        for dim in dims:
+            if dim >= arg.dim():
+                continue
+            size = arg.size(dim)
+            bucket = bucketing.bucket(size)
+            if bucket == size:
+                continue
+            sizes[(idx, dim)] = size
+            padding[2 * (arg.dim() - dim - 1) + 1] = bucket - size
+
+        if any(padding):
+            arg = torch.nn.functional.pad(arg, padding)
+        padded_args.append(arg)
+    return padded_args, sizes
+
+
+def unpad_from_buckets(flat_outs, sizes, output_dims):
+    """
+    Slices the dims of the outputs back to the original size of the padded arg
+    dims they follow. An item of ``output_dims`` is either ``dim``, for the same
+    dim of the first arg, or ``(dim, arg, arg_dim)``. Dims following an arg dim
+    that was not padded are left alone, even when their size equals a bucket.
+    """
+    outs = []
+    for idx, out in enumerate(flat_outs):
+        if isinstance(out, Tensor):
+            for item in output_dims(idx):
+                dim, arg, arg_dim = (item, 0, item) if isinstance(item, int) else item
+                size = sizes.get((arg, arg_dim))
+                if size is not None and dim < out.dim() and out.size(dim) > size:
+                    out = out.narrow(dim, 0, size)
+        outs.append(out)
+    return tuple(outs)
+
+
 def aot_function(
     fn: Callable,
     fw_compiler: Callable,
@@ -261,6 +505,12 @@ def aot_function(
     decompositions: Dict = {},
     hasher_type: str = "StaticShapeHasher",
     static_argnums: Optional[Tuple[int]] = None,
+    cache_key: Optional[Union[str, Callable[[], str]]] = None,
+    cache_dir: Optional[str] = None,
+    bucket_dims: Optional[Dict[int, Sequence[int]]] = None,
+    bucket_output_dims: Optional[Dict[int, Sequence]] = None,
+    bucket_multiple: int = 0,
+    async_compile: bool = False,
 ) -> Callable:
     """
     Returns a function that behaves like the original :attr:`func`, but
@@ -297,6 +547,31 @@ def aot_function(
             larger Aten ops into simpler or core Aten ops.
         static_argnums (Optional[Tuple[Int]]): An option tuple of ints to mark
             the arguments of the function as static.
+        cache_key (Optional[Union[str, Callable]]): A name of :attr:`fn` that
+            is stable across processes, or a function returning it when a new
+            specialization is compiled. When given, every specialization is
+            also stored in a persistent cache shared by processes and ranks, so
+            it is compiled only once. The name must change whenever :attr:`fn`
+            does.
+        cache_dir (Optional[str]): The directory of the persistent cache.
+            Default: ``TORCH_EXTENSIONS_DIR/compile_cache``
+        bucket_dims (Optional[Dict[int, Sequence[int]]]): With the
+            ``BucketedShapeHasher``, the dims of every flattened tensor arg that
+            are rounded up to a bucket, e.g. ``{0: [1]}`` for the sequence dim
+            of the first arg. Those args are zero padded to the bucket so that
+            one compilation serves every shape of it. The function must not mix
+            values along the padded dims, e.g. elementwise ops.
+        bucket_output_dims (Optional[Dict[int, Sequence]]): The dims of every
+            flattened output sliced back to the size of a padded arg dim,
+            either ``dim`` for the same dim of the first arg or
+            ``(dim, arg, arg_dim)``. Only the arg dims that were padded slice
+            the outputs. Default: the bucketed dims of the first arg for every
+            output.
+        bucket_multiple (int): Buckets are multiples of it, or powers of two
+            when it is 0. Default: 0
+        async_compile (bool): Compile new specializations on a background
+            worker and run :attr:`fn` eagerly until they are ready, instead of
+            stalling the call that first sees a shape. Default: False
     Returns:
         Returns a ``Callable`` that retains the eager behavior of the original
         :attr:`fn`, but with forward and backward graph compiled via
@@ -322,14 +597,35 @@ def aot_function(
     """
     global compile_cache
     if compile_cache is None:
-        compile_cache = CompileCache()
+        compile_cache = _create_compile_cache()
     if bw_compiler is None:
         bw_compiler = fw_compiler
-    cached_res = None
 
     fn_id = id(fn)
     fw_compiler_id = id(fw_compiler)
     bw_compiler_id = id(bw_compiler)
+    # resolve the hasher once instead of parsing its name on every call
+    bucketing = None
+    if hasher_type == "BucketedShapeHasher":
+        if not bucket_dims:
+            raise ValueError("`bucket_dims` is needed by the BucketedShapeHasher.")
+        bucket_dims = {idx: list(dims) for idx, dims in bucket_dims.items()}
+        bucketing = ShapeBucketing(bucket_dims, bucket_multiple)
+        hasher = bucketing
+    else:
+        hasher = int(getattr(HasherType, hasher_type))
+
+    def bucketed_output_dims(idx):
+        if bucket_output_dims is not None:
+            return bucket_output_dims.get(idx, ())
+        return bucket_dims.get(0, ())
+
+    persistent_cache = None
+    if cache_key is not None:
+        persistent_cache = PersistentCompileCache(cache_dir)
+
+    def qualified_name(obj):
+        return f"{getattr(obj, '__module__', None)}.{getattr(obj, '__qualname__', obj)}"
 
     if isinstance(static_argnums, int):
         static_argnums = [static_argnums]
@@ -341,7 +637,8 @@ def aot_function(
 
     def returned_function(*args, **kwargs):
         global compile_cache
-        nonlocal cached_res
+        if compile_cache is None:
+            compile_cache = _create_compile_cache()
 
         # Separate out static args if static_argnums is present
         tensor_args = args
@@ -357,7 +654,8 @@ def aot_function(
         # Now flatten the tensor args
         flat_tensor_args, _ = pytree.tree_flatten((tensor_args, kwargs))
 
-        # Check if the fn is already compiled
+        # Check if the fn is already compiled. The entry is local to the call,
+        # concurrent callers look up their own specializations.
         num_tensor_args = len(flat_tensor_args)
         flat_args_for_cache = flat_tensor_args + static_args_hashed
         cached_res = compile_cache.at(
@@ -365,12 +663,21 @@ def aot_function(
             fw_compiler_id,
             bw_compiler_id,
             num_tensor_args,
-            hasher_type,
+            hasher,
             *flat_args_for_cache,
         )
 
+        # Pad the bucketed dims, the entries are compiled for the buckets
+        run_args = flat_tensor_args
+        if bucketing is not None:
+            run_args, bucket_sizes = pad_to_buckets(
+                flat_tensor_args, bucketing, bucket_dims
+            )
+
         # Compile the function and save it in the cache
+        compile_start = None
         if cached_res is None:
+            compile_start = time.perf_counter()
             # Save the args_spec for flat_tensor_args to unflatten while tracing
             _, tensor_args_spec = pytree.tree_flatten((tensor_args, kwargs))
             out_spec = PytreeThunk()
@@ -394,16 +701,49 @@ def aot_function(
                 out_spec.set(spec)
                 return flat_out
 
+            persistent_key = None
+            if persistent_cache is not None:
+                # ids are only valid in this process, name everything instead
+                persistent_key = (
+                    cache_key() if callable(cache_key) else cache_key,
+                    qualified_name(fw_compiler),
+                    qualified_name(bw_compiler),
+                    qualified_name(partition_fn),
+                    sorted(str(op) for op in decompositions),
+                    torch.is_grad_enabled(),
+                    repr(static_args),
+                    compile_cache.key(
+                        0, 0, 0, num_tensor_args, hasher, *flat_tensor_args
+                    ),
+                )
+
             # goto flat function
-            compiled_fn = create_aot_autograd_function(
+            compiled_function = create_aot_autograd_function(
                 flat_fn,
                 fw_compiler,
                 bw_compiler,
                 partition_fn,
                 decompositions,
                 grad_state=torch.is_grad_enabled(),
-            ).apply
-            cached_res = (compiled_fn, out_spec)
+                persistent_cache=persistent_cache,
+                persistent_key=persistent_key,
+                out_spec=out_spec,
+            )
+            cached_res = (compiled_function.apply, out_spec)
+            if async_compile:
+                compile_start = None
+                cached_res = compile_in_background(
+                    fn_id, compiled_function, cached_res, run_args
+                )
+                # nothing is traced yet, the buffers saved for the backward
+                # are usually on the order of the inputs
+                nbytes = tensors_nbytes(run_args)
+            else:
+                # compiled ahead of the insert to size the entry, the same way
+                # the forward of the function would
+                with torch.no_grad():
+                    compiled_function.compile(*run_args)
+                nbytes = compiled_function.nbytes()
 
             # Save the compiled_fn in the cache
             compile_cache.insert(
@@ -411,13 +751,27 @@ def aot_function(
                 fw_compiler_id,
                 bw_compiler_id,
                 num_tensor_args,
-                hasher_type,
+                hasher,
                 cached_res,
                 *flat_args_for_cache,
+                nbytes=nbytes,
             )
 
+        # Run eagerly while the specialization is compiled in the background
+        if async_compile and isinstance(cached_res, PendingCompilation):
+            if not cached_res.ready():
+                return fn(*args, **kwargs)
+            cached_res = cached_res.result
+
         cached_fn, out_spec = cached_res
-        out = cached_fn(*flat_tensor_args)
+        out = cached_fn(*run_args)
+        if compile_start is not None:
+            # graphs are traced and compiled before the first run
+            compile_cache.record_compile_time(
+                fn_id, time.perf_counter() - compile_start
+            )
+        if bucketing is not None and len(bucket_sizes) > 0:
+            out = unpad_from_buckets(out, bucket_sizes, bucketed_output_dims)
         return out_spec.unflatten(out)
 
     return returned_function
@@ -444,6 +798,86 @@ def clear_compile_cache():
         compile_cache = None
 
 
+def set_compile_cache_options(
+    concurrent: bool = False,
+    num_shards: int = 16,
+    max_entries: int = 0,
+    max_bytes: int = 0,
+    max_entries_per_id: int = 0,
+):
+    """
+    Sets the options of the compilation cache and clears it.
+
+    Args:
+        concurrent (bool): spread the cache over ``num_shards`` locked maps and
+            look functions up without holding the GIL, for aot functions
+            called from several threads.
+        num_shards (int): number of shards of a concurrent cache.
+        max_entries (int): maximum number of compiled specializations, the
+            least recently used ones are evicted beyond it. 0 is unbounded.
+        max_bytes (int): maximum estimated memory of the entries, their graph
+            constants and the buffers they save for the backward. 0 is
+            unbounded.
+        max_entries_per_id (int): maximum number of specializations of a single
+            function. 0 is unbounded.
+    """
+    global compile_cache_options
+    clear_compile_cache()
+    compile_cache_options = {
+        "concurrent": concurrent,
+        "num_shards": num_shards,
+        "max_entries": max_entries,
+        "max_bytes": max_bytes,
+        "max_entries_per_id": max_entries_per_id,
+    }
+
+
+def num_of_evictions():
+    """
+    Returns the number of compiled specializations evicted from the bounded
+    compilation cache since it was created.
+    """
+    global compile_cache
+    if compile_cache is None:
+        return 0
+    return compile_cache.evictions()
+
+
+def compile_cache_stats():
+    """
+    Returns the counters of the compilation cache: hits, misses, inserts,
+    evictions, live entries, seconds spent computing keys and compiling, and
+    the same counters of every function id under ``"functions"``.
+    """
+    global compile_cache
+    if compile_cache is None:
+        return {}
+    return compile_cache.stats()
+
+
+def reset_compile_cache_stats():
+    """
+    Resets the counters of the compilation cache, the entries are kept.
+    """
+    global compile_cache
+    if compile_cache is not None:
+        compile_cache.reset_stats()
+
+
+def set_compile_cache_trace_hook(hook: Optional[Callable] = None):
+    """
+    Sets a callable traced with the events of the compilation cache.
+
+    The hook is called with ``(event, fn_id, key)`` on every ``"hit"``,
+    ``"miss"``, ``"insert"`` and ``"evict"``, and with
+    ``(event, fn_id, seconds)`` on ``"compile"``. None disables it.
+    """
+    global compile_cache_trace_hook
+    compile_cache_trace_hook = hook
+    if compile_cache is not None:
+        compile_cache.set_trace_hook(hook)
+
+
 # Polyfilled from pytorch core while we figure out the `remove_duplicate` issues.
 def _named_members(mod, get_members_fn, prefix="", recurse=True, remove_duplicate=True):
     r"""Helper method for yielding various names + members of modules."""
@@ -493,9 +927,26 @@ def _named_buffers(
 
 
 def aot_module(mod, *args, **kwargs):
+    # The functional call swaps the parameters of the module it runs while it
+    # is traced. Other threads, e.g. the worker of ``async_compile``, run a copy
+    # of their own sharing the parameters and buffers, so that they never race
+    # with the eager calls of the caller on the live module.
+    owner = threading.get_ident()
+    copies = threading.local()
+
+    def module_of_thread():
+        if threading.get_ident() == owner:
+            return mod
+        if not hasattr(copies, "mod"):
+            shared = {id(t): t for t in [*mod.parameters(), *mod.buffers()]}
+            copies.mod = copy.deepcopy(mod, memo=shared)
+        return copies.mod
+
     def functional_call(named_params, named_buffers, *args, **kwargs):
         params_and_buffers = {**named_params, **named_buffers}
-        return _stateless.functional_call(mod, params_and_buffers, args, kwargs)
+        return _stateless.functional_call(
+            module_of_thread(), params_and_buffers, args, kwargs
+        )
 
     compiled_f = aot_function(functional_call, *args, **kwargs)
 
@@ -6,3 +6,5 @@ if _bindend is None:
     _bindend = CompilingBinder().bind()
 
 CompileCache = _bindend.CompileCache
+HasherType = _bindend.HasherType
+ShapeBucketing = _bindend.ShapeBucketing
@@ -260,10 +260,18 @@ def print_compile(fx_g, _):
     return fx_g
 
 
-def memory_efficient_fusion(fn, static_argnums=None, min_cut_rematerialization=False):
+def memory_efficient_fusion(
+    fn,
+    static_argnums=None,
+    min_cut_rematerialization=False,
+    cache_key=None,
+    async_compile=False,
+):
     """
     Recomputes the fwd pass in the bwd pass to perform memory efficient fusion.
-    Uses NVFuser as the backend compiler.
+    Uses NVFuser as the backend compiler. With a ``cache_key`` the compiled
+    graphs are shared with other processes through the persistent cache. With
+    ``async_compile`` new shapes run eagerly while they are compiled.
     """
 
     if min_cut_rematerialization:
@@ -278,6 +286,8 @@ def memory_efficient_fusion(fn, static_argnums=None, min_cut_rematerialization=F
         "hasher_type": "StaticShapeHasher",
         "decompositions": default_decompositions,
         "static_argnums": static_argnums,
+        "cache_key": cache_key,
+        "async_compile": async_compile,
     }
     if isinstance(fn, torch.nn.Module):
         return aot_module(fn, **config)
@@ -1,3 +1,4 @@
+import hashlib
 import inspect
 from copy import deepcopy
 from logging import getLogger
@@ -5,6 +6,7 @@ from logging import getLogger
 import torch
 import torch.distributed as dist
 
+from oslo.__version__ import version as oslo_version
 from oslo.pytorch.kernel_fusion.mem_efficient.compilers import (
     default_decompositions,
     memory_efficient_fusion,
@@ -14,6 +16,9 @@ from oslo.pytorch.kernel_fusion.mem_efficient.model_output import OutputManager
 from oslo.pytorch.kernel_fusion.mem_efficient.partitioners import (
     min_cut_rematerialization_partition,
 )
+from oslo.pytorch.kernel_fusion.mem_efficient.persistent_cache import (
+    transformers_version,
+)
 
 logger = getLogger(__name__)
 
@@ -44,8 +49,9 @@ def is_iterable(elem):
 class MemoryEfficientFusionEngine(object):
     __compiling_info_cache__ = []
 
-    def __init__(self, model):
+    def __init__(self, model, async_compile=False):
         self.model = model
+        self.async_compile = async_compile
 
     def fuse(self):
         OutputManager(self.model).register_model_output_classes()
@@ -53,6 +59,20 @@ class MemoryEfficientFusionEngine(object):
         return memory_efficient_fusion(
             self.model,
             min_cut_rematerialization=True,
+            cache_key=self.cache_key,
+            async_compile=self.async_compile,
+        )
+
+    def cache_key(self):
+        # the traced graphs only depend on the model class and its code, its
+        # config and whether dropout is active.
+        config = self.model.config.to_json_string(use_diff=False)
+        digest = hashlib.sha256(config.encode("utf-8")).hexdigest()
+        model_class = self.model.__class__
+        return (
+            f"{model_class.__module__}.{model_class.__qualname__}:"
+            f"oslo={oslo_version}:transformers={transformers_version()}:"
+            f"{digest}:training={self.model.training}"
         )
 
     @staticmethod
@@ -0,0 +1,204 @@
+import hashlib
+import inspect
+import io
+import os
+import socket
+import threading
+import time
+from logging import getLogger
+
+import torch
+
+from oslo.__version__ import version as oslo_version
+from oslo.pytorch._C import DEFAULT_TORCH_EXTENSION_PATH
+
+logger = getLogger(__name__)
+
+# Bump when the layout of the stored artifacts changes.
+CACHE_FORMAT_VERSION = 2
+
+_TORCH_LOAD_KWARGS = (
+    {"weights_only": False}
+    if "weights_only" in inspect.signature(torch.load).parameters
+    else {}
+)
+
+
+def default_cache_dir():
+    ext_path = os.environ.get("TORCH_EXTENSIONS_DIR", DEFAULT_TORCH_EXTENSION_PATH)
+    return os.path.join(ext_path, "compile_cache")
+
+
+def transformers_version():
+    try:
+        import transformers
+    except ImportError:
+        return "none"
+    return transformers.__version__
+
+
+def version_tag():
+    """
+    Name of the directory holding the artifacts of this environment. Entries
+    compiled with another oslo, transformers, torch, CUDA or device
+    architecture are never read.
+    """
+    cuda = torch.version.cuda if torch.version.cuda is not None else "none"
+    arch = "none"
+    if torch.cuda.is_available():
+        major, minor = torch.cuda.get_device_capability()
+        arch = f"{major}{minor}"
+    return (
+        f"v{CACHE_FORMAT_VERSION}-oslo{oslo_version}"
+        f"-transformers{transformers_version()}"
+        f"-torch{torch.__version__}-cuda{cuda}-sm{arch}"
+    )
+
+
+def _lock_owner():
+    return f"{socket.gethostname()}:{os.getpid()}"
+
+
+def _owner_alive(owner):
+    """
+    Whether the process owning a lock is alive, None when it can not be told,
+    e.g. for a process of another host.
+    """
+    host, _, pid = owner.rpartition(":")
+    if host != socket.gethostname() or not pid.isdigit():
+        return None
+    try:
+        os.kill(int(pid), 0)
+    except ProcessLookupError:
+        return False
+    except PermissionError:
+        return True
+    return True
+
+
+def _save_compiled(compiled):
+    # Only TorchScript can outlive the process, other compiled functions are
+    # compiled again from the stored graphs.
+    if not isinstance(compiled, torch.jit.ScriptModule):
+        return None
+    try:
+        buffer = io.BytesIO()
+        torch.jit.save(compiled, buffer)
+        return buffer.getvalue()
+    except Exception:
+        return None
+
+
+class PersistentCompileCache(object):
+    """
+    Content-addressed directory of compiled ``aot_function`` specializations
+    shared by every process and rank of the machine or file system.
+
+    One process compiles a missing key while holding its lock file, the others
+    wait for the artifact and read it. The artifacts are written to a temporary
+    file and renamed, so that a reader never sees a partial entry.
+
+    Args:
+        root (str): cache directory, ``TORCH_EXTENSIONS_DIR/compile_cache`` by
+            default
+        timeout (float): seconds after which the lock of a key is considered
+            stale when its owner runs on another host. The lock of a dead
+            process of this host is broken right away, the one of a live
+            process never.
+        poll_interval (float): seconds between checks of a waiting process
+    """
+
+    def __init__(self, root=None, timeout=600.0, poll_interval=0.1):
+        if root is None:
+            root = default_cache_dir()
+        self.root = os.path.join(root, version_tag())
+        self.timeout = timeout
+        self.poll_interval = poll_interval
+
+    def path(self, key):
+        digest = hashlib.sha256(repr(key).encode("utf-8")).hexdigest()
+        return os.path.join(self.root, digest[:2], f"{digest}.pt")
+
+    def load(self, key):
+        path = self.path(key)
+        if not os.path.exists(path):
+            return None
+        try:
+            artifact = torch.load(path, **_TORCH_LOAD_KWARGS)
+        except Exception as e:
+            logger.warning(f"Ignoring unreadable compile cache entry {path}: {e}")
+            return None
+
+        # a full hash collision check, the digest only names the file
+        if artifact.get("key") != repr(key):
+            return None
+        for name in ("compiled_fw", "compiled_bw"):
+            if artifact.get(name) is not None:
+                artifact[name] = torch.jit.load(io.BytesIO(artifact[name]))
+        return artifact
+
+    def save(self, key, artifact):
+        path = self.path(key)
+        stored = dict(artifact)
+        stored["key"] = repr(key)
+        stored["compiled_fw"] = _save_compiled(artifact.get("compiled_fw"))
+        stored["compiled_bw"] = _save_compiled(artifact.get("compiled_bw"))
+
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        tmp_path = f"{path}.{os.getpid()}.{threading.get_ident()}.tmp"
+        try:
+            torch.save(stored, tmp_path)
+            # readers never see a partially written entry
+            os.replace(tmp_path, path)
+        except Exception as e:
+            logger.warning(f"Could not store compile cache entry {path}: {e}")
+            if os.path.exists(tmp_path):
+                os.remove(tmp_path)
+
+    def is_stale(self, lock_path):
+        with open(lock_path, "r") as lock_file:
+            alive = _owner_alive(lock_file.read())
+        if alive is not None:
+            return not alive
+        return time.time() - os.path.getmtime(lock_path) > self.timeout
+
+    def get_or_create(self, key, create_fn):
+        """
+        Returns the artifact of ``key``, calling ``create_fn`` to compile and
+        store it when no other process has done it yet.
+        """
+        artifact = self.load(key)
+        if artifact is not None:
+            return artifact
+
+        lock_path = f"{self.path(key)}.lock"
+        os.makedirs(os.path.dirname(lock_path), exist_ok=True)
+        while True:
+            try:
+                fd = os.open(lock_path, os.O_CREAT | os.O_EXCL | os.O_WRONLY)
+            except FileExistsError:
+                # another process is compiling this key
+                artifact = self.load(key)
+                if artifact is not None:
+                    return artifact
+                try:
+                    if self.is_stale(lock_path):
+                        os.remove(lock_path)
+                except FileNotFoundError:
+                    pass
+                time.sleep(self.poll_interval)
+                continue
+
+            try:
+                os.write(fd, _lock_owner().encode("utf-8"))
+                artifact = self.load(key)
+                if artifact is None:
+                    artifact = create_fn()
+                    self.save(key, artifact)
+                return artifact
+            finally:
+                os.close(fd)
+                try:
+                    os.remove(lock_path)
+                except FileNotFoundError:
+                    pass
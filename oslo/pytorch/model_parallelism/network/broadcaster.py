@@ -1,9 +1,22 @@
+import struct
+
 import torch
 import torch.distributed as dist
 from torch import Tensor
 
 NoneType = type(None)
 
+# header of a packed message:
+# (magic, is_new_structure, generation, structure_id, structure_bytes,
+#  value_bytes)
+PACKED_HEADER = struct.Struct("<4sBIIII")
+PACKED_MAGIC = b"OSLB"
+# messages up to this size are sent in a single broadcast
+PACKED_CAPACITY = 4096
+# structures remembered per (group, src), the cache restarts beyond it
+# with the next generation
+PACKED_CACHE_SIZE = 64
+
 
 class Broadcaster(object):
     """
@@ -49,6 +62,13 @@ class Broadcaster(object):
             dtype: idx for idx, dtype in enumerate(self.TORCH_ID_TO_DTYPE)
         }
 
+        # packed structures by (group, src), see ``send_packed``
+        self._send_cache = {}
+        self._recv_cache = {}
+        self._send_generation = {}
+        self._recv_generation = {}
+        self._packed_buffer = None
+
     def send(self, value, group, src=0):
         _type = type(value)
         assert _type in self.ID_TO_DTYPE, f"unsupported type: {_type}"
@@ -335,3 +355,241 @@ class Broadcaster(object):
             output_dict[_key_recv] = _val_recv
 
         return output_dict
+
+    # Packed path
+
+    def send_packed(self, value, group, src=0):
+        """
+        Sends a nested structure of the supported types in a single broadcast,
+        plus one broadcast of the data of its tensors per dtype.
+
+        The structure (containers, strings, types, sizes and the dtypes and
+        shapes of the tensors) is encoded apart from the scalar values. The
+        ranks remember the structures they have exchanged on a (group, src),
+        so a structure sent again is only compared on the sender and just
+        referenced by its id in the message. Each restart of the sender cache
+        starts a new generation, and an id is only resolved in the generation
+        it was sent in.
+        """
+        structure, values, tensors = bytearray(), bytearray(), []
+        self._pack(value, structure, values, tensors)
+        structure = bytes(structure)
+
+        key = (group, src)
+        cache = self._send_cache.setdefault(key, {})
+        structure_id = cache.get(structure)
+        is_new = structure_id is None
+        if is_new:
+            if len(cache) >= PACKED_CACHE_SIZE:
+                cache.clear()
+                self._send_generation[key] = self._send_generation.get(key, 0) + 1
+            structure_id = len(cache)
+            cache[structure] = structure_id
+
+        message = bytearray(
+            PACKED_HEADER.pack(
+                PACKED_MAGIC,
+                1 if is_new else 0,
+                self._send_generation.get(key, 0),
+                structure_id,
+                len(structure) if is_new else 0,
+                len(values),
+            )
+        )
+        if is_new:
+            message += structure
+        message += values
+        self._broadcast_message(message, group, src)
+        self._broadcast_tensor_data(tensors, group, src, recv=False)
+
+    def recv_packed(self, group, src=0):
+        """Receives a structure sent by ``send_packed``."""
+        message = self._broadcast_message(None, group, src)
+        header = PACKED_HEADER.unpack_from(message)
+        magic, is_new, generation, structure_id, structure_len, _ = header
+        assert magic == PACKED_MAGIC, "received a corrupted packed message."
+
+        offset = PACKED_HEADER.size
+        key = (group, src)
+        cache = self._recv_cache.setdefault(key, {})
+        if generation != self._recv_generation.get(key, 0):
+            # the sender restarted its cache, the ids of the old one are gone
+            assert is_new, (
+                f"packed structure {structure_id} of generation {generation} "
+                f"was never received."
+            )
+            cache.clear()
+            self._recv_generation[key] = generation
+        if is_new:
+            cache[structure_id] = message[offset : offset + structure_len]
+            offset += structure_len
+        assert structure_id in cache, (
+            f"packed structure {structure_id} of generation {generation} "
+            f"was never received."
+        )
+        structure = cache[structure_id]
+
+        tensors = []
+        value, _, _ = self._unpack(structure, 0, message, offset, tensors)
+        self._broadcast_tensor_data(tensors, group, src, recv=True)
+        return value
+
+    def _broadcast_message(self, message, group, src):
+        if self._packed_buffer is None:
+            self._packed_buffer = torch.empty(
+                PACKED_CAPACITY, dtype=torch.uint8, device=self.device
+            )
+        buffer = self._packed_buffer
+
+        if message is not None:
+            size = len(message)
+            message = torch.frombuffer(message, dtype=torch.uint8)
+            head = min(size, PACKED_CAPACITY)
+            buffer[:head].copy_(message[:head])
+            dist.broadcast(buffer, group=group, src=src)
+            if size > PACKED_CAPACITY:
+                tail = message[PACKED_CAPACITY:].to(self.device)
+                dist.broadcast(tail, group=group, src=src)
+            return None
+
+        dist.broadcast(buffer, group=group, src=src)
+        message = buffer.cpu().numpy().tobytes()
+        header = PACKED_HEADER.unpack_from(message)
+        structure_len, values_len = header[-2:]
+        size = PACKED_HEADER.size + structure_len + values_len
+        if size > PACKED_CAPACITY:
+            tail = torch.empty(
+                size - PACKED_CAPACITY, dtype=torch.uint8, device=self.device
+            )
+            dist.broadcast(tail, group=group, src=src)
+            message += tail.cpu().numpy().tobytes()
+        return message[:size]
+
+    @torch.no_grad()
+    def _broadcast_tensor_data(self, tensors, group, src, recv):
+        # the tensors of a dtype are sent as a single flat buffer
+        by_dtype = {}
+        for tensor in tensors:
+            by_dtype.setdefault(tensor.dtype, []).append(tensor)
+
+        for dtype, items in by_dtype.items():
+            if sum(item.numel() for item in items) == 0:
+                continue
+            if len(items) == 1:
+                dist.broadcast(items[0], group=group, src=src)
+                continue
+            if recv:
+                flat = torch.empty(
+                    sum(item.numel() for item in items),
+                    dtype=dtype,
+                    device=self.device,
+                )
+            else:
+                flat = torch.cat([item.view(-1) for item in items])
+            dist.broadcast(flat, group=group, src=src)
+            if recv:
+                # split the buffer back into the tensors
+                offset = 0
+                for item in items:
+                    item.view(-1).copy_(flat[offset : offset + item.numel()])
+                    offset += item.numel()
+
+    def _pack(self, value, structure, values, tensors):
+        _type = type(value)
+        assert _type in self.ID_TO_DTYPE, f"unsupported type: {_type}"
+        structure.append(self.DTYPE_TO_ID[_type])
+
+        if _type is bool:
+            values += struct.pack("<?", value)
+        elif _type is int:
+            values += struct.pack("<q", value)
+        elif _type is float:
+            values += struct.pack("<d", value)
+        elif _type is complex:
+            values += struct.pack("<dd", value.real, value.imag)
+        elif _type is str:
+            encoded = value.encode("utf-8")
+            structure += struct.pack("<I", len(encoded))
+            structure += encoded
+        elif _type is type:
+            assert value in self.DTYPE_TO_ID, f"unsupported type: {value}"
+            structure.append(self.DTYPE_TO_ID[value])
+        elif _type in (list, tuple, set):
+            structure += struct.pack("<I", len(value))
+            for item in value:
+                self._pack(item, structure, values, tensors)
+        elif _type is dict:
+            structure += struct.pack("<I", len(value))
+            for key, val in value.items():
+                self._pack(key, structure, values, tensors)
+                self._pack(val, structure, values, tensors)
+        elif _type is torch.Size:
+            structure += struct.pack(f"<I{len(value)}q", len(value), *value)
+        elif _type is Tensor:
+            structure += struct.pack(
+                f"<BBI{value.dim()}q",
+                self.TORCH_DTYPE_TO_ID[value.dtype],
+                1 if value.requires_grad else 0,
+                value.dim(),
+                *value.size(),
+            )
+            if value.dtype == torch.bool:
+                value = value.to(torch.uint8)
+            tensors.append(value.detach().contiguous().to(self.device))
+
+    def _unpack(self, structure, s_off, values, v_off, tensors):
+        _type = self.ID_TO_DTYPE[structure[s_off]]
+        s_off += 1
+
+        if _type is NoneType:
+            return None, s_off, v_off
+        if _type is bool:
+            return struct.unpack_from("<?", values, v_off)[0], s_off, v_off + 1
+        if _type is int:
+            return struct.unpack_from("<q", values, v_off)[0], s_off, v_off + 8
+        if _type is float:
+            return struct.unpack_from("<d", values, v_off)[0], s_off, v_off + 8
+        if _type is complex:
+            real, imag = struct.unpack_from("<dd", values, v_off)
+            return complex(real, imag), s_off, v_off + 16
+        if _type is str:
+            (length,) = struct.unpack_from("<I", structure, s_off)
+            s_off += 4
+            _str = bytes(structure[s_off : s_off + length]).decode("utf-8")
+            return _str, s_off + length, v_off
+        if _type is type:
+            return self.ID_TO_DTYPE[structure[s_off]], s_off + 1, v_off
+        if _type in (list, tuple, set, dict):
+            (length,) = struct.unpack_from("<I", structure, s_off)
+            s_off += 4
+            items = []
+            for _ in range(length * 2 if _type is dict else length):
+                item, s_off, v_off = self._unpack(
+                    structure, s_off, values, v_off, tensors
+                )
+                items.append(item)
+            if _type is dict:
+                return dict(zip(items[0::2], items[1::2])), s_off, v_off
+            return _type(items), s_off, v_off
+        if _type is torch.Size:
+            (length,) = struct.unpack_from("<I", structure, s_off)
+            size = struct.unpack_from(f"<{length}q", structure, s_off + 4)
+            return torch.Size(size), s_off + 4 + 8 * length, v_off
+
+        # ``torch.Tensor``
+        dtype_id, requires_grad, ndims = struct.unpack_from("<BBI", structure, s_off)
+        s_off += 6
+        shape = struct.unpack_from(f"<{ndims}q", structure, s_off)
+        s_off += 8 * ndims
+
+        dtype = self.TORCH_ID_TO_DTYPE[dtype_id]
+        recv_dtype = torch.uint8 if dtype == torch.bool else dtype
+        recv_tensor = torch.empty(shape, dtype=recv_dtype, device=self.device)
+        tensors.append(recv_tensor)
+        if dtype == torch.bool:
+            # shares the storage filled by the broadcast of the tensor data
+            return recv_tensor.view(torch.bool), s_off, v_off
+        recv_tensor.requires_grad = (
+            requires_grad == 1 and recv_tensor.is_floating_point()
+        )
+        return recv_tensor, s_off, v_off
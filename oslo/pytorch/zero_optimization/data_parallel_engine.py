@@ -0,0 +1,364 @@
+from contextlib import contextmanager
+from functools import partial
+
+import torch
+import torch.distributed as dist
+from torch.autograd import Variable
+
+
+def reduce_scatter_tensor(output, inputs, group, async_op):
+    if hasattr(dist, "reduce_scatter_tensor"):
+        reduce_scatter = dist.reduce_scatter_tensor
+    else:
+        reduce_scatter = dist._reduce_scatter_base
+    return reduce_scatter(output, inputs, group=group, async_op=async_op)
+
+
+class GradientBucket(object):
+    """
+    Gradients of several parameters, flattened into a slice of a reusable
+    arena and reduced by a single collective.
+    """
+
+    def __init__(self, params, indices, dtype, device, alignment):
+        self.params = params
+        self.indices = indices
+        self.offsets = []
+        numel = 0
+        for param in params:
+            self.offsets.append(numel)
+            numel += param.numel()
+        # reduce scatter needs a multiple of the world size
+        self.numel = (numel + alignment - 1) // alignment * alignment
+        self.arena = torch.zeros(self.numel, dtype=dtype, device=device)
+        self.shard = None
+        self.num_ready = 0
+        self.work = None
+
+    def view(self, i):
+        param = self.params[i]
+        return self.arena.narrow(0, self.offsets[i], param.numel()).view_as(param)
+
+
+class DataParallelEngine(object):
+    """
+    Data parallel engine with bucketed and overlapped gradient reduction.
+
+    The gradients are flattened into the arenas of buckets in the order the
+    backward produces them, and every bucket is all-reduced (or
+    reduce-scattered) over the data parallel group of ``mpu`` on a side stream
+    as soon as its last gradient is ready. The tensor and pipeline parallel
+    ranks hold different parameters, so their gradients are never reduced
+    together.
+
+    After the backward the gradients of the parameters are views of the
+    arenas, so that the next backward accumulates into them in place. A
+    parameter unused by this rank gets the gradient reduced from the others,
+    and like ``DistributedDataParallel`` the gradient of a parameter no rank
+    used is left as it was, None after ``zero_grad``. With
+    ``reduce_scatter`` every rank only gets the reduced shard of every bucket,
+    see ``grad_shards``, and the gradients of the parameters are released.
+    This is the basis of ZeRO stage 1 and 2.
+
+    Args:
+        model (nn.Module): model whose gradients are reduced
+        mpu (MPU): model parallel unit, the whole world is data parallel if None
+        bucket_size (int): bytes of the gradients of a bucket
+        reduce_scatter (bool): reduce scatter the buckets instead of all-reducing
+        average (bool): average the gradients instead of summing them
+        check_overflow (bool): check the gradients for inf and nan while they
+            are flattened, see ``found_inf``
+        fused (bool): flatten, unscale and check the gradients with the native
+            kernel of oslo
+
+    Notes:
+        The order of the gradients is only known after the first backward, so
+        the buckets are rebuilt once before the second one, in the order of
+        rank 0.
+        The buckets are finalized at the end of the outermost backward, which
+        does not work with reentrant activation checkpointing.
+
+    Examples:
+        >>> engine = DataParallelEngine(model, model.mpu, check_overflow=True)
+        >>> engine.parallelize()
+        >>> engine.inv_scale = 1.0 / loss_scale  # float32 CUDA tensor
+        >>> (model(**inputs).loss * loss_scale).backward()
+        >>> if not engine.found_inf.item():
+        ...     optimizer.step()
+    """
+
+    def __init__(
+        self,
+        model,
+        mpu=None,
+        bucket_size=25 * 1024 * 1024,
+        reduce_scatter=False,
+        average=True,
+        check_overflow=False,
+        fused=True,
+    ):
+        self.model = model
+        self.mpu = mpu
+        self.bucket_size = bucket_size
+        self.reduce_scatter = reduce_scatter
+        self.average = average
+        self.check_overflow = check_overflow
+        self.fused = fused
+        self.group = mpu.get_data_parallel_group() if mpu is not None else None
+        self.world_size = dist.get_world_size(self.group)
+        self.rank = dist.get_rank(self.group)
+
+        self.inv_scale = None
+        self.found_inf = None
+        self.params = []
+        self.buckets = []
+        self.locations = {}
+        self.comm_stream = None
+        self.kernels = None
+
+        self._grad_accs = []
+        self._require_sync = True
+        self._callback_queued = False
+        self._next_bucket = 0
+        self._ready = set()
+        self._ready_order = []
+        self._rebuilt = False
+
+    def parallelize(self):
+        self.params = [p for p in self.model.parameters() if p.requires_grad]
+        assert len(self.params) > 0, "the model has no parameter requiring grad."
+        device = self.params[0].device
+        if device.type == "cuda":
+            self.comm_stream = torch.cuda.Stream(device)
+            if self.fused:
+                from oslo.pytorch.kernel_fusion.cuda import CUDA
+
+                self.kernels = CUDA
+        self.found_inf = torch.zeros(1, dtype=torch.float32, device=device)
+
+        for index, param in enumerate(self.params):
+            # the hook of the node accumulating the gradient runs after it
+            grad_acc = param.expand_as(param).grad_fn.next_functions[0][0]
+            grad_acc.register_hook(partial(self._mark_ready, index))
+            self._grad_accs.append(grad_acc)
+
+        # the backward produces the gradients roughly in the reverse order
+        self._build_buckets(list(reversed(range(len(self.params)))))
+        return self
+
+    @contextmanager
+    def no_sync(self):
+        """Accumulates the gradients locally, e.g. for gradient accumulation."""
+        require_sync = self._require_sync
+        self._require_sync = False
+        try:
+            yield
+        finally:
+            self._require_sync = require_sync
+
+    def grad_shards(self):
+        """
+        Returns the reduced shards of the buckets with ``reduce_scatter``, as
+        a list of (shard, segments) where every segment
+        (param, param_offset, shard_offset, numel) maps a part of the shard to
+        the flattened gradient of a parameter.
+        """
+        assert self.reduce_scatter, "only available with ``reduce_scatter``."
+        shards = []
+        for bucket in self.buckets:
+            begin = self.rank * bucket.shard.numel()
+            end = begin + bucket.shard.numel()
+            segments = []
+            for param, offset in zip(bucket.params, bucket.offsets):
+                lo, hi = max(offset, begin), min(offset + param.numel(), end)
+                if lo < hi:
+                    segments.append((param, lo - offset, lo - begin, hi - lo))
+            shards.append((bucket.shard, segments))
+        return shards
+
+    def _build_buckets(self, order):
+        alignment = self.world_size if self.reduce_scatter else 1
+        buckets, opened = [], {}
+
+        def close(key):
+            params, indices, _ = opened.pop(key)
+            bucket = GradientBucket(params, indices, key[0], key[1], alignment)
+            buckets.append(bucket)
+
+        for index in order:
+            param = self.params[index]
+            key = (param.dtype, param.device)
+            params, indices, size = opened.setdefault(key, ([], [], [0]))
+            params.append(param)
+            indices.append(index)
+            size[0] += param.numel() * param.element_size()
+            if size[0] >= self.bucket_size:
+                close(key)
+        for key in list(opened.keys()):
+            close(key)
+
+        # buckets are reduced in this order on every rank
+        self.buckets = buckets
+        self.locations = {}
+        for bucket in buckets:
+            for i, index in enumerate(bucket.indices):
+                self.locations[index] = (bucket, i)
+            if self.reduce_scatter:
+                bucket.shard = bucket.arena.new_zeros(bucket.numel // self.world_size)
+
+    def _rebuild_buckets(self):
+        order = list(self._ready_order)
+        seen = set(order)
+        order += [i for i in reversed(range(len(self.params))) if i not in seen]
+        order = torch.tensor(order, dtype=torch.long, device=self.found_inf.device)
+        # every rank takes the order of rank 0 of the group
+        if self.rank != 0:
+            order.zero_()
+        dist.all_reduce(order, group=self.group)
+
+        buckets = self.buckets
+        self._build_buckets(order.tolist())
+        # move the gradients still held by the old arenas into the new ones
+        for bucket in buckets:
+            for i, param in enumerate(bucket.params):
+                view = bucket.view(i)
+                if param.grad is not None and param.grad.data_ptr() == view.data_ptr():
+                    new_bucket, j = self.locations[bucket.indices[i]]
+                    new_view = new_bucket.view(j)
+                    new_view.copy_(view)
+                    param.grad = new_view
+        self._rebuilt = True
+
+    def _mark_ready(self, index, *unused):
+        if not self._require_sync or index in self._ready:
+            return
+        if not self._callback_queued:
+            # rebuilt from the order of the first backward, before this one
+            # reduces any bucket
+            if not self._rebuilt and len(self._ready_order) > 0:
+                self._rebuild_buckets()
+            Variable._execution_engine.queue_callback(self._finalize)
+            self._callback_queued = True
+        self._ready.add(index)
+        if not self._rebuilt:
+            self._ready_order.append(index)
+
+        bucket, _ = self.locations[index]
+        bucket.num_ready += 1
+        # collectives have to be launched in the same order on every rank
+        while self._next_bucket < len(self.buckets):
+            bucket = self.buckets[self._next_bucket]
+            if bucket.num_ready < len(bucket.params):
+                break
+            self._launch(bucket)
+
+    def _launch(self, bucket):
+        first = self._next_bucket == 0
+        self._next_bucket += 1
+        if self.comm_stream is None:
+            self._reduce(bucket, first)
+            return
+        self.comm_stream.wait_stream(torch.cuda.current_stream())
+        with torch.cuda.stream(self.comm_stream):
+            self._reduce(bucket, first)
+
+    def _reduce(self, bucket, first):
+        if first:
+            self.found_inf.zero_()
+        grads, offsets = [], []
+        for i, param in enumerate(bucket.params):
+            if param.grad is None:
+                bucket.view(i).zero_()
+                continue
+            grad = param.grad
+            if grad.is_cuda:
+                grad.record_stream(torch.cuda.current_stream())
+            grads.append(grad.contiguous())
+            offsets.append(bucket.offsets[i])
+        self._flatten(bucket, grads, offsets)
+
+        if self.reduce_scatter:
+            # the gradients only live in the shards from now on
+            for param in bucket.params:
+                param.grad = None
+            bucket.work = reduce_scatter_tensor(
+                bucket.shard, bucket.arena, group=self.group, async_op=True
+            )
+        else:
+            bucket.work = dist.all_reduce(bucket.arena, group=self.group, async_op=True)
+
+    def _flatten(self, bucket, grads, offsets):
+        factor = 1.0 / self.world_size if self.average else 1.0
+        inv_scale = self.inv_scale
+        if self.kernels is not None:
+            empty = bucket.arena.new_empty(0, dtype=torch.float32)
+            self.kernels.flatten_unscale(
+                grads,
+                offsets,
+                bucket.arena,
+                self.found_inf if self.check_overflow else empty,
+                inv_scale if inv_scale is not None else empty,
+                factor,
+            )
+            return
+
+        for grad, offset in zip(grads, offsets):
+            view = bucket.arena.narrow(0, offset, grad.numel())
+            if view.data_ptr() != grad.data_ptr():
+                view.copy_(grad.view(-1))
+        if inv_scale is not None:
+            bucket.arena.mul_(inv_scale * factor)
+        elif factor != 1.0:
+            bucket.arena.mul_(factor)
+        if self.check_overflow:
+            overflow = (~torch.isfinite(bucket.arena)).any().float()
+            self.found_inf.copy_(torch.max(self.found_inf, overflow))
+
+    def _finalize(self):
+        # the buckets of the parameters not used by this backward
+        for bucket in self.buckets[self._next_bucket :]:
+            self._launch(bucket)
+
+        for bucket in self.buckets:
+            bucket.work.wait()
+            bucket.work = None
+            bucket.num_ready = 0
+        if self.comm_stream is not None:
+            torch.cuda.current_stream().wait_stream(self.comm_stream)
+
+        # the overflow flag and which parameters any rank used, in one
+        # collective over the data parallel group
+        flags = []
+        if self.check_overflow:
+            flags.append(self.found_inf)
+        if not self.reduce_scatter:
+            used = torch.zeros_like(self.found_inf).repeat(len(self.params))
+            used[list(self._ready)] = 1.0
+            flags.append(used)
+        if len(flags) > 0:
+            flags = torch.cat(flags)
+            dist.all_reduce(flags, op=dist.ReduceOp.MAX, group=self.group)
+        if self.check_overflow:
+            self.found_inf.copy_(flags[:1])
+            if self.mpu is not None and self.mpu.get_model_parallel_world_size() > 1:
+                # the model parallel ranks step together too
+                dist.all_reduce(
+                    self.found_inf,
+                    op=dist.ReduceOp.MAX,
+                    group=self.mpu.get_model_parallel_group(),
+                )
+
+        if not self.reduce_scatter:
+            used = flags[1:] if self.check_overflow else flags
+            used = used.bool().tolist()
+            for bucket in self.buckets:
+                for i, param in enumerate(bucket.params):
+                    if not used[bucket.indices[i]]:
+                        continue
+                    view = bucket.view(i)
+                    if param.grad is None or param.grad.data_ptr() != view.data_ptr():
+                        param.grad = view
+
+        self._callback_queued = False
+        self._next_bucket = 0
+        self._ready.clear()
@@ -1,5 +1,7 @@
 # Copyright 2021 TUNiB Inc.
 
+import importlib.util
+import os
 
 from setuptools import find_packages, setup
 
@@ -11,6 +13,51 @@ with open("oslo/__version__.py", "r") as version_file:
 with open("requirements.txt", "r") as requirements_file:
     INSTALL_REQUIRES = requirements_file.read().splitlines()
 
+
+def prebuilt_extensions():
+    """
+    Extensions built ahead of time with ``OSLO_BUILD_EXTENSIONS=1`` for the
+    architectures of ``OSLO_CUDA_ARCH_LIST``, so that no node compiles them on
+    first use. The binders fall back to JIT compilation when they do not match.
+    """
+    if os.environ.get("OSLO_BUILD_EXTENSIONS", "0") != "1":
+        return [], {}
+
+    import torch
+    from torch.utils.cpp_extension import BuildExtension
+
+    # load the binders without importing oslo and its dependencies
+    spec = importlib.util.spec_from_file_location(
+        "oslo_binders", os.path.join("oslo", "pytorch", "_C", "__init__.py")
+    )
+    binders = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(binders)
+
+    arch_list = os.environ.get("OSLO_CUDA_ARCH_LIST", binders.DEFAULT_CUDA_ARCH_LIST)
+    if torch.version.cuda is not None:
+        # e.g. sm_90 needs CUDA 11.8, older toolkits build the rest
+        arch_list = binders.supported_cuda_arch_list(
+            arch_list, binders.get_cuda_version()
+        )
+    base_path = os.path.join("oslo", "pytorch", "_C", "csrc")
+    ext_modules = [binders.CompilingBinder().extension(base_path)]
+    if torch.version.cuda is not None:
+        ext_modules.append(binders.CUDABinder().extension(base_path, arch_list))
+        ext_modules.append(
+            binders.CheckpointBinder().extension(base_path, arch_list)
+        )
+
+    # read by the binders to check that the prebuilt modules match
+    with open(os.path.join("oslo", "pytorch", "_C", "_build_config.py"), "w") as f:
+        f.write(f"TORCH_VERSION = {str(torch.__version__)!r}\n")
+        f.write(f"CUDA_VERSION = {torch.version.cuda!r}\n")
+        f.write(f"CUDA_ARCH_LIST = {arch_list!r}\n")
+
+    return ext_modules, {"build_ext": BuildExtension}
+
+
+EXT_MODULES, CMDCLASS = prebuilt_extensions()
+
 setup(
     name="oslo-core",
     description="OSLO: Open Source framework for Large-scale transformer Optimization",
@@ -37,6 +84,8 @@ setup(
     ],
     package_data={},
     dependency_links=[],
+    ext_modules=EXT_MODULES,
+    cmdclass=CMDCLASS,
     include_package_data=True,
     zip_safe=False,
 )
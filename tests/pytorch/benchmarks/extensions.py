@@ -0,0 +1,398 @@
+"""
+Microbenchmarks of the native extension ops.
+
+Every case is timed with CUDA events and reported as the achieved memory
+bandwidth against the peak of the device, the ops are memory bound. Results
+are printed as a table and written as JSON lines with ``--output``, one
+record per case after a record describing the environment.
+
+USAGE:   ``python extensions.py --suites layer_norm rms_norm --output out.jsonl``
+"""
+import json
+import platform
+import statistics
+import time
+from argparse import ArgumentParser
+from itertools import product
+
+import torch
+import torch.nn.functional as F
+
+from oslo.__version__ import version as oslo_version
+
+DTYPES = {
+    "float32": torch.float32,
+    "float16": torch.float16,
+    "bfloat16": torch.bfloat16,
+}
+
+parser = ArgumentParser()
+parser.add_argument(
+    "--suites",
+    nargs="+",
+    default=["layer_norm", "rms_norm", "ngram_blocking", "compile_cache"],
+)
+parser.add_argument("--n1", nargs="+", type=int, default=[1024, 8192, 32768])
+parser.add_argument(
+    "--n2", nargs="+", type=int, default=[768, 1024, 2048, 4096, 8192, 12288]
+)
+parser.add_argument(
+    "--dtypes",
+    nargs="+",
+    default=["float32-float32", "float16-float16", "bfloat16-bfloat16"]
+    + ["float16-float32", "bfloat16-float32"],
+    help="input-output dtypes, different dtypes use the mixed dtypes ops",
+)
+parser.add_argument("--batch_sizes", nargs="+", type=int, default=[1, 8, 32])
+parser.add_argument("--beams", nargs="+", type=int, default=[1, 4])
+parser.add_argument("--steps", nargs="+", type=int, default=[32, 256, 1024])
+parser.add_argument("--ngram_sizes", nargs="+", type=int, default=[2, 3, 4])
+parser.add_argument("--vocab_size", default=50257, type=int)
+parser.add_argument("--num_keys", nargs="+", type=int, default=[1, 64, 4096])
+parser.add_argument("--churn", nargs="+", type=float, default=[0.0, 0.1, 1.0])
+parser.add_argument("--warmup", default=10, type=int)
+parser.add_argument("--repeat", default=100, type=int)
+parser.add_argument(
+    "--peak_bandwidth",
+    default=None,
+    type=float,
+    help="peak memory bandwidth of the device in GB/s, "
+    "read from NVML or measured with a device copy when not given",
+)
+parser.add_argument("--output", default=None, type=str)
+args = parser.parse_args()
+
+
+def peak_bandwidth():
+    """Peak memory bandwidth of the current device in GB/s."""
+    if args.peak_bandwidth is not None:
+        return args.peak_bandwidth, "argument"
+
+    try:
+        import pynvml
+
+        pynvml.nvmlInit()
+        handle = pynvml.nvmlDeviceGetHandleByIndex(torch.cuda.current_device())
+        clock = pynvml.nvmlDeviceGetMaxClockInfo(handle, pynvml.NVML_CLOCK_MEM)
+        bus_width = pynvml.nvmlDeviceGetMemoryBusWidth(handle)
+        # double data rate, the clock is in MHz and the bus width in bits
+        return 2 * clock * 1e6 * bus_width / 8 / 1e9, "nvml"
+    except Exception:
+        pass
+
+    # the achievable bandwidth of a large device copy
+    src = torch.empty(256 * 1024 * 1024, dtype=torch.uint8, device="cuda")
+    dst = torch.empty_like(src)
+    elapsed = time_cuda(lambda: dst.copy_(src))
+    return 2 * src.numel() / elapsed / 1e9, "copy"
+
+
+def time_cuda(fn):
+    """Median seconds of ``fn`` over the repeats, after the warm up."""
+    for _ in range(args.warmup):
+        fn()
+    starts = [torch.cuda.Event(enable_timing=True) for _ in range(args.repeat)]
+    ends = [torch.cuda.Event(enable_timing=True) for _ in range(args.repeat)]
+    for start, end in zip(starts, ends):
+        start.record()
+        fn()
+        end.record()
+    torch.cuda.synchronize()
+    return statistics.median(s.elapsed_time(e) for s, e in zip(starts, ends)) / 1e3
+
+
+def load_apex():
+    try:
+        import fused_layer_norm_cuda
+
+        return fused_layer_norm_cuda
+    except ImportError:
+        return None
+
+
+class Reporter(object):
+    def __init__(self, output, peak, peak_source):
+        self.output = open(output, "w") if output is not None else None
+        self.peak = peak
+        self.write(
+            {
+                "record": "environment",
+                "device": torch.cuda.get_device_name(),
+                "capability": ".".join(map(str, torch.cuda.get_device_capability())),
+                "peak_gbps": peak,
+                "peak_source": peak_source,
+                "torch": torch.__version__,
+                "cuda": torch.version.cuda,
+                "oslo": oslo_version,
+                "python": platform.python_version(),
+                "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+            }
+        )
+        print(f"peak bandwidth: {peak:.1f} GB/s ({peak_source})")
+
+    def write(self, record):
+        if self.output is not None:
+            self.output.write(json.dumps(record) + "\n")
+            self.output.flush()
+
+    def report(self, suite, impl, params, seconds, nbytes=None, **extra):
+        record = {
+            "record": "case",
+            "suite": suite,
+            "impl": impl,
+            "params": params,
+            "time_us": seconds * 1e6,
+            **extra,
+        }
+        desc = " ".join(f"{k}={v}" for k, v in params.items())
+        line = f"{suite:<16} {impl:<8} {desc:<64} {seconds * 1e6:>10.2f} us"
+        if nbytes is not None:
+            gbps = nbytes / seconds / 1e9
+            record.update(bytes=nbytes, gbps=gbps, peak_fraction=gbps / self.peak)
+            line += f" {gbps:>8.1f} GB/s {100 * gbps / self.peak:>5.1f}%"
+        print(line)
+        self.write(record)
+
+    def close(self):
+        if self.output is not None:
+            self.output.close()
+
+
+def norm_bytes(n1, n2, in_dtype, out_dtype, affine, bias, backward):
+    """Bytes moved by a LayerNorm or RMSNorm over [n1, n2] inputs."""
+    in_size = torch.finfo(in_dtype).bits // 8
+    out_size = torch.finfo(out_dtype).bits // 8
+    num_params = (1 + int(bias)) * n2 * out_size if affine else 0
+    num_stats = (2 if bias else 1) * n1 * 4
+    if not backward:
+        return n1 * n2 * (in_size + out_size) + num_params + num_stats
+    # dout and input are read, grad_input is written, the params are read
+    # and their gradients written
+    return n1 * n2 * (2 * in_size + out_size) + 2 * num_params + num_stats
+
+
+def bench_norm(reporter, suite, cuda, apex):
+    rms = suite == "rms_norm"
+    for n1, n2, dtypes, affine in product(args.n1, args.n2, args.dtypes, [True, False]):
+        in_name, out_name = dtypes.split("-")
+        in_dtype, out_dtype = DTYPES[in_name], DTYPES[out_name]
+        mixed = in_dtype != out_dtype
+        if mixed and not affine:
+            continue
+        if not torch.cuda.is_bf16_supported() and torch.bfloat16 in (
+            in_dtype,
+            out_dtype,
+        ):
+            continue
+
+        shape = (n2,)
+        eps = 1e-5
+        x = torch.randn(n1, n2, dtype=in_dtype, device="cuda")
+        dout = torch.randn(n1, n2, dtype=out_dtype, device="cuda")
+        gamma = torch.randn(n2, dtype=out_dtype, device="cuda")
+        beta = torch.randn(n2, dtype=out_dtype, device="cuda")
+        params = {
+            "n1": n1,
+            "n2": n2,
+            "dtype_in": in_name,
+            "dtype_out": out_name,
+            "affine": affine,
+        }
+
+        if rms:
+            if mixed:
+                forward = lambda: cuda.rms_norm_forward_affine_mixed_dtypes(
+                    x, shape, gamma, eps
+                )
+            elif affine:
+                forward = lambda: cuda.rms_norm_forward_affine(x, shape, gamma, eps)
+            else:
+                forward = lambda: cuda.rms_norm_forward(x, shape, eps)
+            _, invvar = forward()
+            if affine:
+                backward = lambda: cuda.rms_norm_backward_affine(
+                    dout, invvar, x, shape, gamma, eps
+                )
+            else:
+                backward = lambda: cuda.rms_norm_backward(dout, invvar, x, shape, eps)
+        else:
+            if mixed:
+                forward = lambda: cuda.layer_norm_forward_affine_mixed_dtypes(
+                    x, shape, gamma, beta, eps
+                )
+            elif affine:
+                forward = lambda: cuda.layer_norm_forward_affine(
+                    x, shape, gamma, beta, eps
+                )
+            else:
+                forward = lambda: cuda.layer_norm_forward(x, shape, eps)
+            _, mean, invvar = forward()
+            if affine:
+                backward = lambda: cuda.layer_norm_backward_affine(
+                    dout, mean, invvar, x, shape, gamma, beta, eps
+                )
+            else:
+                backward = lambda: cuda.layer_norm_backward(
+                    dout, mean, invvar, x, shape, eps
+                )
+
+        for direction, fn in (("forward", forward), ("backward", backward)):
+            nbytes = norm_bytes(
+                n1, n2, in_dtype, out_dtype, affine, not rms, direction == "backward"
+            )
+            reporter.report(
+                f"{suite}_{direction}",
+                "oslo",
+                params,
+                time_cuda(fn),
+                nbytes,
+            )
+            for impl, baseline in baselines(
+                suite, direction, x, dout, shape, gamma, beta, affine, mixed, eps, apex
+            ):
+                reporter.report(
+                    f"{suite}_{direction}", impl, params, time_cuda(baseline), nbytes
+                )
+
+
+def baselines(suite, direction, x, dout, shape, gamma, beta, affine, mixed, eps, apex):
+    """(name, fn) of the torch and apex implementations of the same case."""
+    cases = []
+    if not mixed and suite == "layer_norm":
+        weight, bias = (gamma, beta) if affine else (None, None)
+        if direction == "forward":
+            cases.append(("torch", lambda: F.layer_norm(x, shape, weight, bias, eps)))
+        else:
+            # the same gradients as the fused backward, x and the affine ones
+            inputs = [x.detach().requires_grad_()]
+            if affine:
+                weight = weight.detach().requires_grad_()
+                bias = bias.detach().requires_grad_()
+                inputs += [weight, bias]
+            y = F.layer_norm(inputs[0], shape, weight, bias, eps)
+            cases.append(
+                (
+                    "torch",
+                    lambda: torch.autograd.grad(y, inputs, dout, retain_graph=True),
+                )
+            )
+
+    if apex is None:
+        return cases
+
+    if suite == "layer_norm" and not mixed:
+        if affine:
+            _, mean, invvar = apex.forward_affine(x, shape, gamma, beta, eps)
+            forward = lambda: apex.forward_affine(x, shape, gamma, beta, eps)
+            backward = lambda: apex.backward_affine(
+                dout, mean, invvar, x, shape, gamma, beta, eps
+            )
+        else:
+            _, mean, invvar = apex.forward(x, shape, eps)
+            forward = lambda: apex.forward(x, shape, eps)
+            backward = lambda: apex.backward(dout, mean, invvar, x, shape, eps)
+        cases.append(("apex", forward if direction == "forward" else backward))
+    elif suite == "rms_norm" and not mixed and hasattr(apex, "rms_forward"):
+        if affine:
+            _, invvar = apex.rms_forward_affine(x, shape, gamma, eps)
+            forward = lambda: apex.rms_forward_affine(x, shape, gamma, eps)
+            backward = lambda: apex.rms_backward_affine(
+                dout, invvar, x, shape, gamma, eps
+            )
+        else:
+            _, invvar = apex.rms_forward(x, shape, eps)
+            forward = lambda: apex.rms_forward(x, shape, eps)
+            backward = lambda: apex.rms_backward(dout, invvar, x, shape, eps)
+        cases.append(("apex", forward if direction == "forward" else backward))
+    return cases
+
+
+def bench_ngram_blocking(reporter, cuda):
+    for batch_size, beams, step, ngram_size in product(
+        args.batch_sizes, args.beams, args.steps, args.ngram_sizes
+    ):
+        rows = batch_size * beams
+        # few distinct tokens, so that ngrams repeat and tokens are banned
+        tokens = torch.randint(0, 16, (rows, step), dtype=torch.long, device="cuda")
+        lprobs = torch.randn(rows, args.vocab_size, device="cuda")
+        fn = lambda: cuda.ngram_repeat_block_forward(
+            tokens, lprobs, batch_size, step - 1, beams, ngram_size
+        )
+        # every thread reads the ngram of its position from the tokens
+        nbytes = tokens.numel() * tokens.element_size()
+        reporter.report(
+            "ngram_blocking",
+            "oslo",
+            {
+                "batch_size": batch_size,
+                "beams": beams,
+                "step": step,
+                "ngram_size": ngram_size,
+            },
+            time_cuda(fn),
+            nbytes,
+        )
+
+
+def bench_compile_cache(reporter):
+    from oslo.pytorch.kernel_fusion.mem_efficient.compat.aot_autograd import (
+        CompileCache,
+        HasherType,
+    )
+
+    hasher = int(HasherType.StaticShapeHasher)
+    for num_keys, churn in product(args.num_keys, args.churn):
+        cache = CompileCache()
+        shapes = [torch.empty(1, 1 + i) for i in range(num_keys)]
+        for tensor in shapes:
+            cache.insert(0, 0, 0, 1, hasher, object(), tensor)
+
+        # a fraction ``churn`` of the lookups are new shapes, missed and inserted
+        num_lookups = max(args.repeat, 1000)
+        lookups, num_new = [], 0
+        for i in range(num_lookups):
+            if int((i + 1) * churn) > num_new:
+                lookups.append(torch.empty(2, 1 + num_new))
+                num_new += 1
+            else:
+                lookups.append(shapes[i % num_keys])
+
+        cache.reset_stats()
+        start = time.perf_counter()
+        for tensor in lookups:
+            if cache.at(0, 0, 0, 1, hasher, tensor) is None:
+                cache.insert(0, 0, 0, 1, hasher, object(), tensor)
+        elapsed = time.perf_counter() - start
+
+        reporter.report(
+            "compile_cache",
+            "oslo",
+            {"num_keys": num_keys, "churn": churn},
+            elapsed / num_lookups,
+            stats=cache.stats(),
+        )
+
+
+def main():
+    cuda = None
+    if any(suite != "compile_cache" for suite in args.suites):
+        from oslo.pytorch.kernel_fusion.cuda import CUDA as cuda
+
+    peak, peak_source = peak_bandwidth()
+    reporter = Reporter(args.output, peak, peak_source)
+    apex = load_apex()
+
+    for suite in args.suites:
+        if suite in ("layer_norm", "rms_norm"):
+            bench_norm(reporter, suite, cuda, apex)
+        elif suite == "ngram_blocking":
+            bench_ngram_blocking(reporter, cuda)
+        elif suite == "compile_cache":
+            bench_compile_cache(reporter)
+        else:
+            raise ValueError(f"Unknown benchmark suite - {suite}.")
+    reporter.close()
+
+
+if __name__ == "__main__":
+    main()
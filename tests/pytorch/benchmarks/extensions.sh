@@ -0,0 +1,8 @@
+# USAGE:   ``sh ./extensions.sh $OUTPUT``
+# EXAMPLE: ``sh ./extensions.sh ./extensions.jsonl``
+
+OUTPUT=$1
+
+python extensions.py \
+       --suites layer_norm rms_norm ngram_blocking compile_cache \
+       --output="$OUTPUT"
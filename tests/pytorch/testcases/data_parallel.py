@@ -0,0 +1,111 @@
+"""
+Compares the gradients of ``DataParallelEngine`` with the ones of
+``DistributedDataParallel`` on a model with parameters used by every rank,
+by some ranks and by no rank.
+
+USAGE:   ``python -m torch.distributed.launch --nproc_per_node=2 data_parallel.py``
+"""
+import copy
+from argparse import ArgumentParser
+
+import torch
+import torch.distributed as dist
+import torch.nn as nn
+from torch.nn.parallel import DistributedDataParallel
+
+from oslo.pytorch.zero_optimization.data_parallel_engine import DataParallelEngine
+
+parser = ArgumentParser()
+parser.add_argument("--local_rank", default=0, type=int)
+parser.add_argument("--steps", default=4, type=int)
+parser.add_argument("--bucket_size", default=4096, type=int)
+parser.add_argument("--fused", action="store_true")
+args = parser.parse_args()
+
+
+class Model(nn.Module):
+    def __init__(self):
+        super().__init__()
+        self.layers = nn.ModuleList([nn.Linear(64, 64) for _ in range(4)])
+        self.used_by_rank_0 = nn.Linear(64, 64)
+        self.unused = nn.Linear(64, 64)
+
+    def forward(self, x):
+        for layer in self.layers:
+            x = torch.relu(layer(x))
+        if dist.get_rank() == 0:
+            x = self.used_by_rank_0(x)
+        return x.square().mean()
+
+
+def assert_grads_equal(name, model, reference):
+    for (param_name, param), ref in zip(
+        model.named_parameters(), reference.parameters()
+    ):
+        if ref.grad is None:
+            assert param.grad is None, f"{name}: {param_name} must have no grad."
+            continue
+        assert param.grad is not None, f"{name}: {param_name} has no grad."
+        assert torch.allclose(param.grad, ref.grad, rtol=1e-5, atol=1e-6), (
+            f"{name}: {param_name} differs from DistributedDataParallel, "
+            f"max diff={(param.grad - ref.grad).abs().max().item()}"
+        )
+
+
+def assert_shards_equal(name, engine, reference):
+    ref_grads = {id(p): r.grad for p, r in zip(engine.params, reference.parameters())}
+    for shard, segments in engine.grad_shards():
+        for param, param_offset, shard_offset, numel in segments:
+            grad = shard.narrow(0, shard_offset, numel)
+            ref = ref_grads[id(param)]
+            if ref is None:
+                # no rank used the parameter
+                assert not grad.any(), f"{name}: an unused shard is not zero."
+                continue
+            ref = ref.view(-1).narrow(0, param_offset, numel)
+            assert torch.allclose(grad, ref, rtol=1e-5, atol=1e-6), (
+                f"{name}: a shard differs from DistributedDataParallel, "
+                f"max diff={(grad - ref).abs().max().item()}"
+            )
+
+
+def test_data_parallel(reduce_scatter):
+    name = "reduce_scatter" if reduce_scatter else "all_reduce"
+    torch.manual_seed(0)
+    model = Model().cuda()
+    reference = DistributedDataParallel(
+        copy.deepcopy(model),
+        device_ids=[args.local_rank],
+        find_unused_parameters=True,
+    )
+    engine = DataParallelEngine(
+        model,
+        bucket_size=args.bucket_size,
+        reduce_scatter=reduce_scatter,
+        check_overflow=True,
+        fused=args.fused,
+    ).parallelize()
+
+    # the buckets are rebuilt before the second backward
+    for step in range(args.steps):
+        torch.manual_seed(step * dist.get_world_size() + dist.get_rank())
+        inputs = torch.randn(8, 64, device="cuda")
+        model.zero_grad(set_to_none=True)
+        reference.zero_grad(set_to_none=True)
+        model(inputs).backward()
+        reference(inputs).backward()
+
+        assert engine.found_inf.item() == 0.0, f"{name}: found inf at {step}."
+        if reduce_scatter:
+            assert_shards_equal(f"{name} step {step}", engine, reference.module)
+        else:
+            assert_grads_equal(f"{name} step {step}", model, reference.module)
+
+
+if __name__ == "__main__":
+    dist.init_process_group("nccl")
+    torch.cuda.set_device(args.local_rank)
+    test_data_parallel(reduce_scatter=False)
+    test_data_parallel(reduce_scatter=True)
+    if dist.get_rank() == 0:
+        print("DataParallelEngine matches DistributedDataParallel.")
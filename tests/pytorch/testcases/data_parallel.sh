@@ -0,0 +1,13 @@
+# USAGE:   ``sh ./data_parallel.sh $NUM_GPUS``
+# EXAMPLE: ``sh ./data_parallel.sh 2``
+
+NUM_GPUS=$1
+
+python -m torch.distributed.launch \
+       --nproc_per_node="$NUM_GPUS" \
+       data_parallel.py
+
+python -m torch.distributed.launch \
+       --nproc_per_node="$NUM_GPUS" \
+       data_parallel.py \
+       --fused
@@ -0,0 +1,592 @@
+"""
+Compares the forward and the backward of the native extension ops with
+reference implementations in torch, computed in float64 from the same
+inputs.
+
+The tensor parallel ops (sharded norms and vocab parallel cross entropy)
+are sharded over every launched process, the others run on every process.
+
+USAGE:   ``python -m torch.distributed.launch --nproc_per_node=2 kernels.py``
+"""
+import math
+import os
+from argparse import ArgumentParser
+
+import torch
+import torch.distributed as dist
+import torch.nn.functional as F
+
+from oslo.pytorch._C import CheckpointBinder
+from oslo.pytorch.kernel_fusion.cuda import CUDA
+from oslo.pytorch.kernel_fusion.cuda.fused_bias_gelu import fused_bias_gelu
+from oslo.pytorch.kernel_fusion.cuda.fused_cross_entropy import (
+    vocab_parallel_cross_entropy,
+)
+from oslo.pytorch.kernel_fusion.cuda.fused_logits_processing import (
+    get_fused_logits_processor,
+)
+from oslo.pytorch.kernel_fusion.cuda.fused_ngram_blocking import (
+    NGramRepeatBlockIndex,
+    ngram_repeat_block_ragged,
+)
+from oslo.pytorch.kernel_fusion.cuda.fused_normalization import (
+    fused_layer_norm,
+    fused_layer_norm_affine,
+    fused_layer_norm_residual_affine,
+    fused_multi_layer_norm,
+    fused_multi_rms_norm,
+    fused_rms_norm,
+    fused_rms_norm_affine,
+    fused_rms_norm_residual_affine,
+    fused_sharded_layer_norm_affine,
+    fused_sharded_rms_norm_affine,
+)
+from oslo.pytorch.kernel_fusion.cuda.fused_softmax import (
+    MASKED_SCORE,
+    scaled_masked_softmax,
+    scaled_upper_triang_masked_softmax,
+)
+from oslo.pytorch.model_parallelism.network.mpu import MPU
+
+parser = ArgumentParser()
+parser.add_argument("--local_rank", default=0, type=int)
+parser.add_argument(
+    "--hidden_sizes", nargs="+", type=int, default=[128, 768, 1000, 4096]
+)
+args = parser.parse_args()
+
+# (rtol, atol) of the outputs and gradients against the float64 reference
+TOLERANCES = {
+    torch.float64: (1e-9, 1e-9),
+    torch.float32: (1e-4, 1e-4),
+    torch.float16: (1e-2, 1e-2),
+    torch.bfloat16: (5e-2, 5e-2),
+}
+
+DTYPES = [torch.float64, torch.float32, torch.float16]
+if torch.cuda.is_bf16_supported():
+    DTYPES.append(torch.bfloat16)
+
+
+def assert_close(name, actual, expected):
+    rtol, atol = TOLERANCES[actual.dtype]
+    expected = expected.to(actual.dtype)
+    assert torch.allclose(actual, expected, rtol=rtol, atol=atol), (
+        f"{name}: max diff="
+        f"{(actual.double() - expected.double()).abs().max().item()}"
+    )
+
+
+def as_tuple(outputs):
+    return tuple(outputs) if isinstance(outputs, (tuple, list)) else (outputs,)
+
+
+def compare(name, fused, reference, tensors):
+    """
+    Compares the outputs of ``fused`` and of ``reference`` and the gradients
+    of ``tensors`` through them for the same random output gradients.
+    """
+    leaves = [tensor.detach().clone().requires_grad_() for tensor in tensors]
+    ref_leaves = [tensor.detach().double().requires_grad_() for tensor in tensors]
+    outputs = as_tuple(fused(*leaves))
+    ref_outputs = as_tuple(reference(*ref_leaves))
+    for i, (output, ref) in enumerate(zip(outputs, ref_outputs)):
+        assert_close(f"{name} output {i}", output, ref)
+
+    grads = [torch.randn_like(output) for output in outputs]
+    torch.autograd.backward(outputs, grads)
+    torch.autograd.backward(ref_outputs, [grad.double() for grad in grads])
+    for i, (leaf, ref) in enumerate(zip(leaves, ref_leaves)):
+        assert_close(f"{name} grad {i}", leaf.grad, ref.grad)
+
+
+def rms_norm_reference(x, shape, weight=None, eps=1e-5):
+    dims = tuple(range(-len(shape), 0))
+    output = x * torch.rsqrt(x.square().mean(dims, keepdim=True) + eps)
+    return output * weight if weight is not None else output
+
+
+# Normalization
+
+
+def test_norms(dtype, n2):
+    shape, eps = (n2,), 1e-5
+    x = torch.randn(64, n2, dtype=dtype, device="cuda")
+    weight = torch.randn(n2, dtype=dtype, device="cuda")
+    bias = torch.randn(n2, dtype=dtype, device="cuda")
+    name = f"[{dtype}, {n2}]"
+
+    compare(
+        f"layer_norm_affine {name}",
+        lambda x, w, b: fused_layer_norm_affine(x, w, b, shape, eps),
+        lambda x, w, b: F.layer_norm(x, shape, w, b, eps),
+        [x, weight, bias],
+    )
+    compare(
+        f"layer_norm {name}",
+        lambda x: fused_layer_norm(x, shape, eps),
+        lambda x: F.layer_norm(x, shape, None, None, eps),
+        [x],
+    )
+    compare(
+        f"rms_norm_affine {name}",
+        lambda x, w: fused_rms_norm_affine(x, w, shape, eps),
+        lambda x, w: rms_norm_reference(x, shape, w, eps),
+        [x, weight],
+    )
+    compare(
+        f"rms_norm {name}",
+        lambda x: fused_rms_norm(x, shape, eps),
+        lambda x: rms_norm_reference(x, shape, None, eps),
+        [x],
+    )
+
+
+def test_residual_norms(dtype, n2):
+    shape, eps = (n2,), 1e-5
+    x = torch.randn(64, n2, dtype=dtype, device="cuda")
+    residual = torch.randn(64, n2, dtype=dtype, device="cuda")
+    bias = torch.randn(n2, dtype=dtype, device="cuda")
+    weight = torch.randn(n2, dtype=dtype, device="cuda")
+    ln_bias = torch.randn(n2, dtype=dtype, device="cuda")
+    name = f"[{dtype}, {n2}]"
+
+    compare(
+        f"layer_norm_residual_affine {name}",
+        lambda x, r, b, w, lb: fused_layer_norm_residual_affine(
+            x, r, b, w, lb, shape, eps
+        ),
+        lambda x, r, b, w, lb: (
+            F.layer_norm(r + x + b, shape, w, lb, eps),
+            r + x + b,
+        ),
+        [x, residual, bias, weight, ln_bias],
+    )
+    compare(
+        f"rms_norm_residual_affine {name}",
+        lambda x, r, b, w: fused_rms_norm_residual_affine(x, r, b, w, shape, eps),
+        lambda x, r, b, w: (rms_norm_reference(r + x + b, shape, w, eps), r + x + b),
+        [x, residual, bias, weight],
+    )
+
+    # the gradient of the input through the sum is the scaled dropout mask
+    p = 0.25
+    x_ = x.detach().clone().requires_grad_()
+    _, sum_ = fused_layer_norm_residual_affine(
+        x_, residual, bias, weight, ln_bias, shape, eps, p
+    )
+    sum_.backward(torch.ones_like(sum_))
+    kept = x_.grad != 0
+    assert abs(kept.float().mean().item() - (1 - p)) < 0.05, f"dropout rate {name}"
+    assert_close(
+        f"layer_norm_residual_affine dropout scale {name}",
+        x_.grad[kept],
+        torch.full_like(x_.grad[kept], 1 / (1 - p), dtype=torch.float64),
+    )
+    assert_close(
+        f"layer_norm_residual_affine dropout {name}",
+        sum_,
+        residual.double() + (x.double() + bias.double()) * kept / (1 - p),
+    )
+
+
+def test_multi_norms(dtype):
+    shapes = [(64,), (128,), (1000,), (16, 48)]
+    sizes = [3, 64, 17, 5]
+    inputs = [
+        torch.randn(size, *shape, dtype=dtype, device="cuda")
+        for size, shape in zip(sizes, shapes)
+    ]
+    weights = [torch.randn(shape, dtype=dtype, device="cuda") for shape in shapes]
+    biases = [torch.randn(shape, dtype=dtype, device="cuda") for shape in shapes]
+    n, eps = len(inputs), 1e-5
+
+    compare(
+        f"multi_layer_norm [{dtype}]",
+        lambda *t: fused_multi_layer_norm(
+            list(t[:n]), shapes, list(t[n : 2 * n]), list(t[2 * n :]), eps
+        ),
+        lambda *t: [
+            F.layer_norm(x, shape, w, b, eps)
+            for x, shape, w, b in zip(t[:n], shapes, t[n : 2 * n], t[2 * n :])
+        ],
+        inputs + weights + biases,
+    )
+    compare(
+        f"multi_rms_norm [{dtype}]",
+        lambda *t: fused_multi_rms_norm(list(t[:n]), shapes, list(t[n:]), eps),
+        lambda *t: [
+            rms_norm_reference(x, shape, w, eps)
+            for x, shape, w in zip(t[:n], shapes, t[n:])
+        ],
+        inputs + weights,
+    )
+
+
+def test_sharded_norms(mpu, dtype, n2):
+    world_size = mpu.get_tensor_parallel_world_size()
+    rank = mpu.get_tensor_parallel_rank()
+    group = mpu.get_tensor_parallel_group()
+    if n2 % world_size != 0:
+        return
+    shape, eps = (n2,), 1e-5
+    name = f"[{dtype}, {n2}]"
+
+    # the same full tensors on every rank, which holds a shard of them
+    torch.manual_seed(n2)
+    x = torch.randn(64, n2, dtype=dtype, device="cuda")
+    weight = torch.randn(n2, dtype=dtype, device="cuda")
+    bias = torch.randn(n2, dtype=dtype, device="cuda")
+    grad = torch.randn(64, n2, dtype=dtype, device="cuda")
+
+    def shard(tensor):
+        return tensor.chunk(world_size, dim=-1)[rank]
+
+    for rms in (False, True):
+        local = [shard(t).detach().clone().requires_grad_() for t in (x, weight, bias)]
+        full = [t.detach().double().requires_grad_() for t in (x, weight, bias)]
+        if rms:
+            output = fused_sharded_rms_norm_affine(
+                local[0], local[1], shape, eps, group
+            )
+            ref = rms_norm_reference(full[0], shape, full[1], eps)
+            local, full = local[:2], full[:2]
+        else:
+            output = fused_sharded_layer_norm_affine(
+                local[0], local[1], local[2], shape, eps, group
+            )
+            ref = F.layer_norm(full[0], shape, full[1], full[2], eps)
+
+        op = "sharded_rms_norm" if rms else "sharded_layer_norm"
+        assert_close(f"{op} output {name}", output, shard(ref))
+        output.backward(shard(grad))
+        ref.backward(grad.double())
+        for i, (leaf, ref_leaf) in enumerate(zip(local, full)):
+            assert_close(f"{op} grad {i} {name}", leaf.grad, shard(ref_leaf.grad))
+
+
+# Fused bias GeLU
+
+
+def gelu_reference(x, approximate):
+    if approximate:
+        inner = math.sqrt(2.0 / math.pi) * (x + 0.044715 * x.pow(3))
+        return 0.5 * x * (1.0 + torch.tanh(inner))
+    return 0.5 * x * (1.0 + torch.erf(x / math.sqrt(2.0)))
+
+
+def test_bias_gelu(dtype):
+    if dtype == torch.float64:
+        return
+    x = torch.randn(8, 32, 1000, dtype=dtype, device="cuda")
+    bias = torch.randn(1000, dtype=dtype, device="cuda")
+    for approximate in (True, False):
+        for recompute in (True, False):
+            name = f"[{dtype}, approximate={approximate}, recompute={recompute}]"
+            compare(
+                f"bias_gelu {name}",
+                lambda x, b: fused_bias_gelu(x, b, approximate, recompute),
+                lambda x, b: gelu_reference(x + b, approximate),
+                [x, bias],
+            )
+            compare(
+                f"gelu {name}",
+                lambda x: fused_bias_gelu(x, None, approximate, recompute),
+                lambda x: gelu_reference(x, approximate),
+                [x],
+            )
+
+
+# Scaled masked softmax
+
+
+def test_softmax(dtype):
+    if dtype == torch.float64:
+        return
+    scale = 0.125
+    for sk in (17, 128, 5000):
+        b, h, sq = 2, 3, 7
+        x = torch.randn(b, h, sq, sk, dtype=dtype, device="cuda")
+        mask = torch.rand(b, 1, sq, sk, device="cuda") < 0.3
+        # no row is fully masked
+        mask[..., 0] = False
+        name = f"[{dtype}, {sk}]"
+
+        for mask_ in (mask, mask[:1, :, :1]):
+            compare(
+                f"scaled_masked_softmax {name} mask={list(mask_.shape)}",
+                lambda x: scaled_masked_softmax(x, mask_, scale),
+                lambda x: torch.softmax(
+                    (x * scale).masked_fill(mask_, MASKED_SCORE), dim=-1
+                ),
+                [x],
+            )
+        compare(
+            f"scaled_softmax {name}",
+            lambda x: scaled_masked_softmax(x, None, scale),
+            lambda x: torch.softmax(x * scale, dim=-1),
+            [x],
+        )
+
+        causal = torch.ones(sq, sk, dtype=torch.bool, device="cuda")
+        causal = causal.triu(diagonal=sk - sq + 1)
+        compare(
+            f"scaled_upper_triang_masked_softmax {name}",
+            lambda x: scaled_upper_triang_masked_softmax(x, scale),
+            lambda x: torch.softmax(
+                (x * scale).masked_fill(causal, MASKED_SCORE), dim=-1
+            ),
+            [x.view(b * h, sq, sk)],
+        )
+
+
+# Vocab parallel cross entropy
+
+
+def test_cross_entropy(mpu, dtype):
+    if dtype == torch.float64:
+        return
+    world_size = mpu.get_tensor_parallel_world_size()
+    rank = mpu.get_tensor_parallel_rank()
+    vocab_size = 1000 * world_size
+
+    torch.manual_seed(0)
+    logits = torch.randn(4, 33, vocab_size, dtype=dtype, device="cuda") * 4
+    targets = torch.randint(0, vocab_size, (4, 33), device="cuda")
+    targets[0, :5] = -100
+
+    for inplace in (False, True):
+        name = f"[{dtype}, inplace={inplace}]"
+        local = logits.chunk(world_size, dim=-1)[rank].detach().clone()
+        local.requires_grad_()
+        full = logits.detach().double().requires_grad_()
+
+        # the in-place backward writes the gradient into a non-leaf input
+        logits_ = local * 1 if inplace else local
+        loss = vocab_parallel_cross_entropy(
+            logits_, targets, mpu=mpu, reduction="none", inplace_backward=inplace
+        )
+        ref = F.cross_entropy(
+            full.view(-1, vocab_size),
+            targets.view(-1),
+            ignore_index=-100,
+            reduction="none",
+        ).view(targets.shape)
+        assert_close(f"vocab_parallel_cross_entropy loss {name}", loss, ref)
+
+        grad = torch.rand_like(loss)
+        loss.backward(grad)
+        ref.backward(grad.double())
+        assert_close(
+            f"vocab_parallel_cross_entropy grad {name}",
+            local.grad,
+            full.grad.chunk(world_size, dim=-1)[rank],
+        )
+
+
+# Ngram blocking
+
+
+def banned_ngram_tokens(history, n):
+    """Tokens that would repeat an ngram of ``history``, a list of tokens."""
+    step = len(history) - 1
+    prefix = history[step - n + 2 : step + 1] if n > 1 else []
+    return {
+        history[i + n - 1]
+        for i in range(step - n + 2)
+        if history[i : i + n - 1] == prefix
+    }
+
+
+def blocked_reference(lprobs, histories, n):
+    expected = lprobs.clone()
+    for row, history in enumerate(histories):
+        for token in banned_ngram_tokens(history, n):
+            expected[row, token] = -float("inf")
+    return expected
+
+
+def test_ngram_blocking():
+    vocab_size = 24
+    bsz, beam_size = 3, 4
+    rows = bsz * beam_size
+    for n in (1, 2, 3, 4):
+        for step in (n, 40, 1500):
+            tokens = torch.randint(0, vocab_size, (rows, step + 1), device="cuda")
+            lprobs = torch.randn(rows, vocab_size, device="cuda")
+            expected = blocked_reference(lprobs, tokens.tolist(), n)
+            blocked = CUDA.ngram_repeat_block_forward(
+                tokens, lprobs.clone(), bsz, step, beam_size, n
+            )
+            assert torch.equal(blocked, expected), f"ngram_repeat_block n={n} {step}"
+
+
+def test_ngram_index():
+    vocab_size, rows, length = 16, 6, 300
+    for n in (2, 3, 4):
+        tokens = torch.randint(0, vocab_size, (rows, length), device="cuda")
+        index = NGramRepeatBlockIndex(n)
+        for step in range(length):
+            if step == length // 2:
+                # hypotheses reselected by the beam search
+                beam_idx = torch.randint(0, rows, (rows,), device="cuda")
+                tokens[:, :step] = tokens[beam_idx, :step]
+                index.reorder(beam_idx)
+            history = tokens[:, : step + 1].contiguous()
+            lprobs = torch.randn(rows, vocab_size, device="cuda")
+            expected = blocked_reference(lprobs, history.tolist(), n)
+            blocked = index(history, lprobs.clone(), step)
+            assert torch.equal(blocked, expected), f"ngram index n={n} step={step}"
+
+
+def test_ragged_ngram_blocking():
+    vocab_size = 16
+    lengths = [1, 5, 64, 700, 3]
+    for n in (2, 3):
+        histories = [
+            torch.randint(0, vocab_size, (length,), device="cuda") for length in lengths
+        ]
+        lprobs = torch.randn(len(lengths), vocab_size, device="cuda")
+        expected = blocked_reference(lprobs, [h.tolist() for h in histories], n)
+
+        cu_seqlens = torch.tensor([0] + lengths, device="cuda").cumsum(0)
+        blocked = ngram_repeat_block_ragged(
+            torch.cat(histories), lprobs.clone(), n, cu_seqlens=cu_seqlens
+        )
+        assert torch.equal(blocked, expected), f"ragged ngram cu_seqlens n={n}"
+
+        # left padded to the longest history
+        max_len = max(lengths)
+        padded = torch.zeros(len(lengths), max_len, dtype=torch.long, device="cuda")
+        attention_mask = torch.zeros_like(padded)
+        for row, history in enumerate(histories):
+            padded[row, max_len - len(history) :] = history
+            attention_mask[row, max_len - len(history) :] = 1
+        blocked = ngram_repeat_block_ragged(
+            padded, lprobs.clone(), n, attention_mask=attention_mask
+        )
+        assert torch.equal(blocked, expected), f"ragged ngram attention_mask n={n}"
+
+
+def test_logits_processor():
+    FusedLogitsProcessor = get_fused_logits_processor()
+    vocab_size = 64
+    input_ids = torch.randint(0, vocab_size, (8, 40), device="cuda")
+    for kwargs in (
+        dict(no_repeat_ngram_size=3),
+        dict(repetition_penalty=1.3, presence_penalty=0.5),
+        dict(temperature=0.7, top_k=10),
+        dict(min_length=50, eos_token_id=2),
+        dict(
+            no_repeat_ngram_size=2,
+            repetition_penalty=1.3,
+            temperature=0.7,
+            top_k=10,
+            min_length=50,
+            eos_token_id=2,
+        ),
+    ):
+        processor = FusedLogitsProcessor(**kwargs)
+        for dtype in DTYPES:
+            if dtype == torch.float64:
+                continue
+            scores = torch.randn(8, vocab_size, dtype=dtype, device="cuda")
+            fused = processor(input_ids, scores.clone())
+            ref = processor._process(input_ids.cpu(), scores.double().cpu())
+            assert torch.equal(fused.isinf(), ref.isinf().cuda()), (
+                f"logits processor {kwargs} [{dtype}] masks other tokens"
+            )
+            finite = ~fused.isinf()
+            assert_close(
+                f"logits processor {kwargs} [{dtype}]",
+                fused[finite],
+                ref.cuda()[finite],
+            )
+
+
+# Checkpoint partitions
+
+
+def quantization_bound(x, bits):
+    """Largest error of every element of ``x`` quantized by blocks of 256."""
+    qmax = 2 ** (bits - 1) - 1
+    flat = x.double().view(-1)
+    blocks = F.pad(flat, (0, -flat.numel() % 256)).view(-1, 256)
+    scale = blocks.abs().amax(dim=1, keepdim=True) / qmax
+    bound = (0.5 * scale * 1.001).expand_as(blocks).reshape(-1)[: flat.numel()]
+    # the dequantized value is rounded to the dtype of the activation
+    return bound + flat.abs() * torch.finfo(x.dtype).eps * 2
+
+
+def test_checkpoint_partitions(native):
+    shapes = [(4, 1000), (4, 3, 7, 5), (256,)]
+    dtypes = [torch.float32, torch.float16]
+    if torch.cuda.is_bf16_supported():
+        dtypes.append(torch.bfloat16)
+    tensors = [
+        torch.randn(shape, dtype=dtype, device="cuda") * 3
+        for shape in shapes
+        for dtype in dtypes
+    ]
+
+    for world_size in (1, 4):
+        packed = [
+            native.partition_pack_forward(tensors, world_size, rank)
+            for rank in range(world_size)
+        ]
+        outputs = [torch.empty_like(tensor) for tensor in tensors]
+        native.gather_unpack_forward(torch.cat(packed), outputs, world_size)
+        for tensor, output in zip(tensors, outputs):
+            assert torch.equal(output, tensor), (
+                f"checkpoint partitions {list(tensor.shape)} [{tensor.dtype}] "
+                f"world_size={world_size} do not round trip"
+            )
+
+        for bits in (8, 4):
+            packed = [
+                native.partition_pack_quantized_forward(
+                    tensors, world_size, rank, bits
+                )
+                for rank in range(world_size)
+            ]
+            outputs = [torch.empty_like(tensor) for tensor in tensors]
+            native.gather_unpack_quantized_forward(
+                torch.cat(packed), outputs, world_size, bits
+            )
+            for tensor, output in zip(tensors, outputs):
+                # the blocks start at every partition
+                for part, output_part in zip(
+                    tensor.view(-1).chunk(world_size), output.view(-1).chunk(world_size)
+                ):
+                    error = (output_part.double() - part.double()).abs()
+                    assert (error <= quantization_bound(part, bits)).all(), (
+                        f"{bits} bit checkpoint partitions {list(tensor.shape)} "
+                        f"[{tensor.dtype}] world_size={world_size}: "
+                        f"max error={error.max().item()}"
+                    )
+
+
+if __name__ == "__main__":
+    # the tensor parallel ops are sharded over every process
+    world_size = int(os.environ.get("WORLD_SIZE", 1))
+    mpu = MPU(tensor_parallel_size=world_size, pipeline_parallel_size=1)
+    torch.cuda.set_device(args.local_rank)
+
+    for dtype in DTYPES:
+        for n2 in args.hidden_sizes:
+            test_norms(dtype, n2)
+            test_residual_norms(dtype, n2)
+            test_sharded_norms(mpu, dtype, n2)
+        test_multi_norms(dtype)
+        test_bias_gelu(dtype)
+        test_softmax(dtype)
+        test_cross_entropy(mpu, dtype)
+
+    test_ngram_blocking()
+    test_ngram_index()
+    test_ragged_ngram_blocking()
+    test_logits_processor()
+    test_checkpoint_partitions(CheckpointBinder().bind())
+
+    if dist.get_rank() == 0:
+        print("The native kernels match their torch references.")
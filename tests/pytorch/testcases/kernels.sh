@@ -0,0 +1,8 @@
+# USAGE:   ``sh ./kernels.sh $NUM_GPUS``
+# EXAMPLE: ``sh ./kernels.sh 2``
+
+NUM_GPUS=$1
+
+python -m torch.distributed.launch \
+       --nproc_per_node="$NUM_GPUS" \
+       kernels.py